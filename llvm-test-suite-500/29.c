@@ -101,11 +101,428 @@ void eval(int *p)  {
   }
 }
 
-int main() {
+
+/*
+ * Dispatch comparison on a small but real bytecode.
+ *
+ * The VM is a stack machine with locals addressed from a frame pointer,
+ * conditional branches and calls.  The same program is run by four engines:
+ *
+ *   switch     a plain switch in a loop
+ *   goto       the computed-goto table used by eval() above
+ *   threaded   direct-threaded code: the bytecode is pre-decoded into cells
+ *              holding handler addresses, so dispatch is one indirect jump
+ *              with no table lookup
+ *   super      threaded code in which frequent opcode pairs, chosen from the
+ *              per-instruction execution counts of a profiling run, are
+ *              replaced by fused handlers
+ *
+ * Pre-decoding keeps one cell per bytecode word, so branch targets and
+ * return addresses are the same indices in every form.  A superinstruction
+ * overwrites only the cell of its first half; the second half keeps its
+ * own handler, so jumping into the middle of a fused pair is still valid.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+enum {
+  OP_HALT, OP_PUSH, OP_POP, OP_DUP, OP_ADD, OP_SUB, OP_MUL, OP_LT,
+  OP_LOAD, OP_STORE, OP_JMP, OP_JZ, OP_CALL, OP_RET, OP_NOPS
+};
+
+static const int op_len[OP_NOPS] = { 1, 2, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 3, 1 };
+static const char *op_name[OP_NOPS] = {
+  "halt", "push", "pop", "dup", "add", "sub", "mul", "lt",
+  "load", "store", "jmp", "jz", "call", "ret"
+};
+
+// Fusable pairs.  The first half must fall through (no branch, call or
+// return); the second half may be anything.
+#define SUPER_LIST(X) \
+  X(LOAD, LOAD)  X(LOAD, PUSH)  X(PUSH, LT)    X(LT, JZ)     \
+  X(PUSH, SUB)   X(PUSH, ADD)   X(LOAD, ADD)   X(ADD, STORE) \
+  X(SUB, CALL)   X(LOAD, RET)   X(ADD, RET)    X(STORE, JMP) \
+  X(PUSH, CALL)  X(STORE, LOAD)
+
+#define SUPER_ENUM(a, b) SI_##a##_##b,
+enum { SUPER_LIST(SUPER_ENUM) SI_COUNT };
+#define SUPER_PAIR(a, b) { OP_##a, OP_##b },
+static const int super_pair[SI_COUNT][2] = { SUPER_LIST(SUPER_PAIR) };
+
+#define VM_STACK  1024
+#define VM_FRAMES 256
+#define VM_CODE   256
+#define VM_NSUPER 6     // superinstructions enabled after profiling
+
+typedef union { const void *h; uint32_t v; } cell;
+typedef struct { const void *pc; uint32_t *fp; } frame;
+
+// Opcode bodies shared by every engine.  Each engine defines ARG(k), the
+// k-th operand word of the current instruction, and BASE, its code start.
+#define B_PUSH   sp[1] = ARG(1); sp++; pc += 2;
+#define B_POP    sp--; pc += 1;
+#define B_DUP    sp[1] = sp[0]; sp++; pc += 1;
+#define B_ADD    sp[-1] += sp[0]; sp--; pc += 1;
+#define B_SUB    sp[-1] -= sp[0]; sp--; pc += 1;
+#define B_MUL    sp[-1] *= sp[0]; sp--; pc += 1;
+#define B_LT     sp[-1] = sp[-1] < sp[0]; sp--; pc += 1;
+#define B_LOAD   sp[1] = fp[ARG(1)]; sp++; pc += 2;
+#define B_STORE  fp[ARG(1)] = sp[0]; sp--; pc += 2;
+#define B_JMP    pc = BASE + ARG(1);
+#define B_JZ     if (*sp--) pc += 2; else pc = BASE + ARG(1);
+#define B_CALL   rp->pc = pc + 3; rp->fp = fp; rp++; \
+                 fp = sp - ARG(2) + 1; pc = BASE + ARG(1);
+#define B_RET    rp--; fp[0] = sp[0]; sp = fp; fp = rp->fp; pc = rp->pc;
+
+#define VM_REGS \
+  uint32_t stack[VM_STACK], *sp = stack - 1, *fp = stack; \
+  frame frames[VM_FRAMES], *rp = frames
+
+static uint32_t vm_code[VM_CODE];
+static int vm_size;
+static int vm_entry;
+
+uint32_t run_switch(const uint32_t *code) __attribute__((noinline));
+uint32_t run_goto(const uint32_t *code) __attribute__((noinline));
+uint32_t run_threaded(const cell *code) __attribute__((noinline));
+uint32_t run_profile(const uint32_t *code, uint64_t *count) __attribute__((noinline));
+
+#define ARG(k) pc[k]
+#define BASE code
+
+uint32_t run_switch(const uint32_t *code) {
+  const uint32_t *pc = code + vm_entry;
+  VM_REGS;
+
+  for (;;) {
+    switch (*pc) {
+      case OP_HALT:  return sp[0];
+      case OP_PUSH:  B_PUSH  break;
+      case OP_POP:   B_POP   break;
+      case OP_DUP:   B_DUP   break;
+      case OP_ADD:   B_ADD   break;
+      case OP_SUB:   B_SUB   break;
+      case OP_MUL:   B_MUL   break;
+      case OP_LT:    B_LT    break;
+      case OP_LOAD:  B_LOAD  break;
+      case OP_STORE: B_STORE break;
+      case OP_JMP:   B_JMP   break;
+      case OP_JZ:    B_JZ    break;
+      case OP_CALL:  B_CALL  break;
+      case OP_RET:   B_RET   break;
+    }
+  }
+}
+
+// The switch engine again, counting executions of every instruction.
+uint32_t run_profile(const uint32_t *code, uint64_t *count) {
+  const uint32_t *pc = code + vm_entry;
+  VM_REGS;
+
+  for (;;) {
+    count[pc - code]++;
+    switch (*pc) {
+      case OP_HALT:  return sp[0];
+      case OP_PUSH:  B_PUSH  break;
+      case OP_POP:   B_POP   break;
+      case OP_DUP:   B_DUP   break;
+      case OP_ADD:   B_ADD   break;
+      case OP_SUB:   B_SUB   break;
+      case OP_MUL:   B_MUL   break;
+      case OP_LT:    B_LT    break;
+      case OP_LOAD:  B_LOAD  break;
+      case OP_STORE: B_STORE break;
+      case OP_JMP:   B_JMP   break;
+      case OP_JZ:    B_JZ    break;
+      case OP_CALL:  B_CALL  break;
+      case OP_RET:   B_RET   break;
+    }
+  }
+}
+
+uint32_t run_goto(const uint32_t *code) {
+  static void *dispatch[OP_NOPS] = {
+    &&L_HALT, &&L_PUSH, &&L_POP, &&L_DUP, &&L_ADD, &&L_SUB, &&L_MUL,
+    &&L_LT, &&L_LOAD, &&L_STORE, &&L_JMP, &&L_JZ, &&L_CALL, &&L_RET
+  };
+  const uint32_t *pc = code + vm_entry;
+  VM_REGS;
+
+#define NEXT goto *dispatch[*pc]
+  NEXT;
+  L_HALT:  return sp[0];
+  L_PUSH:  B_PUSH  NEXT;
+  L_POP:   B_POP   NEXT;
+  L_DUP:   B_DUP   NEXT;
+  L_ADD:   B_ADD   NEXT;
+  L_SUB:   B_SUB   NEXT;
+  L_MUL:   B_MUL   NEXT;
+  L_LT:    B_LT    NEXT;
+  L_LOAD:  B_LOAD  NEXT;
+  L_STORE: B_STORE NEXT;
+  L_JMP:   B_JMP   NEXT;
+  L_JZ:    B_JZ    NEXT;
+  L_CALL:  B_CALL  NEXT;
+  L_RET:   B_RET   NEXT;
+#undef NEXT
+}
+
+#undef ARG
+#define ARG(k) pc[k].v
+
+// Called with code == NULL it only publishes its handler addresses, which
+// is the usual way to get at label values from outside the function.
+static const void *const *threaded_ops;
+static const void *const *threaded_super;
+
+uint32_t run_threaded(const cell *code) {
+  static const void *const ops[OP_NOPS] = {
+    &&L_HALT, &&L_PUSH, &&L_POP, &&L_DUP, &&L_ADD, &&L_SUB, &&L_MUL,
+    &&L_LT, &&L_LOAD, &&L_STORE, &&L_JMP, &&L_JZ, &&L_CALL, &&L_RET
+  };
+#define SUPER_LABEL(a, b) &&S_##a##_##b,
+  static const void *const super[SI_COUNT] = { SUPER_LIST(SUPER_LABEL) };
+  const cell *pc;
+  VM_REGS;
+
+  if (!code) {
+    threaded_ops = ops;
+    threaded_super = super;
+    return 0;
+  }
+  pc = code + vm_entry;
+
+#define NEXT goto *pc->h
+  NEXT;
+  L_HALT:  return sp[0];
+  L_PUSH:  B_PUSH  NEXT;
+  L_POP:   B_POP   NEXT;
+  L_DUP:   B_DUP   NEXT;
+  L_ADD:   B_ADD   NEXT;
+  L_SUB:   B_SUB   NEXT;
+  L_MUL:   B_MUL   NEXT;
+  L_LT:    B_LT    NEXT;
+  L_LOAD:  B_LOAD  NEXT;
+  L_STORE: B_STORE NEXT;
+  L_JMP:   B_JMP   NEXT;
+  L_JZ:    B_JZ    NEXT;
+  L_CALL:  B_CALL  NEXT;
+  L_RET:   B_RET   NEXT;
+#define SUPER_BODY(a, b) S_##a##_##b: { B_##a B_##b } NEXT;
+  SUPER_LIST(SUPER_BODY)
+#undef NEXT
+}
+
+#undef ARG
+#undef BASE
+
+// A two-pass assembler is overkill; forward branches are patched by hand.
+static int emit(int op, int a, int b) {
+  int at = vm_size;
+  vm_code[vm_size++] = op;
+  if (op_len[op] > 1) vm_code[vm_size++] = a;
+  if (op_len[op] > 2) vm_code[vm_size++] = b;
+  return at;
+}
+
+// acc = 0; for (i = 0; i < iters; i++) acc += fib(n) + i;
+static void build_program(int iters, int n) {
+  int fib, rec, loop, exit_jz;
+
+  vm_size = 0;
+  fib = emit(OP_LOAD, 0, 0);          // fib(n): n < 2 ? n : fib(n-1) + fib(n-2)
+  emit(OP_PUSH, 2, 0);
+  emit(OP_LT, 0, 0);
+  rec = emit(OP_JZ, 0, 0);
+  emit(OP_LOAD, 0, 0);
+  emit(OP_RET, 0, 0);
+  vm_code[rec + 1] = vm_size;
+  emit(OP_LOAD, 0, 0);
+  emit(OP_PUSH, 1, 0);
+  emit(OP_SUB, 0, 0);
+  emit(OP_CALL, fib, 1);
+  emit(OP_LOAD, 0, 0);
+  emit(OP_PUSH, 2, 0);
+  emit(OP_SUB, 0, 0);
+  emit(OP_CALL, fib, 1);
+  emit(OP_ADD, 0, 0);
+  emit(OP_RET, 0, 0);
+
+  vm_entry = emit(OP_PUSH, 0, 0);     // local 0: acc
+  emit(OP_PUSH, 0, 0);                // local 1: i
+  loop = emit(OP_LOAD, 1, 0);
+  emit(OP_PUSH, iters, 0);
+  emit(OP_LT, 0, 0);
+  exit_jz = emit(OP_JZ, 0, 0);
+  emit(OP_LOAD, 0, 0);
+  emit(OP_PUSH, n, 0);
+  emit(OP_CALL, fib, 1);
+  emit(OP_ADD, 0, 0);
+  emit(OP_LOAD, 1, 0);
+  emit(OP_ADD, 0, 0);
+  emit(OP_STORE, 0, 0);
+  emit(OP_LOAD, 1, 0);
+  emit(OP_PUSH, 1, 0);
+  emit(OP_ADD, 0, 0);
+  emit(OP_STORE, 1, 0);
+  emit(OP_JMP, loop, 0);
+  vm_code[exit_jz + 1] = vm_size;
+  emit(OP_LOAD, 0, 0);
+  emit(OP_HALT, 0, 0);
+}
+
+static void predecode(cell *out) {
+  int pc, k;
+
+  run_threaded(NULL);
+  for (pc = 0; pc < vm_size; pc += op_len[vm_code[pc]]) {
+    out[pc].h = threaded_ops[vm_code[pc]];
+    for (k = 1; k < op_len[vm_code[pc]]; k++)
+      out[pc + k].v = vm_code[pc + k];
+  }
+}
+
+// Weigh every fusable pair by how often its first half ran, enable the
+// VM_NSUPER heaviest, and rewrite their sites in the threaded code.
+static int select_super(cell *code, const uint64_t *count, int *chosen) {
+  uint64_t weight[SI_COUNT] = { 0 };
+  int on[SI_COUNT] = { 0 };
+  int pc, next, s, k, best, nchosen = 0;
+
+  for (pc = 0; pc < vm_size; pc = next) {
+    next = pc + op_len[vm_code[pc]];
+    if (next < vm_size)
+      for (s = 0; s < SI_COUNT; s++)
+        if (super_pair[s][0] == (int)vm_code[pc] && super_pair[s][1] == (int)vm_code[next])
+          weight[s] += count[pc];
+  }
+  for (k = 0; k < VM_NSUPER; k++) {
+    best = -1;
+    for (s = 0; s < SI_COUNT; s++)
+      if (!on[s] && weight[s] && (best < 0 || weight[s] > weight[best]))
+        best = s;
+    if (best < 0) break;
+    on[best] = 1;
+    chosen[nchosen++] = best;
+  }
+  for (pc = 0; pc < vm_size; pc = next) {
+    next = pc + op_len[vm_code[pc]];
+    if (next < vm_size)
+      for (s = 0; s < SI_COUNT; s++)
+        if (on[s] && super_pair[s][0] == (int)vm_code[pc] && super_pair[s][1] == (int)vm_code[next])
+          code[pc].h = threaded_super[s];
+  }
+  return nchosen;
+}
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int perf_fd = -1;
+
+static void branch_miss_start(void) {
+#ifdef __linux__
+  struct perf_event_attr attr;
+  if (perf_fd < 0) {
+    memset(&attr, 0, sizeof attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof attr;
+    attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    perf_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+  if (perf_fd >= 0) {
+    ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+#endif
+}
+
+// Returns -1 when hardware counters are unavailable.
+static long long branch_miss_stop(void) {
+#ifdef __linux__
+  long long n;
+  if (perf_fd >= 0) {
+    ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(perf_fd, &n, sizeof n) == sizeof n)
+      return n;
+  }
+#endif
+  return -1;
+}
+
+static void report(const char *name, double t, long long misses, uint64_t ops,
+                   uint32_t got, uint32_t want) {
+  printf("%-9s %7.3f s %7.2f ns/op", name, t, t * 1e9 / ops);
+  if (misses >= 0)
+    printf(" %12lld br-miss %6.3f miss/op", misses, (double)misses / ops);
+  else
+    printf("      br-miss n/a");
+  printf("  %s\n", got == want ? "ok" : "WRONG RESULT");
+}
+
+// 29 -bench [iters [n]]
+static int bench(int iters, int n) {
+  static uint64_t count[VM_CODE];
+  static cell threaded[VM_CODE], fused[VM_CODE];
+  int chosen[VM_NSUPER], nchosen, i, bad = 0;
+  uint32_t want = 0, fa = 0, fb = 1, got;
+  uint64_t ops = 0;
+  long long misses;
+  double t;
+
+  for (i = 0; i < n; i++) { uint32_t f = fa + fb; fa = fb; fb = f; }
+  for (i = 0; i < iters; i++) want += fa + i;
+
+  build_program(iters, n);
+  predecode(threaded);
+  memcpy(fused, threaded, sizeof fused);
+  memset(count, 0, sizeof count);
+  bad |= run_profile(vm_code, count) != want;
+  for (i = 0; i < vm_size; i++) ops += count[i];
+  nchosen = select_super(fused, count, chosen);
+
+  printf("program: %d words, %llu ops executed\n", vm_size, (unsigned long long)ops);
+  printf("superinstructions:");
+  for (i = 0; i < nchosen; i++)
+    printf(" %s+%s", op_name[super_pair[chosen[i]][0]], op_name[super_pair[chosen[i]][1]]);
+  printf("\n");
+
+#define RUN(name, call) \
+  branch_miss_start(); t = now_sec(); got = call; t = now_sec() - t; \
+  misses = branch_miss_stop(); report(name, t, misses, ops, got, want); \
+  bad |= got != want;
+
+  RUN("switch", run_switch(vm_code));
+  RUN("goto", run_goto(vm_code));
+  RUN("threaded", run_threaded(threaded));
+  RUN("super", run_threaded(fused));
+#undef RUN
+  return bad;
+}
+
+int main(int argc, char *argv[]) {
   const int BUFSIZE = 2048;
   // Initialize the command buffer. This must end with a 0, which is the
   // "exit" command for the interpreter loop.
   int cmds[BUFSIZE];
+
+  if (argc > 1 && !strcmp(argv[1], "-bench"))
+    return bench(argc > 2 ? atoi(argv[2]) : 10000, argc > 3 ? atoi(argv[3]) : 16);
+
   for (int i = 0; i < BUFSIZE - 1; ++i)
     cmds[i] = i % 31 + 1;
   cmds[BUFSIZE - 1] = 0;
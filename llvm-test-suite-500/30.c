@@ -230,6 +230,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
 #ifndef INTRIG
 #include <math.h>
 #endif
@@ -308,25 +310,8 @@ static double testcase[4][4] = {
 	{-78.1, 1, 0, 0}
 };
 
-/*  Internal trig functions (used only if INTRIG is  defined).	 These
-    standard  functions  may be enabled to obtain timings that reflect
-    the machine's floating point performance rather than the speed  of
-    its trig function evaluation.  */
-
-#ifdef INTRIG
-
-/*  The following definitions should keep you from getting intro trouble
-    with compilers which don't let you redefine intrinsic functions.  */
-
-#define sin I_sin
-#define cos I_cos
-#define tan I_tan
-#define sqrt I_sqrt
-#define atan I_atan
-#define atan2 I_atan2
-#define asin I_asin
-
-#define fabs(x)  ((x < 0.0) ? -x : x)
+/*  Constants shared by the internal trig functions and the batch
+    tracer's vector versions of them.  */
 
 #define pic 3.1415926535897932
 
@@ -352,6 +337,26 @@ static double atanc[] = {
 	1.3258176636680324644
 };
 
+/*  Internal trig functions (used only if INTRIG is  defined).	 These
+    standard  functions  may be enabled to obtain timings that reflect
+    the machine's floating point performance rather than the speed  of
+    its trig function evaluation.  */
+
+#ifdef INTRIG
+
+/*  The following definitions should keep you from getting intro trouble
+    with compilers which don't let you redefine intrinsic functions.  */
+
+#define sin I_sin
+#define cos I_cos
+#define tan I_tan
+#define sqrt I_sqrt
+#define atan I_atan
+#define atan2 I_atan2
+#define asin I_asin
+
+#define fabs(x)  ((x < 0.0) ? -x : x)
+
 /*  aint(x)	  Return integer part of number.  Truncates towards 0	 */
 
 double aint(x)
@@ -673,6 +678,414 @@ double ray_h;
 	}
 }
 
+/*  Batch ray trace
+
+    trace_batch() traces N rays through the current lens in one call.
+    Rays are passed in SoA form (separate height, spectral line, object
+    distance and slope arrays) and are processed RAY_LANES at a time in
+    GCC vector registers, so each step of transit_surface() becomes one
+    SIMD operation across rays.  The trig is the INTRIG polynomial set
+    above evaluated lane by lane with masks instead of branches, so the
+    batch path has the accuracy of the built-in routines whether or not
+    INTRIG is defined.  Batches larger than RAY_SPLIT rays are divided
+    among ray_nthreads threads.  */
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define RAY_LANES 4
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define RAY_LANES 2
+#else
+#define RAY_LANES 2
+#endif
+#define RAY_SPLIT 4096
+#define RAY_MAX_THREADS 64
+
+typedef double vray __attribute__((vector_size(RAY_LANES * sizeof(double))));
+typedef long long vmask __attribute__((vector_size(RAY_LANES * sizeof(double))));
+
+int ray_nthreads = 1;
+
+static inline vray vsel(vmask m, vray a, vray b)
+{
+	return (vray)(((vmask)a & m) | ((vmask)b & ~m));
+}
+
+static inline vray vtrunc(vray x)
+{
+	return __builtin_convertvector(__builtin_convertvector(x, vmask), vray);
+}
+
+static inline vray vsqrt(vray x)
+{
+#if defined(__AVX__)
+	return (vray)_mm256_sqrt_pd((__m256d)x);
+#elif defined(__SSE2__)
+	return (vray)_mm_sqrt_pd((__m128d)x);
+#else
+	int k;
+
+	for (k = 0; k < RAY_LANES; k++)
+	   x[k] = __builtin_sqrt(x[k]);
+	return x;
+#endif
+}
+
+static inline vray vsin(vray x)
+{
+	vmask sign, m;
+	vray y, z, r1, r2;
+
+	sign = x < 0.0;
+	x = vsel(sign, -x, x);
+	x = vsel(x > twopi, x - vtrunc(x / twopi) * twopi, x);
+	m = x > pi;
+	x = vsel(m, x - pi, x);
+	sign ^= m;
+	x = vsel(x > piover2, pi - x, x);
+
+	y = x * fouroverpi;
+	z = y * y;
+	r1 = y * (((((((-0.202253129293E-13 * z + 0.69481520350522E-11) * z -
+	   0.17572474176170806E-8) * z + 0.313361688917325348E-6) * z -
+	   0.365762041821464001E-4) * z + 0.249039457019271628E-2) * z -
+	   0.0807455121882807815) * z + 0.785398163397448310);
+	y = (piover2 - x) * fouroverpi;
+	z = y * y;
+	r2 = ((((((-0.38577620372E-12 * z + 0.11500497024263E-9) * z -
+	   0.2461136382637005E-7) * z + 0.359086044588581953E-5) * z -
+	   0.325991886926687550E-3) * z + 0.0158543442438154109) * z -
+	   0.308425137534042452) * z + 1.0;
+	r1 = vsel(x < piover4, r1, r2);
+	return vsel(sign, -r1, r1);
+}
+
+static inline vray vcos(vray x)
+{
+	x = vsel(x < 0.0, -x, x);
+	x = vsel(x > twopi, x - vtrunc(x / twopi) * twopi, x);
+	return vsin(x + piover2);
+}
+
+static inline vray vatan(vray x)
+{
+	vmask sign, big, mid;
+	vray y, z, a, b;
+	int k;
+
+	sign = x < 0.0;
+	x = vsel(sign, -x, x);
+	big = x >= 4.0;
+	mid = ~big & (x >= 0.25);
+	y = vsel(mid, vtrunc(x / 0.5), x * 0.0);
+	z = y * 0.5;
+	x = vsel(big, 1.0 / x, vsel(mid, (x - z) / (x * z + 1), x));
+
+	z = x * x;
+	b = ((((893025.0 * z + 49116375.0) * z + 425675250.0) * z +
+	    1277025750.0) * z + 1550674125.0) * z + 654729075.0;
+	a = (((13852575.0 * z + 216602100.0) * z + 891080190.0) * z +
+	    1332431100.0) * z + 654729075.0;
+	a = (a / b) * x;
+	for (k = 1; k < 8; k++)	   /* atanc[y] by selects, y is 0..7 */
+	   a = vsel(y == (double)k, a + atanc[k], a);
+	a = vsel(big, piover2 - a, a);
+	return vsel(sign, -a, a);
+}
+
+/*  asin(x) = atan2(x, sqrt(1 - x*x)); the cosine is never negative.  */
+
+static inline vray vasin(vray x)
+{
+	vray c = vsqrt(1.0 - x * x);
+
+	return vsel(c == 0.0, vsel(x > 0.0, x * 0.0 + piover2, x * 0.0 - piover2),
+	   vatan(x / c));
+}
+
+/*  One vector of rays through all surfaces; transit_surface() with every
+    global replaced by a lane.  Plane surfaces are uniform across lanes,
+    so that test stays a scalar branch.  */
+
+static void trace_lanes(const double *ray_h, const int *line, int parax,
+	double *od_out, double *asa_out)
+{
+	vray od, h, asa, from, to, dn, iang, iang_sin, rang, rang_sin, old, sag;
+	vmask at_inf;
+	double r;
+	int i, k;
+
+	for (k = 0; k < RAY_LANES; k++) {
+	   h[k] = ray_h[k];
+	   dn[k] = (spectral_line[4] - spectral_line[line[k]]) /
+	      (spectral_line[3] - spectral_line[6]);
+	}
+	od = h * 0.0;
+	asa = od;
+	from = od + 1.0;
+
+	for (i = 1; i <= current_surfaces; i++) {
+	   r = s[i][1];
+	   to = od * 0.0 + s[i][2];
+	   if (s[i][2] > 1.0)
+	      to = to + dn * ((s[i][2] - 1.0) / s[i][3]);
+	   at_inf = od == 0.0;
+
+	   if (parax) {
+	      if (r != 0.0) {
+		 asa = vsel(at_inf, asa * 0.0, asa);
+		 iang_sin = vsel(at_inf, h / r, ((od - r) / r) * asa);
+		 rang_sin = (from / to) * iang_sin;
+		 old = asa;
+		 asa = asa + iang_sin - rang_sin;
+		 h = vsel(at_inf, h, od * old);
+		 od = h / asa;
+	      } else {
+		 od = od * (to / from);
+		 asa = asa * (from / to);
+	      }
+	   } else if (r != 0.0) {
+	      iang_sin = vsel(at_inf, h / r, ((od - r) / r) * vsin(asa));
+	      asa = vsel(at_inf, asa * 0.0, asa);
+	      iang = vasin(iang_sin);
+	      rang_sin = (from / to) * iang_sin;
+	      old = asa;
+	      asa = asa + iang - vasin(rang_sin);
+	      sag = vsin((old + iang) / 2.0);
+	      sag = 2.0 * r * sag * sag;
+	      od = ((r * vsin(old + iang)) * (vcos(asa) / vsin(asa))) + sag;
+	   } else {
+	      rang = -vasin((from / to) * vsin(asa));
+	      od = od * ((to * vcos(-rang)) / (from * vcos(asa)));
+	      asa = -rang;
+	   }
+	   from = to;
+	   if (i < current_surfaces)
+	      od = od - s[i][4];
+	}
+	for (k = 0; k < RAY_LANES; k++) {
+	   od_out[k] = od[k];
+	   asa_out[k] = asa[k];
+	}
+}
+
+static void trace_range(int n, const double *ray_h, const int *line,
+	int parax, double *od, double *asa)
+{
+	double th[RAY_LANES], tod[RAY_LANES], tasa[RAY_LANES];
+	int tl[RAY_LANES];
+	int i, k;
+
+	for (i = 0; i + RAY_LANES <= n; i += RAY_LANES)
+	   trace_lanes(ray_h + i, line + i, parax, od + i, asa + i);
+	if (i < n) {		   /* pad the tail with copies of its first ray */
+	   for (k = 0; k < RAY_LANES; k++) {
+	      th[k] = ray_h[i + (i + k < n ? k : 0)];
+	      tl[k] = line[i + (i + k < n ? k : 0)];
+	   }
+	   trace_lanes(th, tl, parax, tod, tasa);
+	   for (k = 0; i + k < n; k++) {
+	      od[i + k] = tod[k];
+	      asa[i + k] = tasa[k];
+	   }
+	}
+}
+
+struct trace_job {
+	int n, parax;
+	const double *ray_h;
+	const int *line;
+	double *od, *asa;
+};
+
+static void *trace_worker(void *arg)
+{
+	struct trace_job *j = arg;
+
+	trace_range(j->n, j->ray_h, j->line, j->parax, j->od, j->asa);
+	return NULL;
+}
+
+/*  Trace n rays entering parallel to the axis at heights ray_h[] in
+    spectral lines line[]; the final object distance and axis slope
+    angle of each ray are stored in od[] and asa[].  */
+
+void trace_batch(int n, const double *ray_h, const int *line, int parax,
+	double *od, double *asa)
+{
+	struct trace_job job[RAY_MAX_THREADS];
+	pthread_t tid[RAY_MAX_THREADS];
+	int running[RAY_MAX_THREADS];
+	int nt = ray_nthreads, t, lo, hi;
+
+	if (nt > RAY_MAX_THREADS)
+	   nt = RAY_MAX_THREADS;
+	if (nt <= 1 || n < RAY_SPLIT) {
+	   trace_range(n, ray_h, line, parax, od, asa);
+	   return;
+	}
+	for (t = 0; t < nt; t++) {
+	   /* every slice but the last is a whole number of vectors */
+	   lo = (int)((long long)n * t / nt) / RAY_LANES * RAY_LANES;
+	   hi = (t == nt - 1) ? n :
+	      (int)((long long)n * (t + 1) / nt) / RAY_LANES * RAY_LANES;
+	   job[t].n = hi - lo;
+	   job[t].parax = parax;
+	   job[t].ray_h = ray_h + lo;
+	   job[t].line = line + lo;
+	   job[t].od = od + lo;
+	   job[t].asa = asa + lo;
+	}
+	for (t = 1; t < nt; t++) {
+	   running[t] = pthread_create(&tid[t], NULL, trace_worker, &job[t]) == 0;
+	   if (!running[t])
+	      trace_worker(&job[t]);
+	}
+	trace_worker(&job[0]);
+	for (t = 1; t < nt; t++)
+	   if (running[t])
+	      pthread_join(tid[t], NULL);
+}
+
+/*  Derive the aberrations from the D, C and F traces in od_sa[] */
+
+static void aberrations(double od_cline, double od_fline)
+{
+	aberr_lspher = od_sa[1][0] - od_sa[0][0];
+	aberr_osc = 1.0 - (od_sa[1][0] * od_sa[1][1]) /
+	   (sin(od_sa[0][1]) * od_sa[0][0]);
+	aberr_lchrom = od_fline - od_cline;
+	max_lspher = sin(od_sa[0][1]);
+
+	/* D light */
+
+	max_lspher = 0.0000926 / (max_lspher * max_lspher);
+	max_osc = 0.0025;
+	max_lchrom = max_lspher;
+}
+
+/*  Edit the results of the last trace into outarr[]  */
+
+static void edit_results()
+{
+        sprintf(outarr[0], "%15s   %21.11f  %14.11f",
+           "Marginal ray", od_sa[0][0], od_sa[0][1]);
+        sprintf(outarr[1], "%15s   %21.11f  %14.11f",
+           "Paraxial ray", od_sa[1][0], od_sa[1][1]);
+	sprintf(outarr[2],
+           "Longitudinal spherical aberration:      %16.11f",
+	   aberr_lspher);
+	sprintf(outarr[3],
+           "    (Maximum permissible):              %16.11f",
+	   max_lspher);
+	sprintf(outarr[4],
+           "Offense against sine condition (coma):  %16.11f",
+	   aberr_osc);
+	sprintf(outarr[5],
+           "    (Maximum permissible):              %16.11f",
+	   max_osc);
+	sprintf(outarr[6],
+           "Axial chromatic aberration:             %16.11f",
+	   aberr_lchrom);
+	sprintf(outarr[7],
+           "    (Maximum permissible):              %16.11f",
+	   max_lchrom);
+}
+
+static double now_sec()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*  fbench -bench [rays [threads]]
+
+    Repeats the accuracy check with the batch tracer, then traces a fan
+    of rays in C, D and F light with trace_line() and with trace_batch()
+    and reports rays/sec for each and the largest deviation of the batch
+    results from the scalar ones.  */
+
+static int batch_bench(int nrays, int nthreads)
+{
+	static const int fan_lines[3] = { 3, 4, 6 };
+	double h[3], od[3], asa[3], pod[1], pasa[1];
+	double *fh, *sod, *sasa, *bod, *basa, t_scalar, t_batch, e, e_od, e_asa;
+	int l[3] = { 4, 3, 6 };
+	int *fl, i, errors;
+
+	ray_nthreads = nthreads;
+
+	/* marginal rays in D, C and F, then the paraxial ray in D */
+
+	h[0] = h[1] = h[2] = clear_aperture / 2.0;
+	trace_batch(3, h, l, FALSE, od, asa);
+	trace_batch(1, h, l, TRUE, pod, pasa);
+	od_sa[0][0] = od[0];
+	od_sa[0][1] = asa[0];
+	od_sa[1][0] = pod[0];
+	od_sa[1][1] = pasa[0];
+	aberrations(od[1], od[2]);
+	edit_results();
+	errors = 0;
+	for (i = 0; i < 8; i++)
+	   if (strcmp(outarr[i], refarr[i]) != 0) {
+              printf("Batch trace error on line %d...\n", i + 1);
+              printf("Expected:  \"%s\"\n", refarr[i]);
+              printf("Received:  \"%s\"\n", outarr[i]);
+	      errors++;
+	   }
+        printf("Batch accuracy check: %s\n", errors ? "FAILED" : "no errors");
+
+	fh = malloc(nrays * sizeof(double));
+	fl = malloc(nrays * sizeof(int));
+	sod = malloc(nrays * sizeof(double));
+	sasa = malloc(nrays * sizeof(double));
+	bod = malloc(nrays * sizeof(double));
+	basa = malloc(nrays * sizeof(double));
+	for (i = 0; i < nrays; i++) {
+	   fh[i] = (clear_aperture / 2.0) * (i / 3 + 1) / ((nrays + 2) / 3);
+	   fl[i] = fan_lines[i % 3];
+	}
+
+	paraxial = FALSE;
+	t_scalar = now_sec();
+	for (i = 0; i < nrays; i++) {
+	   trace_line(fl[i], fh[i]);
+	   sod[i] = object_distance;
+	   sasa[i] = axis_slope_angle;
+	}
+	t_scalar = now_sec() - t_scalar;
+
+	t_batch = now_sec();
+	trace_batch(nrays, fh, fl, FALSE, bod, basa);
+	t_batch = now_sec() - t_batch;
+
+	e_od = e_asa = 0.0;
+	for (i = 0; i < nrays; i++) {
+	   e = (bod[i] - sod[i]) / sod[i];
+	   if (e < 0.0)
+	      e = -e;
+	   if (e > e_od)
+	      e_od = e;
+	   e = basa[i] - sasa[i];
+	   if (e < 0.0)
+	      e = -e;
+	   if (e > e_asa)
+	      e_asa = e;
+	}
+        printf("%d rays, %d lanes, %d threads\n", nrays, RAY_LANES, ray_nthreads);
+        printf("trace_line   %12.0f rays/sec\n", nrays / t_scalar);
+        printf("trace_batch  %12.0f rays/sec\n", nrays / t_batch);
+        printf("max relative error in object distance  %.3e\n", e_od);
+        printf("max absolute error in axis slope angle %.3e\n", e_asa);
+
+	free(fh); free(fl); free(sod); free(sasa); free(bod); free(basa);
+	return errors != 0;
+}
+
 /*  Initialise when called the first time  */
 
 int
@@ -707,6 +1120,10 @@ char *argv[];
 	   for (j = 0; j < 4; j++)
 	      s[i + 1][j + 1] = testcase[i][j];
 
+	if (argc > 1 && strcmp(argv[1], "-bench") == 0)
+	   return batch_bench(argc > 2 ? atoi(argv[2]) : 300000,
+	      argc > 3 ? atoi(argv[3]) : 1);
+
 #ifdef ACCURACY
         printf("Beginning execution of floating point accuracy test...\n");
 	passes = 0;
@@ -752,45 +1169,14 @@ char *argv[];
 	   trace_line(6, clear_aperture / 2.0);
 	   od_fline = object_distance;
 
-	   aberr_lspher = od_sa[1][0] - od_sa[0][0];
-	   aberr_osc = 1.0 - (od_sa[1][0] * od_sa[1][1]) /
-	      (sin(od_sa[0][1]) * od_sa[0][0]);
-	   aberr_lchrom = od_fline - od_cline;
-	   max_lspher = sin(od_sa[0][1]);
-
-	   /* D light */
-
-	   max_lspher = 0.0000926 / (max_lspher * max_lspher);
-	   max_osc = 0.0025;
-	   max_lchrom = max_lspher;
+	   aberrations(od_cline, od_fline);
 #ifndef ACCURACY
 	}
 #endif
 
 	/* Now evaluate the accuracy of the results from the last ray trace */
 
-        sprintf(outarr[0], "%15s   %21.11f  %14.11f",
-           "Marginal ray", od_sa[0][0], od_sa[0][1]);
-        sprintf(outarr[1], "%15s   %21.11f  %14.11f",
-           "Paraxial ray", od_sa[1][0], od_sa[1][1]);
-	sprintf(outarr[2],
-           "Longitudinal spherical aberration:      %16.11f",
-	   aberr_lspher);
-	sprintf(outarr[3],
-           "    (Maximum permissible):              %16.11f",
-	   max_lspher);
-	sprintf(outarr[4],
-           "Offense against sine condition (coma):  %16.11f",
-	   aberr_osc);
-	sprintf(outarr[5],
-           "    (Maximum permissible):              %16.11f",
-	   max_osc);
-	sprintf(outarr[6],
-           "Axial chromatic aberration:             %16.11f",
-	   aberr_lchrom);
-	sprintf(outarr[7],
-           "    (Maximum permissible):              %16.11f",
-	   max_lchrom);
+	edit_results();
 
 	/* Now compare the edited results with the master values from
 	   reference executions of this program. */
@@ -224,7 +224,494 @@ static void fourn(data, nn, ndim, isign)
 }
 #undef SWAP
 
-int main()
+/*
+
+	Row-column 2-D FFT
+
+	fourn() walks the whole array once per butterfly stage with
+	strides of a full row, which is hostile to caches once the array
+	outgrows them.  fft2d() does the same transform as a sequence of
+	contiguous 1-D transforms: every row is transformed in place, the
+	matrix is transposed in TILE x TILE blocks that fit in L1, the
+	former columns are transformed as rows, and the matrix is
+	transposed back.  Rows and tiles are divided among fft_nthreads
+	threads.
+
+	rfft2d()/irfft2d() specialise this for real input frames.  Each
+	real row of length n is transformed as a complex row of length
+	n/2 and split into the n/2+1 non-redundant outputs; only that
+	half spectrum is stored and transformed along the columns, which
+	halves both the memory and the arithmetic.
+
+	All of these use fourn()'s conventions: isign = 1 is exp(+i...),
+	and the inverse is unnormalised, so a forward/inverse pair scales
+	the data by the number of elements.  Arrays are 0-based, row-major,
+	with complex values interleaved.
+
+*/
+
+#include <pthread.h>
+#include <time.h>
+
+#define TILE		32	   /* Transpose tile edge, in complex elements */
+#define FFT_MAX_THREADS 64
+
+int fft_nthreads = 1;
+
+typedef struct {
+	int n;			   /* Transform length */
+	double *c, *s;		   /* cos, sin of 2 pi k / n, k < n / 2 */
+} twiddles;
+
+static void make_twiddles(twiddles *t, int n)
+{
+	int k;
+
+	t->n = n;
+	t->c = (double *) malloc(max(n / 2, 1) * sizeof(double));
+	t->s = (double *) malloc(max(n / 2, 1) * sizeof(double));
+	for (k = 0; k < n / 2; k++) {
+	   t->c[k] = cos(6.28318530717959 * k / n);
+	   t->s[k] = sin(6.28318530717959 * k / n);
+	}
+}
+
+static void free_twiddles(twiddles *t)
+{
+	free(t->c);
+	free(t->s);
+}
+
+/*  In-place radix-2 transform of one contiguous complex row  */
+
+static void fft_row(Float *x, int n, int isign, const twiddles *t)
+{
+	int i, j, m, len, half, step, k, a, b;
+	Float tr, ti;
+	double wr, wi;
+
+	for (i = 0, j = 0; i < n - 1; i++) {
+	   if (i < j) {
+	      tr = x[2 * i]; x[2 * i] = x[2 * j]; x[2 * j] = tr;
+	      ti = x[2 * i + 1]; x[2 * i + 1] = x[2 * j + 1]; x[2 * j + 1] = ti;
+	   }
+	   m = n >> 1;
+	   while (j & m) {
+	      j ^= m;
+	      m >>= 1;
+	   }
+	   j |= m;
+	}
+	for (len = 2; len <= n; len <<= 1) {
+	   half = len >> 1;
+	   step = t->n / len;
+	   for (i = 0; i < n; i += len) {
+	      for (k = 0; k < half; k++) {
+		 wr = t->c[k * step];
+		 wi = isign * t->s[k * step];
+		 a = 2 * (i + k);
+		 b = a + 2 * half;
+		 tr = wr * x[b] - wi * x[b + 1];
+		 ti = wr * x[b + 1] + wi * x[b];
+		 x[b] = x[a] - tr;
+		 x[b + 1] = x[a + 1] - ti;
+		 x[a] += tr;
+		 x[a + 1] += ti;
+	      }
+	   }
+	}
+}
+
+/*  Real row x[0..n-1] to half spectrum X[0..n/2] (complex, in out[])  */
+
+static void rfft_row(const Float *x, Float *out, int n, int isign,
+	const twiddles *th, const twiddles *tn)
+{
+	int h = n / 2, k, m;
+	double zr, zi, cr, ci, er, ei, or_, oi, wr, wi;
+	Float z0r, z0i;
+
+	memcpy(out, x, n * sizeof(Float));
+	fft_row(out, h, isign, th);
+	z0r = out[0];
+	z0i = out[1];
+	for (k = 1; k <= h / 2; k++) {
+	   m = h - k;
+	   zr = out[2 * k];  zi = out[2 * k + 1];
+	   cr = out[2 * m];  ci = -out[2 * m + 1];	/* conj(Z[h-k]) */
+	   er = 0.5 * (zr + cr);  ei = 0.5 * (zi + ci);
+	   or_ = 0.5 * (zi - ci); oi = -0.5 * (zr - cr); /* (Z - conj) / 2i */
+	   wr = tn->c[k];  wi = isign * tn->s[k];
+	   out[2 * k]	  = er + wr * or_ - wi * oi;
+	   out[2 * k + 1] = ei + wr * oi + wi * or_;
+	   if (m != k) {		/* X[h-k] = conj(E - W^k O) */
+	      out[2 * m]     = er - (wr * or_ - wi * oi);
+	      out[2 * m + 1] = -(ei - (wr * oi + wi * or_));
+	   }
+	}
+	out[0] = z0r + z0i;
+	out[1] = 0.0;
+	out[2 * h] = z0r - z0i;
+	out[2 * h + 1] = 0.0;
+}
+
+/*  Half spectrum X[0..n/2] in in[] (clobbered) back to n real values,
+    unnormalised (the result is n times the original row).  */
+
+static void irfft_row(Float *in, Float *x, int n, int isign,
+	const twiddles *th, const twiddles *tn)
+{
+	int h = n / 2, k, m, j;
+	double ar, ai, br, bi, dr, di, wr, wi;
+	Float x0, xh;
+
+	x0 = in[0];
+	xh = in[2 * h];
+	for (k = 1; k <= h / 2; k++) {
+	   m = h - k;
+	   ar = in[2 * k];  ai = in[2 * k + 1];
+	   br = in[2 * m];  bi = in[2 * m + 1];
+	   /* Z'[k] = (X[k] + conj X[m]) + i (X[k] - conj X[m]) W^-k */
+	   wr = tn->c[k];  wi = isign * tn->s[k];
+	   dr = ar - br;  di = ai + bi;
+	   in[2 * k]	 = (ar + br) - (dr * wi + di * wr);
+	   in[2 * k + 1] = (ai - bi) + (dr * wr - di * wi);
+	   if (m != k) {
+	      wr = tn->c[m];  wi = isign * tn->s[m];
+	      dr = br - ar;  di = bi + ai;
+	      in[2 * m]	    = (br + ar) - (dr * wi + di * wr);
+	      in[2 * m + 1] = (bi - ai) + (dr * wr - di * wi);
+	   }
+	}
+	in[0] = x0 + xh;
+	in[1] = x0 - xh;
+	fft_row(in, h, isign, th);
+	for (j = 0; j < n; j++)
+	   x[j] = in[j];
+}
+
+/*  Run fn over [0, n) split among fft_nthreads threads  */
+
+typedef void (*range_fn)(void *ctx, int lo, int hi);
+
+struct range_job {
+	range_fn fn;
+	void *ctx;
+	int lo, hi;
+};
+
+static void *range_worker(void *arg)
+{
+	struct range_job *j = arg;
+
+	j->fn(j->ctx, j->lo, j->hi);
+	return NULL;
+}
+
+static void par_for(int n, range_fn fn, void *ctx)
+{
+	struct range_job job[FFT_MAX_THREADS];
+	pthread_t tid[FFT_MAX_THREADS];
+	int running[FFT_MAX_THREADS];
+	int nt = min(min(fft_nthreads, FFT_MAX_THREADS), n), t;
+
+	if (nt <= 1) {
+	   fn(ctx, 0, n);
+	   return;
+	}
+	for (t = 0; t < nt; t++) {
+	   job[t].fn = fn;
+	   job[t].ctx = ctx;
+	   job[t].lo = (int) ((long) n * t / nt);
+	   job[t].hi = (int) ((long) n * (t + 1) / nt);
+	}
+	for (t = 1; t < nt; t++) {
+	   running[t] = pthread_create(&tid[t], NULL, range_worker, &job[t]) == 0;
+	   if (!running[t])
+	      range_worker(&job[t]);
+	}
+	range_worker(&job[0]);
+	for (t = 1; t < nt; t++)
+	   if (running[t])
+	      pthread_join(tid[t], NULL);
+}
+
+struct rows_ctx {
+	Float *a, *b;
+	const Float *ra;
+	Float *rb;
+	int rows, cols, isign;
+	const twiddles *th, *tn;
+};
+
+static void rows_fft(void *p, int lo, int hi)
+{
+	struct rows_ctx *c = p;
+	int r;
+
+	for (r = lo; r < hi; r++)
+	   fft_row(c->a + 2L * r * c->cols, c->cols, c->isign, c->tn);
+}
+
+/*  b[cols][rows] = transpose of a[rows][cols]; lo..hi are tile rows  */
+
+static void rows_transpose(void *p, int lo, int hi)
+{
+	struct rows_ctx *c = p;
+	int ti, tj, i, j, iend, jend;
+
+	for (ti = lo * TILE; ti < min(hi * TILE, c->rows); ti += TILE) {
+	   iend = min(ti + TILE, c->rows);
+	   for (tj = 0; tj < c->cols; tj += TILE) {
+	      jend = min(tj + TILE, c->cols);
+	      for (i = ti; i < iend; i++)
+		 for (j = tj; j < jend; j++) {
+		    c->b[2L * (j * c->rows + i)] = c->a[2L * (i * c->cols + j)];
+		    c->b[2L * (j * c->rows + i) + 1] = c->a[2L * (i * c->cols + j) + 1];
+		 }
+	   }
+	}
+}
+
+static void transpose(Float *b, Float *a, int rows, int cols)
+{
+	struct rows_ctx c;
+
+	c.a = a;
+	c.b = b;
+	c.rows = rows;
+	c.cols = cols;
+	par_for((rows + TILE - 1) / TILE, rows_transpose, &c);
+}
+
+static void fft_rows(Float *a, int rows, int cols, int isign, const twiddles *t)
+{
+	struct rows_ctx c;
+
+	c.a = a;
+	c.rows = rows;
+	c.cols = cols;
+	c.isign = isign;
+	c.tn = t;
+	par_for(rows, rows_fft, &c);
+}
+
+/*  Complex n0 x n1 transform in place; both edges powers of two  */
+
+void fft2d(Float *a, int n0, int n1, int isign)
+{
+	twiddles t0, t1;
+	Float *scratch = (Float *) malloc(2L * n0 * n1 * sizeof(Float));
+
+	make_twiddles(&t0, n0);
+	make_twiddles(&t1, n1);
+	fft_rows(a, n0, n1, isign, &t1);
+	transpose(scratch, a, n0, n1);
+	fft_rows(scratch, n1, n0, isign, &t0);
+	transpose(a, scratch, n1, n0);
+	free_twiddles(&t0);
+	free_twiddles(&t1);
+	free(scratch);
+}
+
+static void rows_rfft(void *p, int lo, int hi)
+{
+	struct rows_ctx *c = p;
+	int r, w = c->cols / 2 + 1;
+
+	for (r = lo; r < hi; r++)
+	   rfft_row(c->ra + (long) r * c->cols, c->b + 2L * r * w, c->cols,
+	      c->isign, c->th, c->tn);
+}
+
+static void rows_irfft(void *p, int lo, int hi)
+{
+	struct rows_ctx *c = p;
+	int r, w = c->cols / 2 + 1;
+
+	for (r = lo; r < hi; r++)
+	   irfft_row(c->b + 2L * r * w, c->rb + (long) r * c->cols, c->cols,
+	      c->isign, c->th, c->tn);
+}
+
+/*  Real n0 x n1 frame to its n0 x (n1/2 + 1) half spectrum  */
+
+void rfft2d(const Float *in, Float *spec, int n0, int n1, int isign)
+{
+	struct rows_ctx c;
+	twiddles t0, th, tn;
+	int w = n1 / 2 + 1;
+	Float *scratch = (Float *) malloc(2L * n0 * w * sizeof(Float));
+
+	make_twiddles(&t0, n0);
+	make_twiddles(&th, n1 / 2);
+	make_twiddles(&tn, n1);
+	c.ra = in;
+	c.b = spec;
+	c.cols = n1;
+	c.isign = isign;
+	c.th = &th;
+	c.tn = &tn;
+	par_for(n0, rows_rfft, &c);
+	transpose(scratch, spec, n0, w);
+	fft_rows(scratch, w, n0, isign, &t0);
+	transpose(spec, scratch, w, n0);
+	free_twiddles(&t0);
+	free_twiddles(&th);
+	free_twiddles(&tn);
+	free(scratch);
+}
+
+/*  Half spectrum (clobbered) back to an n0 x n1 real frame, unnormalised  */
+
+void irfft2d(Float *spec, Float *out, int n0, int n1, int isign)
+{
+	struct rows_ctx c;
+	twiddles t0, th, tn;
+	int w = n1 / 2 + 1;
+	Float *scratch = (Float *) malloc(2L * n0 * w * sizeof(Float));
+
+	make_twiddles(&t0, n0);
+	make_twiddles(&th, n1 / 2);
+	make_twiddles(&tn, n1);
+	transpose(scratch, spec, n0, w);
+	fft_rows(scratch, w, n0, isign, &t0);
+	transpose(spec, scratch, w, n0);
+	c.b = spec;
+	c.rb = out;
+	c.cols = n1;
+	c.isign = isign;
+	c.th = &th;
+	c.tn = &tn;
+	par_for(n0, rows_irfft, &c);
+	free_twiddles(&t0);
+	free_twiddles(&th);
+	free_twiddles(&tn);
+	free(scratch);
+}
+
+/*  The validation from main(): rescale the real parts to 0..255 and
+    compare against the grid pattern.  Returns the number of errors.  */
+
+static int check_grid(const Float *re, int stride, int edge)
+{
+	int i, j, k, l, m = 0;
+	double r, rmin = 1e10, rmax = -1e10, mapscale;
+
+	for (i = 0; i < edge * edge; i++) {
+	   r = re[(long) i * stride];
+	   rmin = min(r, rmin);
+	   rmax = max(r, rmax);
+	}
+	mapscale = 255 / (rmax - rmin);
+	for (i = 0; i < edge; i++)
+	   for (j = 0; j < edge; j++) {
+	      k = (re[((long) i * edge + j) * stride] - rmin) * mapscale;
+	      l = (((i & 15) == 8) || ((j & 15) == 8)) ? 255 : 0;
+	      if (k != l)
+		 m++;
+	   }
+	return m;
+}
+
+static double now_sec()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*  fft -bench [edge [passes [threads]]]
+
+    Runs the forward/inverse loop on the grid image with fourn(), with
+    fft2d() and with the real-input path, validates each result as
+    main() does, and reports time per pair, the working-set size and
+    the largest spectrum deviation from fourn().  */
+
+static int fft_bench(int edge, int passes, int nthreads)
+{
+	long n = (long) edge * edge, i, j;
+	int w = edge / 2 + 1, nn[3] = { 0, edge, edge }, p, errs, bad = 0;
+	Float *ref, *cplx, *real, *spec;
+	double t, e, emax, scale;
+
+	fft_nthreads = nthreads;
+	ref = (Float *) calloc(2 * n + 1, sizeof(Float));
+	cplx = (Float *) calloc(2 * n, sizeof(Float));
+	real = (Float *) calloc(n, sizeof(Float));
+	spec = (Float *) calloc(2L * edge * w, sizeof(Float));
+	for (i = 0; i < edge; i++)
+	   for (j = 0; j < edge; j++)
+	      if (((i & 15) == 8) || ((j & 15) == 8))
+		 ref[1 + 2 * (i * edge + j)] = cplx[2 * (i * edge + j)] =
+		    real[i * edge + j] = 128.0;
+
+	/* One forward transform of each to compare spectra */
+
+	fourn(ref, nn, 2, 1);
+	fft2d(cplx, edge, edge, 1);
+	rfft2d(real, spec, edge, edge, 1);
+	scale = emax = 0.0;
+	for (i = 0; i < 2 * n; i++) {
+	   scale = max(scale, fabs(ref[1 + i]));
+	   emax = max(emax, fabs(cplx[i] - ref[1 + i]));
+	}
+	for (i = 0; i < edge; i++)
+	   for (j = 0; j < w; j++) {
+	      e = fabs(spec[2 * (i * w + j)] - ref[1 + 2 * (i * edge + j)]) +
+		 fabs(spec[2 * (i * w + j) + 1] - ref[2 + 2 * (i * edge + j)]);
+	      emax = max(emax, e);
+	   }
+	fourn(ref, nn, 2, -1);
+	fft2d(cplx, edge, edge, -1);
+	irfft2d(spec, real, edge, edge, -1);
+        printf("%dx%d, %d passes, %d threads; max spectrum error %.3g (relative %.3g)\n",
+	   edge, edge, passes, fft_nthreads, emax, emax / scale);
+
+	t = now_sec();
+	for (p = 1; p < passes; p++) {
+	   fourn(ref, nn, 2, 1);
+	   fourn(ref, nn, 2, -1);
+	}
+	t = now_sec() - t;
+	errs = check_grid(ref + 1, 2, edge);
+	bad |= errs;
+        printf("fourn    %9.3f ms/pair  %6.1f MB  %d errors\n",
+	   1e3 * t / max(passes - 1, 1), 2.0 * n * sizeof(Float) / 1e6, errs);
+
+	t = now_sec();
+	for (p = 1; p < passes; p++) {
+	   fft2d(cplx, edge, edge, 1);
+	   fft2d(cplx, edge, edge, -1);
+	}
+	t = now_sec() - t;
+	errs = check_grid(cplx, 2, edge);
+	bad |= errs;
+        printf("fft2d    %9.3f ms/pair  %6.1f MB  %d errors\n",
+	   1e3 * t / max(passes - 1, 1), 2.0 * n * sizeof(Float) / 1e6, errs);
+
+	t = now_sec();
+	for (p = 1; p < passes; p++) {
+	   rfft2d(real, spec, edge, edge, 1);
+	   irfft2d(spec, real, edge, edge, -1);
+	}
+	t = now_sec() - t;
+	errs = check_grid(real, 1, edge);
+	bad |= errs;
+        printf("rfft2d   %9.3f ms/pair  %6.1f MB  %d errors\n",
+	   1e3 * t / max(passes - 1, 1), 2.0 * edge * w * sizeof(Float) / 1e6, errs);
+
+	free(ref);
+	free(cplx);
+	free(real);
+	free(spec);
+	return bad != 0;
+}
+
+int main(argc, argv)
+  int argc;
+  char *argv[];
 {
 	int i, j, k, l, m, npasses = Passes, faedge;
 	Float *fdata;
@@ -237,6 +724,10 @@ int main()
 	fasize = ((fanum + 1) * 2 * sizeof(Float)); /* FFT array size */
 	nsize[1] = nsize[2] = faedge;
 
+	if (argc > 1 && strcmp(argv[1], "-bench") == 0)
+	   return fft_bench(argc > 2 ? atoi(argv[2]) : Asize,
+	      argc > 3 ? atoi(argv[3]) : 20, argc > 4 ? atoi(argv[4]) : 1);
+
 	fdata = (Float *) malloc(fasize);
 	if (fdata == NULL) {
            fprintf(stderr, "Can't allocate data array.\n");
@@ -116,8 +116,18 @@
 /* #define POSIX1      */
 /***********************/
 
+#ifdef __linux__
+#define _GNU_SOURCE                /* pthread_setaffinity_np() */
+#endif
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
 			    /* 'Uncomment' the line below to run   */
 			    /* with 'register double' variables    */
 			    /* defined, or compile with the        */
@@ -172,7 +182,503 @@ double E3 = 0.411051E-6;
 
 int dtime();
 
-int main()
+/*****************************************************/
+/* Parameterized harness.                            */
+/*                                                   */
+/*   flops -json [-m 1,3,8] [-v scalar,avx2]         */
+/*               [-n loops] [-t threads]             */
+/*                                                   */
+/* runs the selected modules in each selected        */
+/* variant and writes one JSON document to stdout.   */
+/* Variants:                                         */
+/*   scalar  the loops exactly as in main()          */
+/*   sse2    2 lanes per vector (GCC vector types)   */
+/*   avx2    4 lanes, no fused multiply-add          */
+/*   fma     4 lanes, multiply-adds contracted       */
+/* Vector variants are compiled with per-function    */
+/* target attributes and chosen at run time by       */
+/* cpuid, so one binary runs on the whole fleet.     */
+/* With -t N, N copies of every kernel run at once,  */
+/* one per core, each pinned to its own CPU; the     */
+/* reported MFLOPS is the aggregate.                 */
+/*                                                   */
+/* Every module is reduced to a sum over i=1..m-1    */
+/* of f(i*x) (module 2: its series over i=1..m), so  */
+/* every variant computes the module's result and    */
+/* the error reported by main().  A vector result    */
+/* must agree with the scalar result to 1e-9 to be   */
+/* "ok".  As in main(), module 3 writes the sine     */
+/* polynomial as SIN3 with A3, A5 as declared, and   */
+/* modules 4 to 8 as SINP with A3, A5 negated.       */
+/*****************************************************/
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FLOPS_X86
+#endif
+
+#define FLOPS_MODULES   8
+#define FLOPS_VARIANTS  4
+#define FLOPS_THREADS   256
+
+#define SIN3(u,w) ((u)*((((((A6*(w)-A5)*(w)+A4)*(w)-A3)*(w)+A2)*(w)+A1)*(w)+one))
+#define SINP(u,w) ((u)*((((((A6*(w)+A5)*(w)+A4)*(w)+A3)*(w)+A2)*(w)+A1)*(w)+one))
+#define COSP(w)   ((w)*((w)*((w)*((w)*((w)*(B6*(w)+B5)+B4)+B3)+B2)+B1)+one)
+
+#define F1(u,w) ((D1+(u)*(D2+(u)*D3))/(one+(u)*(D1+(u)*(E2+(u)*E3))))
+#define F3(u,w) SIN3(u,w)
+#define F4(u,w) COSP(w)
+#define F5(u,w) (SINP(u,w)/COSP(w))
+#define F6(u,w) (SINP(u,w)*COSP(w))
+#define F7(u,w) (-one/((u)+one)-(u)/((w)+one)-(w)/((u)*(w)+one))
+#define F8(u,w) (COSP(w)*COSP(w)*SINP(u,w))
+
+typedef void (*flops_kernel)(long m, double x, double *out);
+
+/* Scalar kernels: the loops from main(). */
+
+#define SCALAR_SUM(NAME, F)                              \
+static void NAME(long m, double x, double *out)          \
+{                                                        \
+   double s = 0.0, u, w;                                 \
+   long i;                                               \
+                                                         \
+   for( i = 1 ; i <= m-1 ; i++ )                         \
+   {                                                     \
+   u = (double)i * x;                                    \
+   w = u * u;                                            \
+   s = s + F(u,w);                                       \
+   }                                                     \
+   (void)w;                                              \
+   out[0] = s;                                           \
+}
+
+/* Module 2 starts from the state left by Loop 2: m sign */
+/* flips of s = -5 and sa = -1 + the partial sums.  The  */
+/* harness always uses an even m, so sa = -1 and u runs  */
+/* over the odd numbers of the atan(1) series.           */
+static void m2_start(long m, double *s, double *sa)
+{
+   *s  = (m & 1) ? five : -five;
+   *sa = (m & 1) ? -one + five : -one;
+}
+
+static void m2_scalar(long m, double x, double *out)
+{
+   double s, sa, u, v = 0.0, w = 0.0;
+   long i;
+
+   m2_start(m, &s, &sa);
+   u = sa;
+   x = 0.0;
+   for ( i = 1 ; i <= m ; i++)
+   {
+   s  = -s;
+   sa = sa + s;
+   u  = u + two;
+   x  = x +(s - u);
+   v  = v - s * u;
+   w  = w + s / u;
+   }
+   out[0] = sa;  out[1] = x;  out[2] = v;  out[3] = w;
+}
+
+SCALAR_SUM(m1_scalar, F1)
+SCALAR_SUM(m3_scalar, F3)
+SCALAR_SUM(m4_scalar, F4)
+SCALAR_SUM(m5_scalar, F5)
+SCALAR_SUM(m6_scalar, F6)
+SCALAR_SUM(m7_scalar, F7)
+SCALAR_SUM(m8_scalar, F8)
+
+#ifdef FLOPS_X86
+
+/* Vector kernels: W lanes hold consecutive i, two    */
+/* accumulators per kernel, scalar loop for the tail. */
+
+typedef double v2df __attribute__((vector_size(16)));
+typedef double v4df __attribute__((vector_size(32)));
+
+#define VECTOR_SUM(NAME, ATTR, VT, W, F)                 \
+ATTR static void NAME(long m, double x, double *out)     \
+{                                                        \
+   VT lane, s0, s1, u, w;                                \
+   double s = 0.0, su, sw;                               \
+   long i;                                               \
+   int k;                                                \
+                                                         \
+   for (k = 0; k < W; k++) {                             \
+      lane[k] = k + 1; s0[k] = 0.0; s1[k] = 0.0;         \
+   }                                                     \
+   for (i = 1; i + 2*W <= m; i += 2*W) {                 \
+      u = (lane + (double)(i-1)) * x;                    \
+      w = u * u;                                         \
+      s0 = s0 + F(u,w);                                  \
+      u = (lane + (double)(i-1+W)) * x;                  \
+      w = u * u;                                         \
+      s1 = s1 + F(u,w);                                  \
+   }                                                     \
+   s0 = s0 + s1;                                         \
+   for (k = 0; k < W; k++) s += s0[k];                   \
+   for (; i <= m-1; i++) {                               \
+      su = (double)i * x;                                \
+      sw = su * su;                                      \
+      s = s + F(su,sw);                                  \
+   }                                                     \
+   (void)w; (void)sw;                                    \
+   out[0] = s;                                           \
+}
+
+/* Module 2 by lanes: with W even, lane k of every    */
+/* vector always has sign (-1)^(k+1) relative to s0.  */
+#define VECTOR_PI(NAME, ATTR, VT, W)                     \
+ATTR static void NAME(long m, double x, double *out)     \
+{                                                        \
+   VT sv, uv, xv, vv, wv, av;                            \
+   double s, sa, u0, t;                                  \
+   long i;                                               \
+   int k;                                                \
+                                                         \
+   (void)x;                                              \
+   m2_start(m, &s, &sa);                                 \
+   u0 = sa;                                              \
+   for (k = 0; k < W; k++) {                             \
+      sv[k] = (k & 1) ? s : -s;                          \
+      uv[k] = u0 + two * (k + 1);                        \
+      xv[k] = vv[k] = wv[k] = av[k] = 0.0;               \
+   }                                                     \
+   for (i = 1; i + W - 1 <= m; i += W) {                 \
+      av = av + sv;                                      \
+      xv = xv + (sv - uv);                               \
+      vv = vv - sv * uv;                                 \
+      wv = wv + sv / uv;                                 \
+      uv = uv + two * W;                                 \
+   }                                                     \
+   out[0] = sa;  out[1] = out[2] = out[3] = 0.0;         \
+   for (k = 0; k < W; k++) {                             \
+      out[0] += av[k]; out[1] += xv[k];                  \
+      out[2] += vv[k]; out[3] += wv[k];                  \
+   }                                                     \
+   if ((W & 1) == 0 && (i & 1) == 0) s = -s;             \
+   for (; i <= m; i++) {                                 \
+      t = ((i - 1) & 1) ? s : -s;                        \
+      u0 = sa + two * i;                                 \
+      out[0] += t; out[1] += t - u0;                     \
+      out[2] -= t * u0; out[3] += t / u0;                \
+   }                                                     \
+}
+
+#define FLOPS_VECTOR(SUF, ATTR, VT, W)                   \
+VECTOR_SUM(m1_##SUF, ATTR, VT, W, F1)                    \
+VECTOR_PI (m2_##SUF, ATTR, VT, W)                        \
+VECTOR_SUM(m3_##SUF, ATTR, VT, W, F3)                    \
+VECTOR_SUM(m4_##SUF, ATTR, VT, W, F4)                    \
+VECTOR_SUM(m5_##SUF, ATTR, VT, W, F5)                    \
+VECTOR_SUM(m6_##SUF, ATTR, VT, W, F6)                    \
+VECTOR_SUM(m7_##SUF, ATTR, VT, W, F7)                    \
+VECTOR_SUM(m8_##SUF, ATTR, VT, W, F8)
+
+FLOPS_VECTOR(sse2, __attribute__((target("sse2"), optimize("fp-contract=off"))), v2df, 2)
+FLOPS_VECTOR(avx2, __attribute__((target("avx2"), optimize("fp-contract=off"))), v4df, 4)
+FLOPS_VECTOR(fma,  __attribute__((target("avx2,fma"), optimize("fp-contract=fast"))), v4df, 4)
+
+#endif /* FLOPS_X86 */
+
+static const char *flops_vname[FLOPS_VARIANTS] = { "scalar", "sse2", "avx2", "fma" };
+
+/* Floating point operations per loop, from the table at the top. */
+static const double flops_per_loop[FLOPS_MODULES+1] =
+   { 0, 14, 7, 17, 15, 29, 29, 12, 30 };
+
+static flops_kernel flops_table[FLOPS_MODULES+1][FLOPS_VARIANTS] = {
+   { 0 },
+#ifdef FLOPS_X86
+   { m1_scalar, m1_sse2, m1_avx2, m1_fma },
+   { m2_scalar, m2_sse2, m2_avx2, m2_fma },
+   { m3_scalar, m3_sse2, m3_avx2, m3_fma },
+   { m4_scalar, m4_sse2, m4_avx2, m4_fma },
+   { m5_scalar, m5_sse2, m5_avx2, m5_fma },
+   { m6_scalar, m6_sse2, m6_avx2, m6_fma },
+   { m7_scalar, m7_sse2, m7_avx2, m7_fma },
+   { m8_scalar, m8_sse2, m8_avx2, m8_fma },
+#else
+   { m1_scalar }, { m2_scalar }, { m3_scalar }, { m4_scalar },
+   { m5_scalar }, { m6_scalar }, { m7_scalar }, { m8_scalar },
+#endif
+};
+
+static int flops_supported(int v)
+{
+#ifdef FLOPS_X86
+   __builtin_cpu_init();
+   switch (v) {
+   case 0: return 1;
+   case 1: return __builtin_cpu_supports("sse2");
+   case 2: return __builtin_cpu_supports("avx2");
+   case 3: return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+   }
+#endif
+   return v == 0;
+}
+
+/* Step size and result check for each module; the  */
+/* formulas are the ones main() applies after each  */
+/* timed loop.  Returns the value printed as Error. */
+static double flops_step(int mod, long m)
+{
+   switch (mod) {
+   case 1: return one / (double)m;
+   case 6: return piref / ( four * (double)m );
+   case 7: return 102.3321513995275 / (double)m;
+   }
+   return piref / ( three * (double)m );
+}
+
+static double flops_error(int mod, double x, const double *out)
+{
+   double s = out[0], sa, sb, u, w;
+
+   switch (mod) {
+   case 1:
+      sa = (D1+D2+D3)/(one+D1+E2+E3);
+      sa = x * ( sa + D1 + two * s ) / two;
+      return one / sa - 25.2;
+   case 2:
+      sa = four * out[3] / five;
+      sb = sa + five / out[2];
+      return sb - 31.25 / (out[2] * out[2] * out[2]) - piref;
+   case 3:
+      u = piref / three; w = u * u;
+      return x * ( SIN3(u,w) + two * s ) / two - 0.5;
+   case 4:
+      u = piref / three; w = u * u;
+      return x * ( COSP(w) + one + two * s ) / two - SINP(u,w);
+   case 5:
+      u = piref / three; w = u * u;
+      return x * ( SINP(u,w) / COSP(w) + two * s ) / two - 0.6931471805599453;
+   case 6:
+      u = piref / four; w = u * u;
+      return x * ( SINP(u,w) * COSP(w) + two * s ) / two - 0.25;
+   case 7:
+      u = 102.3321513995275; w = u * u;
+      return 18.0 * x * ( -one + F7(u,w) + two * s ) + 500.2;
+   case 8:
+      u = piref / three; w = u * u;
+      return x * ( SINP(u,w) * COSP(w) * COSP(w) + two * s ) / two
+             - 0.29166666666666667;
+   }
+   return 0.0;
+}
+
+static double flops_now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (double)ts.tv_sec + (double)ts.tv_nsec * 1.0e-9;
+}
+
+struct flops_job {
+   pthread_t tid;
+   pthread_barrier_t *start;
+   flops_kernel k;
+   int cpu;
+   long m;
+   double x, out[4], secs;
+};
+
+static void *flops_worker(void *arg)
+{
+   struct flops_job *j = (struct flops_job *)arg;
+   double t;
+
+#ifdef __linux__
+   cpu_set_t set;
+
+   if (j->cpu >= 0) {
+      CPU_ZERO(&set);
+      CPU_SET(j->cpu, &set);
+      pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+   }
+#endif
+   if (j->start) pthread_barrier_wait(j->start);
+   t = flops_now();
+   j->k(j->m, j->x, j->out);
+   j->secs = flops_now() - t;
+   return NULL;
+}
+
+/* Run one kernel on nthreads pinned threads; returns */
+/* the slowest thread's time, result of thread 0.     */
+static double flops_run(flops_kernel k, long m, double x, int nthreads,
+                        double *out)
+{
+   static struct flops_job job[FLOPS_THREADS];
+   pthread_barrier_t start;
+   double secs = 0.0;
+   int t, ncpu = 1;
+
+#ifdef __linux__
+   cpu_set_t set;
+
+   if (sched_getaffinity(0, sizeof set, &set) == 0)
+      ncpu = CPU_COUNT(&set);
+#endif
+   if (nthreads > 1)
+      pthread_barrier_init(&start, NULL, nthreads);
+   for (t = 0; t < nthreads; t++) {
+      job[t].start = nthreads > 1 ? &start : NULL;
+      job[t].k = k;
+      job[t].cpu = nthreads > 1 ? t % ncpu : -1;
+      job[t].m = m;
+      job[t].x = x;
+      if (t > 0)
+         pthread_create(&job[t].tid, NULL, flops_worker, &job[t]);
+   }
+   flops_worker(&job[0]);
+   for (t = 1; t < nthreads; t++)
+      pthread_join(job[t].tid, NULL);
+   if (nthreads > 1)
+      pthread_barrier_destroy(&start);
+   for (t = 0; t < nthreads; t++)
+      if (job[t].secs > secs) secs = job[t].secs;
+   memcpy(out, job[0].out, sizeof job[0].out);
+   return secs;
+}
+
+static int flops_parse_list(const char *arg, int *sel, int nsel,
+                            const char **names)
+{
+   char buf[128], *tok;
+   int i, k;
+
+   for (i = 0; i < nsel; i++) sel[i] = 0;
+   strncpy(buf, arg, sizeof buf - 1);
+   buf[sizeof buf - 1] = '\0';
+   for (tok = strtok(buf, ","); tok; tok = strtok(NULL, ",")) {
+      if (!names) {
+         k = atoi(tok);
+         if (k < 1 || k >= nsel) return -1;
+         sel[k] = 1;
+         continue;
+      }
+      for (k = 0; k < nsel; k++)
+         if (strcmp(tok, names[k]) == 0) break;
+      if (k == nsel) return -1;
+      sel[k] = 1;
+   }
+   return 0;
+}
+
+static int flops_harness(int argc, char *argv[])
+{
+   /* MFLOPS(1..4): weight of each module in the mix. */
+   static const double mix[5][FLOPS_MODULES+1] = {
+      { 0 },
+      { 0, 0, 5, 1, 0, 0, 0, 0, 0 },
+      { 0, 1, 0, 1, 1, 1, 1, 4, 0 },
+      { 0, 1, 0, 1, 1, 1, 1, 1, 1 },
+      { 0, 0, 0, 1, 1, 0, 1, 0, 1 },
+   };
+   int msel[FLOPS_MODULES+1], vsel[FLOPS_VARIANTS];
+   double tau[FLOPS_MODULES+1][FLOPS_VARIANTS];
+   double ref[4], out[4], x, secs, err, fl, tm, a3, a5;
+   long m = 20000000L;
+   int nthreads = 1, mod, v, c, i, k, nout, first = 1, ok, complete;
+
+   for (i = 1; i <= FLOPS_MODULES; i++) msel[i] = 1;
+   for (i = 0; i < FLOPS_VARIANTS; i++) vsel[i] = 1;
+   for (i = 2; i < argc; i++) {
+      if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+         if (flops_parse_list(argv[++i], msel, FLOPS_MODULES+1, NULL)) goto usage;
+      } else if (strcmp(argv[i], "-v") == 0 && i + 1 < argc) {
+         if (flops_parse_list(argv[++i], vsel, FLOPS_VARIANTS, flops_vname)) goto usage;
+      } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+         m = atol(argv[++i]);
+      } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+         nthreads = atoi(argv[++i]);
+      } else
+         goto usage;
+   }
+   if (m < 16 || nthreads < 1 || nthreads > FLOPS_THREADS) goto usage;
+   m += m & 1;                     /* module 2 only converges to pi */
+                                   /* when Loop 2 leaves sa = -1    */
+   vsel[0] = 1;                    /* scalar is the reference */
+
+   piref = 3.14159265358979324;
+   one   = 1.0;
+   two   = 2.0;
+   three = 3.0;
+   four  = 4.0;
+   five  = 5.0;
+   a3    = A3;
+   a5    = A5;
+
+   printf("{\n  \"benchmark\": \"flops\",\n  \"version\": \"2.0\",\n");
+   printf("  \"loops\": %ld,\n  \"threads\": %d,\n  \"isa\": {", m, nthreads);
+   for (v = 1; v < FLOPS_VARIANTS; v++)
+      printf("%s\"%s\": %s", v > 1 ? ", " : " ", flops_vname[v],
+             flops_supported(v) ? "true" : "false");
+   printf(" },\n  \"modules\": [");
+
+   for (mod = 1; mod <= FLOPS_MODULES; mod++) {
+      if (!msel[mod]) continue;
+      x = flops_step(mod, m);
+      A3 = mod >= 4 ? -a3 : a3;        /* main() negates them */
+      A5 = mod >= 4 ? -a5 : a5;        /* before module 4     */
+      nout = mod == 2 ? 4 : 1;
+      for (v = 0; v < FLOPS_VARIANTS; v++) {
+         tau[mod][v] = -1.0;
+         if (!vsel[v] || !flops_supported(v)) continue;
+         secs = flops_run(flops_table[mod][v], m, x, nthreads, out);
+         err = flops_error(mod, x, out);
+         if (v == 0) memcpy(ref, out, sizeof ref);
+         /* compare the sums with the scalar ones; the  */
+         /* errors are too small for a relative test    */
+         ok = 1;
+         for (k = 0; k < nout; k++)
+            if (fabs(out[k] - ref[k]) > 1e-9 * fmax(fabs(ref[k]), 1.0)) ok = 0;
+         tau[mod][v] = secs / (double)m;
+         printf("%s\n    { \"module\": %d, \"variant\": \"%s\", \"seconds\": %.6f, "
+                "\"mflops\": %.2f, \"error\": %.6e, \"ok\": %s }",
+                first ? "" : ",", mod, flops_vname[v], secs,
+                nthreads * flops_per_loop[mod] * (double)m / secs / 1.0e6,
+                err, ok ? "true" : "false");
+         first = 0;
+      }
+   }
+   printf("\n  ],\n  \"mflops\": {");
+   first = 1;
+   for (v = 0; v < FLOPS_VARIANTS; v++) {
+      if (!vsel[v] || !flops_supported(v)) continue;
+      printf("%s\n    \"%s\": {", first ? "" : ",", flops_vname[v]);
+      first = 0;
+      for (c = 1; c <= 4; c++) {
+         fl = tm = 0.0;
+         complete = 1;
+         for (mod = 1; mod <= FLOPS_MODULES; mod++)
+            if (mix[c][mod] != 0.0) {
+               if (!msel[mod] || tau[mod][v] < 0.0) complete = 0;
+               else {
+                  fl += mix[c][mod] * flops_per_loop[mod];
+                  tm += mix[c][mod] * tau[mod][v];
+               }
+            }
+         printf("%s\"MFLOPS(%d)\": ", c > 1 ? ", " : " ", c);
+         if (complete) printf("%.2f", nthreads * fl / tm / 1.0e6);
+         else printf("null");
+      }
+      printf(" }");
+   }
+   printf("\n  }\n}\n");
+   return 0;
+
+usage:
+   fprintf(stderr, "usage: %s -json [-m 1,2,..8] [-v scalar,sse2,avx2,fma]"
+                   " [-n loops] [-t threads]\n", argv[0]);
+   return 2;
+}
+
+int main(int argc, char *argv[])
 {
 
 #ifdef ROPT
@@ -184,6 +690,9 @@ int main()
    long loops, NLimit;
    register long i, m, n;
 
+   if (argc > 1 && strcmp(argv[1], "-json") == 0)
+      return flops_harness(argc, argv);
+
    printf("\n");
    printf("   FLOPS C Program (Double Precision), V2.0 18 Dec 1992\n\n");
 
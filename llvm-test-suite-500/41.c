@@ -1,5 +1,43 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+/*
+    Vector types and helpers for the -bench paths, over GCC vector
+    extensions.  loop() itself stays scalar; loop_vdW below sums W floats
+    at a time in vfW, widened to vdW doubles.  The helpers are macros so
+    they serve every width:
+
+        vec_lanes(v)            number of lanes of v
+        vec_load(T, p)          lanes from p, any alignment
+        vec_load_mask(T, p, n)  the first n lanes from p, zero above;
+                                reads nothing past p + n
+        vec_cvt(T, v)           lane-wise conversion, float to double
+        vec_fma(a, b, c)        a * b + c; GCC fuses it where the target
+                                has FMA
+        vec_sum(v)              sum of the lanes, halving pairwise
+*/
+typedef double vd2 __attribute__ ((vector_size (2 * sizeof(double))));
+typedef double vd4 __attribute__ ((vector_size (4 * sizeof(double))));
+typedef double vd8 __attribute__ ((vector_size (8 * sizeof(double))));
+typedef float  vf2 __attribute__ ((vector_size (2 * sizeof(float))));
+typedef float  vf4 __attribute__ ((vector_size (4 * sizeof(float))));
+typedef float  vf8 __attribute__ ((vector_size (8 * sizeof(float))));
+
+#define vec_lanes(v)    ((int)(sizeof(v) / sizeof((v)[0])))
+#define vec_load(T,p) \
+    ({ T v_; memcpy(&v_, (p), sizeof(v_)); v_; })
+#define vec_load_mask(T,p,n) \
+    ({ T v_ = {0}; memcpy(&v_, (p), (n) * sizeof(v_[0])); v_; })
+#define vec_cvt(T,v)    __builtin_convertvector((v), T)
+#define vec_fma(a,b,c)  ((a)*(b) + (c))
+#define vec_sum(v) \
+    ({ __typeof__(v) v_ = (v); int h_, i_; \
+       for (h_ = vec_lanes(v_)/2; h_ > 0; h_ /= 2) \
+           for (i_ = 0; i_ < h_; i_++) v_[i_] += v_[i_+h_]; \
+       v_[0]; })
 
 double loop(float *x, float *y, long length) {
   long i;
@@ -10,12 +48,376 @@ double loop(float *x, float *y, long length) {
   return accumulator;
 }
 
+/* The same sum with W lanes of floats widened to doubles; two
+   accumulators hide the add latency and the tail is a masked load. */
+#define LOOP_DEFINE(D, F)                                               \
+double loop_##D(float *x, float *y, long length) {                      \
+  D acc0 = {0}, acc1 = {0};                                             \
+  long i, n, w = vec_lanes(acc0);                                       \
+  for (i=0; i+2*w<=length; i+=2*w) {                                    \
+    acc0 = vec_fma(vec_cvt(D, vec_load(F, x+i)),                        \
+                   vec_cvt(D, vec_load(F, y+i)), acc0);                 \
+    acc1 = vec_fma(vec_cvt(D, vec_load(F, x+i+w)),                      \
+                   vec_cvt(D, vec_load(F, y+i+w)), acc1);               \
+  }                                                                     \
+  for (; i<length; i+=w) {                                              \
+    n = length-i < w ? length-i : w;                                    \
+    acc0 = vec_fma(vec_cvt(D, vec_load_mask(F, x+i, n)),                \
+                   vec_cvt(D, vec_load_mask(F, y+i, n)), acc0);         \
+  }                                                                     \
+  return vec_sum(acc0 + acc1);                                          \
+}
+
+LOOP_DEFINE(vd2, vf2)
+LOOP_DEFINE(vd4, vf4)
+LOOP_DEFINE(vd8, vf8)
+
+/* Dot-product engine.
+
+   dot_engine() runs the loop() sum with K = 1, 2, 4 or 8 independent
+   accumulators of four doubles, so K FMA chains are in flight rather
+   than one.  A product of two floats is exact in double, so the only
+   rounding is in the sum; in compensated mode every lane keeps a second
+   accumulator for the error of each addition (TwoSum), and the lanes are
+   folded the same way at the end.
+
+   dot_batch() dots one query against count rows, stride floats apart.
+   Four rows go together so each query load serves four of them, and
+   while a block of rows is summed the next block is prefetched.
+
+   Both are built twice, for AVX2/FMA and for the base target, and pick
+   one at run time. */
+
+#define DOT_ROWS 4              /* rows per batch block */
+
+static inline __attribute__((always_inline))
+void dot_two_sum(vd4 *s, vd4 *c, const vd4 *p) {
+  vd4 t = *s + *p, bp = t - *s;
+  *c += (*s - (t - bp)) + (*p - bp);
+  *s = t;
+}
+
+/* sum the lanes of s[0..k) and c[0..k), compensating when c is used */
+static inline __attribute__((always_inline))
+double dot_fold(const vd4 *s, const vd4 *c, int k, int comp) {
+  double sum = 0.0, err = 0.0, t;
+  int j, l;
+  if (!comp) {
+    vd4 v = s[0];
+    for (j=1; j<k; ++j) v += s[j];
+    return vec_sum(v);
+  }
+  for (j=0; j<k; ++j)
+    for (l=0; l<4; ++l) {
+      t = sum + s[j][l];
+      err += fabs(sum) >= fabs(s[j][l]) ? (sum - t) + s[j][l] : (s[j][l] - t) + sum;
+      sum = t;
+      err += c[j][l];
+    }
+  return sum + err;
+}
+
+static inline __attribute__((always_inline))
+double dot_body(const float *x, const float *y, long n, int k, int comp) {
+  vd4 s[8], c[8], p;
+  long i;
+  int j;
+#pragma GCC unroll 8
+  for (j=0; j<k; ++j)
+    s[j] = c[j] = (vd4){0};
+  for (i=0; i+4*k<=n; i+=4*k) {
+#pragma GCC unroll 8
+    for (j=0; j<k; ++j) {
+      vd4 xv = vec_cvt(vd4, vec_load(vf4, x+i+4*j));
+      vd4 yv = vec_cvt(vd4, vec_load(vf4, y+i+4*j));
+      if (comp)
+        { p = xv*yv; dot_two_sum(&s[j], &c[j], &p); }
+      else
+        s[j] = vec_fma(xv, yv, s[j]);
+    }
+  }
+  for (; i<n; i+=4) {
+    long m = n-i < 4 ? n-i : 4;
+    p = vec_cvt(vd4, vec_load_mask(vf4, x+i, m)) * vec_cvt(vd4, vec_load_mask(vf4, y+i, m));
+    if (comp)
+      dot_two_sum(&s[0], &c[0], &p);
+    else
+      s[0] += p;
+  }
+  return dot_fold(s, c, k, comp);
+}
+
+static inline __attribute__((always_inline))
+void dot_batch_body(const float *q, const float *rows, long n, long stride,
+                    long count, double *out, int comp) {
+  vd4 s[DOT_ROWS], c[DOT_ROWS], qv, p;
+  const float *row[DOT_ROWS];
+  long r, i, m;
+  int j;
+  for (r=0; r+DOT_ROWS<=count; r+=DOT_ROWS) {
+#pragma GCC unroll 4
+    for (j=0; j<DOT_ROWS; ++j) {
+      row[j] = rows + (r+j)*stride;
+      s[j] = c[j] = (vd4){0};
+    }
+    for (i=0; i+4<=n; i+=4) {
+      if (!(i & 15) && r+2*DOT_ROWS <= count)
+#pragma GCC unroll 4
+        for (j=0; j<DOT_ROWS; ++j)
+          __builtin_prefetch(row[j] + DOT_ROWS*stride + i);
+      qv = vec_cvt(vd4, vec_load(vf4, q+i));
+#pragma GCC unroll 4
+      for (j=0; j<DOT_ROWS; ++j) {
+        p = vec_cvt(vd4, vec_load(vf4, row[j]+i));
+        if (comp)
+          { p *= qv; dot_two_sum(&s[j], &c[j], &p); }
+        else
+          s[j] = vec_fma(qv, p, s[j]);
+      }
+    }
+    if (i < n) {
+      m = n-i;
+      qv = vec_cvt(vd4, vec_load_mask(vf4, q+i, m));
+      for (j=0; j<DOT_ROWS; ++j) {
+        p = qv * vec_cvt(vd4, vec_load_mask(vf4, row[j]+i, m));
+        if (comp)
+          dot_two_sum(&s[j], &c[j], &p);
+        else
+          s[j] += p;
+      }
+    }
+    for (j=0; j<DOT_ROWS; ++j)
+      out[r+j] = dot_fold(&s[j], &c[j], 1, comp);
+  }
+  for (; r<count; ++r)
+    out[r] = dot_body(q, rows + r*stride, n, 2, comp);
+}
+
+typedef double dot_fn(const float *, const float *, long);
+typedef void dot_batch_fn(const float *, const float *, long, long, long, double *);
+
+#define DOT_DEFINE(suffix, attr)                                        \
+attr static double dot_k1_##suffix(const float *x, const float *y, long n) \
+{ return dot_body(x, y, n, 1, 0); }                                     \
+attr static double dot_k2_##suffix(const float *x, const float *y, long n) \
+{ return dot_body(x, y, n, 2, 0); }                                     \
+attr static double dot_k4_##suffix(const float *x, const float *y, long n) \
+{ return dot_body(x, y, n, 4, 0); }                                     \
+attr static double dot_k8_##suffix(const float *x, const float *y, long n) \
+{ return dot_body(x, y, n, 8, 0); }                                     \
+attr static double dot_k1c_##suffix(const float *x, const float *y, long n) \
+{ return dot_body(x, y, n, 1, 1); }                                     \
+attr static double dot_k2c_##suffix(const float *x, const float *y, long n) \
+{ return dot_body(x, y, n, 2, 1); }                                     \
+attr static double dot_k4c_##suffix(const float *x, const float *y, long n) \
+{ return dot_body(x, y, n, 4, 1); }                                     \
+attr static double dot_k8c_##suffix(const float *x, const float *y, long n) \
+{ return dot_body(x, y, n, 8, 1); }                                     \
+attr static void dot_batch_##suffix(const float *q, const float *rows,  \
+    long n, long stride, long count, double *out)                       \
+{ dot_batch_body(q, rows, n, stride, count, out, 0); }                  \
+attr static void dot_batchc_##suffix(const float *q, const float *rows, \
+    long n, long stride, long count, double *out)                       \
+{ dot_batch_body(q, rows, n, stride, count, out, 1); }                  \
+static dot_fn *const dot_table_##suffix[2][4] = {                       \
+  { dot_k1_##suffix, dot_k2_##suffix, dot_k4_##suffix, dot_k8_##suffix },     \
+  { dot_k1c_##suffix, dot_k2c_##suffix, dot_k4c_##suffix, dot_k8c_##suffix } }; \
+static dot_batch_fn *const dot_batch_table_##suffix[2] =                \
+  { dot_batch_##suffix, dot_batchc_##suffix };
+
+DOT_DEFINE(gen, )
+#if defined(__GNUC__) && defined(__x86_64__)
+#define DOT_AVX2 1
+DOT_DEFINE(avx2, __attribute__((target("avx2,fma"))))
+#endif
+
+static int dot_have_avx2(void) {
+#ifdef DOT_AVX2
+  return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#else
+  return 0;
+#endif
+}
+
+/* The loop() sum of x and y over n floats with k accumulators, rounded
+   up to 1, 2, 4 or 8, compensated if comp is set. */
+double dot_engine(const float *x, const float *y, long n, int k, int comp) {
+  int j = k <= 1 ? 0 : k <= 2 ? 1 : k <= 4 ? 2 : 3;
+  comp = comp != 0;
+#ifdef DOT_AVX2
+  if (dot_have_avx2())
+    return dot_table_avx2[comp][j](x, y, n);
+#endif
+  return dot_table_gen[comp][j](x, y, n);
+}
+
+/* out[r] = the dot of q with rows + r*stride over n floats, r < count */
+void dot_batch(const float *q, const float *rows, long n, long stride,
+               long count, double *out, int comp) {
+  comp = comp != 0;
+#ifdef DOT_AVX2
+  if (dot_have_avx2()) {
+    dot_batch_table_avx2[comp](q, rows, n, stride, count, out);
+    return;
+  }
+#endif
+  dot_batch_table_gen[comp](q, rows, n, stride, count, out);
+}
+
 #ifdef SMALL_PROBLEM_SIZE
 #define COUNT 100000
 #else
 #define COUNT 500000
 #endif
 
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+#define ENGINE_PASSES 100
+
+static unsigned engine_seed = 12345;
+
+/* uniform on [-1, 1) scaled by 2^-12 .. 2^12, so the sums cancel and
+   lose bits to rounding */
+static float engine_random(void) {
+  float v;
+  engine_seed = engine_seed*1103515245u + 12345u;
+  v = (float)(engine_seed >> 8) * (2.0f/16777216.0f) - 1.0f;
+  engine_seed = engine_seed*1103515245u + 12345u;
+  return ldexpf(v, (int)(engine_seed >> 27) - 12);
+}
+
+/* ENGINE_PASSES passes of a query against rows random rows of length
+   floats through each engine, best of reps, with the largest error of
+   any row relative to a long double sum. */
+static void engine_bench(long length, int reps, long rows) {
+  enum { SCALAR, ENGINE, BATCH };
+  static const struct { const char *name; int kind, k, comp; } path[] = {
+    { "scalar", SCALAR, 1, 0 },
+    { "k1", ENGINE, 1, 0 },     { "k2", ENGINE, 2, 0 },
+    { "k4", ENGINE, 4, 0 },     { "k8", ENGINE, 8, 0 },
+    { "k4 comp", ENGINE, 4, 1 }, { "k8 comp", ENGINE, 8, 1 },
+    { "batch", BATCH, 0, 0 },   { "batch comp", BATCH, 0, 1 } };
+  long stride = (length + 15) & ~15L, j, r;
+  float *q, *m;
+  double *out, t, best, err, e;
+  long double *ref, sum;
+  int p, i, rep;
+
+  q = malloc(stride * sizeof(float));
+  m = malloc(rows * stride * sizeof(float));
+  out = malloc(rows * sizeof(double));
+  ref = malloc(rows * sizeof(long double));
+  if (!q || !m || !out || !ref) {
+    fprintf(stderr, "out of memory\n");
+    exit(2);
+  }
+  for (j=0; j<length; ++j)
+    q[j] = engine_random();
+  for (r=0; r<rows; ++r) {
+    sum = 0.0L;
+    for (j=0; j<length; ++j) {
+      m[r*stride+j] = engine_random();
+      sum += (long double)q[j] * m[r*stride+j];
+    }
+    ref[r] = sum;
+  }
+
+  printf("\n%d passes over %ld random rows of %ld floats, best of %d\n\n",
+         ENGINE_PASSES, rows, length, reps);
+  printf("engine        seconds  GFLOP/s   max rel err\n");
+  for (p=0; p<(int)(sizeof(path)/sizeof(path[0])); ++p) {
+    best = 1e30;
+    for (rep=0; rep<reps; ++rep) {
+      t = now();
+      for (i=0; i<ENGINE_PASSES; ++i)
+        switch (path[p].kind) {
+        case SCALAR:
+          for (r=0; r<rows; ++r) out[r] = loop(q, m + r*stride, length);
+          break;
+        case ENGINE:
+          for (r=0; r<rows; ++r)
+            out[r] = dot_engine(q, m + r*stride, length, path[p].k, path[p].comp);
+          break;
+        default:
+          dot_batch(q, m, length, stride, rows, out, path[p].comp);
+        }
+      t = now() - t;
+      if (t < best) best = t;
+    }
+    err = 0.0;
+    for (r=0; r<rows; ++r) {
+      e = (double)fabsl((out[r] - ref[r]) / ref[r]);
+      if (e > err) err = e;
+    }
+    printf("%-10s %10.6f %8.2f %13.3e\n", path[p].name, best,
+           2.0*ENGINE_PASSES*rows*length/best/1e9, err);
+  }
+  free(q);
+  free(m);
+  free(out);
+  free(ref);
+}
+
+/* -bench [length [reps [rows]]]: best of reps runs of COUNT dot products
+   of length (default 2048) floats through each width and the scalar loop,
+   with the relative difference of the totals, then the engine table over
+   rows (default 256) random rows. */
+static int bench(int argc, char *argv[]) {
+  static const struct { const char *name; int lanes; double (*fn)(float *, float *, long); }
+    path[] = { { "scalar", 1, loop }, { "vd2", 2, loop_vd2 },
+               { "vd4", 4, loop_vd4 },       { "vd8", 8, loop_vd8 } };
+  long length = argc > 0 ? atol(argv[0]) : 2048;
+  int reps = argc > 1 ? atoi(argv[1]) : 3;
+  long rows = argc > 2 ? atol(argv[2]) : 256;
+  double total, ref = 0.0, t, best, base = 0.0;
+  float *x, *y;
+  int i, p, r;
+  long j;
+
+  if (length < 1) length = 1;
+  if (reps < 1) reps = 1;
+  if (rows < 1) rows = 1;
+  x = malloc(length * sizeof(float));
+  y = malloc(length * sizeof(float));
+  if (!x || !y) {
+    fprintf(stderr, "out of memory\n");
+    return 2;
+  }
+  for (j=0; j<length; ++j) {
+    x[j] = 0.1f + (float)j;
+    y[j] = 1.2f + (float)j;
+  }
+
+  printf("%d dot products of %ld floats, best of %d\n\n", COUNT, length, reps);
+  printf("path    lanes     seconds  GFLOP/s  speedup  rel diff\n");
+  for (p=0; p<4; ++p) {
+    best = 1e30;
+    total = 0.0;
+    for (r=0; r<reps; ++r) {
+      total = 0.0;
+      t = now();
+      for (i=0; i<COUNT; ++i)
+        total += path[p].fn(x, y, length - (i & 1));
+      t = now() - t;
+      if (t < best) best = t;
+    }
+    if (p == 0) {
+      base = best;
+      ref = total;
+    }
+    printf("%-6s %6d %11.6f %8.2f %8.2f %9.2e\n", path[p].name, path[p].lanes,
+           best, 2.0*COUNT*length/best/1e9, base/best, (total - ref)/ref);
+  }
+  free(x);
+  free(y);
+  engine_bench(length, reps, rows);
+  return 0;
+}
+
 int main(int argc, char *argv[]) {
   int i, j;
   float x[2048];
@@ -24,6 +426,9 @@ int main(int argc, char *argv[]) {
   float a = 0.0f;
   float b = 1.0f;
     
+  if (argc > 1 && !strcmp(argv[1], "-bench"))
+    return bench(argc-2, argv+2);
+
   for (i=0; i<COUNT; ++i) {
     if (i % 10) {
       a = 0.0f;
@@ -48,9 +48,361 @@ static void doTest(size_t numberOfIterations)
     lower_StringImpl(testData, numberOfCharacters, result);
 }
 
+/*
+ * UTF-16 case mapping: lower, upper and simple case folding.
+ *
+ * Each mapping is a two-stage table over the BMP: the high byte of a
+ * code unit picks a 256-entry block of deltas, and every page without
+ * cased characters shares block 0 (all zero), so the tables stay a few
+ * kilobytes.  They are built once from caseRanges (runs of upper/lower
+ * pairs) and caseSpecials (the one-way mappings such as U+0130 or the
+ * final sigma).  The data covers the simple mappings of Latin-1, Latin
+ * Extended-A, Greek, Cyrillic, Armenian, Latin Extended Additional,
+ * Roman numerals, circled and fullwidth letters; other code units,
+ * including surrogates, map to themselves.
+ *
+ * The bulk kernel works on 16 code units at a time (two SSE2 registers)
+ * or 32 with AVX2, using GCC vector extensions; without SSE2 only the
+ * table loop is built.  Blocks made only of ASCII, Latin-1 and caseless
+ * CJK/kana/Hangul are converted in registers; a block with anything
+ * else takes the table, and the kernel returns to the vector loop at
+ * the next block.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#define CASE_BLOCKS 24
+
+struct CaseMap {
+  unsigned char page[256];
+  short delta[CASE_BLOCKS][256];
+  int blocks;
+};
+
+enum { CASE_LOWER, CASE_UPPER, CASE_FOLD };
+
+static struct CaseMap caseMaps[3];
+
+/* Every step-th code unit in first..last is upper case and its lower
+   case is delta away; step 2 describes alternating upper/lower pairs. */
+static const struct { UChar first, last; short delta; unsigned char step; } caseRanges[] = {
+  { 0x0041, 0x005A, 32, 1 }, { 0x00C0, 0x00D6, 32, 1 }, { 0x00D8, 0x00DE, 32, 1 },
+  { 0x0100, 0x012F, 1, 2 }, { 0x0132, 0x0137, 1, 2 }, { 0x0139, 0x0148, 1, 2 },
+  { 0x014A, 0x0177, 1, 2 }, { 0x0178, 0x0178, -121, 1 }, { 0x0179, 0x017E, 1, 2 },
+  { 0x0386, 0x0386, 38, 1 }, { 0x0388, 0x038A, 37, 1 }, { 0x038C, 0x038C, 64, 1 },
+  { 0x038E, 0x038F, 63, 1 }, { 0x0391, 0x03A1, 32, 1 }, { 0x03A3, 0x03AB, 32, 1 },
+  { 0x0400, 0x040F, 80, 1 }, { 0x0410, 0x042F, 32, 1 }, { 0x0460, 0x0481, 1, 2 },
+  { 0x048A, 0x04BF, 1, 2 }, { 0x04D0, 0x04FF, 1, 2 }, { 0x0531, 0x0556, 48, 1 },
+  { 0x1E00, 0x1E95, 1, 2 }, { 0x1EA0, 0x1EFF, 1, 2 }, { 0x2160, 0x216F, 16, 1 },
+  { 0x24B6, 0x24CF, 26, 1 }, { 0xFF21, 0xFF3A, 32, 1 },
+};
+
+static const struct { UChar from, to; unsigned char map; } caseSpecials[] = {
+  { 0x00B5, 0x039C, CASE_UPPER }, { 0x00B5, 0x03BC, CASE_FOLD },
+  { 0x0130, 0x0069, CASE_LOWER }, { 0x0131, 0x0049, CASE_UPPER },
+  { 0x017F, 0x0053, CASE_UPPER }, { 0x017F, 0x0073, CASE_FOLD },
+  { 0x03C2, 0x03A3, CASE_UPPER }, { 0x03C2, 0x03C3, CASE_FOLD },
+};
+
+static void setCase(struct CaseMap* map, UChar from, UChar to)
+{
+  unsigned hi = from >> 8;
+  if (!map->page[hi]) {
+    if (map->blocks == CASE_BLOCKS)
+      abort();
+    map->page[hi] = map->blocks++;
+  }
+  map->delta[map->page[hi]][from & 0xFF] = (short)(to - from);
+}
+
+static void initCaseMaps(void)
+{
+  size_t r, m;
+  unsigned c;
+  if (caseMaps[CASE_LOWER].blocks)
+    return;
+  for (m = 0; m < 3; m++)
+    caseMaps[m].blocks = 1;
+  for (r = 0; r < sizeof(caseRanges) / sizeof(caseRanges[0]); r++) {
+    unsigned step = caseRanges[r].step;
+    for (c = caseRanges[r].first; c <= caseRanges[r].last; c += step) {
+      UChar lower = c + caseRanges[r].delta;
+      setCase(&caseMaps[CASE_LOWER], c, lower);
+      setCase(&caseMaps[CASE_FOLD], c, lower);
+      setCase(&caseMaps[CASE_UPPER], lower, c);
+    }
+  }
+  for (r = 0; r < sizeof(caseSpecials) / sizeof(caseSpecials[0]); r++)
+    setCase(&caseMaps[caseSpecials[r].map], caseSpecials[r].from, caseSpecials[r].to);
+}
+
+static inline UChar mapCase(const struct CaseMap* map, UChar c)
+{
+  return c + map->delta[map->page[c >> 8]][c & 0xFF];
+}
+
+/* Reference: the table alone, one code unit at a time. */
+static size_t convertCaseScalar(int kind, const UChar* data, size_t length, UChar* output)
+{
+  const struct CaseMap* map = &caseMaps[kind];
+  UChar ored = 0;
+  size_t i;
+  for (i = 0; i < length; i++) {
+    ored |= data[i];
+    output[i] = mapCase(map, data[i]);
+  }
+  return !(ored & ~0x7F);
+}
+
+#if defined(__SSE2__)
+#if defined(__AVX2__)
+#define CASE_STEP 32
+#else
+#define CASE_STEP 16
+#endif
+
+/* one hardware register of code units; a block is two of them */
+typedef UChar CaseVector __attribute__((vector_size(CASE_STEP)));
+typedef short CaseMask __attribute__((vector_size(CASE_STEP)));
+
+/* unsigned x < k lane by lane; SSE2 and AVX2 only compare signed words.
+   anyLane() takes comparison results (all-ones or zero lanes) */
+#define BELOW(x, k) ((CaseMask)((x) ^ 0x8000) < (short)((k) ^ 0x8000))
+
+static inline __attribute__((always_inline)) int anyLane(CaseMask m0, CaseMask m1)
+{
+#if defined(__AVX2__)
+  return _mm256_movemask_epi8((__m256i)(m0 | m1)) != 0;
+#else
+  return _mm_movemask_epi8((__m128i)(m0 | m1)) != 0;
+#endif
+}
+
+/*
+ * One block of CASE_STEP code units; returns nonzero if it was all ASCII.
+ * ASCII blocks are tested for first.  Otherwise ASCII and Latin-1
+ * letters, which differ from their partner only in bit 5, are flipped in
+ * the vector and code units with no case mapping are kept.  A block
+ * holding anything else (Greek, Cyrillic, ..., or the Latin-1 oddities
+ * U+00B5 and U+00FF) goes through the table.
+ */
+static inline __attribute__((always_inline)) int convertCaseBlock(int kind, const UChar* data, UChar* output)
+{
+  const UChar letter = kind == CASE_UPPER ? 'a' : 'A';
+  const UChar latin1 = kind == CASE_UPPER ? 0xE0 : 0xC0;
+  const UChar odd = kind == CASE_UPPER ? 0xFF : 0xB5;
+  CaseVector c0, c1;
+  CaseMask flip0, flip1, table0, table1;
+
+  memcpy(&c0, data, sizeof(c0));
+  memcpy(&c1, data + CASE_STEP / 2, sizeof(c1));
+  flip0 = (CaseMask)((c0 | c1) & (UChar)~0x7F);
+  if (!anyLane(flip0 != 0, flip0 != 0)) {
+    c0 ^= (CaseVector)(BELOW(c0 - letter, 26) & 0x20);
+    c1 ^= (CaseVector)(BELOW(c1 - letter, 26) & 0x20);
+    memcpy(output, &c0, sizeof(c0));
+    memcpy(output + CASE_STEP / 2, &c1, sizeof(c1));
+    return 1;
+  }
+  flip0 = BELOW(c0 - letter, 26) | (BELOW(c0 - latin1, 31) & (CaseMask)(c0 != (UChar)(latin1 + 0x17)));
+  flip1 = BELOW(c1 - letter, 26) | (BELOW(c1 - latin1, 31) & (CaseMask)(c1 != (UChar)(latin1 + 0x17)));
+  table0 = (~BELOW(c0, 0x100) & ~BELOW(c0 - 0x2E80, 0xA640 - 0x2E80) & ~BELOW(c0 - 0xAC00, 0xD7A4 - 0xAC00))
+         | (CaseMask)(c0 == 0xB5) | (CaseMask)(c0 == odd);
+  table1 = (~BELOW(c1, 0x100) & ~BELOW(c1 - 0x2E80, 0xA640 - 0x2E80) & ~BELOW(c1 - 0xAC00, 0xD7A4 - 0xAC00))
+         | (CaseMask)(c1 == 0xB5) | (CaseMask)(c1 == odd);
+  if (anyLane(table0, table1)) {
+    convertCaseScalar(kind, data, CASE_STEP, output);
+    return 0;
+  }
+  c0 ^= (CaseVector)(flip0 & 0x20);
+  c1 ^= (CaseVector)(flip1 & 0x20);
+  memcpy(output, &c0, sizeof(c0));
+  memcpy(output + CASE_STEP / 2, &c1, sizeof(c1));
+  return 0;
+}
+
+#endif /* __SSE2__ */
+
+static inline __attribute__((always_inline))
+size_t convertCaseRun(int kind, const UChar* __restrict data, size_t length, UChar* __restrict output)
+{
+  size_t i;
+  int ascii = 1;
+#if defined(__SSE2__)
+  for (i = 0; i + CASE_STEP <= length; i += CASE_STEP)
+    ascii &= convertCaseBlock(kind, data + i, output + i);
+#else
+  i = 0;
+#endif
+  return convertCaseScalar(kind, data + i, length - i, output + i) & ascii;
+}
+
+/* kind is a literal in each call so the block constants fold */
+static size_t convertCase(int kind, const UChar* data, size_t length, UChar* output)
+{
+  switch (kind) {
+  case CASE_LOWER:
+    return convertCaseRun(CASE_LOWER, data, length, output);
+  case CASE_UPPER:
+    return convertCaseRun(CASE_UPPER, data, length, output);
+  default:
+    return convertCaseRun(CASE_FOLD, data, length, output);
+  }
+}
+
+/* Each returns nonzero if the input was all ASCII, like lower_StringImpl. */
+size_t lowerUTF16(const UChar* data, size_t length, UChar* output)
+{
+  initCaseMaps();
+  return convertCase(CASE_LOWER, data, length, output);
+}
+
+size_t upperUTF16(const UChar* data, size_t length, UChar* output)
+{
+  initCaseMaps();
+  return convertCase(CASE_UPPER, data, length, output);
+}
+
+size_t foldCaseUTF16(const UChar* data, size_t length, UChar* output)
+{
+  initCaseMaps();
+  return convertCase(CASE_FOLD, data, length, output);
+}
+
+static double nowSeconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static const UChar asciiText[] = {
+  'T', 'h', 'e', ' ', 'Q', 'u', 'i', 'c', 'k', ' ', 'B', 'r', 'o', 'w', 'n', ' ',
+  'F', 'o', 'x', ' ', 'J', 'u', 'm', 'p', 's', ' ', 'O', 'v', 'e', 'r', ' ', 'T',
+  'h', 'e', ' ', 'L', 'a', 'z', 'y', ' ', 'D', 'O', 'G', '.', ' '
+};
+
+/* "Ça Straße ΑΘΗΝΑ Москва École naïve Œuvre " */
+static const UChar mixedText[] = {
+  0x00C7, 'a', ' ', 'S', 't', 'r', 'a', 0x00DF, 'e', ' ', 'i', 's', ' ', 'i', 'n', ' ',
+  0x0391, 0x0398, 0x0397, 0x039D, 0x0391, ',', ' ', 'n', 'o', 't', ' ', 'M', 'o', 's', 'c', 'o',
+  'w', ' ', '(', 0x041C, 0x043E, 0x0441, 0x043A, 0x0432, 0x0430, ')', ';', ' ', 0x00C9, 'c', 'o', 'l',
+  'e', ' ', 'N', 'a', 0x00EF, 'v', 'e', ' ', 'a', 'n', 'd', ' ', 0x0152, 'u', 'v', 'r', 'e', ' ',
+  'T', 'h', 'e', ' ', 'R', 'e', 's', 't', ' ', 'I', 's', ' ', 'P', 'l', 'a', 'i', 'n', ' ',
+  'E', 'n', 'g', 'l', 'i', 's', 'h', ' ', 'T', 'e', 'x', 't', '.', ' '
+};
+
+/* kanji, kana and Hangul with an occasional fullwidth or ASCII word */
+static const UChar cjkText[] = {
+  0x6771, 0x4EAC, 0x90FD, 0x306E, 0x5929, 0x6C17, 0x306F, 0x6674, 0x308C, 0x3067, 0x3059, 0x3002,
+  0x4ECA, 0x65E5, 0x306F, 0xFF21, 0xFF22, 0xFF23, 0x306E, 0x65E5, 0x3067, 0x3059, 0x3002, 0x30AB,
+  0x30BF, 0x30AB, 0x30CA, 0x3068, 0x6F22, 0x5B57, 0x3092, 0x4F7F, 0x3044, 0x307E, 0x3059, 0x3002,
+  0xD55C, 0xAD6D, 0xC5B4, 0x20, 'U', 'T', 'F', '-', '1', '6', 0x20, 0xD14D, 0xC2A4, 0xD2B8, 0x3002,
+  0x4E2D, 0x6587, 0x6587, 0x672C, 0x548C, 0x65E5, 0x672C, 0x8A9E, 0x306E, 0x6587, 0x7AE0, 0x3002
+};
+
+static void fillText(UChar* text, size_t length, const UChar* phrase, size_t phraseLength)
+{
+  size_t i;
+  for (i = 0; i < length; i++)
+    text[i] = phrase[i % phraseLength];
+}
+
+static int checkCaseMaps(void)
+{
+  static const struct { UChar c, lower, upper, fold; } cases[] = {
+    { 'A', 'a', 'A', 'a' }, { 'z', 'z', 'Z', 'z' }, { 0x00C9, 0x00E9, 0x00C9, 0x00E9 },
+    { 0x00DF, 0x00DF, 0x00DF, 0x00DF }, { 0x00FF, 0x00FF, 0x0178, 0x00FF },
+    { 0x00B5, 0x00B5, 0x039C, 0x03BC }, { 0x0130, 0x0069, 0x0130, 0x0130 },
+    { 0x0131, 0x0131, 0x0049, 0x0131 }, { 0x0152, 0x0153, 0x0152, 0x0153 },
+    { 0x017F, 0x017F, 0x0053, 0x0073 }, { 0x0391, 0x03B1, 0x0391, 0x03B1 },
+    { 0x03C2, 0x03C2, 0x03A3, 0x03C3 }, { 0x0401, 0x0451, 0x0401, 0x0451 },
+    { 0x0433, 0x0433, 0x0413, 0x0433 }, { 0x0561, 0x0561, 0x0531, 0x0561 },
+    { 0x1E9B, 0x1E9B, 0x1E9B, 0x1E9B }, { 0xFF41, 0xFF41, 0xFF21, 0xFF41 },
+    { 0x6771, 0x6771, 0x6771, 0x6771 }, { 0xD800, 0xD800, 0xD800, 0xD800 },
+  };
+  size_t i;
+  int bad = 0;
+  for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    if (mapCase(&caseMaps[CASE_LOWER], cases[i].c) != cases[i].lower
+        || mapCase(&caseMaps[CASE_UPPER], cases[i].c) != cases[i].upper
+        || mapCase(&caseMaps[CASE_FOLD], cases[i].c) != cases[i].fold) {
+      printf("case table wrong for U+%04X\n", cases[i].c);
+      bad = 1;
+    }
+  }
+  return bad;
+}
+
+/*
+ * 43 -bench [units [reps]]: GB/s (input bytes) of lower_StringImpl, the
+ * per-unit table loop and the bulk kernels on ASCII-only, mixed Latin/
+ * Greek/Cyrillic and CJK-heavy text; the kernels are checked against
+ * the table loop.
+ */
+static int caseBench(size_t length, int reps)
+{
+  static const struct { const char* name; const UChar* phrase; size_t length; } inputs[] = {
+    { "ascii", asciiText, sizeof(asciiText) / sizeof(UChar) },
+    { "mixed", mixedText, sizeof(mixedText) / sizeof(UChar) },
+    { "cjk", cjkText, sizeof(cjkText) / sizeof(UChar) },
+  };
+  static const char* kindNames[] = { "lower", "upper", "fold" };
+  UChar* text = malloc(sizeof(UChar) * length);
+  UChar* expect = malloc(sizeof(UChar) * length);
+  UChar* result = malloc(sizeof(UChar) * length);
+  size_t in;
+  int kind, r, bad = checkCaseMaps();
+  double t0, bytes = (double)length * sizeof(UChar) * reps;
+
+#if defined(__SSE2__)
+  printf("%lu code units x %d, %d units per block\n", (unsigned long)length, reps, CASE_STEP);
+#else
+  printf("%lu code units x %d, no vector kernel\n", (unsigned long)length, reps);
+#endif
+  printf("input  lower_StringImpl  kind   table GB/s  bulk GB/s\n");
+  for (in = 0; in < sizeof(inputs) / sizeof(inputs[0]); in++) {
+    double base;
+    fillText(text, length, inputs[in].phrase, inputs[in].length);
+    t0 = nowSeconds();
+    for (r = 0; r < reps; r++)
+      lower_StringImpl(text, length, result);
+    base = bytes / (nowSeconds() - t0) * 1e-9;
+    for (kind = CASE_LOWER; kind <= CASE_FOLD; kind++) {
+      double table, bulk;
+      t0 = nowSeconds();
+      for (r = 0; r < reps; r++)
+        convertCaseScalar(kind, text, length, expect);
+      table = bytes / (nowSeconds() - t0) * 1e-9;
+      t0 = nowSeconds();
+      for (r = 0; r < reps; r++)
+        convertCase(kind, text, length, result);
+      bulk = bytes / (nowSeconds() - t0) * 1e-9;
+      printf("%-6s %16.2f  %-5s %11.2f %10.2f\n", kind == CASE_LOWER ? inputs[in].name : "",
+             base, kindNames[kind], table, bulk);
+      if (memcmp(expect, result, sizeof(UChar) * length)) {
+        printf("%s %s: bulk kernel disagrees with the table\n", inputs[in].name, kindNames[kind]);
+        bad = 1;
+      }
+    }
+  }
+  free(text);
+  free(expect);
+  free(result);
+  return bad;
+}
+
 int main(int argc, char **argv)
 {
   size_t i;
+  if (argc > 1 && !strcmp(argv[1], "-bench")) {
+    initCaseMaps();
+    return caseBench(argc > 2 ? (size_t)atol(argv[2]) : 1 << 20, argc > 3 ? atoi(argv[3]) : 200);
+  }
   for (i = 0; i < 32; i++)
     doTest(i);
 
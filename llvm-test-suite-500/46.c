@@ -38,7 +38,288 @@ void wrap_mul4(double *Out, const double A[4][4], const double B[4][4])
   mul4(Out, A, B);
 }
 
-int main() {
+/* Batched small-matrix products.
+ *
+ * mul_batch_NxN(Out, A, B, count) computes Out[m] = A[m] * B[m] for
+ * count N x N matrices, N = 2..8, stored in packs of BATCH_LANES
+ * matrices: within a pack, element (i,j) of all its matrices is one
+ * contiguous run of BATCH_LANES doubles, so element e of matrix m is at
+ * [(m / BATCH_LANES) * N*N*BATCH_LANES + e*BATCH_LANES + m % BATCH_LANES].
+ * Each vector lane then works on a different matrix and the kernel is
+ * N^3 lane-wide multiply-adds with no shuffles, while a pack still
+ * streams from one place in memory.  Buffers are sized for
+ * mul_batch_padded(count) matrices; soa_pack() zeroes the padding
+ * lanes.  As in mul4, each product is formed in a temporary before it
+ * is stored, so Out may be A or B.
+ *
+ * The kernels are generated per N by MUL_BATCH_DEFINE, each built twice:
+ * for AVX2 + FMA (four matrices per register), used when the CPU has
+ * them, and for the baseline ISA (two SSE2 registers per vector).  With
+ * FMA the sums are contracted, so results may differ from mul4 in the
+ * last bit.  Batches of at least mul_batch_min_split matrices are split
+ * across mul_batch_nthreads threads.
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BATCH_LANES 4
+#define BATCH_MAX_N 8
+
+typedef double batch_vec __attribute__((vector_size(BATCH_LANES * sizeof(double))));
+
+typedef void (*mul_range_fn)(double *Out, const double *A, const double *B,
+                             size_t lo, size_t hi);
+
+int mul_batch_nthreads = 1;
+size_t mul_batch_min_split = 1 << 14;
+
+size_t mul_batch_padded(size_t count) {
+  return (count + BATCH_LANES - 1) / BATCH_LANES * BATCH_LANES;
+}
+
+/* One pack of BATCH_LANES matrices. */
+static inline __attribute__((always_inline))
+void mul_lanes(unsigned N, double *Out, const double *A, const double *B) {
+  batch_vec a[BATCH_MAX_N * BATCH_MAX_N], b[BATCH_MAX_N * BATCH_MAX_N];
+  batch_vec Res[BATCH_MAX_N * BATCH_MAX_N];
+  unsigned i, j, k;
+
+#pragma GCC unroll 64
+  for (i = 0; i != N * N; ++i) {
+    memcpy(&a[i], A + i * BATCH_LANES, sizeof(batch_vec));
+    memcpy(&b[i], B + i * BATCH_LANES, sizeof(batch_vec));
+  }
+#pragma GCC unroll 8
+  for (i = 0; i != N; ++i)
+#pragma GCC unroll 8
+    for (j = 0; j != N; ++j) {
+      batch_vec s = a[i * N] * b[j];
+#pragma GCC unroll 8
+      for (k = 1; k != N; ++k)
+        s += a[i * N + k] * b[k * N + j];
+      Res[i * N + j] = s;
+    }
+#pragma GCC unroll 64
+  for (i = 0; i != N * N; ++i)
+    memcpy(Out + i * BATCH_LANES, &Res[i], sizeof(batch_vec));
+}
+
+static int mul_batch_use_fma(void) {
+  static int have = -1;
+  if (have < 0) {
+    __builtin_cpu_init();
+    have = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  }
+  return have;
+}
+
+/* Packs lo..hi-1. */
+#define MUL_BATCH_DEFINE(N)                                                  \
+static void mul_range_##N(double *Out, const double *A, const double *B,    \
+                          size_t lo, size_t hi) {                           \
+  size_t g;                                                                 \
+  for (g = lo; g != hi; ++g)                                                \
+    mul_lanes(N, Out + g * (N * N * BATCH_LANES),                           \
+              A + g * (N * N * BATCH_LANES), B + g * (N * N * BATCH_LANES));\
+}                                                                           \
+                                                                            \
+__attribute__((target("avx2,fma")))                                         \
+static void mul_range_fma_##N(double *Out, const double *A, const double *B,\
+                              size_t lo, size_t hi) {                       \
+  size_t g;                                                                 \
+  for (g = lo; g != hi; ++g)                                                \
+    mul_lanes(N, Out + g * (N * N * BATCH_LANES),                           \
+              A + g * (N * N * BATCH_LANES), B + g * (N * N * BATCH_LANES));\
+}                                                                           \
+                                                                            \
+void mul_batch_##N##x##N(double *Out, const double *A, const double *B,     \
+                         size_t count) {                                    \
+  mul_batch_split(mul_batch_use_fma() ? mul_range_fma_##N : mul_range_##N,  \
+                  Out, A, B, mul_batch_padded(count) / BATCH_LANES);        \
+}
+
+struct mul_job {
+  mul_range_fn range;
+  double *Out;
+  const double *A, *B;
+  size_t lo, hi;
+};
+
+static void *mul_job_run(void *arg) {
+  struct mul_job *job = arg;
+  job->range(job->Out, job->A, job->B, job->lo, job->hi);
+  return NULL;
+}
+
+static void mul_batch_split(mul_range_fn range, double *Out, const double *A,
+                            const double *B, size_t packs) {
+  struct mul_job job[64];
+  pthread_t tid[64];
+  unsigned t, nthreads = mul_batch_nthreads;
+
+  if (nthreads > 64)
+    nthreads = 64;
+  if (nthreads < 2 || packs * BATCH_LANES < mul_batch_min_split) {
+    range(Out, A, B, 0, packs);
+    return;
+  }
+  for (t = 0; t != nthreads; ++t) {
+    job[t].range = range;
+    job[t].Out = Out;
+    job[t].A = A;
+    job[t].B = B;
+    job[t].lo = packs * t / nthreads;
+    job[t].hi = packs * (t + 1) / nthreads;
+    if (t)
+      pthread_create(&tid[t], NULL, mul_job_run, &job[t]);
+  }
+  mul_job_run(&job[0]);
+  for (t = 1; t != nthreads; ++t)
+    pthread_join(tid[t], NULL);
+}
+
+MUL_BATCH_DEFINE(2)
+MUL_BATCH_DEFINE(3)
+MUL_BATCH_DEFINE(4)
+MUL_BATCH_DEFINE(5)
+MUL_BATCH_DEFINE(6)
+MUL_BATCH_DEFINE(7)
+MUL_BATCH_DEFINE(8)
+
+/* Any size from 2 to 8; returns -1, doing nothing, for any other N. */
+int mul_batch(unsigned N, double *Out, const double *A, const double *B,
+              size_t count) {
+  static void (*const fn[BATCH_MAX_N + 1])(double *, const double *,
+                                           const double *, size_t) = {
+    0, 0, mul_batch_2x2, mul_batch_3x3, mul_batch_4x4, mul_batch_5x5,
+    mul_batch_6x6, mul_batch_7x7, mul_batch_8x8
+  };
+  if (N > BATCH_MAX_N || !fn[N])
+    return -1;
+  fn[N](Out, A, B, count);
+  return 0;
+}
+
+/* Row-major matrices one after another <-> the packed layout above. */
+void soa_pack(double *Soa, const double *Aos, unsigned N, size_t count) {
+  size_t m, padded = mul_batch_padded(count);
+  unsigned e;
+  for (m = 0; m != padded; ++m)
+    for (e = 0; e != N * N; ++e)
+      Soa[m / BATCH_LANES * N * N * BATCH_LANES + e * BATCH_LANES
+          + m % BATCH_LANES] = m < count ? Aos[m * N * N + e] : 0.0;
+}
+
+void soa_unpack(double *Aos, const double *Soa, unsigned N, size_t count) {
+  size_t m;
+  unsigned e;
+  for (m = 0; m != count; ++m)
+    for (e = 0; e != N * N; ++e)
+      Aos[m * N * N + e] = Soa[m / BATCH_LANES * N * N * BATCH_LANES
+                               + e * BATCH_LANES + m % BATCH_LANES];
+}
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Plain triple loop on one row-major matrix, for checking. */
+static void mul_ref(double *Out, const double *A, const double *B, unsigned N) {
+  unsigned i, j, k;
+  for (i = 0; i != N; ++i)
+    for (j = 0; j != N; ++j) {
+      double s = A[i * N] * B[j];
+      for (k = 1; k != N; ++k)
+        s += A[i * N + k] * B[k * N + j];
+      Out[i * N + j] = s;
+    }
+}
+
+/* 46 -bench [count [threads [reps]]]: matrices/sec of wrap_mul4 on
+ * count separate 4x4 products, and of mul_batch_NxN for N = 2..8 on one
+ * thread and on `threads' threads, each checked against mul_ref. */
+static int mul_bench(size_t count, unsigned nthreads, unsigned reps) {
+  size_t elems = mul_batch_padded(count) * BATCH_MAX_N * BATCH_MAX_N, m;
+  double *A = malloc(elems * sizeof(double));
+  double *B = malloc(elems * sizeof(double));
+  double *C = malloc(elems * sizeof(double));
+  double *SA = malloc(elems * sizeof(double));
+  double *SB = malloc(elems * sizeof(double));
+  double *SC = malloc(elems * sizeof(double));
+  double ref[BATCH_MAX_N * BATCH_MAX_N], t0, t1, base, err, maxerr;
+  unsigned N, r, e, bad = 0;
+
+  srand(46);
+  for (m = 0; m != elems; ++m) {
+    A[m] = rand() / (double)RAND_MAX * 10.0 - 5.0;
+    B[m] = rand() / (double)RAND_MAX * 10.0 - 5.0;
+  }
+
+  t0 = now_seconds();
+  for (r = 0; r != reps; ++r)
+    for (m = 0; m != count; ++m)
+      wrap_mul4(C + m * 16, (const double (*)[4])(A + m * 16),
+                (const double (*)[4])(B + m * 16));
+  base = (double)count * reps / (now_seconds() - t0);
+  printf("%lu matrices x %u, %u threads\n", (unsigned long)count, reps,
+         nthreads);
+  printf("wrap_mul4 4x4 %12.3e matrices/s\n", base);
+  printf("  N     1 thread    %2u threads   vs mul4    max rel err\n",
+         nthreads);
+
+  for (N = 2; N <= BATCH_MAX_N; ++N) {
+    soa_pack(SA, A, N, count);
+    soa_pack(SB, B, N, count);
+    mul_batch_nthreads = 1;
+    t0 = now_seconds();
+    for (r = 0; r != reps; ++r)
+      mul_batch(N, SC, SA, SB, count);
+    t0 = (double)count * reps / (now_seconds() - t0);
+    mul_batch_nthreads = nthreads;
+    t1 = now_seconds();
+    for (r = 0; r != reps; ++r)
+      mul_batch(N, SC, SA, SB, count);
+    t1 = (double)count * reps / (now_seconds() - t1);
+
+    soa_unpack(C, SC, N, count);
+    maxerr = 0;
+    for (m = 0; m != count; ++m) {
+      double scale = 0;
+      mul_ref(ref, A + m * N * N, B + m * N * N, N);
+      for (e = 0; e != N * N; ++e)
+        if (fabs(ref[e]) > scale)
+          scale = fabs(ref[e]);
+      for (e = 0; e != N * N; ++e) {
+        err = fabs(C[m * N * N + e] - ref[e]) / scale;
+        if (err > maxerr)
+          maxerr = err;
+      }
+    }
+    if (maxerr > 1e-9)
+      bad = 1;
+    if (N == 4)
+      printf("%3u %12.3e %12.3e %8.2fx %14.2e\n", N, t0, t1, t1 / base, maxerr);
+    else
+      printf("%3u %12.3e %12.3e %9s %14.2e\n", N, t0, t1, "", maxerr);
+  }
+  if (bad)
+    printf("batched products disagree with the reference\n");
+  free(A);
+  free(B);
+  free(C);
+  free(SA);
+  free(SB);
+  free(SC);
+  return bad;
+}
+
+int main(int argc, char **argv) {
 #ifdef SMALL_PROBLEM_SIZE
   const unsigned Iterations = 1000000;
 #else
@@ -59,6 +340,11 @@ int main() {
   double C[4][4];
   unsigned n, m;
 
+  if (argc > 1 && !strcmp(argv[1], "-bench"))
+    return mul_bench(argc > 2 ? (size_t)atol(argv[2]) : 100000,
+                     argc > 3 ? atoi(argv[3]) : 2,
+                     argc > 4 ? atoi(argv[4]) : 20);
+
   for (n = 0; n != Iterations; ++n)
     wrap_mul4(&C[0][0], A, B);
 
@@ -2,6 +2,7 @@
 #include <memory.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 /* memalign */
 #if !defined(__APPLE__) && !defined(__FreeBSD__) && !defined(__NetBSD__) && \
     !defined(__OpenBSD__) && !defined(_AIX)
@@ -11,6 +12,12 @@
 /* random number generator, 0 <= RND < 1 */
 #define RND(p) ((*(p) = (*(p) * 7141 + 54773) % 259200) * (1.0 / 259200.0))
 #define MAX(x,y) ((x) > (y) ? (x) : (y))
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
+
+/* plan kinds for fft_plan_get/fft_transform/fft_batch */
+#define FFT_COMPLEX 0
+#define FFT_REAL    1
+#define FFT_DCT     2
 
 void makewt(int nw, int *ip, double *w);
 void cdft(int, int, double *, int *, double *);
@@ -18,6 +25,7 @@ void putdata(int nini, int nend, double *a);
 double errorcheck(int nini, int nend, double scale, double *a);
 
 double get_time(void);
+static int fft_bench(int nthreads, int batch);
 
 #define N 1024
 #ifdef SMALL_PROBLEM_SIZE
@@ -26,13 +34,17 @@ double get_time(void);
 #define TRIES 150000
 #endif
 
-int main()
+int main(int argc, char *argv[])
 {
   int i, j;
   int *ip;
   double *ref, *cmp, *src, *w;
   double t_start, t_end, t_overhead, t_total = 0, err_val;
 
+  if (argc > 1 && !strcmp(argv[1], "-bench"))
+    return fft_bench(argc > 2 ? atoi(argv[2]) : 2,
+                     argc > 3 ? atoi(argv[3]) : 64);
+
   /* Measure overhead of get_time() call */
   t_start = get_time();
   t_end = get_time();
@@ -761,3 +773,718 @@ void cftmdl(int n, int l, double *a, double *w)
     }
   }
 }
+
+
+/* -------- AVX2 radix-4 butterflies -------- */
+
+/*
+ * cftmdl_avx2 is cftmdl with two complex points per __m256d.  Every
+ * lane performs the same multiplies, adds and sign flips as the scalar
+ * code, in the same order.  cdft and the original cftfsub/cftbsub keep
+ * the scalar cftmdl; only the plan entry points (fft_run, fft_transform,
+ * fft_batch) and rdft/ddct go through fft_fsub/fft_bsub, which take the
+ * AVX2 copies when the CPU has AVX2.  fft_use_avx2 = 0 forces the
+ * scalar code; it is resolved under the plan lock, so workers only read
+ * it.
+ */
+
+int fft_use_avx2 = -1;
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/* (cr + i ci) * d, as wkr * dr - wki * di, wkr * di + wki * dr */
+#define CMUL(d, cr, ci) \
+  _mm256_addsub_pd(_mm256_mul_pd(cr, d), \
+                   _mm256_mul_pd(ci, _mm256_permute_pd(d, 5)))
+
+__attribute__((target("avx2")))
+static void cftmdl_avx2(int n, int l, double *a, double *w)
+{
+  int j, j1, j2, j3, k, k1, k2, m, m2;
+  const __m256d negre = _mm256_setr_pd(-0.0, 0.0, -0.0, 0.0);
+  const __m256d negim = _mm256_setr_pd(0.0, -0.0, 0.0, -0.0);
+  __m256d wk1r, wk1i, wk2r, wk2i, wk3r, wk3i, nwk2i;
+  __m256d x0, x1, x2, x3, ix3, y;
+  double w1r, w1i, w2r, w2i, w3r, w3i;
+
+  m = l << 2;
+  for (j = 0; j < l; j += 4) {
+    j1 = j + l;
+    j2 = j1 + l;
+    j3 = j2 + l;
+    x0 = _mm256_add_pd(_mm256_loadu_pd(a + j), _mm256_loadu_pd(a + j1));
+    x1 = _mm256_sub_pd(_mm256_loadu_pd(a + j), _mm256_loadu_pd(a + j1));
+    x2 = _mm256_add_pd(_mm256_loadu_pd(a + j2), _mm256_loadu_pd(a + j3));
+    x3 = _mm256_sub_pd(_mm256_loadu_pd(a + j2), _mm256_loadu_pd(a + j3));
+    ix3 = _mm256_xor_pd(_mm256_permute_pd(x3, 5), negre);
+    _mm256_storeu_pd(a + j, _mm256_add_pd(x0, x2));
+    _mm256_storeu_pd(a + j2, _mm256_sub_pd(x0, x2));
+    _mm256_storeu_pd(a + j1, _mm256_add_pd(x1, ix3));
+    _mm256_storeu_pd(a + j3, _mm256_sub_pd(x1, ix3));
+  }
+  wk1r = _mm256_set1_pd(w[2]);
+  for (j = m; j < l + m; j += 4) {
+    j1 = j + l;
+    j2 = j1 + l;
+    j3 = j2 + l;
+    x0 = _mm256_add_pd(_mm256_loadu_pd(a + j), _mm256_loadu_pd(a + j1));
+    x1 = _mm256_sub_pd(_mm256_loadu_pd(a + j), _mm256_loadu_pd(a + j1));
+    x2 = _mm256_add_pd(_mm256_loadu_pd(a + j2), _mm256_loadu_pd(a + j3));
+    x3 = _mm256_sub_pd(_mm256_loadu_pd(a + j2), _mm256_loadu_pd(a + j3));
+    _mm256_storeu_pd(a + j, _mm256_add_pd(x0, x2));
+    /* (x2i - x0i, x0r - x2r) */
+    y = _mm256_sub_pd(x0, x2);
+    _mm256_storeu_pd(a + j2, _mm256_xor_pd(_mm256_permute_pd(y, 5), negre));
+    /* x0 = x1 + i x3; wk1r * (x0r - x0i, x0r + x0i) */
+    y = _mm256_add_pd(x1, _mm256_xor_pd(_mm256_permute_pd(x3, 5), negre));
+    _mm256_storeu_pd(a + j1, _mm256_mul_pd(wk1r,
+                     _mm256_addsub_pd(y, _mm256_permute_pd(y, 5))));
+    /* x0 = (x3i + x1r, x3r - x1i); wk1r * (x0i - x0r, x0i + x0r) */
+    y = _mm256_add_pd(_mm256_permute_pd(x3, 5), _mm256_xor_pd(x1, negim));
+    _mm256_storeu_pd(a + j3, _mm256_mul_pd(wk1r,
+                     _mm256_addsub_pd(_mm256_permute_pd(y, 5), y)));
+  }
+  k1 = 0;
+  m2 = 2 * m;
+  for (k = m2; k < n; k += m2) {
+    k1 += 2;
+    k2 = 2 * k1;
+    w2r = w[k1];
+    w2i = w[k1 + 1];
+    w1r = w[k2];
+    w1i = w[k2 + 1];
+    w3r = w1r - 2 * w2i * w1i;
+    w3i = 2 * w2i * w1r - w1i;
+    wk1r = _mm256_set1_pd(w1r);
+    wk1i = _mm256_set1_pd(w1i);
+    wk2r = _mm256_set1_pd(w2r);
+    wk2i = _mm256_set1_pd(w2i);
+    wk3r = _mm256_set1_pd(w3r);
+    wk3i = _mm256_set1_pd(w3i);
+    for (j = k; j < l + k; j += 4) {
+      j1 = j + l;
+      j2 = j1 + l;
+      j3 = j2 + l;
+      x0 = _mm256_add_pd(_mm256_loadu_pd(a + j), _mm256_loadu_pd(a + j1));
+      x1 = _mm256_sub_pd(_mm256_loadu_pd(a + j), _mm256_loadu_pd(a + j1));
+      x2 = _mm256_add_pd(_mm256_loadu_pd(a + j2), _mm256_loadu_pd(a + j3));
+      x3 = _mm256_sub_pd(_mm256_loadu_pd(a + j2), _mm256_loadu_pd(a + j3));
+      ix3 = _mm256_xor_pd(_mm256_permute_pd(x3, 5), negre);
+      _mm256_storeu_pd(a + j, _mm256_add_pd(x0, x2));
+      y = _mm256_sub_pd(x0, x2);
+      _mm256_storeu_pd(a + j2, CMUL(y, wk2r, wk2i));
+      y = _mm256_add_pd(x1, ix3);
+      _mm256_storeu_pd(a + j1, CMUL(y, wk1r, wk1i));
+      y = _mm256_sub_pd(x1, ix3);
+      _mm256_storeu_pd(a + j3, CMUL(y, wk3r, wk3i));
+    }
+    w1r = w[k2 + 2];
+    w1i = w[k2 + 3];
+    w3r = w1r - 2 * w2r * w1i;
+    w3i = 2 * w2r * w1r - w1i;
+    wk1r = _mm256_set1_pd(w1r);
+    wk1i = _mm256_set1_pd(w1i);
+    wk3r = _mm256_set1_pd(w3r);
+    wk3i = _mm256_set1_pd(w3i);
+    nwk2i = _mm256_set1_pd(-w2i);
+    for (j = k + m; j < l + (k + m); j += 4) {
+      j1 = j + l;
+      j2 = j1 + l;
+      j3 = j2 + l;
+      x0 = _mm256_add_pd(_mm256_loadu_pd(a + j), _mm256_loadu_pd(a + j1));
+      x1 = _mm256_sub_pd(_mm256_loadu_pd(a + j), _mm256_loadu_pd(a + j1));
+      x2 = _mm256_add_pd(_mm256_loadu_pd(a + j2), _mm256_loadu_pd(a + j3));
+      x3 = _mm256_sub_pd(_mm256_loadu_pd(a + j2), _mm256_loadu_pd(a + j3));
+      ix3 = _mm256_xor_pd(_mm256_permute_pd(x3, 5), negre);
+      _mm256_storeu_pd(a + j, _mm256_add_pd(x0, x2));
+      /* (-wk2i * x0r - wk2r * x0i, -wk2i * x0i + wk2r * x0r) */
+      y = _mm256_sub_pd(x0, x2);
+      _mm256_storeu_pd(a + j2, CMUL(y, nwk2i, wk2r));
+      y = _mm256_add_pd(x1, ix3);
+      _mm256_storeu_pd(a + j1, CMUL(y, wk1r, wk1i));
+      y = _mm256_sub_pd(x1, ix3);
+      _mm256_storeu_pd(a + j3, CMUL(y, wk3r, wk3i));
+    }
+  }
+}
+
+/* cftfsub and cftbsub with the AVX2 middle stages */
+
+__attribute__((target("avx2")))
+static void cftfsub_avx2(int n, double *a, double *w)
+{
+  int j, j1, j2, j3, l;
+  double x0r, x0i, x1r, x1i, x2r, x2i, x3r, x3i;
+    
+  l = 2;
+  if (n > 8) {
+    cft1st(n, a, w);
+    l = 8;
+    while ((l << 2) < n) {
+      cftmdl_avx2(n, l, a, w);
+      l <<= 2;
+    }
+  }
+  if ((l << 2) == n) {
+    for (j = 0; j < l; j += 2) {
+      j1 = j + l;
+      j2 = j1 + l;
+      j3 = j2 + l;
+      x0r = a[j] + a[j1];
+      x0i = a[j + 1] + a[j1 + 1];
+      x1r = a[j] - a[j1];
+      x1i = a[j + 1] - a[j1 + 1];
+      x2r = a[j2] + a[j3];
+      x2i = a[j2 + 1] + a[j3 + 1];
+      x3r = a[j2] - a[j3];
+      x3i = a[j2 + 1] - a[j3 + 1];
+      a[j] = x0r + x2r;
+      a[j + 1] = x0i + x2i;
+      a[j2] = x0r - x2r;
+      a[j2 + 1] = x0i - x2i;
+      a[j1] = x1r - x3i;
+      a[j1 + 1] = x1i + x3r;
+      a[j3] = x1r + x3i;
+      a[j3 + 1] = x1i - x3r;
+    }
+  } else {
+    for (j = 0; j < l; j += 2) {
+      j1 = j + l;
+      x0r = a[j] - a[j1];
+      x0i = a[j + 1] - a[j1 + 1];
+      a[j] += a[j1];
+      a[j + 1] += a[j1 + 1];
+      a[j1] = x0r;
+      a[j1 + 1] = x0i;
+    }
+  }
+}
+
+
+__attribute__((target("avx2")))
+static void cftbsub_avx2(int n, double *a, double *w)
+{
+  int j, j1, j2, j3, l;
+  double x0r, x0i, x1r, x1i, x2r, x2i, x3r, x3i;
+    
+  l = 2;
+  if (n > 8) {
+    cft1st(n, a, w);
+    l = 8;
+    while ((l << 2) < n) {
+      cftmdl_avx2(n, l, a, w);
+      l <<= 2;
+    }
+  }
+  if ((l << 2) == n) {
+    for (j = 0; j < l; j += 2) {
+      j1 = j + l;
+      j2 = j1 + l;
+      j3 = j2 + l;
+      x0r = a[j] + a[j1];
+      x0i = -a[j + 1] - a[j1 + 1];
+      x1r = a[j] - a[j1];
+      x1i = -a[j + 1] + a[j1 + 1];
+      x2r = a[j2] + a[j3];
+      x2i = a[j2 + 1] + a[j3 + 1];
+      x3r = a[j2] - a[j3];
+      x3i = a[j2 + 1] - a[j3 + 1];
+      a[j] = x0r + x2r;
+      a[j + 1] = x0i - x2i;
+      a[j2] = x0r - x2r;
+      a[j2 + 1] = x0i + x2i;
+      a[j1] = x1r - x3i;
+      a[j1 + 1] = x1i - x3r;
+      a[j3] = x1r + x3i;
+      a[j3 + 1] = x1i + x3r;
+    }
+  } else {
+    for (j = 0; j < l; j += 2) {
+      j1 = j + l;
+      x0r = a[j] - a[j1];
+      x0i = -a[j + 1] + a[j1 + 1];
+      a[j] += a[j1];
+      a[j + 1] = -a[j + 1] - a[j1 + 1];
+      a[j1] = x0r;
+      a[j1 + 1] = x0i;
+    }
+  }
+}
+
+
+#endif
+
+/* cftfsub/cftbsub for the plan entry points: the AVX2 copies when the
+   CPU has AVX2 and fft_use_avx2 allows it, else the scalar ones */
+static int fft_avx2(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  if (fft_use_avx2 < 0) {
+    __builtin_cpu_init();
+    fft_use_avx2 = __builtin_cpu_supports("avx2") != 0;
+  }
+  return fft_use_avx2;
+#else
+  return 0;
+#endif
+}
+
+static void fft_fsub(int n, double *a, double *w)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  if (fft_avx2()) {
+    cftfsub_avx2(n, a, w);
+    return;
+  }
+#endif
+  cftfsub(n, a, w);
+}
+
+static void fft_bsub(int n, double *a, double *w)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  if (fft_avx2()) {
+    cftbsub_avx2(n, a, w);
+    return;
+  }
+#endif
+  cftbsub(n, a, w);
+}
+
+
+/* -------- real transforms -------- */
+
+void makect(int nc, double *c)
+{
+  int j, nch;
+  double delta;
+
+  if (nc > 1) {
+    nch = nc >> 1;
+    delta = atan(1.0) / nch;
+    c[0] = cos(delta * nch);
+    c[nch] = 0.5 * c[0];
+    for (j = 1; j < nch; j++) {
+      c[j] = 0.5 * cos(delta * j);
+      c[nc - j] = 0.5 * sin(delta * j);
+    }
+  }
+}
+
+
+static void rftfsub(int n, double *a, int nc, double *c)
+{
+  int j, k, kk, ks, m;
+  double wkr, wki, xr, xi, yr, yi;
+
+  m = n >> 1;
+  ks = 2 * nc / m;
+  kk = 0;
+  for (j = 2; j < m; j += 2) {
+    k = n - j;
+    kk += ks;
+    wkr = 0.5 - c[nc - kk];
+    wki = c[kk];
+    xr = a[j] - a[k];
+    xi = a[j + 1] + a[k + 1];
+    yr = wkr * xr - wki * xi;
+    yi = wkr * xi + wki * xr;
+    a[j] -= yr;
+    a[j + 1] -= yi;
+    a[k] += yr;
+    a[k + 1] -= yi;
+  }
+}
+
+
+static void rftbsub(int n, double *a, int nc, double *c)
+{
+  int j, k, kk, ks, m;
+  double wkr, wki, xr, xi, yr, yi;
+
+  a[1] = -a[1];
+  m = n >> 1;
+  ks = 2 * nc / m;
+  kk = 0;
+  for (j = 2; j < m; j += 2) {
+    k = n - j;
+    kk += ks;
+    wkr = 0.5 - c[nc - kk];
+    wki = c[kk];
+    xr = a[j] - a[k];
+    xi = a[j + 1] + a[k + 1];
+    yr = wkr * xr + wki * xi;
+    yi = wkr * xi - wki * xr;
+    a[j] -= yr;
+    a[j + 1] = yi - a[j + 1];
+    a[k] += yr;
+    a[k + 1] = yi - a[k + 1];
+  }
+  a[m + 1] = -a[m + 1];
+}
+
+
+static void dctsub(int n, double *a, int nc, double *c)
+{
+  int j, k, kk, ks, m;
+  double wkr, wki, xr;
+
+  m = n >> 1;
+  ks = nc / n;
+  kk = 0;
+  for (j = 1; j < m; j++) {
+    k = n - j;
+    kk += ks;
+    wkr = c[kk] - c[nc - kk];
+    wki = c[kk] + c[nc - kk];
+    xr = wki * a[j] - wkr * a[k];
+    a[j] = wkr * a[j] + wki * a[k];
+    a[k] = xr;
+  }
+  a[m] *= c[0];
+}
+
+
+/*
+ * rdft: real DFT of n doubles, n a power of 2, w from makewt(n >> 2) and
+ * c from makect(n >> 2).
+ *   isgn >= 0: a[2k] = R[k], a[2k+1] = I[k] (0 < k < n/2), a[1] = R[n/2]
+ *              with R[k] + i I[k] = sum_j a[j] exp(2 pi i jk/n)
+ *   isgn < 0:  the inverse, scaled by n/2
+ * ddct: DCT-II/III, w from makewt(n >> 2) and c from makect(n).
+ * Both take the AVX2 butterflies when fft_fsub/fft_bsub pick them.
+ *   isgn < 0:  C[k] = sum_j a[j] cos(pi (j+1/2) k/n)
+ *   isgn >= 0: C[k] = sum_j a[j] cos(pi j (k+1/2)/n); the inverse of
+ *              isgn < 0 after a[0] *= 0.5 and scaling by 2/n
+ */
+void rdft(int n, int isgn, double *a, int *ip, double *w, double *c)
+{
+  int nc = n >> 2;
+  double xi;
+
+  if (isgn >= 0) {
+    if (n > 4) {
+      bitrv2(n, ip, a);
+      fft_fsub(n, a, w);
+      rftfsub(n, a, nc, c);
+    } else if (n == 4) {
+      fft_fsub(n, a, w);
+    }
+    xi = a[0] - a[1];
+    a[0] += a[1];
+    a[1] = xi;
+  } else {
+    a[1] = 0.5 * (a[0] - a[1]);
+    a[0] -= a[1];
+    if (n > 4) {
+      rftbsub(n, a, nc, c);
+      bitrv2(n, ip, a);
+      fft_bsub(n, a, w);
+    } else if (n == 4) {
+      fft_fsub(n, a, w);
+    }
+  }
+}
+
+
+void ddct(int n, int isgn, double *a, int *ip, double *w, double *c)
+{
+  int j, nc = n;
+  double xr;
+
+  if (isgn < 0) {
+    xr = a[n - 1];
+    for (j = n - 2; j >= 2; j -= 2) {
+      a[j + 1] = a[j] - a[j - 1];
+      a[j] += a[j - 1];
+    }
+    a[1] = a[0] - xr;
+    a[0] += xr;
+    if (n > 4) {
+      rftbsub(n, a, nc, c);
+      bitrv2(n, ip, a);
+      fft_bsub(n, a, w);
+    } else if (n == 4) {
+      fft_fsub(n, a, w);
+    }
+  }
+  dctsub(n, a, nc, c);
+  if (isgn >= 0) {
+    if (n > 4) {
+      bitrv2(n, ip, a);
+      fft_fsub(n, a, w);
+      rftfsub(n, a, nc, c);
+    } else if (n == 4) {
+      fft_fsub(n, a, w);
+    }
+    xr = a[0] - a[1];
+    a[0] += a[1];
+    for (j = 2; j < n; j += 2) {
+      a[j - 1] = a[j] - a[j + 1];
+      a[j] += a[j + 1];
+    }
+    a[n - 1] = xr;
+  }
+}
+
+
+/* -------- plan cache -------- */
+
+/*
+ * A plan holds the makewt/makect tables for one (kind, n).  The tables
+ * do not depend on the direction, so both directions share a plan.
+ * Plans are built on first use under fft_plan_lock and kept until
+ * fft_plan_clear(); after that they are read-only, so any number of
+ * threads may transform with one.  bitrv2 uses ip as scratch, so each
+ * call gets its own on the stack instead of sharing the plan's.
+ */
+
+#include <pthread.h>
+
+/* bitrv2 needs sqrt(n/2) ints of ip; enough for n up to 2^23 */
+#define FFT_IP_MAX 2048
+
+struct fft_plan {
+  int kind, n;
+  double *w, *c;
+  struct fft_plan *next;
+};
+
+static struct fft_plan *fft_plans;
+static pthread_mutex_t fft_plan_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct fft_plan *fft_plan_get(int kind, int n)
+{
+  struct fft_plan *p;
+  int ip[FFT_IP_MAX];
+  int nw = n >> 2, nc = kind == FFT_DCT ? n : n >> 2;
+
+  pthread_mutex_lock(&fft_plan_lock);
+  fft_avx2();
+  for (p = fft_plans; p; p = p->next)
+    if (p->kind == kind && p->n == n)
+      break;
+  if (!p) {
+    p = malloc(sizeof(*p));
+    p->kind = kind;
+    p->n = n;
+    p->w = malloc((nw + nc + 2) * sizeof(double));
+    p->c = p->w + nw;
+    makewt(nw, ip, p->w);
+    if (kind != FFT_COMPLEX)
+      makect(nc, p->c);
+    p->next = fft_plans;
+    fft_plans = p;
+  }
+  pthread_mutex_unlock(&fft_plan_lock);
+  return p;
+}
+
+void fft_plan_clear(void)
+{
+  struct fft_plan *p;
+
+  pthread_mutex_lock(&fft_plan_lock);
+  while ((p = fft_plans)) {
+    fft_plans = p->next;
+    free(p->w);
+    free(p);
+  }
+  pthread_mutex_unlock(&fft_plan_lock);
+}
+
+/* cdft with the butterflies fft_fsub/fft_bsub pick */
+static void fft_cdft(int n, int isgn, double *a, int *ip, double *w)
+{
+  if (n > 4) {
+    if (isgn >= 0) {
+      bitrv2(n, ip, a);
+      fft_fsub(n, a, w);
+    } else {
+      bitrv2conj(n, ip, a);
+      fft_bsub(n, a, w);
+    }
+  } else if (n == 4) {
+    fft_fsub(n, a, w);
+  }
+}
+
+/* n doubles: n/2 complex points for FFT_COMPLEX, n reals otherwise */
+void fft_run(struct fft_plan *p, int isgn, double *a)
+{
+  int ip[FFT_IP_MAX];
+
+  switch (p->kind) {
+  case FFT_COMPLEX:
+    fft_cdft(p->n, isgn, a, ip, p->w);
+    break;
+  case FFT_REAL:
+    rdft(p->n, isgn, a, ip, p->w, p->c);
+    break;
+  case FFT_DCT:
+    ddct(p->n, isgn, a, ip, p->w, p->c);
+    break;
+  }
+}
+
+void fft_transform(int kind, int n, int isgn, double *a)
+{
+  fft_run(fft_plan_get(kind, n), isgn, a);
+}
+
+
+/* -------- batch executor -------- */
+
+/*
+ * fft_batch runs count independent transforms of the same kind, size and
+ * direction on fft_nthreads threads.  Workers pull the next index from
+ * a shared counter, so uneven progress balances out.
+ */
+
+int fft_nthreads = 1;
+
+struct fft_batch_job {
+  struct fft_plan *plan;
+  int isgn, count;
+  double **a;
+  int next;
+};
+
+static void *fft_batch_worker(void *arg)
+{
+  struct fft_batch_job *job = arg;
+  int i;
+
+  while ((i = __sync_fetch_and_add(&job->next, 1)) < job->count)
+    fft_run(job->plan, job->isgn, job->a[i]);
+  return NULL;
+}
+
+void fft_batch(int kind, int n, int isgn, double **a, int count)
+{
+  struct fft_batch_job job;
+  pthread_t tid[64];
+  int t, nthreads = fft_nthreads;
+
+  job.plan = fft_plan_get(kind, n);
+  job.isgn = isgn;
+  job.count = count;
+  job.a = a;
+  job.next = 0;
+  if (nthreads > 64)
+    nthreads = 64;
+  if (nthreads > count)
+    nthreads = count;
+  for (t = 1; t < nthreads; t++)
+    pthread_create(&tid[t], NULL, fft_batch_worker, &job);
+  fft_batch_worker(&job);
+  for (t = 1; t < nthreads; t++)
+    pthread_join(tid[t], NULL);
+}
+
+
+/* -------- benchmark -------- */
+
+/*
+ * 47 -bench [threads [batch]]: for 2^6..2^20 points, ns per transform
+ * of cdft (scalar and AVX2 butterflies), rdft and ddct through the plan
+ * cache, each with its errorcheck round-trip error, and ns per cdft in
+ * a batch of `batch' transforms on `threads' threads.  Also reports how
+ * far the AVX2 cdft strays from the scalar one, relative to its largest
+ * output; above 1e-10 it, or a round-trip error, fails the run.
+ */
+static int fft_bench(int nthreads, int batch)
+{
+  double *a, *b, **v, t0, t1, t2, err, worst = 0, diff = 0, big;
+  int lg, n, r, reps, kind, i;
+
+  a = malloc(2 * (1 << 20) * sizeof(double));
+  b = malloc(2 * (1 << 20) * sizeof(double));
+  v = malloc(batch * sizeof(double *));
+  printf("%-6s %9s %9s  %-7s %9s  %-7s %9s  %-7s %9s\n", "points", "cdft ns",
+         "scalar", "err", "rdft ns", "err", "ddct ns", "err", "batch ns");
+  for (lg = 6; lg <= 20; lg++) {
+    n = 1 << lg;
+    reps = (1 << 22) / n;
+    printf("2^%-4d", lg);
+    for (kind = FFT_COMPLEX; kind <= FFT_DCT; kind++) {
+      int len = kind == FFT_COMPLEX ? 2 * n : n;
+      struct fft_plan *p = fft_plan_get(kind, len);
+
+      putdata(0, len - 1, a);
+      t0 = get_time();
+      for (r = 0; r < reps; r++) {
+        fft_run(p, 1, a);
+        fft_run(p, -1, a);
+      }
+      t0 = (get_time() - t0) / (2.0 * reps) * 1e9;
+      /* each round trip scales by n (cdft), n/2 (rdft) or n/2 with a[0]
+         halved (ddct); restart from fresh data to measure one */
+      putdata(0, len - 1, a);
+      if (kind == FFT_DCT) {
+        fft_run(p, -1, a);
+        a[0] *= 0.5;
+        fft_run(p, 1, a);
+      } else {
+        fft_run(p, 1, a);
+        fft_run(p, -1, a);
+      }
+      err = errorcheck(0, len - 1, kind == FFT_COMPLEX ? 1.0 / n : 2.0 / len,
+                       a);
+      worst = MAX(worst, err);
+      if (kind == FFT_COMPLEX) {
+        int use = fft_use_avx2;
+
+        putdata(0, len - 1, a);
+        putdata(0, len - 1, b);
+        fft_run(p, 1, a);
+        fft_use_avx2 = 0;
+        fft_run(p, 1, b);
+        /* the same operations, but a build that contracts the scalar
+           code to FMA rounds differently, so allow for that */
+        big = 0;
+        for (i = 0; i < len; i++)
+          big = MAX(big, fabs(b[i]));
+        for (i = 0; i < len; i++)
+          diff = MAX(diff, fabs(a[i] - b[i]) / big);
+        t1 = get_time();
+        for (r = 0; r < reps; r++) {
+          fft_run(p, 1, b);
+          fft_run(p, -1, b);
+        }
+        t1 = (get_time() - t1) / (2.0 * reps) * 1e9;
+        fft_use_avx2 = use;
+        printf(" %9.0f %9.0f  %.1e", t0, t1, err);
+      } else {
+        printf(" %9.0f  %.1e", t0, err);
+      }
+    }
+
+    /* batch of cdfts, at most 2^20 complex points in flight */
+    r = MAX(1, MIN(batch, (1 << 20) / n));
+    for (i = 0; i < r; i++) {
+      v[i] = malloc(2 * n * sizeof(double));
+      putdata(0, 2 * n - 1, v[i]);
+    }
+    fft_nthreads = nthreads;
+    reps = MAX(1, (1 << 22) / (n * r));
+    t2 = get_time();
+    for (i = 0; i < reps; i++)
+      fft_batch(FFT_COMPLEX, 2 * n, 1, v, r);
+    t2 = (get_time() - t2) / ((double)reps * r) * 1e9;
+    printf(" %9.0f\n", t2);
+    for (i = 0; i < r; i++)
+      free(v[i]);
+  }
+  printf("worst round-trip error %.2e; ", worst);
+  if (fft_use_avx2)
+    printf("AVX2 butterflies differ from scalar by %.2e\n", diff);
+  else
+    printf("AVX2 butterflies not available\n");
+  free(a);
+  free(b);
+  free(v);
+  fft_plan_clear();
+  return worst > 1e-10 || diff > 1e-10;
+}
@@ -61,8 +61,367 @@ static init() {
     p[256+i] = p[i] = permutation[i];
 }
 
-int main() {
+// ---------------------------------------------------------------------------
+// Bulk evaluation.  Everything below computes the same expression as
+// noise(), in the same order, so results match it bit for bit.
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// noise() at n arbitrary points.  With AVX2 four points go through one
+// set of registers, the permutation lookups done as 32-bit gathers; the
+// build only needs the target attribute, the CPU is checked at run time.
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("avx2")))
+static inline __m256d fade4(__m256d t) {
+  return _mm256_mul_pd(_mm256_mul_pd(_mm256_mul_pd(t, t), t),
+         _mm256_add_pd(_mm256_mul_pd(t, _mm256_sub_pd(
+           _mm256_mul_pd(t, _mm256_set1_pd(6)), _mm256_set1_pd(15))),
+           _mm256_set1_pd(10)));
+}
+
+__attribute__((target("avx2")))
+static inline __m256d lerp4(__m256d t, __m256d a, __m256d b) {
+  return _mm256_add_pd(a, _mm256_mul_pd(t, _mm256_sub_pd(b, a)));
+}
+
+__attribute__((target("avx2")))
+static inline __m256d grad4(__m128i hash, __m256d x, __m256d y, __m256d z) {
+  __m256i h = _mm256_cvtepi32_epi64(_mm_and_si128(hash, _mm_set1_epi32(15)));
+  __m256d lt8 = _mm256_castsi256_pd(_mm256_cmpgt_epi64(_mm256_set1_epi64x(8), h));
+  __m256d lt4 = _mm256_castsi256_pd(_mm256_cmpgt_epi64(_mm256_set1_epi64x(4), h));
+  __m256d hx = _mm256_castsi256_pd(_mm256_or_si256(
+                 _mm256_cmpeq_epi64(h, _mm256_set1_epi64x(12)),
+                 _mm256_cmpeq_epi64(h, _mm256_set1_epi64x(14))));
+  __m256d u = _mm256_blendv_pd(y, x, lt8);
+  __m256d v = _mm256_blendv_pd(_mm256_blendv_pd(z, x, hx), y, lt4);
+  __m256d su = _mm256_castsi256_pd(_mm256_slli_epi64(h, 63));
+  __m256d sv = _mm256_castsi256_pd(_mm256_slli_epi64(
+                 _mm256_srli_epi64(h, 1), 63));
+  return _mm256_add_pd(_mm256_xor_pd(u, su), _mm256_xor_pd(v, sv));
+}
+
+#define PGATHER(i) _mm_i32gather_epi32(p, i, 4)
+
+__attribute__((target("avx2")))
+static void noise_batch_avx2(const double *xs, const double *ys,
+                             const double *zs, double *out, size_t n) {
+  const __m128i m255 = _mm_set1_epi32(255), one = _mm_set1_epi32(1);
+  const __m256d d1 = _mm256_set1_pd(1);
+  size_t i;
+
+  for (i = 0; i + 4 <= n; i += 4) {
+    __m256d x = _mm256_loadu_pd(xs + i), fx = _mm256_floor_pd(x);
+    __m256d y = _mm256_loadu_pd(ys + i), fy = _mm256_floor_pd(y);
+    __m256d z = _mm256_loadu_pd(zs + i), fz = _mm256_floor_pd(z);
+    __m128i X = _mm_and_si128(_mm256_cvttpd_epi32(fx), m255);
+    __m128i Y = _mm_and_si128(_mm256_cvttpd_epi32(fy), m255);
+    __m128i Z = _mm_and_si128(_mm256_cvttpd_epi32(fz), m255);
+    __m256d u, v, w, x1, y1, z1;
+    __m128i A, AA, AB, B, BA, BB;
+
+    x = _mm256_sub_pd(x, fx);
+    y = _mm256_sub_pd(y, fy);
+    z = _mm256_sub_pd(z, fz);
+    u = fade4(x);
+    v = fade4(y);
+    w = fade4(z);
+    x1 = _mm256_sub_pd(x, d1);
+    y1 = _mm256_sub_pd(y, d1);
+    z1 = _mm256_sub_pd(z, d1);
+    A = _mm_add_epi32(PGATHER(X), Y);
+    AA = _mm_add_epi32(PGATHER(A), Z);
+    AB = _mm_add_epi32(PGATHER(_mm_add_epi32(A, one)), Z);
+    B = _mm_add_epi32(PGATHER(_mm_add_epi32(X, one)), Y);
+    BA = _mm_add_epi32(PGATHER(B), Z);
+    BB = _mm_add_epi32(PGATHER(_mm_add_epi32(B, one)), Z);
+
+    _mm256_storeu_pd(out + i,
+      lerp4(w, lerp4(v, lerp4(u, grad4(PGATHER(AA), x, y, z),
+                                 grad4(PGATHER(BA), x1, y, z)),
+                        lerp4(u, grad4(PGATHER(AB), x, y1, z),
+                                 grad4(PGATHER(BB), x1, y1, z))),
+               lerp4(v, lerp4(u, grad4(PGATHER(_mm_add_epi32(AA, one)), x, y, z1),
+                                 grad4(PGATHER(_mm_add_epi32(BA, one)), x1, y, z1)),
+                        lerp4(u, grad4(PGATHER(_mm_add_epi32(AB, one)), x, y1, z1),
+                                 grad4(PGATHER(_mm_add_epi32(BB, one)), x1, y1, z1)))));
+  }
+  for (; i < n; i++)
+    out[i] = noise(xs[i], ys[i], zs[i]);
+}
+#endif
+
+static int noise_use_avx2 = -1;
+
+void noise_batch(const double *xs, const double *ys, const double *zs,
+                 double *out, size_t n) {
+  size_t i;
+#if defined(__x86_64__) || defined(__i386__)
+  if (noise_use_avx2 < 0) {
+    __builtin_cpu_init();
+    noise_use_avx2 = __builtin_cpu_supports("avx2") != 0;
+  }
+  if (noise_use_avx2) {
+    noise_batch_avx2(xs, ys, zs, out, n);
+    return;
+  }
+#endif
+  for (i = 0; i < n; i++)
+    out[i] = noise(xs[i], ys[i], zs[i]);
+}
+
+// One row of a lattice: noise((x0 + i*step) * scale, y, z) for i < nx.
+// Along the row y, z and their fades are fixed, and consecutive samples
+// in the same unit cube share all eight corner hashes; those are looked
+// up once per cube and turned into gradient coefficients, so the inner
+// loop is plain arithmetic the compiler can vectorise.  grad(h, ...) is
+// c0*x + c1*y + c2*z with one coefficient zero, which rounds exactly
+// like grad().
+
+static void grad_coef(int hash, double c[3]) {
+  int h = hash & 15;
+  c[0] = c[1] = c[2] = 0;
+  c[h < 8 ? 0 : 1] = (h & 1) ? -1 : 1;
+  c[h < 4 ? 1 : h == 12 || h == 14 ? 0 : 2] = (h & 2) ? -1 : 1;
+}
+
+static void noise_row(double *out, double x0, double step, double scale,
+                      int nx, double y, double z) {
+  double fy = floor(y), fz = floor(z), gc[8][3], gy[8], gz[8];
+  int Y = (int)fy & 255, Z = (int)fz & 255, i = 0, j, c;
+
+  y -= fy;
+  z -= fz;
+  double v = fade(y), w = fade(z);
+  double cy[2] = { y, y - 1 }, cz[2] = { z, z - 1 };
+
+  while (i < nx) {
+    double fx = floor((x0 + i * step) * scale);
+    int X = (int)fx & 255;
+    int A = p[X  ]+Y, AA = p[A]+Z, AB = p[A+1]+Z,
+        B = p[X+1]+Y, BA = p[B]+Z, BB = p[B+1]+Z;
+    // corner c: bit 0 = x+1, bit 1 = y+1, bit 2 = z+1
+    int h[8] = { p[AA], p[BA], p[AB], p[BB],
+                 p[AA+1], p[BA+1], p[AB+1], p[BB+1] };
+
+    for (c = 0; c < 8; c++) {
+      grad_coef(h[c], gc[c]);
+      gy[c] = gc[c][1] * cy[(c >> 1) & 1];
+      gz[c] = gc[c][2] * cz[c >> 2];
+    }
+    for (j = i + 1; j < nx && floor((x0 + j * step) * scale) == fx; j++)
+      ;
+    for (; i < j; i++) {
+      double x = (x0 + i * step) * scale - fx, x1 = x - 1, u = fade(x);
+      double g[8];
+      for (c = 0; c < 8; c++)
+        g[c] = (gc[c][0] * (c & 1 ? x1 : x) + gy[c]) + gz[c];
+      out[i] = lerp(w, lerp(v, lerp(u, g[0], g[1]), lerp(u, g[2], g[3])),
+                       lerp(v, lerp(u, g[4], g[5]), lerp(u, g[6], g[7])));
+    }
+  }
+}
+
+// Octave stacks.  Octave k samples at frequency lacunarity^k with
+// amplitude gain^k; fBm sums the noise, turbulence its absolute value.
+
+double noise_fbm(double x, double y, double z, int octaves,
+                 double lacunarity, double gain, int turbulence) {
+  double sum = 0, amp = 1, freq = 1, n;
+  int k;
+  for (k = 0; k < octaves; k++) {
+    n = noise(x * freq, y * freq, z * freq);
+    sum += amp * (turbulence ? fabs(n) : n);
+    amp *= gain;
+    freq *= lacunarity;
+  }
+  return sum;
+}
+
+// noise_volume fills out[(k*ny + j)*nx + i] with noise_fbm at
+// (x0 + i*step, y0 + j*step, z0 + k*step), one octave being plain
+// noise().  The volume is cut into z slabs, one per thread.
+
+int noise_nthreads = 1;
+
+struct noise_volume_job {
+  double *out, x0, y0, z0, step, lacunarity, gain;
+  int nx, ny, octaves, turbulence, zlo, zhi;
+};
+
+static void *noise_slab(void *arg) {
+  struct noise_volume_job *jb = arg;
+  double *row = malloc(4 * jb->nx * sizeof(double));
+  double *xs = row + jb->nx, *ys = xs + jb->nx, *zs = ys + jb->nx;
+  int i, j, k, o;
+
+  for (k = jb->zlo; k < jb->zhi; k++)
+    for (j = 0; j < jb->ny; j++) {
+      double *out = jb->out + ((size_t)k * jb->ny + j) * jb->nx;
+      double y = jb->y0 + j * jb->step, z = jb->z0 + k * jb->step;
+      double amp = 1, freq = 1;
+      for (o = 0; o < jb->octaves; o++) {
+        if (jb->step * freq < 0.5) {
+          noise_row(row, jb->x0, jb->step, freq, jb->nx, y * freq, z * freq);
+        } else {
+          // about one sample per cube: nothing to share, use the gathers
+          for (i = 0; i < jb->nx; i++) {
+            xs[i] = (jb->x0 + i * jb->step) * freq;
+            ys[i] = y * freq;
+            zs[i] = z * freq;
+          }
+          noise_batch(xs, ys, zs, row, jb->nx);
+        }
+        for (i = 0; i < jb->nx; i++) {
+          double n = jb->turbulence ? fabs(row[i]) : row[i];
+          out[i] = o ? out[i] + amp * n : 0 + amp * n;
+        }
+        amp *= jb->gain;
+        freq *= jb->lacunarity;
+      }
+    }
+  free(row);
+  return NULL;
+}
+
+void noise_volume(double *out, double x0, double y0, double z0, double step,
+                  int nx, int ny, int nz, int octaves, double lacunarity,
+                  double gain, int turbulence) {
+  struct noise_volume_job jb[64];
+  pthread_t tid[64];
+  int t, nthreads = noise_nthreads;
+
+  if (nthreads > 64)
+    nthreads = 64;
+  if (nthreads > nz)
+    nthreads = nz;
+  if (nthreads < 1)
+    nthreads = 1;
+  for (t = 0; t < nthreads; t++) {
+    jb[t].out = out;
+    jb[t].x0 = x0;
+    jb[t].y0 = y0;
+    jb[t].z0 = z0;
+    jb[t].step = step;
+    jb[t].lacunarity = lacunarity;
+    jb[t].gain = gain;
+    jb[t].nx = nx;
+    jb[t].ny = ny;
+    jb[t].octaves = octaves;
+    jb[t].turbulence = turbulence;
+    jb[t].zlo = (int)((long)nz * t / nthreads);
+    jb[t].zhi = (int)((long)nz * (t + 1) / nthreads);
+    if (t)
+      pthread_create(&tid[t], NULL, noise_slab, &jb[t]);
+  }
+  noise_slab(&jb[0]);
+  for (t = 1; t < nthreads; t++)
+    pthread_join(tid[t], NULL);
+}
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double max_diff(const double *a, const double *b, size_t n) {
+  double m = 0;
+  size_t i;
+  for (i = 0; i < n; i++)
+    if (fabs(a[i] - b[i]) > m)
+      m = fabs(a[i] - b[i]);
+  return m;
+}
+
+// perlin -bench [points [threads]]: samples/sec and max |error| against
+// noise() for noise_batch on scattered points, and for noise_volume
+// (1 and 6 octaves of fBm, 4 of turbulence) on a lattice of about the
+// same size, on one thread and on `threads' threads.
+static int perlin_bench(size_t n, int nthreads) {
+  double *xs = calloc(n, sizeof(double)), *ys = calloc(n, sizeof(double));
+  double *zs = calloc(n, sizeof(double)), *ref = malloc(n * sizeof(double));
+  double *out = malloc(n * sizeof(double)), t0, t1, t2, err, worst = 0;
+  static const struct { const char *name; int octaves, turbulence; } vol[] = {
+    { "noise", 1, 0 }, { "fbm6", 6, 0 }, { "turb4", 4, 1 },
+  };
+  int nx = 256, ny = 64, nz = (int)(n / (nx * ny)), v, i, j, k;
+  const double x0 = -11352.57, y0 = -346.1235, z0 = -156.235, step = .1235;
+  size_t s;
+
+  srand(48);
+  for (s = 0; s < n; s++) {
+    xs[s] = rand() / (double)RAND_MAX * 34914.0 - 11352.57;
+    ys[s] = rand() / (double)RAND_MAX * 470.0 - 346.1235;
+    zs[s] = rand() / (double)RAND_MAX * 180.0 - 156.235;
+  }
+  t0 = now_seconds();
+  for (s = 0; s < n; s++)
+    ref[s] = noise(xs[s], ys[s], zs[s]);
+  t0 = n / (now_seconds() - t0);
+  t1 = now_seconds();
+  noise_batch(xs, ys, zs, out, n);
+  t1 = n / (now_seconds() - t1);
+  err = max_diff(ref, out, n);
+  worst = err > worst ? err : worst;
+  printf("%lu points, %d threads, AVX2 %s\n", (unsigned long)n, nthreads,
+         noise_use_avx2 ? "yes" : "no");
+  printf("%-8s %12s %12s %12s %10s\n", "", "scalar/s", "1 thread/s",
+         "threads/s", "max err");
+  printf("%-8s %12.3e %12.3e %12s %10.1e\n", "batch", t0, t1, "", err);
+
+  if (nz < 1)
+    nz = 1;
+  s = (size_t)nx * ny * nz;
+  if (s > n) {
+    nz = 1;
+    s = (size_t)nx * ny;
+    ref = realloc(ref, s * sizeof(double));
+    out = realloc(out, s * sizeof(double));
+  }
+  for (v = 0; v < 3; v++) {
+    t0 = now_seconds();
+    for (k = 0; k < nz; k++)
+      for (j = 0; j < ny; j++)
+        for (i = 0; i < nx; i++)
+          ref[((size_t)k * ny + j) * nx + i] =
+            noise_fbm(x0 + i * step, y0 + j * step, z0 + k * step,
+                      vol[v].octaves, 2.0, 0.5, vol[v].turbulence);
+    t0 = s / (now_seconds() - t0);
+    noise_nthreads = 1;
+    t1 = now_seconds();
+    noise_volume(out, x0, y0, z0, step, nx, ny, nz, vol[v].octaves, 2.0,
+                 0.5, vol[v].turbulence);
+    t1 = s / (now_seconds() - t1);
+    err = max_diff(ref, out, s);
+    noise_nthreads = nthreads;
+    t2 = now_seconds();
+    noise_volume(out, x0, y0, z0, step, nx, ny, nz, vol[v].octaves, 2.0,
+                 0.5, vol[v].turbulence);
+    t2 = s / (now_seconds() - t2);
+    err = fmax(err, max_diff(ref, out, s));
+    printf("%-8s %12.3e %12.3e %12.3e %10.1e\n", vol[v].name, t0, t1, t2,
+           err);
+    worst = err > worst ? err : worst;
+  }
+  free(xs);
+  free(ys);
+  free(zs);
+  free(ref);
+  free(out);
+  return worst != 0;
+}
+
+int main(int argc, char **argv) {
   init();
+  if (argc > 1 && !strcmp(argv[1], "-bench"))
+    return perlin_bench(argc > 2 ? (size_t)atol(argv[2]) : 1 << 20,
+                        argc > 3 ? atoi(argv[3]) : 2);
   
   double x, y, z, sum = 0.0;
 #ifdef SMALL_PROBLEM_SIZE
@@ -8,6 +8,15 @@
  *  Translated to C from FORTRAN 20 Nov 1993
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MC_X86 1
+#endif
 
 void myadd(float *sum,float *addend) {
 /*
@@ -18,10 +27,323 @@ c   calls/returns to be factored in as part of the benchmark.
 }
 
 
+/*
+ * Monte-Carlo kernel framework.
+ *
+ * Samples are numbered 0..n-1 and grouped in blocks of MC_BLOCK.  Block b
+ * draws from its own stream: random word c of the block is a keyed hash
+ * of the counter c, with keys derived from (seed, b).  Nothing is carried
+ * from one draw to the next, so any block can be evaluated by any thread,
+ * in any order, and scalar and SIMD code can produce lanes independently.
+ *
+ * Each block yields a tally.  Tallies are kept per block and summed in
+ * block order once all threads are done, so a run gives the same answer
+ * for every thread count.
+ */
+#define MC_BLOCK  (1L << 16)
+#define MC_GOLDEN 0x9e3779b9u
+
+struct mc_tally {
+  long hits;                    /* accepted samples */
+  double sum;                   /* sum of the kernel's per-sample value */
+};
+
+struct mc_kernel {
+  const char *name;
+  double scale;                 /* estimate = scale * hits / samples */
+  double exact;                 /* known answer, for error reports */
+  /* evaluate samples 0..n-1 of the stream with keys k0, k1 */
+  void (*block)(unsigned k0, unsigned k1, long n, struct mc_tally *t);
+  void (*block_simd)(unsigned k0, unsigned k1, long n, struct mc_tally *t);
+};
+
+struct mc_result {
+  long samples, hits;
+  double sum, estimate;
+};
+
+int mc_nthreads = 1;
+int mc_use_simd = -1;           /* -1: decide at run time */
+
+static inline unsigned mc_mix(unsigned x)
+{
+  x ^= x >> 16;
+  x *= 0x85ebca6bu;
+  x ^= x >> 13;
+  x *= 0xc2b2ae35u;
+  x ^= x >> 16;
+  return x;
+}
+
+/* random word c of the stream (k0, k1): two keyed rounds of mc_mix */
+static inline unsigned mc_word(unsigned k0, unsigned k1, unsigned c)
+{
+  return mc_mix(mc_mix(c ^ k0) + k1);
+}
+
+/* uniform in [0,1) with 24 bits, exact in a float */
+static inline float mc_unit(unsigned w)
+{
+  return (float)(w >> 8) * (1.0f / 16777216.0f);
+}
+
+static void mc_keys(unsigned long seed, long b, unsigned *k0, unsigned *k1)
+{
+  unsigned s = mc_mix((unsigned)seed ^ mc_mix((unsigned)(seed >> 32) + MC_GOLDEN));
+
+  *k0 = mc_mix(s + (unsigned)b * MC_GOLDEN);
+  *k1 = mc_mix(*k0 ^ (unsigned)(b >> 32) ^ 0x6a09e667u);
+}
+
+/*
+ * The pi kernel: sample i takes x and y from words 2i and 2i+1 and is
+ * accepted when x*x + y*y <= 1.  The sum tracks z = x*x + y*y, as the
+ * serial program does with ztot.
+ */
+static void pi_block(unsigned k0, unsigned k1, long n, struct mc_tally *t)
+{
+  long i, hits = 0;
+  double sum = 0.0;
+
+  for (i = 0; i < n; i++) {
+    float x = mc_unit(mc_word(k0, k1, 2 * (unsigned)i));
+    float y = mc_unit(mc_word(k0, k1, 2 * (unsigned)i + 1));
+    float xx = x * x, yy = y * y;
+    float z = xx + yy;
+
+    sum += z;
+    hits += z <= 1.0f;
+  }
+  t->hits = hits;
+  t->sum = sum;
+}
+
+#ifdef MC_X86
+__attribute__((target("avx2")))
+static inline __m256i mc_mix8(__m256i x)
+{
+  x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+  x = _mm256_mullo_epi32(x, _mm256_set1_epi32((int)0x85ebca6bu));
+  x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 13));
+  x = _mm256_mullo_epi32(x, _mm256_set1_epi32((int)0xc2b2ae35u));
+  x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+  return x;
+}
+
+__attribute__((target("avx2")))
+static inline __m256 mc_unit8(__m256i c, __m256i k0, __m256i k1)
+{
+  __m256i w = mc_mix8(_mm256_add_epi32(mc_mix8(_mm256_xor_si256(c, k0)), k1));
+
+  return _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(w, 8)),
+                       _mm256_set1_ps(1.0f / 16777216.0f));
+}
+
+/*
+ * Eight samples per iteration.  Accept/reject stays in registers: the
+ * compare mask is -1 for accepted lanes and is subtracted from a lane
+ * counter.  z is widened to double so the sum keeps the scalar kernel's
+ * precision; only the order of additions differs.
+ */
+__attribute__((target("avx2")))
+static void pi_block_avx2(unsigned k0, unsigned k1, long n, struct mc_tally *t)
+{
+  const __m256i vk0 = _mm256_set1_epi32((int)k0), vk1 = _mm256_set1_epi32((int)k1);
+  const __m256i step = _mm256_set1_epi32(16);
+  const __m256 one = _mm256_set1_ps(1.0f);
+  __m256i cx = _mm256_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14);
+  __m256i cy = _mm256_add_epi32(cx, _mm256_set1_epi32(1));
+  __m256i acc = _mm256_setzero_si256();
+  __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+  double sum, part[4];
+  int lane[8], k;
+  long i, hits;
+
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m256 x = mc_unit8(cx, vk0, vk1);
+    __m256 y = mc_unit8(cy, vk0, vk1);
+    __m256 z = _mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y));
+
+    acc = _mm256_sub_epi32(acc, _mm256_castps_si256(_mm256_cmp_ps(z, one, _CMP_LE_OQ)));
+    s0 = _mm256_add_pd(s0, _mm256_cvtps_pd(_mm256_castps256_ps128(z)));
+    s1 = _mm256_add_pd(s1, _mm256_cvtps_pd(_mm256_extractf128_ps(z, 1)));
+    cx = _mm256_add_epi32(cx, step);
+    cy = _mm256_add_epi32(cy, step);
+  }
+  _mm256_storeu_si256((__m256i *)lane, acc);
+  _mm256_storeu_pd(part, _mm256_add_pd(s0, s1));
+  for (hits = 0, k = 0; k < 8; k++)
+    hits += lane[k];
+  sum = (part[0] + part[1]) + (part[2] + part[3]);
+  for (; i < n; i++) {
+    float x = mc_unit(mc_word(k0, k1, 2 * (unsigned)i));
+    float y = mc_unit(mc_word(k0, k1, 2 * (unsigned)i + 1));
+    float xx = x * x, yy = y * y;
+    float z = xx + yy;
+
+    sum += z;
+    hits += z <= 1.0f;
+  }
+  t->hits = hits;
+  t->sum = sum;
+}
+#endif
+
+const struct mc_kernel mc_pi = {
+  "pi", 4.0, 3.14159265358979323846, pi_block,
+#ifdef MC_X86
+  pi_block_avx2
+#else
+  NULL
+#endif
+};
+
+struct mc_job {
+  void (*block)(unsigned, unsigned, long, struct mc_tally *);
+  unsigned long seed;
+  long samples, nblocks;
+  struct mc_tally *tally;
+  long next;
+};
+
+static void *mc_worker(void *arg)
+{
+  struct mc_job *job = arg;
+  unsigned k0, k1;
+  long b, n;
+
+  while ((b = __sync_fetch_and_add(&job->next, 1)) < job->nblocks) {
+    n = job->samples - b * MC_BLOCK;
+    if (n > MC_BLOCK)
+      n = MC_BLOCK;
+    mc_keys(job->seed, b, &k0, &k1);
+    job->block(k0, k1, n, &job->tally[b]);
+  }
+  return NULL;
+}
+
+static int mc_simd_ok(const struct mc_kernel *k)
+{
+  if (k->block_simd == NULL)
+    return 0;
+  if (mc_use_simd < 0) {
+#ifdef MC_X86
+    mc_use_simd = __builtin_cpu_supports("avx2") != 0;
+#else
+    mc_use_simd = 0;
+#endif
+  }
+  return mc_use_simd;
+}
+
+/*
+ * Run samples of kernel k with the given seed on mc_nthreads threads.
+ * Returns -1 if the tally buffer cannot be allocated.
+ */
+int mc_run(const struct mc_kernel *k, unsigned long seed, long samples,
+           struct mc_result *r)
+{
+  struct mc_job job;
+  pthread_t tid[64];
+  int t, nthreads = mc_nthreads;
+  long b;
+
+  job.block = mc_simd_ok(k) ? k->block_simd : k->block;
+  job.seed = seed;
+  job.samples = samples;
+  job.nblocks = (samples + MC_BLOCK - 1) / MC_BLOCK;
+  job.next = 0;
+  job.tally = malloc((job.nblocks + 1) * sizeof *job.tally);
+  if (job.tally == NULL)
+    return -1;
+
+  if (nthreads > job.nblocks)
+    nthreads = (int)job.nblocks;
+  if (nthreads > 64)
+    nthreads = 64;
+  for (t = 1; t < nthreads; t++)
+    pthread_create(&tid[t], NULL, mc_worker, &job);
+  mc_worker(&job);
+  for (t = 1; t < nthreads; t++)
+    pthread_join(tid[t], NULL);
+
+  r->samples = samples;
+  r->hits = 0;
+  r->sum = 0.0;
+  for (b = 0; b < job.nblocks; b++) {
+    r->hits += job.tally[b].hits;
+    r->sum += job.tally[b].sum;
+  }
+  r->estimate = samples > 0 ? k->scale * (double)r->hits / (double)samples : 0.0;
+  free(job.tally);
+  return 0;
+}
+
+static double mc_seconds(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Convergence report: the estimate at 4x more samples per row, its error
+ * against the exact value next to the expected standard error, and the
+ * throughput.  Before that, check that scalar and SIMD kernels agree and
+ * that 1 and n threads give identical results.
+ */
+static int mc_bench(const struct mc_kernel *k, long max_samples, int nthreads)
+{
+  struct mc_result a, b;
+  long n, check = max_samples < (1L << 22) ? max_samples : (1L << 22);
+  double p, t0, t, stderr_;
+  int saved = mc_use_simd, bad = 0;
+
+  mc_nthreads = 1;
+  mc_use_simd = 0;
+  mc_run(k, 1907, check, &a);
+  mc_use_simd = saved;
+  if (mc_simd_ok(k)) {
+    mc_run(k, 1907, check, &b);
+    printf("%s: simd vs scalar, %ld samples: hits %s, sum rel diff %.2e\n",
+           k->name, check, a.hits == b.hits ? "equal" : "DIFFER",
+           fabs(a.sum - b.sum) / (fabs(a.sum) + 1e-300));
+    bad |= a.hits != b.hits || fabs(a.sum - b.sum) > 1e-9 * fabs(a.sum);
+  }
+  mc_run(k, 1907, check, &a);
+  mc_nthreads = nthreads;
+  mc_run(k, 1907, check, &b);
+  printf("%s: 1 vs %d threads: %s\n", k->name, nthreads,
+         a.hits == b.hits && a.sum == b.sum ? "identical" : "DIFFER");
+  bad |= a.hits != b.hits || a.sum != b.sum;
+
+  printf("%12s %14s %12s %12s %12s\n", "samples", "estimate", "|error|",
+         "std error", "samples/s");
+  for (n = 1024; n <= max_samples; n *= 4) {
+    t0 = mc_seconds();
+    if (mc_run(k, 1907, n, &a) < 0)
+      return 1;
+    t = mc_seconds() - t0;
+    p = (double)a.hits / (double)n;
+    stderr_ = k->scale * sqrt(p * (1.0 - p) / (double)n);
+    printf("%12ld %14.10f %12.3e %12.3e %12.3e\n", n, a.estimate,
+           fabs(a.estimate - k->exact), stderr_, t > 0 ? n / t : 0.0);
+  }
+  return bad;
+}
+
 int main(int argc, char *argv[]) {
    float ztot, yran, ymult, ymod, x, y, z, pi, prod;
    long int low, ixran, itot, j, iprod;
 
+      /* pi -bench [samples [threads]] */
+      if (argc > 1 && strcmp(argv[1], "-bench") == 0) {
+        long n = argc > 2 ? atol(argv[2]) : 1L << 28;
+        int nthreads = argc > 3 ? atoi(argv[3]) : 4;
+        return mc_bench(&mc_pi, n, nthreads < 1 ? 1 : nthreads);
+      }
+
       printf("Starting PI...\n");
       ztot = 0.0;
       low = 1;
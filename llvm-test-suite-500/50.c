@@ -9,6 +9,12 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BITS_X86 1
+#endif
 
 #define NUM 0x1000000
 
@@ -34,11 +40,565 @@ unsigned long long __attribute__((noinline)) ReverseBits64(unsigned long long n)
          ((n & 0x00000000FF000000ull) << 8);
 }
 
-int main (void) {
+/*
+ * Array-at-a-time bit kernels.
+ *
+ *   bits_reverse32/64   dst[i] = bit reverse of src[i]
+ *   bits_popcount       total number of set bits in src[0..n)
+ *   bits_parity64       dst[i] = parity of src[i], as 0 or 1
+ *   bits_pdep64/pext64  deposit/extract under one mask for all of src
+ *
+ * Each kernel has a scalar, an SSSE3 and an AVX2 version.  The vector
+ * versions work a byte at a time through 16-entry nibble tables looked up
+ * with pshufb.  pdep/pext split the mask into runs of contiguous ones once
+ * per call, so each element costs a shift, an and and an or per run.
+ * bits_set_isa picks the level; by default it is the best one the CPU
+ * supports.  dst and src may be the same array but must not otherwise
+ * overlap.
+ */
+enum { BITS_SCALAR, BITS_SSSE3, BITS_AVX2, BITS_NLEVELS };
+
+static const char *const bits_isa_name[BITS_NLEVELS] = { "scalar", "ssse3", "avx2" };
+
+/* runs of ones in a pdep/pext mask: src bit lo[r] goes to packed bit pos[r] */
+struct bits_runs {
+  int n;
+  unsigned char lo[32], pos[32];
+  unsigned long long len_mask[32];
+};
+
+struct bits_impl {
+  void (*reverse32)(unsigned *dst, const unsigned *src, size_t n);
+  void (*reverse64)(unsigned long long *dst, const unsigned long long *src, size_t n);
+  unsigned long long (*popcount)(const unsigned long long *src, size_t n);
+  void (*parity64)(unsigned char *dst, const unsigned long long *src, size_t n);
+  void (*pdep64)(unsigned long long *dst, const unsigned long long *src, size_t n,
+                 const struct bits_runs *r);
+  void (*pext64)(unsigned long long *dst, const unsigned long long *src, size_t n,
+                 const struct bits_runs *r);
+};
+
+static void bits_make_runs(unsigned long long mask, struct bits_runs *r) {
+  int pos = 0;
+
+  r->n = 0;
+  while (mask) {
+    int lo = __builtin_ctzll(mask);
+    unsigned long long from_lo = mask >> lo;
+    int len = ~from_lo ? __builtin_ctzll(~from_lo) : 64 - lo;
+
+    r->lo[r->n] = lo;
+    r->pos[r->n] = pos;
+    r->len_mask[r->n] = len == 64 ? ~0ull : (1ull << len) - 1;
+    r->n++;
+    pos += len;
+    mask = len + lo == 64 ? 0 : mask & ~0ull << (lo + len);
+  }
+}
+
+static inline unsigned bits_rev32(unsigned n) {
+  n = ((n >> 1) & 0x55555555u) | ((n & 0x55555555u) << 1);
+  n = ((n >> 2) & 0x33333333u) | ((n & 0x33333333u) << 2);
+  n = ((n >> 4) & 0x0F0F0F0Fu) | ((n & 0x0F0F0F0Fu) << 4);
+  return __builtin_bswap32(n);
+}
+
+static inline unsigned long long bits_rev64(unsigned long long n) {
+  n = ((n >> 1) & 0x5555555555555555ull) | ((n & 0x5555555555555555ull) << 1);
+  n = ((n >> 2) & 0x3333333333333333ull) | ((n & 0x3333333333333333ull) << 2);
+  n = ((n >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((n & 0x0F0F0F0F0F0F0F0Full) << 4);
+  return __builtin_bswap64(n);
+}
+
+static inline unsigned long long bits_pdep_runs(unsigned long long x,
+                                                const struct bits_runs *r) {
+  unsigned long long v = 0;
+  for (int k = 0; k < r->n; ++k)
+    v |= ((x >> r->pos[k]) & r->len_mask[k]) << r->lo[k];
+  return v;
+}
+
+static inline unsigned long long bits_pext_runs(unsigned long long x,
+                                                const struct bits_runs *r) {
+  unsigned long long v = 0;
+  for (int k = 0; k < r->n; ++k)
+    v |= ((x >> r->lo[k]) & r->len_mask[k]) << r->pos[k];
+  return v;
+}
+
+static void reverse32_scalar(unsigned *dst, const unsigned *src, size_t n) {
+  for (size_t i = 0; i < n; ++i)
+    dst[i] = bits_rev32(src[i]);
+}
+
+static void reverse64_scalar(unsigned long long *dst, const unsigned long long *src,
+                             size_t n) {
+  for (size_t i = 0; i < n; ++i)
+    dst[i] = bits_rev64(src[i]);
+}
+
+static unsigned long long popcount_scalar(const unsigned long long *src, size_t n) {
+  unsigned long long c = 0;
+  for (size_t i = 0; i < n; ++i)
+    c += __builtin_popcountll(src[i]);
+  return c;
+}
+
+static void parity64_scalar(unsigned char *dst, const unsigned long long *src,
+                            size_t n) {
+  for (size_t i = 0; i < n; ++i)
+    dst[i] = __builtin_parityll(src[i]);
+}
+
+static void pdep64_scalar(unsigned long long *dst, const unsigned long long *src,
+                          size_t n, const struct bits_runs *r) {
+  for (size_t i = 0; i < n; ++i)
+    dst[i] = bits_pdep_runs(src[i], r);
+}
+
+static void pext64_scalar(unsigned long long *dst, const unsigned long long *src,
+                          size_t n, const struct bits_runs *r) {
+  for (size_t i = 0; i < n; ++i)
+    dst[i] = bits_pext_runs(src[i], r);
+}
+
+#ifdef BITS_X86
+// Nibble tables: bit reverse moved to the high nibble, bit reverse, popcount
+// and parity of the index.
+#define BITS_REV_HI 0x00, 0x80, 0x40, 0xc0, 0x20, 0xa0, 0x60, 0xe0, \
+                    0x10, 0x90, 0x50, 0xd0, 0x30, 0xb0, 0x70, 0xf0
+#define BITS_REV_LO 0x0, 0x8, 0x4, 0xc, 0x2, 0xa, 0x6, 0xe, \
+                    0x1, 0x9, 0x5, 0xd, 0x3, 0xb, 0x7, 0xf
+#define BITS_POP    0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4
+#define BITS_PAR    0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0
+// Byte order reversal within 32- and 64-bit elements.
+#define BITS_BSWAP32 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12
+#define BITS_BSWAP64 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8
+
+__attribute__((target("ssse3")))
+static inline __m128i rev_bytes_ssse3(__m128i x) {
+  const __m128i hi = _mm_setr_epi8(BITS_REV_HI), lo = _mm_setr_epi8(BITS_REV_LO);
+  const __m128i m = _mm_set1_epi8(0x0f);
+  return _mm_or_si128(_mm_shuffle_epi8(hi, _mm_and_si128(x, m)),
+                      _mm_shuffle_epi8(lo, _mm_and_si128(_mm_srli_epi16(x, 4), m)));
+}
+
+__attribute__((target("ssse3")))
+static void reverse32_ssse3(unsigned *dst, const unsigned *src, size_t n) {
+  const __m128i bswap = _mm_setr_epi8(BITS_BSWAP32);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi8(rev_bytes_ssse3(x), bswap));
+  }
+  reverse32_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("ssse3")))
+static void reverse64_ssse3(unsigned long long *dst, const unsigned long long *src,
+                            size_t n) {
+  const __m128i bswap = _mm_setr_epi8(BITS_BSWAP64);
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi8(rev_bytes_ssse3(x), bswap));
+  }
+  reverse64_scalar(dst + i, src + i, n - i);
+}
+
+// Per-byte counts are summed for up to 31 vectors (at most 8 per byte each,
+// so no byte overflows) before psadbw widens them to 64 bits.
+__attribute__((target("ssse3")))
+static unsigned long long popcount_ssse3(const unsigned long long *src, size_t n) {
+  const __m128i pop = _mm_setr_epi8(BITS_POP), m = _mm_set1_epi8(0x0f);
+  __m128i total = _mm_setzero_si128();
+  size_t i = 0;
+  while (i + 2 <= n) {
+    __m128i bytes = _mm_setzero_si128();
+    for (int k = 0; k < 31 && i + 2 <= n; ++k, i += 2) {
+      __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+      bytes = _mm_add_epi8(bytes, _mm_shuffle_epi8(pop, _mm_and_si128(x, m)));
+      bytes = _mm_add_epi8(bytes, _mm_shuffle_epi8(pop, _mm_and_si128(_mm_srli_epi16(x, 4), m)));
+    }
+    total = _mm_add_epi64(total, _mm_sad_epu8(bytes, _mm_setzero_si128()));
+  }
+  unsigned long long t[2];
+  _mm_storeu_si128((__m128i *)t, total);
+  return t[0] + t[1] + popcount_scalar(src + i, n - i);
+}
+
+// Fold each element down to one nibble, look its parity up, then pack the
+// low bytes of eight elements into eight output bytes.
+__attribute__((target("ssse3")))
+static inline __m128i parity_lanes_ssse3(__m128i x) {
+  const __m128i par = _mm_setr_epi8(BITS_PAR);
+  x = _mm_xor_si128(x, _mm_srli_epi64(x, 32));
+  x = _mm_xor_si128(x, _mm_srli_epi64(x, 16));
+  x = _mm_xor_si128(x, _mm_srli_epi64(x, 8));
+  x = _mm_xor_si128(x, _mm_srli_epi64(x, 4));
+  x = _mm_shuffle_epi8(par, _mm_and_si128(x, _mm_set1_epi8(0x0f)));
+  return _mm_and_si128(x, _mm_set_epi64x(0xff, 0xff));
+}
+
+__attribute__((target("ssse3")))
+static void parity64_ssse3(unsigned char *dst, const unsigned long long *src,
+                           size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m128i *p = (const __m128i *)(src + i);
+    __m128i a = _mm_packs_epi32(parity_lanes_ssse3(_mm_loadu_si128(p)),
+                                parity_lanes_ssse3(_mm_loadu_si128(p + 1)));
+    __m128i b = _mm_packs_epi32(parity_lanes_ssse3(_mm_loadu_si128(p + 2)),
+                                parity_lanes_ssse3(_mm_loadu_si128(p + 3)));
+    __m128i c = _mm_packs_epi32(a, b);
+    _mm_storel_epi64((__m128i *)(dst + i), _mm_packus_epi16(c, c));
+  }
+  parity64_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("ssse3")))
+static void pdep64_ssse3(unsigned long long *dst, const unsigned long long *src,
+                         size_t n, const struct bits_runs *r) {
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(src + i)), v = _mm_setzero_si128();
+    for (int k = 0; k < r->n; ++k) {
+      __m128i f = _mm_srl_epi64(x, _mm_cvtsi32_si128(r->pos[k]));
+      f = _mm_and_si128(f, _mm_set1_epi64x(r->len_mask[k]));
+      v = _mm_or_si128(v, _mm_sll_epi64(f, _mm_cvtsi32_si128(r->lo[k])));
+    }
+    _mm_storeu_si128((__m128i *)(dst + i), v);
+  }
+  pdep64_scalar(dst + i, src + i, n - i, r);
+}
+
+__attribute__((target("ssse3")))
+static void pext64_ssse3(unsigned long long *dst, const unsigned long long *src,
+                         size_t n, const struct bits_runs *r) {
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(src + i)), v = _mm_setzero_si128();
+    for (int k = 0; k < r->n; ++k) {
+      __m128i f = _mm_srl_epi64(x, _mm_cvtsi32_si128(r->lo[k]));
+      f = _mm_and_si128(f, _mm_set1_epi64x(r->len_mask[k]));
+      v = _mm_or_si128(v, _mm_sll_epi64(f, _mm_cvtsi32_si128(r->pos[k])));
+    }
+    _mm_storeu_si128((__m128i *)(dst + i), v);
+  }
+  pext64_scalar(dst + i, src + i, n - i, r);
+}
+
+// The AVX2 versions are the same byte-wise algorithms on 256-bit registers.
+// pshufb works within each 128-bit half, which suits per-element shuffles.
+__attribute__((target("avx2")))
+static inline __m256i rev_bytes_avx2(__m256i x) {
+  const __m256i hi = _mm256_setr_epi8(BITS_REV_HI, BITS_REV_HI);
+  const __m256i lo = _mm256_setr_epi8(BITS_REV_LO, BITS_REV_LO);
+  const __m256i m = _mm256_set1_epi8(0x0f);
+  return _mm256_or_si256(_mm256_shuffle_epi8(hi, _mm256_and_si256(x, m)),
+                         _mm256_shuffle_epi8(lo, _mm256_and_si256(_mm256_srli_epi16(x, 4), m)));
+}
+
+__attribute__((target("avx2")))
+static void reverse32_avx2(unsigned *dst, const unsigned *src, size_t n) {
+  const __m256i bswap = _mm256_setr_epi8(BITS_BSWAP32, BITS_BSWAP32);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(src + i));
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_shuffle_epi8(rev_bytes_avx2(x), bswap));
+  }
+  reverse32_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void reverse64_avx2(unsigned long long *dst, const unsigned long long *src,
+                           size_t n) {
+  const __m256i bswap = _mm256_setr_epi8(BITS_BSWAP64, BITS_BSWAP64);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(src + i));
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_shuffle_epi8(rev_bytes_avx2(x), bswap));
+  }
+  reverse64_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static unsigned long long popcount_avx2(const unsigned long long *src, size_t n) {
+  const __m256i pop = _mm256_setr_epi8(BITS_POP, BITS_POP), m = _mm256_set1_epi8(0x0f);
+  __m256i total = _mm256_setzero_si256();
+  size_t i = 0;
+  while (i + 4 <= n) {
+    __m256i bytes = _mm256_setzero_si256();
+    for (int k = 0; k < 31 && i + 4 <= n; ++k, i += 4) {
+      __m256i x = _mm256_loadu_si256((const __m256i *)(src + i));
+      bytes = _mm256_add_epi8(bytes, _mm256_shuffle_epi8(pop, _mm256_and_si256(x, m)));
+      bytes = _mm256_add_epi8(bytes, _mm256_shuffle_epi8(pop, _mm256_and_si256(_mm256_srli_epi16(x, 4), m)));
+    }
+    total = _mm256_add_epi64(total, _mm256_sad_epu8(bytes, _mm256_setzero_si256()));
+  }
+  unsigned long long t[4];
+  _mm256_storeu_si256((__m256i *)t, total);
+  return t[0] + t[1] + t[2] + t[3] + popcount_scalar(src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i parity_lanes_avx2(__m256i x) {
+  const __m256i par = _mm256_setr_epi8(BITS_PAR, BITS_PAR);
+  x = _mm256_xor_si256(x, _mm256_srli_epi64(x, 32));
+  x = _mm256_xor_si256(x, _mm256_srli_epi64(x, 16));
+  x = _mm256_xor_si256(x, _mm256_srli_epi64(x, 8));
+  x = _mm256_xor_si256(x, _mm256_srli_epi64(x, 4));
+  x = _mm256_shuffle_epi8(par, _mm256_and_si256(x, _mm256_set1_epi8(0x0f)));
+  return _mm256_and_si256(x, _mm256_set1_epi64x(0xff));
+}
+
+// The packs work within 128-bit halves, leaving element order
+// 0 1 4 5 8 9 12 13 | 2 3 6 7 10 11 14 15; a final pshufb restores it.
+__attribute__((target("avx2")))
+static void parity64_avx2(unsigned char *dst, const unsigned long long *src,
+                          size_t n) {
+  const __m128i order = _mm_setr_epi8(0, 1, 8, 9, 2, 3, 10, 11, 4, 5, 12, 13, 6, 7, 14, 15);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    const __m256i *p = (const __m256i *)(src + i);
+    __m256i a = _mm256_packs_epi32(parity_lanes_avx2(_mm256_loadu_si256(p)),
+                                   parity_lanes_avx2(_mm256_loadu_si256(p + 1)));
+    __m256i b = _mm256_packs_epi32(parity_lanes_avx2(_mm256_loadu_si256(p + 2)),
+                                   parity_lanes_avx2(_mm256_loadu_si256(p + 3)));
+    __m256i c = _mm256_packs_epi32(a, b);
+    c = _mm256_permute4x64_epi64(_mm256_packus_epi16(c, c), 0x08);
+    _mm_storeu_si128((__m128i *)(dst + i),
+                     _mm_shuffle_epi8(_mm256_castsi256_si128(c), order));
+  }
+  parity64_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void pdep64_avx2(unsigned long long *dst, const unsigned long long *src,
+                        size_t n, const struct bits_runs *r) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(src + i)), v = _mm256_setzero_si256();
+    for (int k = 0; k < r->n; ++k) {
+      __m256i f = _mm256_srl_epi64(x, _mm_cvtsi32_si128(r->pos[k]));
+      f = _mm256_and_si256(f, _mm256_set1_epi64x(r->len_mask[k]));
+      v = _mm256_or_si256(v, _mm256_sll_epi64(f, _mm_cvtsi32_si128(r->lo[k])));
+    }
+    _mm256_storeu_si256((__m256i *)(dst + i), v);
+  }
+  pdep64_scalar(dst + i, src + i, n - i, r);
+}
+
+__attribute__((target("avx2")))
+static void pext64_avx2(unsigned long long *dst, const unsigned long long *src,
+                        size_t n, const struct bits_runs *r) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(src + i)), v = _mm256_setzero_si256();
+    for (int k = 0; k < r->n; ++k) {
+      __m256i f = _mm256_srl_epi64(x, _mm_cvtsi32_si128(r->lo[k]));
+      f = _mm256_and_si256(f, _mm256_set1_epi64x(r->len_mask[k]));
+      v = _mm256_or_si256(v, _mm256_sll_epi64(f, _mm_cvtsi32_si128(r->pos[k])));
+    }
+    _mm256_storeu_si256((__m256i *)(dst + i), v);
+  }
+  pext64_scalar(dst + i, src + i, n - i, r);
+}
+#endif
+
+static const struct bits_impl bits_impls[BITS_NLEVELS] = {
+  { reverse32_scalar, reverse64_scalar, popcount_scalar, parity64_scalar,
+    pdep64_scalar, pext64_scalar },
+#ifdef BITS_X86
+  { reverse32_ssse3, reverse64_ssse3, popcount_ssse3, parity64_ssse3,
+    pdep64_ssse3, pext64_ssse3 },
+  { reverse32_avx2, reverse64_avx2, popcount_avx2, parity64_avx2,
+    pdep64_avx2, pext64_avx2 },
+#endif
+};
+
+static int bits_level = -1;
+
+// Highest level this CPU (and build) supports.
+int bits_max_isa(void) {
+#ifdef BITS_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return BITS_AVX2;
+  if (__builtin_cpu_supports("ssse3"))
+    return BITS_SSSE3;
+#endif
+  return BITS_SCALAR;
+}
+
+// Select a level; requests above what the CPU supports are lowered.
+// Returns the level in effect.
+int bits_set_isa(int level) {
+  int max = bits_max_isa();
+  bits_level = level < BITS_SCALAR ? BITS_SCALAR : level > max ? max : level;
+  return bits_level;
+}
+
+static const struct bits_impl *bits_impl(void) {
+  if (bits_level < 0)
+    bits_set_isa(BITS_NLEVELS - 1);
+  return &bits_impls[bits_level];
+}
+
+void bits_reverse32(unsigned *dst, const unsigned *src, size_t n) {
+  bits_impl()->reverse32(dst, src, n);
+}
+
+void bits_reverse64(unsigned long long *dst, const unsigned long long *src, size_t n) {
+  bits_impl()->reverse64(dst, src, n);
+}
+
+unsigned long long bits_popcount(const unsigned long long *src, size_t n) {
+  return bits_impl()->popcount(src, n);
+}
+
+void bits_parity64(unsigned char *dst, const unsigned long long *src, size_t n) {
+  bits_impl()->parity64(dst, src, n);
+}
+
+void bits_pdep64(unsigned long long *dst, const unsigned long long *src, size_t n,
+                 unsigned long long mask) {
+  struct bits_runs r;
+  bits_make_runs(mask, &r);
+  bits_impl()->pdep64(dst, src, n, &r);
+}
+
+void bits_pext64(unsigned long long *dst, const unsigned long long *src, size_t n,
+                 unsigned long long mask) {
+  struct bits_runs r;
+  bits_make_runs(mask, &r);
+  bits_impl()->pext64(dst, src, n, &r);
+}
+
+// Bit-at-a-time references for the cross-check.
+static unsigned long long ref_pdep(unsigned long long x, unsigned long long mask) {
+  unsigned long long v = 0;
+  for (unsigned long long b = 1; mask; b <<= 1, mask &= mask - 1)
+    if (x & b)
+      v |= mask & -mask;
+  return v;
+}
+
+static unsigned long long ref_pext(unsigned long long x, unsigned long long mask) {
+  unsigned long long v = 0;
+  for (unsigned long long b = 1; mask; b <<= 1, mask &= mask - 1)
+    if (x & mask & -mask)
+      v |= b;
+  return v;
+}
+
+static double bits_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+enum { K_REV32, K_REV64, K_POPCOUNT, K_PARITY, K_PDEP, K_PEXT, K_NKERNELS };
+
+static const char *const bits_kernel_name[K_NKERNELS] = {
+  "reverse32", "reverse64", "popcount", "parity64", "pdep64", "pext64"
+};
+
+static unsigned long long bits_run_kernel(int k, void *dst, const void *src, size_t n,
+                                          unsigned long long mask) {
+  switch (k) {
+  case K_REV32:    bits_reverse32(dst, src, n); break;
+  case K_REV64:    bits_reverse64(dst, src, n); break;
+  case K_POPCOUNT: return bits_popcount(src, n);
+  case K_PARITY:   bits_parity64(dst, src, n); break;
+  case K_PDEP:     bits_pdep64(dst, src, n, mask); break;
+  case K_PEXT:     bits_pext64(dst, src, n, mask); break;
+  }
+  return 0;
+}
+
+// Returns the number of elements of dst (or the popcount total) that
+// disagree with the per-element reference.
+static size_t bits_check(int k, const void *dst, const void *src, size_t n,
+                         unsigned long long mask, unsigned long long count) {
+  const unsigned *s32 = src, *d32 = dst;
+  const unsigned long long *s64 = src, *d64 = dst;
+  const unsigned char *d8 = dst;
+  unsigned long long total = 0;
+  size_t bad = 0;
+
+  for (size_t i = 0; i < n; ++i) {
+    switch (k) {
+    case K_REV32:    bad += d32[i] != ReverseBits32(s32[i]); break;
+    case K_REV64:    bad += d64[i] != ReverseBits64(s64[i]); break;
+    case K_POPCOUNT: total += __builtin_popcountll(s64[i]); break;
+    case K_PARITY:   bad += d8[i] != (unsigned char)__builtin_parityll(s64[i]); break;
+    case K_PDEP:     bad += d64[i] != ref_pdep(s64[i], mask); break;
+    case K_PEXT:     bad += d64[i] != ref_pext(s64[i], mask); break;
+    }
+  }
+  return k == K_POPCOUNT ? total != count : bad;
+}
+
+/*
+ * Elements/sec for every kernel at every level the CPU supports, each
+ * result checked against the per-element reference.  The pdep/pext rows
+ * use a mask with 8 runs of ones.
+ */
+static int bits_bench(size_t n, int reps) {
+  const unsigned long long mask = 0x00ff0f0f00ff3c3cull;
+  unsigned long long *src = malloc(n * sizeof *src), *dst = malloc(n * sizeof *dst);
+  unsigned long long x = 0x0123456789abcdefull, count = 0;
+  int max = bits_max_isa(), fails = 0;
+
+  if (src == NULL || dst == NULL)
+    return 1;
+  for (size_t i = 0; i < n; ++i) {
+    x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+    src[i] = x;
+  }
+
+  printf("%zu elements, %d reps, mask 0x%016llx\n", n, reps, mask);
+  printf("%-10s", "kernel");
+  for (int l = 0; l <= max; ++l)
+    printf(" %14s", bits_isa_name[l]);
+  printf("   (elements/s)\n");
+  for (int k = 0; k < K_NKERNELS; ++k) {
+    // reverse32 treats the buffer as 2n 32-bit elements.
+    size_t elems = k == K_REV32 ? 2 * n : n;
+    printf("%-10s", bits_kernel_name[k]);
+    for (int l = 0; l <= max; ++l) {
+      bits_set_isa(l);
+      memset(dst, 0, n * sizeof *dst);
+      double t = bits_seconds();
+      for (int r = 0; r < reps; ++r)
+        count = bits_run_kernel(k, dst, src, elems, mask);
+      t = bits_seconds() - t;
+      size_t bad = bits_check(k, dst, src, elems, mask, count);
+      fails += bad != 0;
+      printf(" %14.3e%s", t > 0 ? (double)elems * reps / t : 0.0, bad ? "!" : "");
+    }
+    printf("\n");
+  }
+  bits_set_isa(max);
+  printf("%s\n", fails ? "MISMATCH" : "all levels match the reference");
+  free(src);
+  free(dst);
+  return fails != 0;
+}
+
+int main (int argc, char **argv) {
   unsigned long long sum32 = 0, sum64 = 0;
   unsigned int rev32 = strtoll("0x12345678", NULL, 16);
   unsigned long long rev64 = strtoll("0x0123456789012345", NULL, 16);
 
+  // 50 -bench [elements [reps]]
+  if (argc > 1 && strcmp(argv[1], "-bench") == 0) {
+    size_t n = argc > 2 ? strtoul(argv[2], NULL, 0) : NUM;
+    int reps = argc > 3 ? atoi(argv[3]) : 10;
+    return bits_bench(n, reps < 1 ? 1 : reps);
+  }
+
 // Check for compilers that don't support __has_builtin
 #ifndef __has_builtin
 #define __has_builtin(x) 0
@@ -20,6 +20,9 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
 
 #ifdef SMALL_PROBLEM_SIZE
 #define                Count           1000*1000
@@ -254,6 +257,7 @@ struct task *qpkt(struct packet *pkt)
 
 struct task *idlefn(struct packet *pkt)
 {
+    (void)pkt;
     --v2;
     if ( v2==0 ) return ( holdself() );
 
@@ -347,14 +351,504 @@ void append(struct packet *pkt, struct packet *ptr)
     ptr->p_link = pkt;
 }
 
-int main()
+/*
+**  Scheduler engine.
+**
+**  The same Richards workload on a scheduler core whose state lives in
+**  one struct, so that independent instances can run side by side.
+**
+**  -  Every task owns one bit of a ready word, in priority order; the
+**     next task to run is the highest set bit, found with one count of
+**     leading zeros instead of a walk down the task list.  The classic
+**     schedule() only ever continues from a task that is the highest
+**     runnable one, so both pick the same task at every step and the
+**     qpkt and hold counts are unchanged.
+**  -  Packet queues keep a tail pointer, so appending is O(1).
+**  -  Packets come from a fixed pool inside the instance; running the
+**     benchmark does no allocation.
+*/
+
+#define                SCHED_MAXTASKS  16
+#define                SCHED_MAXPKTS   16
+
+struct spacket
 {
-    struct packet *wkq = 0;
-    int retval;
+    struct spacket *link;
+    int             id;
+    int             kind;
+    int             a1;
+    char            a2[BUFSIZE+1];
+};
 
-    printf("Bench mark starting\n");
+struct squeue
+{
+    struct spacket *head;
+    struct spacket *tail;
+};
+
+struct sched;
+
+struct stask
+{
+    int             id;
+    int             pri;
+    int             state;
+    unsigned long long bit;     /* this task's bit in sched.ready */
+    struct squeue   wkq;
+    struct stask *(*fn)(struct sched *, struct stask *, struct spacket *);
+    long            v1;
+    long            v2;
+    struct squeue   q1;         /* task-private packet queues */
+    struct squeue   q2;
+};
+
+struct sched
+{
+    unsigned long long ready;   /* bit per runnable task */
+    struct stask   *byslot[SCHED_MAXTASKS];
+    struct stask    task[SCHED_MAXTASKS + 1];   /* indexed by task id */
+    int             ntasks;
+    struct spacket  pool[SCHED_MAXPKTS];
+    struct spacket *freepkts;
+    long            qpktcount;
+    long            holdcount;
+    long            switches;   /* task function invocations */
+};
+
+static void sq_push(struct squeue *q, struct spacket *p)
+{
+    p->link = 0;
+    if (q->head == 0) q->head = p;
+    else q->tail->link = p;
+    q->tail = p;
+}
+
+static struct spacket *sq_pop(struct squeue *q)
+{
+    struct spacket *p = q->head;
+
+    if (p != 0) q->head = p->link;
+    return (p);
+}
+
+/* S_RUN, S_RUNPKT and S_WAITPKT are runnable */
+static void sched_setstate(struct sched *s, struct stask *t, int state)
+{
+    t->state = state;
+    if ((0x0b >> state) & 1) s->ready |= t->bit;
+    else s->ready &= ~t->bit;
+}
+
+void sched_init(struct sched *s)
+{
+    int i;
+
+    memset(s, 0, sizeof(*s));
+    for (i = SCHED_MAXPKTS - 1; i >= 0; i--)
+    {
+        s->pool[i].link = s->freepkts;
+        s->freepkts = &s->pool[i];
+    }
+}
+
+struct spacket *sched_pkt(struct sched *s, struct spacket *link, int id, int kind)
+{
+    struct spacket *p = s->freepkts;
+
+    if (p == 0) return (0);
+    s->freepkts = p->link;
+    memset(p->a2, 0, sizeof(p->a2));
+    p->link = link;
+    p->id = id;
+    p->kind = kind;
+    p->a1 = 0;
+    return (p);
+}
+
+/* wkq is a chain of packets linked through p->link, as pkt() builds them */
+void sched_task(struct sched *s, int id, int pri, struct spacket *wkq, int state,
+                struct stask *(*fn)(struct sched *, struct stask *, struct spacket *),
+                long v1, long v2)
+{
+    struct stask *t = &s->task[id];
+
+    t->id = id;
+    t->pri = pri;
+    t->state = state;
+    t->fn = fn;
+    t->v1 = v1;
+    t->v2 = v2;
+    t->wkq.head = wkq;
+    while (wkq != 0 && wkq->link != 0) wkq = wkq->link;
+    t->wkq.tail = wkq;
+    s->ntasks++;
+}
+
+/*
+**  Give each task a bit, lowest priority in bit 0.  Priorities must be
+**  distinct, as they are in Richards.
+*/
+void sched_start(struct sched *s)
+{
+    int i, j, n = 0;
+    struct stask *t;
+
+    for (i = 1; i <= SCHED_MAXTASKS; i++)
+    {
+        if (s->task[i].fn == 0) continue;
+        t = &s->task[i];
+        for (j = n; j > 0 && s->byslot[j-1]->pri > t->pri; j--)
+            s->byslot[j] = s->byslot[j-1];
+        s->byslot[j] = t;
+        n++;
+    }
+    s->ready = 0;
+    for (i = 0; i < n; i++)
+    {
+        s->byslot[i]->bit = 1ull << i;
+        sched_setstate(s, s->byslot[i], s->byslot[i]->state);
+    }
+}
+
+/* highest-priority runnable task, or 0 */
+static struct stask *sched_next(struct sched *s)
+{
+    if (s->ready == 0) return (0);
+    return (s->byslot[63 - __builtin_clzll(s->ready)]);
+}
+
+/*
+**  Task functions return the task to run next, as in the classic
+**  scheduler: themselves, a higher-priority task they just touched, or
+**  sched_next() after blocking.  A returned task that is not runnable
+**  is passed over for sched_next(), where the classic scheduler would
+**  walk down the list to the same task.
+*/
+void sched_run(struct sched *s)
+{
+    struct stask *t = sched_next(s);
+    long switches = 0;
+
+    while (t != 0)
+    {
+        struct spacket *pkt = 0;
+
+        if ((s->ready & t->bit) == 0)
+        {
+            t = sched_next(s);
+            continue;
+        }
+
+        if (t->state == S_WAITPKT)
+        {
+            pkt = sq_pop(&t->wkq);
+            t->state = t->wkq.head == 0 ? S_RUN : S_RUNPKT;
+        }
+        switches++;
+        t = (*t->fn)(s, t, pkt);
+    }
+    s->switches += switches;
+}
+
+static struct stask *s_wait(struct sched *s, struct stask *self)
+{
+    sched_setstate(s, self, self->state | WAITBIT);
+    return (sched_next(s));
+}
 
-    createtask(I_IDLE, 0, wkq, S_RUN, idlefn, 1, Count);
+static struct stask *s_holdself(struct sched *s, struct stask *self)
+{
+    ++s->holdcount;
+    sched_setstate(s, self, self->state | HOLDBIT);
+    return (sched_next(s));
+}
+
+/* release and qpkt switch to the other task only if it outranks self */
+static struct stask *s_release(struct sched *s, struct stask *self, int id)
+{
+    struct stask *t = &s->task[id];
+
+    sched_setstate(s, t, t->state & NOTHOLDBIT);
+    return (t->pri > self->pri ? t : self);
+}
+
+static struct stask *s_qpkt(struct sched *s, struct stask *self, struct spacket *pkt)
+{
+    struct stask *t = &s->task[pkt->id];
+
+    s->qpktcount++;
+    pkt->id = self->id;
+    if (t->wkq.head == 0)
+    {
+        sq_push(&t->wkq, pkt);
+        sched_setstate(s, t, t->state | PKTBIT);
+        if (t->pri > self->pri) return (t);
+    }
+    else
+        sq_push(&t->wkq, pkt);
+    return (self);
+}
+
+static struct stask *s_idlefn(struct sched *s, struct stask *t, struct spacket *pkt)
+{
+    (void)pkt;
+    --t->v2;
+    if (t->v2 == 0) return (s_holdself(s, t));
+
+    if ((t->v1&1) == 0)
+    {
+        t->v1 = (t->v1>>1) & MAXINT;
+        return (s_release(s, t, I_DEVA));
+    }
+    else
+    {
+        t->v1 = ((t->v1>>1) & MAXINT) ^ 0XD008;
+        return (s_release(s, t, I_DEVB));
+    }
+}
+
+static struct stask *s_workfn(struct sched *s, struct stask *t, struct spacket *pkt)
+{
+    int i;
+
+    if (pkt == 0) return (s_wait(s, t));
+
+    t->v1 = I_HANDLERA + I_HANDLERB - t->v1;
+    pkt->id = t->v1;
+    pkt->a1 = 0;
+    for (i=0; i<=BUFSIZE; i++)
+    {
+        t->v2++;
+        if (t->v2 > 26) t->v2 = 1;
+        pkt->a2[i] = alphabet[t->v2];
+    }
+    return (s_qpkt(s, t, pkt));
+}
+
+/* q1 holds work packets, q2 device packets */
+static struct stask *s_handlerfn(struct sched *s, struct stask *t, struct spacket *pkt)
+{
+    if (pkt != 0) sq_push(pkt->kind == K_WORK ? &t->q1 : &t->q2, pkt);
+
+    if (t->q1.head != 0)
+    {
+        struct spacket *workpkt = t->q1.head;
+        int count = workpkt->a1;
+
+        if (count > BUFSIZE)
+        {
+            return (s_qpkt(s, t, sq_pop(&t->q1)));
+        }
+        if (t->q2.head != 0)
+        {
+            struct spacket *devpkt = sq_pop(&t->q2);
+
+            devpkt->a1 = workpkt->a2[count];
+            workpkt->a1 = count+1;
+            return (s_qpkt(s, t, devpkt));
+        }
+    }
+    return (s_wait(s, t));
+}
+
+/* q1 holds the one packet a device keeps between activations */
+static struct stask *s_devfn(struct sched *s, struct stask *t, struct spacket *pkt)
+{
+    if (pkt == 0)
+    {
+        if (t->q1.head == 0) return (s_wait(s, t));
+        return (s_qpkt(s, t, sq_pop(&t->q1)));
+    }
+    sq_push(&t->q1, pkt);
+    return (s_holdself(s, t));
+}
+
+/* the task set of main(), with count idle iterations */
+void richards_init(struct sched *s, long count)
+{
+    struct spacket *wkq;
+
+    sched_init(s);
+    sched_task(s, I_IDLE, 0, 0, S_RUN, s_idlefn, 1, count);
+
+    wkq = sched_pkt(s, 0, 0, K_WORK);
+    wkq = sched_pkt(s, wkq, 0, K_WORK);
+    sched_task(s, I_WORK, 1000, wkq, S_WAITPKT, s_workfn, I_HANDLERA, 0);
+
+    wkq = sched_pkt(s, 0, I_DEVA, K_DEV);
+    wkq = sched_pkt(s, wkq, I_DEVA, K_DEV);
+    wkq = sched_pkt(s, wkq, I_DEVA, K_DEV);
+    sched_task(s, I_HANDLERA, 2000, wkq, S_WAITPKT, s_handlerfn, 0, 0);
+
+    wkq = sched_pkt(s, 0, I_DEVB, K_DEV);
+    wkq = sched_pkt(s, wkq, I_DEVB, K_DEV);
+    wkq = sched_pkt(s, wkq, I_DEVB, K_DEV);
+    sched_task(s, I_HANDLERB, 3000, wkq, S_WAITPKT, s_handlerfn, 0, 0);
+
+    sched_task(s, I_DEVA, 4000, 0, S_WAIT, s_devfn, 0, 0);
+    sched_task(s, I_DEVB, 5000, 0, S_WAIT, s_devfn, 0, 0);
+    sched_start(s);
+}
+
+/*
+**  Work-stealing pool.  Each worker owns a Chase-Lev deque of job
+**  indices: it pushes and pops at the bottom, idle workers steal from
+**  the top.  All jobs are known up front, so the deques never grow and
+**  a worker is done once every deque is empty.
+*/
+
+struct wsdeque
+{
+    long            top;
+    long            bottom;
+    int            *buf;
+    long            mask;       /* capacity - 1, a power of two */
+};
+
+#define WS_EMPTY        -1
+#define WS_ABORT        -2
+
+static void ws_push(struct wsdeque *d, int job)
+{
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+
+    d->buf[b & d->mask] = job;
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+}
+
+static int ws_pop(struct wsdeque *d)
+{
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    long t;
+    int job;
+
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+    if (t > b)
+    {
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        return (WS_EMPTY);
+    }
+    job = d->buf[b & d->mask];
+    if (t == b)
+    {
+        /* last job: race the thieves for it */
+        if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            job = WS_EMPTY;
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return (job);
+}
+
+static int ws_steal(struct wsdeque *d)
+{
+    long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    long b;
+    int job;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b) return (WS_EMPTY);
+    job = d->buf[t & d->mask];
+    if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return (WS_ABORT);
+    return (job);
+}
+
+struct richards_pool
+{
+    int             nworkers;
+    struct wsdeque *deque;
+    long           *count;      /* per job: idle iterations */
+    struct sched   *result;     /* per job: finished instance */
+};
+
+struct richards_worker
+{
+    struct richards_pool *pool;
+    int             self;
+    pthread_t       tid;
+};
+
+static void *richards_worker(void *arg)
+{
+    struct richards_worker *w = (struct richards_worker *)arg;
+    struct richards_pool *p = w->pool;
+    int job, i, busy;
+
+    for (;;)
+    {
+        job = ws_pop(&p->deque[w->self]);
+        for (i = 1; job < 0 && i <= p->nworkers; i++)
+        {
+            /* look at every other deque; retry one that lost a race */
+            busy = 0;
+            do job = ws_steal(&p->deque[(w->self + i) % p->nworkers]);
+            while (job == WS_ABORT && ++busy < 64);
+        }
+        if (job < 0) break;
+        richards_init(&p->result[job], p->count[job]);
+        sched_run(&p->result[job]);
+    }
+    return (0);
+}
+
+/*
+**  Run njobs independent Richards instances on nworkers threads; jobs are
+**  dealt round robin and rebalanced by stealing.  Results land in
+**  result[0..njobs).  Returns -1 if memory runs out.
+*/
+int richards_pool_run(int njobs, const long *count, int nworkers, struct sched *result)
+{
+    struct richards_pool p;
+    struct richards_worker *w;
+    long cap = 1;
+    int i;
+
+    if (nworkers < 1) nworkers = 1;
+    if (nworkers > 64) nworkers = 64;
+    while (cap < njobs) cap <<= 1;
+
+    p.nworkers = nworkers;
+    p.count = (long *)count;
+    p.result = result;
+    p.deque = (struct wsdeque *)calloc(nworkers, sizeof(struct wsdeque));
+    w = (struct richards_worker *)calloc(nworkers, sizeof(struct richards_worker));
+    if (p.deque == 0 || w == 0) { free(p.deque); free(w); return (-1); }
+    for (i = 0; i < nworkers; i++)
+    {
+        p.deque[i].mask = cap - 1;
+        p.deque[i].buf = (int *)malloc(cap * sizeof(int));
+        if (p.deque[i].buf == 0) nworkers = 0;
+    }
+    for (i = 0; nworkers > 0 && i < njobs; i++)
+        ws_push(&p.deque[i % nworkers], i);
+
+    for (i = 0; i < nworkers; i++)
+    {
+        w[i].pool = &p;
+        w[i].self = i;
+        if (i > 0) pthread_create(&w[i].tid, 0, richards_worker, &w[i]);
+    }
+    if (nworkers > 0) richards_worker(&w[0]);
+    for (i = 1; i < nworkers; i++)
+        pthread_join(w[i].tid, 0);
+
+    for (i = 0; i < p.nworkers; i++)
+        free(p.deque[i].buf);
+    free(p.deque);
+    free(w);
+    return (nworkers > 0 ? 0 : -1);
+}
+
+void inittasks(long count)
+{
+    struct packet *wkq = 0;
+
+    createtask(I_IDLE, 0, wkq, S_RUN, idlefn, 1, count);
 
     wkq = pkt(0, 0, K_WORK);
     wkq = pkt(wkq, 0, K_WORK);
@@ -376,6 +870,95 @@ int main()
     wkq = 0;
     createtask(I_DEVA, 4000, wkq, S_WAIT, devfn, 0, 0);
     createtask(I_DEVB, 5000, wkq, S_WAIT, devfn, 0, 0);
+}
+
+static double seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+/*
+**  Run the classic scheduler once, then the engine on one instance and
+**  on njobs instances across nworkers threads.  Every engine run must
+**  reproduce the classic qpkt and hold counts.  Reports task switches/sec
+**  (task function calls; the same number for both schedulers).
+*/
+int bench(long count, int njobs, int nworkers)
+{
+    struct sched *res;
+    long *counts, switches = 0;
+    double t;
+    int i, bad = 0;
+
+    res = (struct sched *)malloc(njobs * sizeof(struct sched));
+    counts = (long *)malloc(njobs * sizeof(long));
+    if (res == 0 || counts == 0) return (1);
+
+    tasklist = 0;
+    memset(tasktab, 0, sizeof(tasktab));
+    inittasks(count);
+    tcb = tasklist;
+    qpktcount = holdcount = 0;
+    tracing = FALSE;
+    t = seconds();
+    schedule();
+    t = seconds() - t;
+
+    richards_init(&res[0], count);
+    sched_run(&res[0]);
+    printf("count %ld: qpkt count = %d  holdcount = %d, %ld task switches\n",
+           count, qpktcount, holdcount, res[0].switches);
+    if (count == Count && (qpktcount != Qpktcountval || holdcount != Holdcountval))
+    {
+        printf("classic scheduler results are incorrect\n");
+        bad = 1;
+    }
+    printf("classic     1 thread : %10.3e switches/s\n", res[0].switches / t);
+
+    t = seconds();
+    richards_init(&res[0], count);
+    sched_run(&res[0]);
+    t = seconds() - t;
+    printf("engine      1 thread : %10.3e switches/s\n", res[0].switches / t);
+
+    for (i = 0; i < njobs; i++)
+        counts[i] = count;
+    t = seconds();
+    if (richards_pool_run(njobs, counts, nworkers, res) < 0) return (1);
+    t = seconds() - t;
+    for (i = 0; i < njobs; i++)
+    {
+        switches += res[i].switches;
+        if (res[i].qpktcount != qpktcount || res[i].holdcount != holdcount)
+            bad = 1;
+    }
+    printf("pool %3d x %2d threads: %10.3e switches/s\n", njobs, nworkers,
+           switches / t);
+    printf("engine results are %s\n", bad ? "incorrect" : "correct");
+    free(res);
+    free(counts);
+    return (bad);
+}
+
+int main(int argc, char **argv)
+{
+    int retval;
+
+    /* bench -bench [count [instances [threads]]] */
+    if (argc > 1 && strcmp(argv[1], "-bench") == 0)
+    {
+        long count = argc > 2 ? atol(argv[2]) : Count;
+        int njobs = argc > 3 ? atoi(argv[3]) : 16;
+        int nworkers = argc > 4 ? atoi(argv[4]) : 4;
+        return (bench(count < 1 ? 1 : count, njobs < 1 ? 1 : njobs, nworkers));
+    }
+
+    printf("Bench mark starting\n");
+
+    inittasks(Count);
 
     tcb = tasklist;
 
@@ -1,6 +1,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 /* salsa20 is due to Daniel J. Bernstein, who has stated
    "My policy is that Salsa20 is free for everyone to use."
@@ -49,7 +55,389 @@ uint32_t salsa(void) {
   return(outbuf[ptr]);
 }
 
-int main(void) {
+/* ChaCha20, the same author's variant, in the layout of salsa20 above:
+   constants in words 0-3, key in 4-11, block counter in 12-13, nonce
+   in 14-15. */
+#define QR(a,b,c,d) \
+  x[a] += x[b]; x[d] = R(x[d] ^ x[a],16); \
+  x[c] += x[d]; x[b] = R(x[b] ^ x[c],12); \
+  x[a] += x[b]; x[d] = R(x[d] ^ x[a], 8); \
+  x[c] += x[d]; x[b] = R(x[b] ^ x[c], 7);
+void chacha20(uint32_t out[16],uint32_t in[16]) {
+  uint32_t i, x[16];
+
+  for (i = 0;i < 16;++i)
+    x[i] = in[i];
+
+  for (i = 20;i > 0;i -= 2) {
+    QR(0, 4, 8,12) QR(1, 5, 9,13) QR(2, 6,10,14) QR(3, 7,11,15)
+    QR(0, 5,10,15) QR(1, 6,11,12) QR(2, 7, 8,13) QR(3, 4, 9,14)
+  }
+  for (i = 0;i < 16;++i) out[i] = x[i] + in[i];
+}
+
+/*
+ * Keystream engine.
+ *
+ * stream_xor(cipher, in, offset, buf, len) xors len bytes of keystream,
+ * starting at byte offset of the stream, into buf.  in is the 16-word
+ * input block; its 64-bit block counter (words 8-9 for Salsa20, 12-13
+ * for ChaCha20, low word first) is replaced by offset / 64 and counts
+ * up from there.  Encryption and decryption are the same call.
+ *
+ * Whole blocks are produced 8 at a time with AVX2 or 4 at a time with
+ * SSE2: vector register k holds word k of every block, one block per
+ * lane, and the result is transposed back to block order before the
+ * xor.  Large buffers are split by counter range over stream_nthreads
+ * threads.
+ */
+#define CIPHER_SALSA20  0
+#define CIPHER_CHACHA20 1
+
+int stream_nthreads = 1;
+size_t stream_min_split = 1 << 20;     /* bytes per thread, at least */
+int stream_ways = -1;                  /* 1, 4 or 8 blocks at a time; -1: auto */
+
+static const int ctr_word[2] = { 8, 12 };
+
+static void stream_block(int cipher, uint32_t out[16], const uint32_t in[16],
+                         uint64_t ctr) {
+  uint32_t x[16];
+
+  memcpy(x, in, sizeof(x));
+  x[ctr_word[cipher]] = (uint32_t)ctr;
+  x[ctr_word[cipher] + 1] = (uint32_t)(ctr >> 32);
+  if (cipher == CIPHER_SALSA20) salsa20(out, x);
+  else chacha20(out, x);
+}
+
+/* xor bytes [skip, skip+len) of block ctr into buf */
+static void stream_xor_block(int cipher, const uint32_t in[16], uint64_t ctr,
+                             size_t skip, uint8_t *buf, size_t len) {
+  uint32_t ks[16];
+  size_t j;
+
+  stream_block(cipher, ks, in, ctr);
+  for (j = 0; j < len; j++)
+    buf[j] ^= (uint8_t)(ks[(skip + j) >> 2] >> (8 * ((skip + j) & 3)));
+}
+
+/* Column and diagonal rounds on any vector type, given its operations */
+#define SALSA_ROUNDS(x, ADD, XOR, ROT) \
+  for (int r_ = 20; r_ > 0; r_ -= 2) { \
+    x[ 4] = XOR(x[ 4], ROT(ADD(x[ 0], x[12]), 7)); x[ 8] = XOR(x[ 8], ROT(ADD(x[ 4], x[ 0]), 9)); \
+    x[12] = XOR(x[12], ROT(ADD(x[ 8], x[ 4]),13)); x[ 0] = XOR(x[ 0], ROT(ADD(x[12], x[ 8]),18)); \
+    x[ 9] = XOR(x[ 9], ROT(ADD(x[ 5], x[ 1]), 7)); x[13] = XOR(x[13], ROT(ADD(x[ 9], x[ 5]), 9)); \
+    x[ 1] = XOR(x[ 1], ROT(ADD(x[13], x[ 9]),13)); x[ 5] = XOR(x[ 5], ROT(ADD(x[ 1], x[13]),18)); \
+    x[14] = XOR(x[14], ROT(ADD(x[10], x[ 6]), 7)); x[ 2] = XOR(x[ 2], ROT(ADD(x[14], x[10]), 9)); \
+    x[ 6] = XOR(x[ 6], ROT(ADD(x[ 2], x[14]),13)); x[10] = XOR(x[10], ROT(ADD(x[ 6], x[ 2]),18)); \
+    x[ 3] = XOR(x[ 3], ROT(ADD(x[15], x[11]), 7)); x[ 7] = XOR(x[ 7], ROT(ADD(x[ 3], x[15]), 9)); \
+    x[11] = XOR(x[11], ROT(ADD(x[ 7], x[ 3]),13)); x[15] = XOR(x[15], ROT(ADD(x[11], x[ 7]),18)); \
+    x[ 1] = XOR(x[ 1], ROT(ADD(x[ 0], x[ 3]), 7)); x[ 2] = XOR(x[ 2], ROT(ADD(x[ 1], x[ 0]), 9)); \
+    x[ 3] = XOR(x[ 3], ROT(ADD(x[ 2], x[ 1]),13)); x[ 0] = XOR(x[ 0], ROT(ADD(x[ 3], x[ 2]),18)); \
+    x[ 6] = XOR(x[ 6], ROT(ADD(x[ 5], x[ 4]), 7)); x[ 7] = XOR(x[ 7], ROT(ADD(x[ 6], x[ 5]), 9)); \
+    x[ 4] = XOR(x[ 4], ROT(ADD(x[ 7], x[ 6]),13)); x[ 5] = XOR(x[ 5], ROT(ADD(x[ 4], x[ 7]),18)); \
+    x[11] = XOR(x[11], ROT(ADD(x[10], x[ 9]), 7)); x[ 8] = XOR(x[ 8], ROT(ADD(x[11], x[10]), 9)); \
+    x[ 9] = XOR(x[ 9], ROT(ADD(x[ 8], x[11]),13)); x[10] = XOR(x[10], ROT(ADD(x[ 9], x[ 8]),18)); \
+    x[12] = XOR(x[12], ROT(ADD(x[15], x[14]), 7)); x[13] = XOR(x[13], ROT(ADD(x[12], x[15]), 9)); \
+    x[14] = XOR(x[14], ROT(ADD(x[13], x[12]),13)); x[15] = XOR(x[15], ROT(ADD(x[14], x[13]),18)); \
+  }
+
+#define CHACHA_QR(x, ADD, XOR, ROT, a, b, c, d) \
+  x[a] = ADD(x[a], x[b]); x[d] = ROT(XOR(x[d], x[a]),16); \
+  x[c] = ADD(x[c], x[d]); x[b] = ROT(XOR(x[b], x[c]),12); \
+  x[a] = ADD(x[a], x[b]); x[d] = ROT(XOR(x[d], x[a]), 8); \
+  x[c] = ADD(x[c], x[d]); x[b] = ROT(XOR(x[b], x[c]), 7);
+#define CHACHA_ROUNDS(x, ADD, XOR, ROT) \
+  for (int r_ = 20; r_ > 0; r_ -= 2) { \
+    CHACHA_QR(x, ADD, XOR, ROT, 0, 4, 8,12) CHACHA_QR(x, ADD, XOR, ROT, 1, 5, 9,13) \
+    CHACHA_QR(x, ADD, XOR, ROT, 2, 6,10,14) CHACHA_QR(x, ADD, XOR, ROT, 3, 7,11,15) \
+    CHACHA_QR(x, ADD, XOR, ROT, 0, 5,10,15) CHACHA_QR(x, ADD, XOR, ROT, 1, 6,11,12) \
+    CHACHA_QR(x, ADD, XOR, ROT, 2, 7, 8,13) CHACHA_QR(x, ADD, XOR, ROT, 3, 4, 9,14) \
+  }
+
+#ifdef __SSE2__
+#define ADD4(a,b) _mm_add_epi32(a,b)
+#define XOR4(a,b) _mm_xor_si128(a,b)
+#define ROT4(a,n) _mm_or_si128(_mm_slli_epi32(a,n), _mm_srli_epi32(a,32-(n)))
+
+/* transpose words w..w+3 of 4 lanes into 16-byte pieces of 4 blocks */
+#define XOR_OUT4(x, w, buf) { \
+  __m128i t0 = _mm_unpacklo_epi32(x[w], x[w+1]), t1 = _mm_unpackhi_epi32(x[w], x[w+1]); \
+  __m128i t2 = _mm_unpacklo_epi32(x[w+2], x[w+3]), t3 = _mm_unpackhi_epi32(x[w+2], x[w+3]); \
+  __m128i b_[4] = { _mm_unpacklo_epi64(t0, t2), _mm_unpackhi_epi64(t0, t2), \
+                    _mm_unpacklo_epi64(t1, t3), _mm_unpackhi_epi64(t1, t3) }; \
+  for (int k_ = 0; k_ < 4; k_++) { \
+    __m128i *p_ = (__m128i *)((buf) + 64 * k_ + 4 * (w)); \
+    _mm_storeu_si128(p_, _mm_xor_si128(_mm_loadu_si128(p_), b_[k_])); \
+  } }
+
+static void stream_xor4(int cipher, const uint32_t in[16], uint64_t ctr,
+                        uint8_t *buf, size_t nblocks) {
+  int cw = ctr_word[cipher];
+
+  for (; nblocks >= 4; nblocks -= 4, ctr += 4, buf += 256) {
+    __m128i x[16], y[16];
+    for (int k = 0; k < 16; k++)
+      y[k] = _mm_set1_epi32((int)in[k]);
+    y[cw] = _mm_setr_epi32((int)ctr, (int)(ctr + 1), (int)(ctr + 2), (int)(ctr + 3));
+    y[cw + 1] = _mm_setr_epi32((int)(ctr >> 32), (int)((ctr + 1) >> 32),
+                               (int)((ctr + 2) >> 32), (int)((ctr + 3) >> 32));
+    for (int k = 0; k < 16; k++)
+      x[k] = y[k];
+    if (cipher == CIPHER_SALSA20) SALSA_ROUNDS(x, ADD4, XOR4, ROT4)
+    else CHACHA_ROUNDS(x, ADD4, XOR4, ROT4)
+    for (int k = 0; k < 16; k++)
+      x[k] = _mm_add_epi32(x[k], y[k]);
+    XOR_OUT4(x, 0, buf) XOR_OUT4(x, 4, buf) XOR_OUT4(x, 8, buf) XOR_OUT4(x, 12, buf)
+  }
+  for (; nblocks > 0; nblocks--, ctr++, buf += 64)
+    stream_xor_block(cipher, in, ctr, 0, buf, 64);
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ADD8(a,b) _mm256_add_epi32(a,b)
+#define XOR8(a,b) _mm256_xor_si256(a,b)
+#define ROT8(a,n) _mm256_or_si256(_mm256_slli_epi32(a,n), _mm256_srli_epi32(a,32-(n)))
+/* ChaCha's byte-sized rotations are a single byte shuffle */
+#define ROT8C(a,n) ((n) == 16 ? _mm256_shuffle_epi8(a, rot16) : \
+                    (n) == 8 ? _mm256_shuffle_epi8(a, rot8) : ROT8(a,n))
+
+/* transpose words w..w+7 of 8 lanes into 32-byte pieces of 8 blocks */
+#define XOR_OUT8(x, w, buf) { \
+  __m256i t0 = _mm256_unpacklo_epi32(x[w], x[w+1]), t1 = _mm256_unpackhi_epi32(x[w], x[w+1]); \
+  __m256i t2 = _mm256_unpacklo_epi32(x[w+2], x[w+3]), t3 = _mm256_unpackhi_epi32(x[w+2], x[w+3]); \
+  __m256i t4 = _mm256_unpacklo_epi32(x[w+4], x[w+5]), t5 = _mm256_unpackhi_epi32(x[w+4], x[w+5]); \
+  __m256i t6 = _mm256_unpacklo_epi32(x[w+6], x[w+7]), t7 = _mm256_unpackhi_epi32(x[w+6], x[w+7]); \
+  __m256i u0 = _mm256_unpacklo_epi64(t0, t2), u1 = _mm256_unpackhi_epi64(t0, t2); \
+  __m256i u2 = _mm256_unpacklo_epi64(t1, t3), u3 = _mm256_unpackhi_epi64(t1, t3); \
+  __m256i u4 = _mm256_unpacklo_epi64(t4, t6), u5 = _mm256_unpackhi_epi64(t4, t6); \
+  __m256i u6 = _mm256_unpacklo_epi64(t5, t7), u7 = _mm256_unpackhi_epi64(t5, t7); \
+  __m256i b_[8] = { _mm256_permute2x128_si256(u0, u4, 0x20), _mm256_permute2x128_si256(u1, u5, 0x20), \
+                    _mm256_permute2x128_si256(u2, u6, 0x20), _mm256_permute2x128_si256(u3, u7, 0x20), \
+                    _mm256_permute2x128_si256(u0, u4, 0x31), _mm256_permute2x128_si256(u1, u5, 0x31), \
+                    _mm256_permute2x128_si256(u2, u6, 0x31), _mm256_permute2x128_si256(u3, u7, 0x31) }; \
+  for (int k_ = 0; k_ < 8; k_++) { \
+    __m256i *p_ = (__m256i *)((buf) + 64 * k_ + 4 * (w)); \
+    _mm256_storeu_si256(p_, _mm256_xor_si256(_mm256_loadu_si256(p_), b_[k_])); \
+  } }
+
+__attribute__((target("avx2")))
+static void stream_xor8(int cipher, const uint32_t in[16], uint64_t ctr,
+                        uint8_t *buf, size_t nblocks) {
+  const __m256i rot16 = _mm256_setr_epi8(2,3,0,1, 6,7,4,5, 10,11,8,9, 14,15,12,13,
+                                         2,3,0,1, 6,7,4,5, 10,11,8,9, 14,15,12,13);
+  const __m256i rot8 = _mm256_setr_epi8(3,0,1,2, 7,4,5,6, 11,8,9,10, 15,12,13,14,
+                                        3,0,1,2, 7,4,5,6, 11,8,9,10, 15,12,13,14);
+  int cw = ctr_word[cipher];
+
+  for (; nblocks >= 8; nblocks -= 8, ctr += 8, buf += 512) {
+    __m256i x[16], y[16];
+    uint32_t lo[8], hi[8];
+    for (int k = 0; k < 8; k++) {
+      lo[k] = (uint32_t)(ctr + k);
+      hi[k] = (uint32_t)((ctr + k) >> 32);
+    }
+    for (int k = 0; k < 16; k++)
+      y[k] = _mm256_set1_epi32((int)in[k]);
+    y[cw] = _mm256_loadu_si256((const __m256i *)lo);
+    y[cw + 1] = _mm256_loadu_si256((const __m256i *)hi);
+    for (int k = 0; k < 16; k++)
+      x[k] = y[k];
+    if (cipher == CIPHER_SALSA20) SALSA_ROUNDS(x, ADD8, XOR8, ROT8)
+    else CHACHA_ROUNDS(x, ADD8, XOR8, ROT8C)
+    for (int k = 0; k < 16; k++)
+      x[k] = _mm256_add_epi32(x[k], y[k]);
+    XOR_OUT8(x, 0, buf) XOR_OUT8(x, 8, buf)
+  }
+#ifdef __SSE2__
+  stream_xor4(cipher, in, ctr, buf, nblocks);
+#else
+  for (; nblocks > 0; nblocks--, ctr++, buf += 64)
+    stream_xor_block(cipher, in, ctr, 0, buf, 64);
+#endif
+}
+#endif
+
+static int stream_pick_ways(void) {
+  if (stream_ways < 0) {
+    stream_ways = 1;
+#ifdef __SSE2__
+    stream_ways = 4;
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2"))
+      stream_ways = 8;
+#endif
+  }
+  return stream_ways;
+}
+
+static void stream_xor_range(int cipher, const uint32_t in[16], uint64_t offset,
+                             uint8_t *buf, size_t len) {
+  uint64_t ctr = offset >> 6;
+  size_t skip = offset & 63, n, nblocks;
+  int ways = stream_pick_ways();
+
+  if (skip != 0 && len > 0) {
+    n = 64 - skip < len ? 64 - skip : len;
+    stream_xor_block(cipher, in, ctr++, skip, buf, n);
+    buf += n;
+    len -= n;
+  }
+  nblocks = len >> 6;
+#if defined(__x86_64__) || defined(__i386__)
+  if (ways == 8) stream_xor8(cipher, in, ctr, buf, nblocks);
+  else
+#endif
+#ifdef __SSE2__
+  if (ways == 4) stream_xor4(cipher, in, ctr, buf, nblocks);
+  else
+#endif
+  for (n = 0; n < nblocks; n++)
+    stream_xor_block(cipher, in, ctr + n, 0, buf + 64 * n, 64);
+  ctr += nblocks;
+  buf += 64 * nblocks;
+  len &= 63;
+  if (len > 0)
+    stream_xor_block(cipher, in, ctr, 0, buf, len);
+}
+
+struct stream_job {
+  int cipher;
+  const uint32_t *in;
+  uint64_t offset;
+  uint8_t *buf;
+  size_t len;
+};
+
+static void *stream_worker(void *arg) {
+  struct stream_job *job = arg;
+
+  stream_xor_range(job->cipher, job->in, job->offset, job->buf, job->len);
+  return NULL;
+}
+
+void stream_xor(int cipher, const uint32_t in[16], uint64_t offset,
+                uint8_t *buf, size_t len) {
+  struct stream_job job[64];
+  pthread_t tid[64];
+  size_t chunk, done;
+  int t, nthreads = stream_nthreads;
+
+  if (nthreads > 64) nthreads = 64;
+  if (nthreads > 1 && len / nthreads < stream_min_split)
+    nthreads = len / stream_min_split > 1 ? (int)(len / stream_min_split) : 1;
+  if (nthreads <= 1) {
+    stream_xor_range(cipher, in, offset, buf, len);
+    return;
+  }
+
+  /* whole blocks per thread, so each piece starts on a block boundary
+     whenever the buffer does */
+  stream_pick_ways();
+  chunk = (len / nthreads + 63) & ~(size_t)63;
+  if ((size_t)nthreads > (len + chunk - 1) / chunk)
+    nthreads = (int)((len + chunk - 1) / chunk);    /* rounding left none */
+  for (t = 0, done = 0; t < nthreads; t++) {
+    job[t].cipher = cipher;
+    job[t].in = in;
+    job[t].offset = offset + done;
+    job[t].buf = buf + done;
+    job[t].len = t == nthreads - 1 ? len - done : chunk;
+    done += job[t].len;
+    if (t > 0) pthread_create(&tid[t], NULL, stream_worker, &job[t]);
+  }
+  stream_worker(&job[0]);
+  for (t = 1; t < nthreads; t++)
+    pthread_join(tid[t], NULL);
+}
+
+static double stream_seconds(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Check every width against the single-block salsa20()/chacha20() at an
+ * unaligned offset whose counter carries into the high word, then report
+ * GB/s for each width on one thread and for the widest on nthreads.
+ */
+static int stream_bench(size_t mb, int nthreads) {
+  static const char *name[2] = { "salsa20", "chacha20" };
+#ifdef __SSE2__
+  static const int width[] = { 1, 4, 8 };
+#else
+  static const int width[] = { 1, 8 };
+#endif
+  const int nwidth = sizeof(width) / sizeof(width[0]);
+  const uint64_t offset = ((uint64_t)1 << 38) - 64 * 5 - 7;
+  const size_t clen = 64 * 41 + 19, len = mb << 20;
+  uint8_t *a = malloc(clen), *b = malloc(clen), *big = malloc(len);
+  uint32_t in[16], ks[16];
+  uint32_t zero[16] = { 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574 };
+  int ways = stream_pick_ways(), bad = 0;
+  double t;
+
+  if (a == NULL || b == NULL || big == NULL) return 1;
+  for (int i = 0; i < 16; i++)
+    in[i] = (0xedababe5+(i+13))^(0xdeadbeef-i);
+  memset(big, 0x5a, len);
+
+  /* "expand 32-byte k", all-zero key and nonce: the published first word */
+  chacha20(ks, zero);
+  if (ks[0] != 0xade0b876) {
+    printf("chacha20 reference is wrong\n");
+    bad = 1;
+  }
+
+  for (int c = 0; c < 2; c++) {
+    for (size_t j = 0; j < clen; j++) {
+      uint64_t pos = offset + j;
+      if (j == 0 || (pos & 63) == 0) stream_block(c, ks, in, pos >> 6);
+      a[j] = (uint8_t)(j * 7) ^ (uint8_t)(ks[(pos & 63) >> 2] >> (8 * (pos & 3)));
+    }
+    /* each width on one thread, then the widest split into 64-byte pieces */
+    for (int w = 0; w <= nwidth && (w == nwidth || width[w] <= ways); w++) {
+      for (size_t j = 0; j < clen; j++)
+        b[j] = (uint8_t)(j * 7);
+      stream_ways = w == nwidth ? ways : width[w];
+      stream_nthreads = w == nwidth ? nthreads : 1;
+      stream_min_split = 64;
+      stream_xor(c, in, offset, b, clen);
+      if (memcmp(a, b, clen) != 0) {
+        printf("%s %d-way, %d threads: keystream differs from single-block output\n",
+               name[c], stream_ways, stream_nthreads);
+        bad = 1;
+      }
+    }
+    stream_nthreads = 1;
+
+    for (int w = 0; w < nwidth && width[w] <= ways; w++) {
+      stream_ways = width[w];
+      t = stream_seconds();
+      stream_xor(c, in, 0, big, len);
+      t = stream_seconds() - t;
+      printf("%-8s %d-way, 1 thread : %6.3f GB/s\n", name[c], width[w], len / t * 1e-9);
+    }
+    stream_ways = ways;
+    stream_nthreads = nthreads;
+    t = stream_seconds();
+    stream_xor(c, in, 0, big, len);
+    t = stream_seconds() - t;
+    printf("%-8s %d-way, %d threads: %6.3f GB/s\n", name[c], ways, nthreads, len / t * 1e-9);
+  }
+  printf("keystream check: %s\n", bad ? "FAILED" : "ok");
+  free(a);
+  free(b);
+  free(big);
+  return bad;
+}
+
+int main(int argc, char **argv) {
   uint32_t val, i;
 #ifdef SMALL_PROBLEM_SIZE
   uint32_t count = 5379194;
@@ -59,6 +447,13 @@ int main(void) {
   uint32_t offset = 0;
 #endif
 
+  /* salsa -bench [megabytes [threads]] */
+  if (argc > 1 && strcmp(argv[1], "-bench") == 0) {
+    long mb = argc > 2 ? atol(argv[2]) : 256;
+    int nthreads = argc > 3 ? atoi(argv[3]) : 4;
+    return stream_bench(mb < 1 ? 1 : mb, nthreads < 1 ? 1 : nthreads);
+  }
+
   for(i=0; i<16; i++)
     STATE[i] = (0xedababe5+(i+13))^(0xdeadbeef-i);
   
@@ -60,6 +60,7 @@ C**********************************************************************
 
 /* the following is optional depending on the timing function used */
 #include <time.h>
+#include <pthread.h>
 
 /* map the FORTRAN math functions, etc. to the C versions */
 #define DSIN	sin
@@ -75,7 +76,9 @@ void POUT(long N, long J, long K, double X1, double X2, double X3, double X4);
 void PA(double E[]);
 void P0(void);
 void P3(double X, double Y, double *Z);
-#define USAGE	"usage: whetdc [-c] [loops]\n"
+int BENCH(int argc, char *argv[]);
+#define USAGE	"usage: whetdc [-c] [loops]\n" \
+		"       whetdc -bench [loops [copies]] [-json]\n"
 
 /*
 	COMMON T,T1,T2,E1(4),J,K,L
@@ -106,6 +109,9 @@ main(int argc, char *argv[])
 #endif
 	continuous = 0;
 
+	if (argc > 1 && strcmp(argv[1], "-bench") == 0)
+		return(BENCH(argc - 2, argv + 2));
+
 	II = 1;		/* start at the first arg (temp use of II here) */
 	while (II < argc) {
 		if (strncmp(argv[II], "-c", 2) == 0 || argv[II][0] == 'c') {
@@ -437,3 +443,479 @@ POUT(long N, long J, long K, double X1, double X2, double X3, double X4)
 						N, J, K, X1, X2, X3, X4);
 }
 #endif
+
+/*
+ * Per-module benchmark.
+ *
+ * BENCH runs the same modules as main, each timed on its own, from a
+ * struct WHET holding what main keeps in COMMON, so that several copies
+ * can run at once.  It reports
+ *
+ *	- time and rate for each of N1-N11, and the MWIPS of the whole loop,
+ *	- array variants of the transcendental modules N7 and N11, which
+ *	  run independent lanes side by side so the library calls can be
+ *	  vectorized.  Built with -O2 -ffast-math -ftree-vectorize on
+ *	  x86-64 glibc, GCC turns them into libmvec calls; otherwise they
+ *	  use scalar libm, and comparing two builds compares the two libms,
+ *	- with copies > 1, one copy per thread started together, for
+ *	  throughput scaling against a single copy,
+ *
+ * as a table, or as JSON with -json.
+ */
+#define WLANES	1024		/* lanes in the array variants */
+#define NMOD	11
+
+struct WHET {
+	double T, T1, T2, E1[5];
+	int J, K, L;
+};
+
+struct WRESULT {
+	long LOOP;
+	long N[NMOD+1];		/* iterations of module 1..11 */
+	double SEC[NMOD+1];	/* seconds per module */
+	double R[NMOD+1][4];	/* what POUT would print for the module */
+	double TOTAL;		/* seconds for the whole loop */
+};
+
+static const char *MNAME[NMOD+1] = {
+	"", "simple identifiers", "array elements", "array as parameter",
+	"conditional jumps", "omitted", "integer arithmetic",
+	"trigonometric functions", "procedure calls", "array references",
+	"integer arithmetic", "standard functions"
+};
+
+static double
+WSECONDS(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+static void
+WPA(struct WHET *w, double E[])
+{
+	w->J = 0;
+
+L10:
+	E[1] = ( E[1] + E[2] + E[3] - E[4]) * w->T;
+	E[2] = ( E[1] + E[2] - E[3] + E[4]) * w->T;
+	E[3] = ( E[1] - E[2] + E[3] + E[4]) * w->T;
+	E[4] = (-E[1] + E[2] + E[3] + E[4]) / w->T2;
+	w->J += 1;
+
+	if (w->J < 6)
+		goto L10;
+}
+
+static void
+WP0(struct WHET *w)
+{
+	w->E1[w->J] = w->E1[w->K];
+	w->E1[w->K] = w->E1[w->L];
+	w->E1[w->L] = w->E1[w->J];
+}
+
+static void
+WP3(struct WHET *w, double X, double Y, double *Z)
+{
+	double X1, Y1;
+
+	X1 = X;
+	Y1 = Y;
+	X1 = w->T * (X1 + Y1);
+	Y1 = w->T * (X1 + Y1);
+	*Z  = (X1 + Y1) / w->T2;
+}
+
+/*
+ * WKEEP(v) makes v opaque to the compiler once per iteration and makes
+ * it assume memory is read and written there.  Without it GCC folds or
+ * hoists the loops of N4, N6, N8 and N9, whose state repeats or whose
+ * inputs never change, and their times measure nothing.
+ */
+#if defined(__GNUC__)
+#define WKEEP(v)	__asm__ __volatile__("" : "+g"(v) : : "memory")
+#else
+#define WKEEP(v)	((void)0)
+#endif
+
+/* module M of main's loop, N iterations, on the state in w */
+static void
+WMODULE(struct WHET *w, int M, long N, double R[4])
+{
+	double X1, X2, X3, X4, X, Y, Z;
+	double *E1 = w->E1, T = w->T, T1 = w->T1, T2 = w->T2;
+	long I;
+	int J, K, L;
+
+	switch (M) {
+	case 1:
+		X1 =  1.0;
+		X2 = -1.0;
+		X3 = -1.0;
+		X4 = -1.0;
+		for (I = 1; I <= N; I++) {
+		    X1 = (X1 + X2 + X3 - X4) * T;
+		    X2 = (X1 + X2 - X3 + X4) * T;
+		    X3 = (X1 - X2 + X3 + X4) * T;
+		    X4 = (-X1+ X2 + X3 + X4) * T;
+		}
+		R[0] = X1; R[1] = X2; R[2] = X3; R[3] = X4;
+		break;
+	case 2:
+		E1[1] =  1.0;
+		E1[2] = -1.0;
+		E1[3] = -1.0;
+		E1[4] = -1.0;
+		for (I = 1; I <= N; I++) {
+		    E1[1] = ( E1[1] + E1[2] + E1[3] - E1[4]) * T;
+		    E1[2] = ( E1[1] + E1[2] - E1[3] + E1[4]) * T;
+		    E1[3] = ( E1[1] - E1[2] + E1[3] + E1[4]) * T;
+		    E1[4] = (-E1[1] + E1[2] + E1[3] + E1[4]) * T;
+		}
+		memcpy(R, &E1[1], 4 * sizeof(double));
+		break;
+	case 3:
+		for (I = 1; I <= N; I++)
+			WPA(w, E1);
+		memcpy(R, &E1[1], 4 * sizeof(double));
+		break;
+	case 4:
+		J = 1;
+		for (I = 1; I <= N; I++) {
+			if (J == 1)
+				J = 2;
+			else
+				J = 3;
+
+			if (J > 2)
+				J = 0;
+			else
+				J = 1;
+
+			if (J < 1)
+				J = 1;
+			else
+				J = 0;
+			WKEEP(J);
+		}
+		w->J = J;
+		R[0] = R[1] = R[2] = R[3] = J;
+		break;
+	case 6:
+		J = 1;
+		K = 2;
+		L = 3;
+		for (I = 1; I <= N; I++) {
+		    J = J * (K-J) * (L-K);
+		    K = L * K - (L-J) * K;
+		    L = (L-K) * (K+J);
+		    E1[L-1] = J + K + L;
+		    E1[K-1] = J * K * L;
+		    WKEEP(J); WKEEP(K); WKEEP(L);
+		}
+		w->J = J; w->K = K; w->L = L;
+		memcpy(R, &E1[1], 4 * sizeof(double));
+		break;
+	case 7:
+		X = 0.5;
+		Y = 0.5;
+		for (I = 1; I <= N; I++) {
+			X = T * DATAN(T2*DSIN(X)*DCOS(X)/(DCOS(X+Y)+DCOS(X-Y)-1.0));
+			Y = T * DATAN(T2*DSIN(Y)*DCOS(Y)/(DCOS(X+Y)+DCOS(X-Y)-1.0));
+		}
+		R[0] = R[1] = X; R[2] = R[3] = Y;
+		break;
+	case 8:
+		X = 1.0;
+		Y = 1.0;
+		Z = 1.0;
+		for (I = 1; I <= N; I++) {
+			WKEEP(X); WKEEP(Y);
+			WP3(w, X, Y, &Z);
+			WKEEP(Z);
+		}
+		R[0] = X; R[1] = Y; R[2] = R[3] = Z;
+		break;
+	case 9:
+		w->J = 1;
+		w->K = 2;
+		w->L = 3;
+		E1[1] = 1.0;
+		E1[2] = 2.0;
+		E1[3] = 3.0;
+		for (I = 1; I <= N; I++) {
+			WP0(w);
+			WKEEP(w);
+		}
+		memcpy(R, &E1[1], 4 * sizeof(double));
+		break;
+	case 10:
+		J = 2;
+		K = 3;
+		for (I = 1; I <= N; I++) {
+		    J = J + K;
+		    K = J + K;
+		    J = K - J;
+		    K = K - J - J;
+		}
+		w->J = J; w->K = K;
+		R[0] = J; R[1] = K; R[2] = R[3] = 0.0;
+		break;
+	case 11:
+		X = 0.75;
+		for (I = 1; I <= N; I++)
+			X = DSQRT(DEXP(DLOG(X)/T1));
+		R[0] = R[1] = R[2] = R[3] = X;
+		break;
+	}
+}
+
+/* one major loop of main with LOOP, timing each module */
+static void
+WRUN(long LOOP, struct WRESULT *r)
+{
+	static const long MULT[NMOD+1] = { 0, 0, 12, 14, 345, 0, 210, 32, 899, 616, 0, 93 };
+	struct WHET w;
+	double t0, t;
+	int M;
+
+	memset(&w, 0, sizeof(w));
+	w.T  = .499975;
+	w.T1 = 0.50025;
+	w.T2 = 2.0;
+	r->LOOP = LOOP;
+	t0 = WSECONDS();
+	for (M = 1; M <= NMOD; M++) {
+		r->N[M] = MULT[M] * LOOP;
+		if (M == 5) {
+			r->SEC[M] = 0.0;
+			continue;
+		}
+		t = WSECONDS();
+		WMODULE(&w, M, r->N[M], r->R[M]);
+		r->SEC[M] = WSECONDS() - t;
+	}
+	r->TOTAL = WSECONDS() - t0;
+}
+
+/*
+ * Array variants.  Lane i starts where the scalar module starts, nudged
+ * by i * 1e-9 so the lanes differ; lane 0 is the scalar recurrence.
+ * sin and cos of the same argument are taken in separate passes:
+ * GCC fuses them into sincos otherwise, which has no vector form.
+ */
+static void
+WMOD7V(long STEPS, double *X, double *Y, double *S, double T, double T2)
+{
+	long I;
+	int i;
+
+	for (I = 1; I <= STEPS; I++) {
+		for (i = 0; i < WLANES; i++)
+			S[i] = DSIN(X[i]);
+		for (i = 0; i < WLANES; i++)
+			S[i] *= DCOS(X[i]);
+		for (i = 0; i < WLANES; i++)
+			X[i] = T * DATAN(T2*S[i]/(DCOS(X[i]+Y[i])+DCOS(X[i]-Y[i])-1.0));
+		for (i = 0; i < WLANES; i++)
+			S[i] = DSIN(Y[i]);
+		for (i = 0; i < WLANES; i++)
+			S[i] *= DCOS(Y[i]);
+		for (i = 0; i < WLANES; i++)
+			Y[i] = T * DATAN(T2*S[i]/(DCOS(X[i]+Y[i])+DCOS(X[i]-Y[i])-1.0));
+	}
+}
+
+static void
+WMOD11V(long STEPS, double *X, double T1)
+{
+	long I;
+	int i;
+
+	for (I = 1; I <= STEPS; I++)
+		for (i = 0; i < WLANES; i++)
+			X[i] = DSQRT(DEXP(DLOG(X[i])/T1));
+}
+
+struct WVARIANT {
+	int M;
+	long STEPS;
+	double SEC, DIFF;	/* DIFF: lane 0 against the scalar module */
+	double SCALAR_NS;	/* ns per iteration of the scalar module in r */
+};
+
+static void
+WVARIANTS(const struct WRESULT *r, struct WVARIANT v[2])
+{
+	static double X[WLANES], Y[WLANES], S[WLANES];
+	struct WHET w;
+	double R[4], t;
+	int i;
+
+	memset(&w, 0, sizeof(w));
+	w.T  = .499975;
+	w.T1 = 0.50025;
+	w.T2 = 2.0;
+
+	v[0].M = 7;
+	v[0].STEPS = (r->N[7] + WLANES - 1) / WLANES;
+	v[0].SCALAR_NS = r->SEC[7] / r->N[7] * 1e9;
+	WMODULE(&w, 7, v[0].STEPS, R);
+	for (i = 0; i < WLANES; i++)
+		X[i] = Y[i] = 0.5 + i * 1e-9;
+	t = WSECONDS();
+	WMOD7V(v[0].STEPS, X, Y, S, w.T, w.T2);
+	v[0].SEC = WSECONDS() - t;
+	v[0].DIFF = fabs(X[0] - R[0]) / fabs(R[0]);
+
+	v[1].M = 11;
+	v[1].STEPS = (r->N[11] + WLANES - 1) / WLANES;
+	v[1].SCALAR_NS = r->SEC[11] / r->N[11] * 1e9;
+	WMODULE(&w, 11, v[1].STEPS, R);
+	for (i = 0; i < WLANES; i++)
+		X[i] = 0.75 + i * 1e-9;
+	t = WSECONDS();
+	WMOD11V(v[1].STEPS, X, w.T1);
+	v[1].SEC = WSECONDS() - t;
+	v[1].DIFF = fabs(X[0] - R[0]) / fabs(R[0]);
+}
+
+struct WCOPY {
+	long LOOP;
+	pthread_barrier_t *START;
+	struct WRESULT r;
+};
+
+static void *
+WCOPYRUN(void *arg)
+{
+	struct WCOPY *c = (struct WCOPY *)arg;
+
+	pthread_barrier_wait(c->START);
+	WRUN(c->LOOP, &c->r);
+	return(NULL);
+}
+
+/* MWIPS: 100 * LOOP thousand Whetstone instructions per major loop */
+#define MWIPS(LOOP, SEC)	((SEC) > 0 ? 0.1 * (LOOP) / (SEC) : 0.0)
+
+int
+BENCH(int argc, char *argv[])
+{
+	struct WRESULT r;
+	struct WVARIANT v[2];
+	struct WCOPY *c = NULL;
+	pthread_t *tid = NULL;
+	pthread_barrier_t start;
+	long LOOP = 10000, COPIES = 1, n = 0;
+	double wall = 0.0, sum = 0.0, rate;
+	int json = 0, vlibm = 0, bad = 0, M, i;
+
+#if defined(__x86_64__) && defined(__FAST_MATH__) && defined(__GLIBC__)
+	vlibm = 1;
+#endif
+	for (i = 0; i < argc; i++) {
+		if (strcmp(argv[i], "-json") == 0)
+			json = 1;
+		else if (atol(argv[i]) > 0 && n < 2)
+			*(n++ == 0 ? &LOOP : &COPIES) = atol(argv[i]);
+		else {
+			fprintf(stderr, USAGE);
+			return(1);
+		}
+	}
+	if (COPIES > 256)
+		COPIES = 256;
+
+	WRUN(LOOP, &r);
+	WVARIANTS(&r, v);
+
+	if (COPIES > 1) {
+		c = (struct WCOPY *)calloc(COPIES, sizeof(*c));
+		tid = (pthread_t *)calloc(COPIES, sizeof(*tid));
+		if (c == NULL || tid == NULL)
+			return(1);
+		pthread_barrier_init(&start, NULL, COPIES + 1);
+		for (i = 0; i < COPIES; i++) {
+			c[i].LOOP = LOOP;
+			c[i].START = &start;
+			pthread_create(&tid[i], NULL, WCOPYRUN, &c[i]);
+		}
+		wall = WSECONDS();
+		pthread_barrier_wait(&start);
+		for (i = 0; i < COPIES; i++)
+			pthread_join(tid[i], NULL);
+		wall = WSECONDS() - wall;
+		pthread_barrier_destroy(&start);
+		for (i = 0; i < COPIES; i++) {
+			sum += MWIPS(LOOP, c[i].r.TOTAL);
+			for (M = 1; M <= NMOD; M++)
+				bad |= memcmp(c[i].r.R[M], r.R[M], sizeof(r.R[M])) != 0;
+		}
+	}
+
+	if (json) {
+		printf("{\n  \"loops\": %ld,\n  \"vector_libm\": %s,\n", LOOP,
+		       vlibm ? "true" : "false");
+		printf("  \"mwips\": %.1f,\n  \"seconds\": %.6f,\n",
+		       MWIPS(LOOP, r.TOTAL), r.TOTAL);
+		printf("  \"modules\": [\n");
+		for (M = 1; M <= NMOD; M++) {
+			if (M == 5)
+				continue;
+			printf("    {\"module\": \"N%d\", \"name\": \"%s\", \"iterations\": %ld, "
+			       "\"seconds\": %.6f, \"mloops_per_sec\": %.3f}%s\n",
+			       M, MNAME[M], r.N[M], r.SEC[M],
+			       r.SEC[M] > 0 ? r.N[M] / r.SEC[M] * 1e-6 : 0.0,
+			       M < NMOD ? "," : "");
+		}
+		printf("  ],\n  \"array_variants\": [\n");
+		for (i = 0; i < 2; i++)
+			printf("    {\"module\": \"N%d\", \"lanes\": %d, \"steps\": %ld, "
+			       "\"seconds\": %.6f, \"ns_per_iteration\": %.3f, "
+			       "\"scalar_ns_per_iteration\": %.3f, \"lane0_rel_diff\": %.3e}%s\n",
+			       v[i].M, WLANES, v[i].STEPS, v[i].SEC,
+			       v[i].SEC / ((double)v[i].STEPS * WLANES) * 1e9,
+			       v[i].SCALAR_NS, v[i].DIFF, i < 1 ? "," : "");
+		printf("  ]");
+		if (COPIES > 1) {
+			printf(",\n  \"multi_copy\": {\"copies\": %ld, \"wall_seconds\": %.6f, "
+			       "\"mwips_total\": %.1f, \"scaling\": %.3f, \"results_match\": %s, "
+			       "\"mwips_per_copy\": [", COPIES, wall, sum,
+			       sum / MWIPS(LOOP, r.TOTAL), bad ? "false" : "true");
+			for (i = 0; i < COPIES; i++)
+				printf("%s%.1f", i ? ", " : "", MWIPS(LOOP, c[i].r.TOTAL));
+			printf("]}");
+		}
+		printf("\n}\n");
+	} else {
+		printf("Loops: %ld, vector libm: %s\n\n", LOOP, vlibm ? "yes" : "no");
+		printf("Module %-24s %12s %10s %12s\n", "", "iterations", "seconds", "Mloops/s");
+		for (M = 1; M <= NMOD; M++) {
+			if (M == 5)
+				continue;
+			rate = r.SEC[M] > 0 ? r.N[M] / r.SEC[M] * 1e-6 : 0.0;
+			printf("N%-5d %-24s %12ld %10.4f %12.3f\n",
+			       M, MNAME[M], r.N[M], r.SEC[M], rate);
+		}
+		printf("\nC Converted Double Precision Whetstones: %.1f MWIPS\n\n",
+		       MWIPS(LOOP, r.TOTAL));
+		printf("Array variant  lanes   ns/iter  scalar ns/iter  lane 0 rel diff\n");
+		for (i = 0; i < 2; i++)
+			printf("N%-13d %5d %9.3f %15.3f %16.3e\n", v[i].M, WLANES,
+			       v[i].SEC / ((double)v[i].STEPS * WLANES) * 1e9,
+			       v[i].SCALAR_NS, v[i].DIFF);
+		if (COPIES > 1) {
+			printf("\n%ld copies: %.1f MWIPS total, %.2fx one copy, results %s\n",
+			       COPIES, sum, sum / MWIPS(LOOP, r.TOTAL),
+			       bad ? "DIFFER" : "match");
+		}
+	}
+	free(c);
+	free(tid);
+	return(bad);
+}
@@ -1,5 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
 
 #define NDATA (int *)malloc(ncol * sizeof(int))
 #define NLIST (struct _list *)malloc(sizeof(struct _list))
@@ -333,11 +336,488 @@ void get_real_move(int *data1,int *data2,int *row,int *col) /* returns row & col
   *row = data1[*col];  /* row is given by the content of the structure */
 }
 
-int main(void)
+/*****************************************************************************/
+/* Packed-position solver.                                                   */
+/*                                                                           */
+/* A position is the same column-height vector as a _data (non-increasing,  */
+/* at most nrow), stored as the staircase path around it: from the top-left */
+/* corner, one 1 bit per step down and one 0 bit per column, lowest bit     */
+/* first, then a 1 sentinel above the path.  nrow + ncol + 1 bits must fit  */
+/* in a chomp_key.  Values are as in the _play tree: 1 if the player to    */
+/* move has a move to a 0 position (or the board is empty), else 0.  The   */
+/* chosen move is the first one, in make_list() order, to a 0 position -  */
+/* the one get_good_move() returns.                                         */
+/*                                                                           */
+/*   chomp_retro()   retrograde sweep over every position, in an order     */
+/*                   where all moves lead to earlier positions, with the   */
+/*                   values in a bit array indexed by rank                 */
+/*   chomp_search()  depth-first search from the full board, caching       */
+/*                   values in a shared hash table; the root moves are     */
+/*                   split over threads                                    */
+/*****************************************************************************/
+
+#ifdef __SIZEOF_INT128__
+typedef unsigned __int128 chomp_key;
+#else
+typedef unsigned long long chomp_key;
+#endif
+#define CHOMP_KEY_BITS ((int)sizeof(chomp_key) * 8)
+
+chomp_key chomp_encode(const int *h,int nr,int nc)
+{
+  chomp_key key = 0;
+  int c,bit = 0,cur = nr;
+  for (c = 0;c != nc;c ++)
+    {
+      key |= (((chomp_key)1 << (cur - h[c])) - 1) << bit; /* steps down */
+      bit += cur - h[c] + 1;                               /* and a column */
+      cur = h[c];
+    }
+  key |= (((chomp_key)1 << cur) - 1) << bit; /* down to the bottom */
+  return key | (chomp_key)1 << (bit + cur);  /* sentinel */
+}
+
+void chomp_decode(chomp_key key,int nr,int nc,int *h)
+{
+  int c = 0,cur = nr;
+  while (c != nc)
+    {
+      if (key & 1) cur --;
+      else h[c ++] = cur;
+      key >>= 1;
+    }
+}
+
+/* position after the move (row,col); the move is valid if h[col] > row */
+static void chomp_move(const int *h,int *q,int nc,int row,int col)
+{
+  int c;
+  for (c = 0;c != nc;c ++)
+      q[c] = (c >= col && h[c] > row) ? row : h[c];
+}
+
+/* --- retrograde analysis ------------------------------------------------ */
+
+struct chomp_retro_table
+{
+  int nrow,ncol;
+  unsigned long long count;  /* positions: C(nrow + ncol,ncol) */
+  unsigned long long *w;     /* rank weights, ncol x (nrow + 1) */
+  unsigned char *value;      /* one bit per position */
+};
+
+/*
+ * Positions are ranked in the order next_data() visits the valid ones
+ * (column 0 fastest).  A move only lowers heights, so it always leads to
+ * a lower rank.  rank = sum over c of w[c][h[c]] - w[c][h[c+1]], where
+ * w[c][v] counts the ways to fill columns 0..c-1 for each height below v.
+ */
+unsigned long long chomp_rank(const struct chomp_retro_table *t,const int *h)
+{
+  unsigned long long r = 0;
+  int c;
+  for (c = 0;c != t->ncol;c ++)
+      r += t->w[c * (t->nrow + 1) + h[c]]
+         - t->w[c * (t->nrow + 1) + (c + 1 == t->ncol ? 0 : h[c + 1])];
+  return r;
+}
+
+static int chomp_get(const struct chomp_retro_table *t,unsigned long long r)
+{
+  return (t->value[r >> 3] >> (r & 7)) & 1;
+}
+
+static unsigned long long chomp_binom(int n,int k)
+{
+  unsigned long long r = 1;
+  int i;
+  for (i = 1;i <= k;i ++)
+      r = r * (n - k + i) / i;
+  return r;
+}
+
+/* Returns 0, or -1 if the board is too large to tabulate. */
+int chomp_retro(struct chomp_retro_table *t,int nr,int nc,unsigned long long limit)
+{
+  unsigned long long r,n;
+  int c,v,row,col,val;
+  int h[128],q[128];
+
+  t->nrow = nr;
+  t->ncol = nc;
+  t->w = NULL;
+  t->value = NULL;
+  if (nc > 128) return -1;
+  for (n = 1,c = 1;c <= nc;c ++)  /* C(nr + nc,nc), stopping past limit */
+    {
+      n = n * (nr + c) / c;
+      if (n > limit) return -1;
+    }
+  t->count = n;
+  t->w = malloc(nc * (nr + 1) * sizeof(unsigned long long));
+  t->value = calloc((n + 7) / 8,1);
+  if (t->w == NULL || t->value == NULL) return -1;
+  for (c = 0;c != nc;c ++)
+    {
+      t->w[c * (nr + 1)] = 0;
+      for (v = 1;v <= nr;v ++)
+          t->w[c * (nr + 1) + v] = t->w[c * (nr + 1) + v - 1]
+                                 + chomp_binom(nr - v + 1 + c,c);
+    }
+
+  memset(h,0,sizeof(h)); /* rank 0 is the empty board, value 1 */
+  t->value[0] = 1;
+  for (r = 1;r != n;r ++)
+    {
+      for (c = 0;h[c] == nr;c ++); /* next position in rank order */
+      h[c] ++;
+      while (c --) h[c] = h[c + 1];
+      val = 0;
+      for (row = 0;row != nr && ! val;row ++)
+          for (col = 0;col != nc && h[col] > row && ! val;col ++)
+            {
+              chomp_move(h,q,nc,row,col);
+              val = ! chomp_get(t,chomp_rank(t,q));
+            }
+      t->value[r >> 3] |= val << (r & 7);
+    }
+  return 0;
+}
+
+void chomp_retro_free(struct chomp_retro_table *t)
+{
+  free(t->w);
+  free(t->value);
+}
+
+/* --- transposition table search ----------------------------------------- */
+
+/*
+ * Open addressing, shared by all threads.  A key lives in one of the
+ * CHOMP_PROBES slots after its hash; when all are taken, the first is
+ * overwritten, so the table works at any size and only costs recomputed
+ * values once it is full.  Each slot's state holds a generation count
+ * above a 2-bit tag (0 empty, 1 being written, 2 + value); a writer
+ * claims the slot by moving the tag to 1, stores the key and publishes
+ * the value with a new generation, and a reader retries if the state
+ * changed while it read the key.
+ */
+#define CHOMP_PROBES 8
+
+struct chomp_tt
+{
+  unsigned long long (*key)[2]; /* low and high halves, read and written */
+                                /* with relaxed atomics */
+  unsigned *state;
+  unsigned long long mask;
+  unsigned long long stored;     /* values written */
+  unsigned long long replaced;   /* of which overwrote another key */
+};
+
+static void chomp_tt_setkey(struct chomp_tt *tt,unsigned long long i,chomp_key k)
+{
+  __atomic_store_n(&tt->key[i][0],(unsigned long long)k,__ATOMIC_RELAXED);
+  __atomic_store_n(&tt->key[i][1],(unsigned long long)(k >> 32 >> 32),__ATOMIC_RELAXED);
+}
+
+static int chomp_tt_iskey(struct chomp_tt *tt,unsigned long long i,chomp_key k)
+{
+  return __atomic_load_n(&tt->key[i][0],__ATOMIC_RELAXED) == (unsigned long long)k
+      && __atomic_load_n(&tt->key[i][1],__ATOMIC_RELAXED) == (unsigned long long)(k >> 32 >> 32);
+}
+
+static unsigned long long chomp_hash(chomp_key k)
+{
+  unsigned long long x = (unsigned long long)k ^
+                         (unsigned long long)(k >> 32 >> 32) * 0x9e3779b97f4a7c15ull;
+  x ^= x >> 31;
+  x *= 0xbf58476d1ce4e5b9ull;
+  x ^= x >> 29;
+  return x;
+}
+
+int chomp_tt_init(struct chomp_tt *tt,int log2_slots)
+{
+  tt->mask = (1ull << log2_slots) - 1;
+  tt->key = malloc((tt->mask + 1) * sizeof(*tt->key));
+  tt->state = calloc(tt->mask + 1,sizeof(unsigned));
+  tt->stored = 0;
+  tt->replaced = 0;
+  return tt->key != NULL && tt->state != NULL ? 0 : -1;
+}
+
+void chomp_tt_free(struct chomp_tt *tt)
+{
+  free(tt->key);
+  free(tt->state);
+}
+
+size_t chomp_tt_bytes(const struct chomp_tt *tt)
+{
+  return (tt->mask + 1) * (sizeof(*tt->key) + sizeof(unsigned));
+}
+
+/* value of key, or -1 if not stored */
+int chomp_tt_get(struct chomp_tt *tt,chomp_key k)
+{
+  unsigned long long i = chomp_hash(k);
+  unsigned st;
+  int n,hit;
+  for (n = 0;n != CHOMP_PROBES;n ++)
+    {
+      unsigned long long slot = (i + n) & tt->mask;
+      unsigned *state = &tt->state[slot];
+      do
+        {
+          while (((st = __atomic_load_n(state,__ATOMIC_ACQUIRE)) & 3) == 1);
+          hit = chomp_tt_iskey(tt,slot,k);
+          __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        }
+      while (__atomic_load_n(state,__ATOMIC_RELAXED) != st);
+      if ((st & 3) == 0) return -1;
+      if (hit) return (st & 3) - 2;
+    }
+  return -1;
+}
+
+void chomp_tt_put(struct chomp_tt *tt,chomp_key k,int value)
+{
+  unsigned long long i = chomp_hash(k);
+  unsigned st;
+  unsigned *state;
+  int n;
+  for (n = 0;n != CHOMP_PROBES;n ++)
+    {
+      state = &tt->state[(i + n) & tt->mask];
+      st = __atomic_load_n(state,__ATOMIC_ACQUIRE);
+      if ((st & 3) == 0) break;
+      if ((st & 3) != 1 && chomp_tt_iskey(tt,(i + n) & tt->mask,k)) return;
+    }
+  if (n == CHOMP_PROBES) /* all taken: overwrite the first */
+    {
+      n = 0;
+      state = &tt->state[i & tt->mask];
+      st = __atomic_load_n(state,__ATOMIC_ACQUIRE);
+    }
+  if ((st & 3) == 1 ||
+      ! __atomic_compare_exchange_n(state,&st,(st & ~3u) | 1,0,
+                                    __ATOMIC_ACQUIRE,__ATOMIC_RELAXED))
+      return; /* another writer has the slot; the value can be recomputed */
+  if ((st & 3) != 0) __atomic_fetch_add(&tt->replaced,1,__ATOMIC_RELAXED);
+  chomp_tt_setkey(tt,(i + n) & tt->mask,k);
+  __atomic_store_n(state,(st & ~3u) + 4 + 2 + value,__ATOMIC_RELEASE);
+  __atomic_fetch_add(&tt->stored,1,__ATOMIC_RELAXED);
+}
+
+static int chomp_value(struct chomp_tt *tt,const int *h,int nr,int nc)
+{
+  chomp_key k;
+  int row,col,val = 0;
+  int q[nc];
+  if (h[0] == 0) return 1; /* empty board: the poison was just taken */
+  k = chomp_encode(h,nr,nc);
+  if ((val = chomp_tt_get(tt,k)) >= 0) return val;
+  val = 0;
+  for (row = 0;row != nr && ! val;row ++)
+      for (col = 0;col != nc && h[col] > row && ! val;col ++)
+        {
+          chomp_move(h,q,nc,row,col);
+          val = ! chomp_value(tt,q,nr,nc);
+        }
+  chomp_tt_put(tt,k,val);
+  return val;
+}
+
+struct chomp_root
+{
+  struct chomp_tt *tt;
+  int nrow,ncol,nmoves;
+  int (*move)[2];  /* root moves, in make_list() order */
+  int *value;      /* value of the position each one leads to */
+  int next,best;   /* next move to take; first move known to win */
+};
+
+static void *chomp_root_worker(void *arg)
+{
+  struct chomp_root *root = arg;
+  int i,q[128],full[128];
+  for (i = 0;i != root->ncol;i ++) full[i] = root->nrow;
+  while ((i = __atomic_fetch_add(&root->next,1,__ATOMIC_RELAXED)) < root->nmoves)
+    {
+      if (i > __atomic_load_n(&root->best,__ATOMIC_RELAXED))
+          continue; /* an earlier move already wins */
+      chomp_move(full,q,root->ncol,root->move[i][0],root->move[i][1]);
+      root->value[i] = chomp_value(root->tt,q,root->nrow,root->ncol);
+      if (root->value[i] == 0)
+        {
+          int b = __atomic_load_n(&root->best,__ATOMIC_RELAXED);
+          while (i < b && ! __atomic_compare_exchange_n(&root->best,&b,i,0,
+                                  __ATOMIC_RELAXED,__ATOMIC_RELAXED));
+        }
+    }
+  return NULL;
+}
+
+/*
+ * Solve the full nr x nc board on nthreads threads, each taking root
+ * moves in turn.  Stores the chosen move in *row,*col and returns the
+ * board's value, or -1 on error.
+ */
+int chomp_search(struct chomp_tt *tt,int nr,int nc,int nthreads,int *row,int *col)
+{
+  struct chomp_root root;
+  pthread_t tid[64];
+  int r,c,t,i;
+  if (nr + nc + 1 > CHOMP_KEY_BITS || nc > 128) return -1;
+  root.tt = tt;
+  root.nrow = nr;
+  root.ncol = nc;
+  root.nmoves = 0;
+  root.move = malloc(nr * nc * sizeof(*root.move));
+  root.value = malloc(nr * nc * sizeof(int));
+  if (root.move == NULL || root.value == NULL) return -1;
+  for (r = 0;r != nr;r ++)
+      for (c = 0;c != nc;c ++)
+        {
+          root.move[root.nmoves][0] = r;
+          root.move[root.nmoves ++][1] = c;
+        }
+  root.next = 0;
+  root.best = root.nmoves;
+  if (nthreads > 64) nthreads = 64;
+  for (t = 1;t < nthreads;t ++)
+      pthread_create(&tid[t],NULL,chomp_root_worker,&root);
+  chomp_root_worker(&root);
+  for (t = 1;t < nthreads;t ++)
+      pthread_join(tid[t],NULL);
+  i = root.best < root.nmoves ? root.best : root.nmoves - 1;
+  *row = root.move[i][0];
+  *col = root.move[i][1];
+  free(root.move);
+  free(root.value);
+  return root.best < root.nmoves;
+}
+
+static double chomp_seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Time the _play tree (when it is small enough), the retrograde table
+ * and the threaded search on an nr x nc board.  Every value in the tree
+ * is checked against the table, and all three must pick the same first
+ * move.
+ */
+int chomp_bench(int nr,int nc,int nthreads,int log2_slots)
+{
+  struct chomp_retro_table t;
+  struct chomp_tt tt;
+  struct _play *tree,*look;
+  int *win,*full,row,col,trow = -1,tcol = -1,bad = 0,bits,val;
+  unsigned long long n,i;
+  double sec;
+
+  if (nr < 1 || nc < 1 || nr + nc + 1 > CHOMP_KEY_BITS || nc > 128)
+    {
+      printf("board must have nrow + ncol < %d, ncol <= 128\n",CHOMP_KEY_BITS);
+      return 1;
+    }
+  nrow = nr;
+  ncol = nc;
+  printf("%d x %d CHOMP, %d-bit keys\n",nr,nc,CHOMP_KEY_BITS);
+
+  sec = chomp_seconds();
+  if (chomp_retro(&t,nr,nc,1ull << 33) == 0)
+    {
+      sec = chomp_seconds() - sec;
+      val = chomp_get(&t,t.count - 1);
+      printf("retrograde : %llu positions, %.3e positions/s, table %llu bytes\n",
+             t.count,t.count / sec,(t.count + 7) / 8);
+      full = make_data(nr,nc);
+      for (row = 0;row != nr && trow < 0;row ++) /* first move to a 0 */
+          for (col = 0;col != nc && trow < 0;col ++)
+            {
+              int q[128];
+              chomp_move(full,q,nc,row,col);
+              if (! chomp_get(&t,chomp_rank(&t,q))) trow = row,tcol = col;
+            }
+      if (trow < 0) trow = nr - 1,tcol = nc - 1; /* no good move: the last one */
+      printf("             value %d, first move (%d,%d)\n",val,trow,tcol);
+      free(full);
+    }
+  else
+      printf("retrograde : skipped, too many positions\n");
+
+  n = 1;
+  for (i = 1;i <= (unsigned long long)nc && n < (1ull << 40);i ++) n = n * (nr + i) / i;
+  for (bits = 10;(1ull << bits) < 2 * n && bits < log2_slots;bits ++);
+  if (chomp_tt_init(&tt,bits) < 0) return 1;
+  sec = chomp_seconds();
+  val = chomp_search(&tt,nr,nc,nthreads,&row,&col);
+  sec = chomp_seconds() - sec;
+  printf("search     : %d threads, %llu positions, %.3e positions/s, table %zu bytes\n",
+         nthreads,tt.stored,tt.stored / sec,chomp_tt_bytes(&tt));
+  if (tt.replaced)
+      printf("             %llu entries overwritten\n",tt.replaced);
+  printf("             value %d, first move (%d,%d)\n",val,row,col);
+  if (trow >= 0 && (row != trow || col != tcol))
+    {
+      printf("search and retrograde disagree\n");
+      bad = 1;
+    }
+
+  if (n <= 20000) /* the tree is quadratic in the number of positions */
+    {
+      sec = chomp_seconds();
+      tree = make_play(1);
+      win = get_winning_move(tree);
+      sec = chomp_seconds() - sec;
+      full = make_data(nr,nc);
+      get_real_move(win,full,&trow,&tcol);
+      printf("_play tree : %llu positions, %.3e positions/s\n",n,n / sec);
+      printf("             get_winning_move (%d,%d)\n",trow,tcol);
+      if (row != trow || col != tcol)
+        {
+          printf("search and get_winning_move disagree\n");
+          bad = 1;
+        }
+      for (look = tree;look != NULL && t.value != NULL;look = look -> next)
+          if (look -> value != chomp_get(&t,chomp_rank(&t,look -> state)))
+              bad = 1;
+      for (look = tree;look != NULL;look = look -> next)
+        {
+          int v = chomp_tt_get(&tt,chomp_encode(look -> state,nr,nc));
+          if (v >= 0 && v != look -> value)
+              bad = 1;
+        }
+      free(win);
+      free(full);
+      dump_play(tree);
+    }
+  printf("%s\n",bad ? "values DISAGREE" : "all values agree");
+  chomp_retro_free(&t);
+  chomp_tt_free(&tt);
+  return bad;
+}
+
+int main(int argc,char **argv)
 {
   int row,col,maxrow,player;
   int *win,*current,*temp;
   struct _play *tree,*look;
+  if (argc > 1 && ! strcmp(argv[1],"-bench"))
+    { /* chomp -bench [rows [cols [threads [log2 table slots]]]] */
+      int nthreads,log2_slots;
+      nrow = argc > 2 ? atoi(argv[2]) : 8;
+      ncol = argc > 3 ? atoi(argv[3]) : 7;
+      nthreads = argc > 4 ? atoi(argv[4]) : 4;
+      log2_slots = argc > 5 ? atoi(argv[5]) : 22;
+      return chomp_bench(nrow,ncol,nthreads < 1 ? 1 : nthreads,
+                         log2_slots < 16 ? 16 : log2_slots > 34 ? 34 : log2_slots);
+    }
     /* allow user to select mode */
   printf("Mode : 1 -> multiple first moves\n");
   printf("       2 -> report game\n");
@@ -38,6 +38,10 @@ PART 1: PROGRAM
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
 
 #define NOOP		0
 #define ADD		1
@@ -339,6 +343,33 @@ void doSearch(void)
 	printSolution( solution, bestDepth );
 }
 
+int setInput( int *nums, int length )
+
+/*  Set up the global variables for a search over nums[0..length-1],
+    nums[length] being t.
+*/
+
+{
+    free( workList );
+    free( combList );
+    free( solution );
+
+    listLength = length;
+    goal = nums[listLength];
+    best = 0;
+    bestDepth = 0;
+
+    workList = newWorkList( 2 * listLength );
+    combList = newCombList( listLength );
+    solution = newCombList( listLength );
+
+    initWorkList( workList, nums, listLength );
+    initCombList( combList, listLength );
+    initCombList( solution, listLength );
+
+    return( listLength );
+}
+
 int getInput(void)
 {
     int nums[16];
@@ -358,18 +389,7 @@ int getInput(void)
 
     if( i == 0 ) i = 4;
 
-    listLength = i - 1;
-    goal = nums[listLength];
-    
-    workList = newWorkList( 2 * listLength );
-    combList = newCombList( listLength );
-    solution = newCombList( listLength );
-
-    initWorkList( workList, nums, listLength );
-    initCombList( combList, listLength );
-    initCombList( solution, listLength );
-
-    return( listLength );
+    return( setInput( nums, i - 1 ) );
 }
 
 void search(void)
@@ -381,8 +401,548 @@ void search(void)
     doSearch();
 }
 
+/************************* SUBSET-DP SEARCH *************************/
+
+/*  Alternative to the iterative deepening search. Rather than enumerating
+    sequences of combinations, it computes for every subset of S (a mask
+    over the first listLength entries of the work list) the set of values
+    an expression using exactly those numbers can take. That set only
+    depends on the sets of the proper submasks, so masks are processed in
+    layers of increasing size; layer k corresponds to depth k - 1 of
+    doSearch(), and the first layer reaching t gives a solution with no
+    more combinations than the one doSearch() finds.
+
+    Each unordered split { A, B } of a mask is visited once (A holds the
+    lowest number of the mask) and each pair of values is combined with
+    the larger one as left operand, so a+b / b+a and a*b / b*a are only
+    tried once. A value is stored once per mask however many expressions
+    reach it, which is where the memoization pays: recSearch() rebuilds
+    the same sub-expressions along every path. Combinations are pruned as
+    in recSearch() (no x*1, x/1 or use of a 0) and results that would
+    overflow an int are dropped.
+
+    The masks of a layer are independent and are handed out to dpThreads
+    workers through an atomic counter. Each worker folds the distance of
+    its values to t into a shared atomic minimum; once a worker reaches t
+    the others stop taking new masks.
+*/
+
+typedef struct
+{
+    int left;		/* mask of the left operand, 0 for an element of S */
+    int lval, rval;	/* operand values, lval >= rval */
+    int operation;
+
+} DpEntry;
+
+typedef struct
+{
+    int *value;
+    DpEntry *entry;
+    int count;
+
+} DpSet;
+
+typedef struct
+{
+    int *value;		/* values of the mask being built, with entries */
+    DpEntry *entry;
+    int count, size;
+    int *slot;		/* open addressing table of indices into value */
+    unsigned *stamp;	/* slot is in use iff stamp == gen */
+    unsigned gen;
+    int slotMask;
+    double states;	/* pairs of values combined */
+
+} DpScratch;
+
+static int dpThreads = 1;
+static DpSet *dpSets;		/* indexed by mask */
+static int *dpQueue;		/* masks of the current layer */
+static int dpQueueLength;
+static int dpNext;		/* next entry of dpQueue to build */
+static int dpFound;		/* t was reached in the current layer */
+static double dpStart, dpFirst;
+static unsigned long long dpLayerBest;
+
+static double dpNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void *dpCheck( void *p )
+{
+    if( p ) return p;
+
+    fprintf( stderr, "Out of memory for subset search\n" );
+    exit( 1 );
+}
+
+static void *dpAlloc( size_t size )
+{
+    return dpCheck( malloc( size ? size : 1 ) );
+}
+
+static unsigned dpHash( int value )
+{
+    unsigned h = (unsigned) value * 0x9e3779b1u;
+
+    return h ^ ( h >> 16 );
+}
+
+static void dpRehash( DpScratch *s, int slots )
+{
+    int i;
+
+    free( s->slot );
+    free( s->stamp );
+    s->slot = (int *) dpAlloc( slots * sizeof( int ) );
+    s->stamp = (unsigned *) dpCheck( calloc( slots, sizeof( unsigned ) ) );
+    s->slotMask = slots - 1;
+    s->gen = 1;
+
+    for( i = 0; i < s->count; i++ )
+    {
+	unsigned h = dpHash( s->value[i] ) & s->slotMask;
+
+	while( s->stamp[h] == s->gen ) h = ( h + 1 ) & s->slotMask;
+	s->stamp[h] = s->gen;
+	s->slot[h] = i;
+    }
+}
+
+static void dpInsert( DpScratch *s, long long value, int left,
+		      int lval, int rval, int operation )
+
+/*  Add value to the set being built unless it is already there or does
+    not fit in an int.
+*/
+
+{
+    unsigned h;
+
+    if( value > INT_MAX ) return;
+
+    if( 2 * ( s->count + 1 ) > s->slotMask + 1 )
+	dpRehash( s, 2 * ( s->slotMask + 1 ) );
+
+    h = dpHash( (int) value ) & s->slotMask;
+
+    while( s->stamp[h] == s->gen )
+    {
+	if( s->value[s->slot[h]] == value ) return;
+	h = ( h + 1 ) & s->slotMask;
+    }
+
+    if( s->count == s->size )
+    {
+	s->size *= 2;
+	s->value = (int *) dpCheck( realloc( s->value,
+					     s->size * sizeof( int ) ) );
+	s->entry = (DpEntry *) dpCheck( realloc( s->entry,
+					s->size * sizeof( DpEntry ) ) );
+    }
+
+    s->stamp[h] = s->gen;
+    s->slot[h] = s->count;
+    s->value[s->count] = (int) value;
+    s->entry[s->count].left = left;
+    s->entry[s->count].lval = lval;
+    s->entry[s->count].rval = rval;
+    s->entry[s->count].operation = operation;
+    s->count++;
+}
+
+static void dpCombine( DpScratch *s, int maskA, int maskB )
+
+/*  Combine every value of maskA with every value of maskB.
+*/
+
+{
+    const DpSet *a = &dpSets[maskA];
+    const DpSet *b = &dpSets[maskB];
+    int i, j;
+
+    s->states += (double) a->count * b->count;
+
+    for( i = 0; i < a->count; i++ )
+    {
+	int x = a->value[i];
+
+	for( j = 0; j < b->count; j++ )
+	{
+	    int y = b->value[j];
+	    int hi = x >= y ? x : y;
+	    int lo = x >= y ? y : x;
+	    int left = x >= y ? maskA : maskB;
+
+	    dpInsert( s, (long long) hi + lo, left, hi, lo, ADD );
+
+	    /* a - a = 0 may not be used any further */
+	    if( hi != lo )
+		dpInsert( s, hi - lo, left, hi, lo, SUB );
+
+	    /* x * 1 = x; x / 1 = x */
+	    if( lo == 1 ) continue;
+
+	    dpInsert( s, (long long) hi * lo, left, hi, lo, MUL );
+
+	    if( hi % lo == 0 )
+		dpInsert( s, hi / lo, left, hi, lo, DIV );
+	}
+    }
+}
+
+static void dpBuild( DpScratch *s, int mask )
+
+/*  Compute the set of values of mask, whose proper submasks are done,
+    and fold its best value into dpLayerBest.
+*/
+
+{
+    int low = mask & -mask;
+    int rest = mask ^ low;
+    int sub, i;
+    unsigned long long key, layerBest = ~0ULL;
+    DpSet *set = &dpSets[mask];
+
+    s->count = 0;
+    if( ++s->gen == 0 ) dpRehash( s, s->slotMask + 1 );
+
+    /* A = low | sub for every proper submask sub of rest */
+    for( sub = ( rest - 1 ) & rest; ; sub = ( sub - 1 ) & rest )
+    {
+	dpCombine( s, low | sub, mask ^ ( low | sub ) );
+	if( sub == 0 ) break;
+    }
+
+    set->value = (int *) dpAlloc( s->count * sizeof( int ) );
+    set->entry = (DpEntry *) dpAlloc( s->count * sizeof( DpEntry ) );
+    memcpy( set->value, s->value, s->count * sizeof( int ) );
+    memcpy( set->entry, s->entry, s->count * sizeof( DpEntry ) );
+    set->count = s->count;
+
+    /* key: distance to t, then side of t, then mask */
+    for( i = 0; i < s->count; i++ )
+    {
+	long long d = (long long) s->value[i] - goal;
+
+	key = (unsigned long long) ( d < 0 ? -d : d ) << 17 |
+	      (unsigned long long) ( d > 0 ) << 16 | mask;
+	if( key < layerBest ) layerBest = key;
+    }
+
+    key = __atomic_load_n( &dpLayerBest, __ATOMIC_RELAXED );
+    while( layerBest < key &&
+	   !__atomic_compare_exchange_n( &dpLayerBest, &key, layerBest, 1,
+					 __ATOMIC_RELAXED,
+					 __ATOMIC_RELAXED ) )
+	;
+
+    if( layerBest >> 17 == 0 &&
+	!__atomic_exchange_n( &dpFound, 1, __ATOMIC_RELAXED ) )
+	dpFirst = dpNow() - dpStart;
+}
+
+static void *dpWorker( void *arg )
+{
+    DpScratch *s = (DpScratch *) arg;
+
+    while( !__atomic_load_n( &dpFound, __ATOMIC_RELAXED ) )
+    {
+	int i = __atomic_fetch_add( &dpNext, 1, __ATOMIC_RELAXED );
+
+	if( i >= dpQueueLength ) break;
+	dpBuild( s, dpQueue[i] );
+    }
+
+    return NULL;
+}
+
+static int dpEmit( Comb *out, int n, int mask, int value )
+
+/*  Append to out the combinations producing value from mask, operands
+    first, and return the new length of out.
+*/
+
+{
+    const DpSet *set = &dpSets[mask];
+    const DpEntry *e;
+    int i;
+
+    for( i = 0; set->value[i] != value; i++ )
+	;
+    e = &set->entry[i];
+
+    if( e->operation == NOOP ) return n;
+
+    n = dpEmit( out, n, e->left, e->lval );
+    n = dpEmit( out, n, mask ^ e->left, e->rval );
+
+    out[n].operand1 = e->lval;
+    out[n].operand2 = e->rval;
+    out[n].operation = e->operation;
+
+    return n + 1;
+}
+
+int dpSearch( double *states, double *first )
+
+/*  Subset-DP counterpart of doSearch(): print the best expression and
+    return its number of combinations. *states receives the number of
+    value pairs combined and *first the time at which t was first
+    reached, or -1.
+
+    The answer can be better than doSearch()'s, because recSearch() has
+    two quirks that are kept there but not copied here:
+
+    - best starts at 0, so a value only counts if it is nearer to t than
+      0 is. With { 100 } and t = 36 doSearch() reports distance 36 and
+      no expression, where 100 is at distance 64 -- and with { 65536,
+      1000 } and t = 60, distance 60 where 1000 is at 940. So when
+      nothing gets within t of the goal, dpSearch() reports a larger
+      distance than doSearch() claims, but for a real expression.
+    - a division is tested for divisibility before the operands are put
+      in order, so it is only tried when the later number in the work
+      list divides by the earlier one: with { 10, 2 } it never tries
+      10:2. dpSearch() tries every divisible pair, and may reach t in
+      fewer combinations or get closer to it.
+*/
+
+{
+    int masks = 1 << listLength;
+    int nthreads = dpThreads < 1 ? 1 : dpThreads > 64 ? 64 : dpThreads;
+    DpScratch scratch[64];
+    pthread_t tid[64];
+    unsigned long long bestKey = ~0ULL;
+    int mask, size, i, length;
+    long long dist;
+
+    dpStart = dpNow();
+    dpFirst = -1;
+    dpSets = (DpSet *) dpCheck( calloc( masks, sizeof( DpSet ) ) );
+    dpQueue = (int *) dpAlloc( masks * sizeof( int ) );
+
+    memset( scratch, 0, sizeof( scratch ) );
+    for( i = 0; i < nthreads; i++ )
+    {
+	scratch[i].size = 64;
+	scratch[i].value = (int *) dpAlloc( 64 * sizeof( int ) );
+	scratch[i].entry = (DpEntry *) dpAlloc( 64 * sizeof( DpEntry ) );
+	dpRehash( &scratch[i], 128 );
+    }
+
+    for( size = 1; size <= listLength; size++ )
+    {
+	dpQueueLength = 0;
+	for( mask = 1; mask < masks; mask++ )
+	    if( __builtin_popcount( mask ) == size )
+		dpQueue[dpQueueLength++] = mask;
+
+	dpNext = 0;
+	dpFound = 0;
+	dpLayerBest = ~0ULL;
+
+	if( size == 1 )
+	{
+	    /* elements of S */
+	    for( i = 0; i < listLength; i++ )
+	    {
+		DpSet *set = &dpSets[1 << i];
+		unsigned long long key;
+
+		set->value = (int *) dpAlloc( sizeof( int ) );
+		set->entry = (DpEntry *) dpCheck( calloc( 1, sizeof( DpEntry ) ) );
+		set->value[0] = workList[i];
+		set->count = 1;
+
+		dist = (long long) workList[i] - goal;
+		key = (unsigned long long) ( dist < 0 ? -dist : dist ) << 17 |
+		      (unsigned long long) ( dist > 0 ) << 16 | 1 << i;
+		if( key < dpLayerBest ) dpLayerBest = key;
+	    }
+	    if( dpLayerBest >> 17 == 0 ) dpFirst = dpNow() - dpStart;
+	}
+
+	else
+	{
+	    for( i = 1; i < nthreads; i++ )
+		if( pthread_create( &tid[i], NULL, dpWorker, &scratch[i] ) )
+		{
+		    fprintf( stderr, "Cannot create search thread\n" );
+		    exit( 1 );
+		}
+	    dpWorker( &scratch[0] );
+	    for( i = 1; i < nthreads; i++ )
+		pthread_join( tid[i], NULL );
+	}
+
+	/* strictly closer only, so smaller expressions win ties */
+	if( dpLayerBest >> 17 < bestKey >> 17 ) bestKey = dpLayerBest;
+	if( bestKey >> 17 == 0 ) break;
+    }
+
+    /* rebuild the expression */
+    mask = (int) ( bestKey & 0xffff );
+    dist = (long long) ( bestKey >> 17 );
+    length = 0;
+    if( mask )
+    {
+	best = (int) ( ( bestKey >> 16 & 1 ) ? goal + dist : goal - dist );
+	length = dpEmit( combList, 0, mask, best );
+    }
+
+    if( dist == 0 && length == 0 ) printf( ".\n" );
+    else printSolution( combList, length );
+
+    *states = 0;
+    for( i = 0; i < nthreads; i++ )
+    {
+	*states += scratch[i].states;
+	free( scratch[i].value );
+	free( scratch[i].entry );
+	free( scratch[i].slot );
+	free( scratch[i].stamp );
+    }
+    *first = dpFirst;
+
+    for( mask = 0; mask < masks; mask++ )
+    {
+	free( dpSets[mask].value );
+	free( dpSets[mask].entry );
+    }
+    free( dpSets );
+    free( dpQueue );
+
+    return length;
+}
+
+/************************* BENCHMARK *************************/
+
+static int benchInstance( int *nums, int length )
+
+/*  Solve one instance with doSearch() and with dpSearch() on one and on
+    dpThreads threads; return 0 if dpSearch() ends up farther from t, or,
+    when both reach t, uses more combinations. See dpSearch() for why it
+    can do better; a distance doSearch() reports without an expression
+    (nothing nearer than 0) is not held against it.
+*/
+
+{
+    int threads[2], runs, r, i, ops, dist, ok = 1, same = 1;
+    int refOps, refDist, refFound;
+    double t, refTime, states, first;
+
+    threads[0] = 1;
+    threads[1] = dpThreads;
+    runs = dpThreads > 1 ? 2 : 1;
+
+    for( i = 0; i < length; i++ ) printf( "%d ", nums[i] );
+    printf( "-> %d\n", nums[length] );
+
+    setInput( nums, length );
+    printf( "  doSearch:  " );
+    t = dpNow();
+    search();
+    refTime = dpNow() - t;
+    refDist = abs( best - goal );
+    refOps = bestDepth;
+    refFound = bestDepth > 0 || best != 0;
+
+    printf( "  %-10s %4s %4s %8s %12s %10s %10s %12s\n", "engine", "thr",
+	    "ops", "dist", "states", "time ms", "first ms", "states/s" );
+    printf( "  %-10s %4d %4d %8d %12d %10.3f ", "doSearch", 1, refOps,
+	    refDist, nbNodes, refTime * 1e3 );
+    if( stopSearch || refDist == 0 ) printf( "%10.3f", refTime * 1e3 );
+    else printf( "%10s", "-" );
+    printf( " %12.4g\n", nbNodes / refTime );
+
+    for( r = 0; r < runs; r++ )
+    {
+	int saved = dpThreads;
+
+	setInput( nums, length );
+	dpThreads = threads[r];
+	printf( "  subset-dp: " );
+	t = dpNow();
+	ops = dpSearch( &states, &first );
+	t = dpNow() - t;
+	dpThreads = saved;
+
+	printf( "  %-10s %4d %4d %8d %12.0f %10.3f ", "subset-dp", threads[r],
+		ops, abs( best - goal ), states, t * 1e3 );
+	if( first >= 0 ) printf( "%10.3f", first * 1e3 );
+	else printf( "%10s", "-" );
+	printf( " %12.4g\n", states / t );
+
+	dist = abs( best - goal );
+	if( ( refFound && dist > refDist ) ||
+	    ( dist == 0 && refDist == 0 && ops > refOps ) )
+	    ok = 0;
+	if( dist != refDist || ( dist == 0 && ops != refOps ) )
+	    same = 0;
+    }
+
+    printf( "  %s\n\n", !ok ? "MISMATCH" : same ? "agree" :
+	    refFound ? "subset-dp better" : "no doSearch expression to compare" );
+    return ok;
+}
+
+int benchSearch( int argc, char *argv[] )
+
+/*  -bench [threads [n1 ... nk t]]
+    Compare doSearch() and dpSearch() on the given instance, or on a few
+    built-in ones.
+*/
+
+{
+    static int instances[][8] =
+    {
+	{ 13, 32, 14, 1412 },
+	{ 25, 50, 75, 100, 3, 6, 952 },
+	{ 1, 3, 7, 10, 25, 50, 765 },
+	{ 2, 3, 5, 7, 11, 13, 9999 },
+	{ 4, 7, 9, 25, 75, 100, 3, 886 }
+    };
+    static int lengths[] = { 3, 6, 6, 6, 7 };
+    int nums[16];
+    int i, ok = 1;
+
+    dpThreads = argc > 0 ? atoi( argv[0] ) : 4;
+    if( dpThreads < 1 ) dpThreads = 1;
+    if( dpThreads > 64 ) dpThreads = 64;
+
+    if( argc > 2 )
+    {
+	if( argc - 1 > 16 )
+	{
+	    fprintf( stderr, "At most 15 numbers\n" );
+	    return 1;
+	}
+	for( i = 1; i < argc; i++ ) nums[i - 1] = atoi( argv[i] );
+	for( i = 0; i < argc - 1; i++ )
+	    if( nums[i] <= 0 )
+	    {
+		fprintf( stderr, "Numbers must be natural numbers\n" );
+		return 1;
+	    }
+	return !benchInstance( nums, argc - 2 );
+    }
+
+    for( i = 0; i < (int) ( sizeof( lengths ) / sizeof( lengths[0] ) ); i++ )
+	ok &= benchInstance( instances[i], lengths[i] );
+
+    return !ok;
+}
+
 int main( int argc, char *argv[] )
 {
+    if( argc > 1 && !strcmp( argv[1], "-bench" ) )
+	return benchSearch( argc - 2, argv + 2 );
+
     if( getInput() )
 	search();
     return 0;
@@ -33,6 +33,9 @@ prob described above.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
 
 #define INF 10000
 #define MAX_REG_LN 100
@@ -59,6 +62,7 @@ int simulate(int iterations, misr_type *present, double prob, char *structure);
 void init(misr_type *present);
 void kill_list(misr_type *present);
 void create_link_list(misr_type *cell_array);
+int misr_bench(int argc, char *argv[]);
 
 /* Main Program */
 
@@ -70,6 +74,9 @@ int main(int argc,char *argv[])
 	char structure[MAX_REG_LN];
 	unsigned short seed[3];
 
+	if (argc > 1 && !strcmp(argv[1], "-bench"))
+		return misr_bench(argc - 2, argv + 2);
+
 /* Check usage */
 	if (0 && argc < 6)
 	{
@@ -289,3 +296,411 @@ int simulate(int iterations, misr_type *present, double prob, char *structure)
 	return different;
 
 }
+
+
+/*************************************************************
+Bit-sliced simulator.
+
+Since every cell is updated modulo 2, only the difference
+between the fault free and the faulty MISR matters: it starts
+at zero, shifts exactly like the MISR and picks up a 1 in cell
+i whenever an error is injected there. The outputs are the
+same (the errors aliased) iff the difference is zero at the
+end. The simulator below therefore keeps the difference
+register only, one word per cell, with bit t of every word
+belonging to trial t, so that one clock advances 64 (or 256)
+independent trials. The feedback cells are selected with
+all-ones/all-zeros XOR masks and the errors come from a
+Bernoulli generator that builds a word of p-biased bits from
+random words along the binary expansion of p.
+
+In the infinite case (#_vectors = 0) each lane is a chain run
+for INF clocks and then sampled on MISR_CHAIN consecutive
+clocks, as the serial program samples one chain.
+*************************************************************/
+
+#define MISR_CHAIN 1024
+#define MISR_MAX_THREADS 64
+
+struct misr_setup {
+	int len;		/* reg_len */
+	int vectors;		/* #_vectors, 0 for infinite */
+	unsigned long long p_cell; /* error probabilities scaled by 2^32 */
+	unsigned long long p_last;
+	char tap[MAX_REG_LN];	/* structure as 0/1 */
+	unsigned long long seed;
+	long trials;
+};
+
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__)
+# define MISR_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+# define MISR_CLONES
+#endif
+
+typedef unsigned long long misr_v1 __attribute__((vector_size(8)));
+typedef unsigned long long misr_v4 __attribute__((vector_size(32)));
+
+static unsigned long long misr_splitmix(unsigned long long *z)
+{
+	unsigned long long x = (*z += 0x9e3779b97f4a7c15ULL);
+
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+/* Probability that (lrand48() % scale) / scale < prob, scaled by 2^32 */
+static unsigned long long misr_prob(double prob, int scale)
+{
+	int k, n = 0;
+
+	for (k = 0; k < scale; k++)
+		if (prob > (double)k / scale) n++;
+	return ((unsigned long long)n << 32) / scale;
+}
+
+/*************************************************************
+MISR_ENGINE(sfx, vtype, nwords) defines misr_block_sfx(), which
+runs block #block of 64*nwords lanes and returns the number of
+its samples with identical outputs. xoshiro256** runs in each
+64 bit element; multiplications by 5 and 9 are spelt as shifts
+so they stay in vector registers.
+
+misr_bern_sfx() sets each bit with probability p/2^32. When p
+has few significant bits they are folded in from the lowest one
+(x = x|r for a 1, x&r for a 0), one random word each. Otherwise
+every lane compares a random 32 bit number with p from the top
+bit down and stops once all lanes are decided, which takes
+about log2(lanes) + 2 words whatever p is.
+*************************************************************/
+#define MISR_SHORT_PROB 8
+
+#define MISR_ROTL(x, k) (((x) << (k)) | ((x) >> (64 - (k))))
+
+#define MISR_ENGINE(sfx, vtype, nwords)					\
+static inline __attribute__((always_inline))				\
+void misr_next_##sfx(vtype *s, vtype *out)				\
+{									\
+	vtype r = s[1] + (s[1] << 2);					\
+	vtype t = s[1] << 17;						\
+									\
+	r = MISR_ROTL(r, 7);						\
+	r = r + (r << 3);						\
+	s[2] ^= s[0];							\
+	s[3] ^= s[1];							\
+	s[1] ^= s[2];							\
+	s[0] ^= s[3];							\
+	s[2] ^= t;							\
+	s[3] = MISR_ROTL(s[3], 45);					\
+	*out = r;							\
+}									\
+									\
+static inline __attribute__((always_inline))				\
+void misr_bern_##sfx(vtype *s, unsigned long long p, vtype *out)	\
+{									\
+	vtype x = {0}, r, open;						\
+	unsigned long long any;						\
+	int b, k;							\
+									\
+	if (p >> 32)							\
+		x = ~x;							\
+	else if (p && 32 - __builtin_ctzll(p) <= MISR_SHORT_PROB)	\
+		for (b = __builtin_ctzll(p); b < 32; b++) {		\
+			misr_next_##sfx(s, &r);				\
+			if ((p >> b) & 1) x |= r;			\
+			else x &= r;					\
+		}							\
+	else if (p)							\
+		for (open = ~x, b = 31; b >= 0; b--) {			\
+			misr_next_##sfx(s, &r);				\
+			if ((p >> b) & 1) {				\
+				x |= open & ~r;				\
+				open &= r;				\
+			} else						\
+				open &= ~r;				\
+			for (any = 0, k = 0; k < (nwords); k++)		\
+				any |= open[k];				\
+			if (!any) break;				\
+		}							\
+	*out = x;							\
+}									\
+									\
+static MISR_CLONES long misr_block_##sfx(const struct misr_setup *m,	\
+		long block)						\
+{									\
+	vtype s[4], d[MAX_REG_LN], tap[MAX_REG_LN], fb, e, diff;	\
+	const vtype zero = {0};						\
+	const int lanes = 64 * (nwords);				\
+	const long chain = m->vectors ? 1 : MISR_CHAIN;			\
+	long base = block * lanes * chain, c, n, same = 0;		\
+	unsigned long long z, mask;					\
+	int i, j, k, clocks;						\
+									\
+	for (k = 0; k < (nwords); k++) {				\
+		z = m->seed ^ ((unsigned long long)block * (nwords) + k) \
+				* 0xd1342543de82ef95ULL;		\
+		for (j = 0; j < 4; j++)					\
+			s[j][k] = misr_splitmix(&z);			\
+	}								\
+	for (i = 0; i < m->len; i++) {					\
+		d[i] = zero;						\
+		tap[i] = m->tap[i] ? ~zero : zero;			\
+	}								\
+									\
+	clocks = m->vectors ? m->vectors : INF;				\
+	for (c = 0; c < chain && base + c * lanes < m->trials; c++) {	\
+		for (; clocks > 0; clocks--) {				\
+			fb = zero;					\
+			for (i = 0; i < m->len; i++)			\
+				fb ^= d[i] & tap[i];			\
+			for (i = 0; i < m->len - 1; i++) {		\
+				misr_bern_##sfx(s, m->p_cell, &e);	\
+				d[i] = d[i + 1] ^ e;			\
+			}						\
+			misr_bern_##sfx(s, m->p_last, &e);		\
+			d[m->len - 1] = fb ^ e;				\
+		}							\
+		clocks = 1;						\
+									\
+		diff = zero;						\
+		for (i = 0; i < m->len; i++)				\
+			diff |= d[i];					\
+		n = m->trials - base - c * lanes;			\
+		for (k = 0; k < (nwords) && n > 0; k++, n -= 64) {	\
+			mask = n >= 64 ? ~0ULL : (1ULL << n) - 1;	\
+			same += __builtin_popcountll(~diff[k] & mask);	\
+		}							\
+	}								\
+	return same;							\
+}
+
+MISR_ENGINE(64, misr_v1, 1)
+MISR_ENGINE(256, misr_v4, 4)
+
+static int misr_lanes = 256;
+static int misr_nthreads = 1;
+
+struct misr_job {
+	const struct misr_setup *m;
+	long blocks;
+	long next;		/* next block to run */
+	long same;
+};
+
+static void *misr_worker(void *arg)
+{
+	struct misr_job *job = arg;
+	long b, same = 0;
+
+	while ((b = __sync_fetch_and_add(&job->next, 1)) < job->blocks)
+		same += misr_lanes == 64 ? misr_block_64(job->m, b)
+					 : misr_block_256(job->m, b);
+	__sync_fetch_and_add(&job->same, same);
+	return NULL;
+}
+
+/*************************************************************
+Run m->trials trials on misr_nthreads threads and return the
+number of them where both MISR's agree. Blocks are seeded from
+their index, so the result does not depend on the number of
+threads.
+*************************************************************/
+long misr_simulate_sliced(const struct misr_setup *m)
+{
+	pthread_t tid[MISR_MAX_THREADS];
+	struct misr_job job;
+	long per_block = (long)misr_lanes * (m->vectors ? 1 : MISR_CHAIN);
+	int i, nthreads = misr_nthreads;
+
+	if (nthreads < 1) nthreads = 1;
+	if (nthreads > MISR_MAX_THREADS) nthreads = MISR_MAX_THREADS;
+
+	job.m = m;
+	job.blocks = (m->trials + per_block - 1) / per_block;
+	job.next = 0;
+	job.same = 0;
+	for (i = 1; i < nthreads; i++)
+		if (pthread_create(&tid[i], NULL, misr_worker, &job)) {
+			fprintf(stderr, "cannot create thread\n");
+			exit(1);
+		}
+	misr_worker(&job);
+	for (i = 1; i < nthreads; i++)
+		pthread_join(tid[i], NULL);
+	return job.same;
+}
+
+/*************************************************************
+Exact probability of identical outputs, from the distribution
+of the difference register (2^reg_len states).
+*************************************************************/
+double misr_exact(const struct misr_setup *m)
+{
+	long states = 1L << m->len, x, y;
+	double *dist, *next, p, q, delta;
+	unsigned long long taps = 0;
+	int i, h, clocks;
+
+	dist = calloc(states, sizeof(double));
+	next = malloc(states * sizeof(double));
+	if (!dist || !next) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < m->len; i++)
+		if (m->tap[i]) taps |= 1ULL << i;
+
+	dist[0] = 1;
+	clocks = m->vectors ? m->vectors : INF;
+	for (h = 0; h < clocks; h++) {
+		/* shift, feedback into the last cell */
+		memset(next, 0, states * sizeof(double));
+		for (x = 0; x < states; x++) {
+			y = (x >> 1) | (long)__builtin_parityll(x & taps)
+				<< (m->len - 1);
+			next[y] += dist[x];
+		}
+		/* errors, one cell at a time */
+		for (i = 0; i < m->len; i++) {
+			p = (double)(i == m->len - 1 ? m->p_last : m->p_cell)
+				/ 4294967296.0;
+			for (x = 0; x < states; x++)
+				if (!(x >> i & 1)) {
+					q = next[x];
+					next[x] = (1 - p) * q + p * next[x | 1L << i];
+					next[x | 1L << i] = p * q + (1 - p) * next[x | 1L << i];
+				}
+		}
+		delta = fabs(next[0] - dist[0]);
+		memcpy(dist, next, states * sizeof(double));
+		if (!m->vectors && h > m->len && delta < 1e-16) break;
+	}
+	p = dist[0];
+	free(dist);
+	free(next);
+	return p;
+}
+
+static double misr_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*************************************************************
+-bench [trials [threads [reg_len #_vectors prob [structure]]]]
+Compare the linked list simulator with the bit-sliced one and,
+for reg_len <= 20, with the exact aliasing probability.
+Returns 1 if some estimate is more than 5 sigma off.
+*************************************************************/
+int misr_bench(int argc, char *argv[])
+{
+	struct misr_setup m;
+	misr_type cell_array;
+	char structure[MAX_REG_LN + 1];
+	unsigned short seed[3] = { 1, 0, 0 };
+	long ref_trials, num_true, same;
+	double prob = .25, t, exact = -1, ref, est, sigma;
+	int i, r, ok = 1;
+	static const int lanes[3] = { 64, 256, 256 };
+
+	m.trials = argc > 0 ? atol(argv[0]) : 1L << 24;
+	misr_nthreads = argc > 1 ? atoi(argv[1]) : 4;
+	reg_len = argc > 2 ? atoi(argv[2]) : 10;
+	m.vectors = argc > 3 ? atoi(argv[3]) : 10;
+	if (argc > 4) prob = atof(argv[4]);
+	if (reg_len < 1 || reg_len > MAX_REG_LN || m.vectors < 0 ||
+	    prob < 0 || prob > 1 || m.trials < 1) {
+		printf("Bad parameters\n");
+		return 2;
+	}
+	if (argc > 5) {
+		strncpy(structure, argv[5], MAX_REG_LN);
+		structure[MAX_REG_LN] = 0;
+	} else {
+		for (i = 1; i < reg_len; i++)
+			structure[i] = '0';
+		structure[0] = '1';
+		structure[reg_len] = 0;
+	}
+	if (strlen(structure) != (size_t)reg_len) {
+		printf("Structure does not match Register length:\n");
+		return 4;
+	}
+
+	m.len = reg_len;
+	m.p_cell = misr_prob(prob, 1000);
+	m.p_last = misr_prob(prob, 10000);
+	for (i = 0; i < reg_len; i++)
+		m.tap[i] = structure[i] == '1';
+	m.seed = 1;
+
+	printf("reg_len %d  #_vect %d  prob %.3e  struct %s\n",
+	       reg_len, m.vectors, prob, structure);
+	printf("%-12s %5s %7s %12s %14s %10s %10s %12s\n", "simulator",
+	       "lanes", "threads", "trials", "prob same", "sigma", "time s",
+	       "trials/s");
+
+	if (reg_len <= 20) {
+		exact = misr_exact(&m);
+		printf("%-12s %5s %7s %12s %14.8e\n", "exact", "-", "-", "-",
+		       exact);
+	}
+
+	/* the serial simulator, as in main() */
+	ref_trials = m.trials < 100000 ? m.trials : 100000;
+	seed48(seed);
+	create_link_list(&cell_array);
+	t = misr_now();
+	num_true = 0;
+	if (m.vectors != 0) {
+		for (i = 0; i < ref_trials; i++) {
+			init(&cell_array);
+			num_true += simulate(m.vectors, &cell_array, prob, structure);
+		}
+	} else {
+		init(&cell_array);
+		simulate(INF, &cell_array, prob, structure);
+		for (i = 0; i < ref_trials; i++)
+			num_true += simulate(1, &cell_array, prob, structure);
+	}
+	t = misr_now() - t;
+	kill_list(cell_array.next);
+	ref = (double)(ref_trials - num_true) / ref_trials;
+	sigma = sqrt(ref * (1 - ref) / ref_trials);
+	printf("%-12s %5d %7d %12ld %14.8e %10.2e %10.3f %12.4g\n",
+	       "linked list", 1, 1, ref_trials, ref, sigma, t, ref_trials / t);
+	if (exact >= 0 && fabs(ref - exact) > 5 * sqrt(exact * (1 - exact)
+					/ ref_trials) + 1e-12)
+		ok = 0;
+
+	for (r = 0; r < 3; r++) {
+		int saved = misr_nthreads;
+
+		misr_lanes = lanes[r];
+		if (r < 2) misr_nthreads = 1;
+		else if (misr_nthreads == 1) break;
+		t = misr_now();
+		same = misr_simulate_sliced(&m);
+		t = misr_now() - t;
+		est = (double)same / m.trials;
+		sigma = sqrt(est * (1 - est) / m.trials);
+		printf("%-12s %5d %7d %12ld %14.8e %10.2e %10.3f %12.4g\n",
+		       "bit-sliced", misr_lanes, misr_nthreads, m.trials, est,
+		       sigma, t, m.trials / t);
+		misr_nthreads = saved;
+
+		/* chains in the infinite case are correlated; be lenient */
+		if (exact >= 0) sigma = sqrt(exact * (1 - exact) / m.trials);
+		else sigma = sqrt(sigma * sigma + ref * (1 - ref) / ref_trials);
+		if (!m.vectors) sigma *= 4;
+		if (fabs(est - (exact >= 0 ? exact : ref)) > 5 * sigma + 1e-12)
+			ok = 0;
+	}
+
+	printf("%s\n", ok ? "agree" : "MISMATCH");
+	return !ok;
+}
@@ -228,6 +228,8 @@
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 
 
 static REAL atime[9][15];
@@ -244,6 +246,9 @@ REAL epslon (REAL x);
 int idamax (int n, REAL dx[], int incx);
 void dscal (int n, REAL da, REAL dx[], int incx);
 REAL ddot (int n, REAL dx[], int incx, REAL dy[], int incy);
+void matgenl (REAL a[], int lda, int n, REAL b[], REAL *norma);
+void dgefa_blk (REAL a[], int lda, int n, int ipvt[], int *info);
+int lu_bench (int argc, char *argv[]);
 
 /* TIME TIME TIME TIME TIME TIME TIME TIME TIME TIME TIME TIME TIME */
    #include <time.h>  /* for following time functions only */
@@ -262,7 +267,7 @@ REAL ddot (int n, REAL dx[], int incx, REAL dy[], int incy);
      }
 
 
-int main ()
+int main (int argc, char *argv[])
 {
         static REAL aa[200*200],a[200*201],b[200],x[200];       
         REAL cray,ops,total,norma,normx;
@@ -273,6 +278,9 @@ int main ()
         REAL overhead1, overhead2, time1, time2;
         char *compiler, *options, general[9][80] = {" "}; 
 
+        if (argc > 1 && !strcmp(argv[1], "-bench"))
+                return lu_bench(argc - 2, argv + 2);
+
 /************************************************************************
  *           Enter details of compiler and options used                 *
  ************************************************************************/
@@ -1224,3 +1232,507 @@ function, references to m[i][j] are written m[ldm*i+j].  */
 } 
 
 /*----------------------*/ 
+void matgenl (REAL a[], int lda, int n, REAL b[], REAL *norma)
+
+/*
+     matgen with a 64 bit congruential generator. The generator of
+     matgen repeats after 16384 numbers, which makes the matrix
+     singular for orders such as 2000 (columns 1024 apart are equal);
+     the entries have the same distribution.
+*/
+
+{
+        unsigned long long init;
+        int i, j;
+
+        init = 1325;
+        *norma = 0.0;
+        for (j = 0; j < n; j++) {
+                for (i = 0; i < n; i++) {
+                        init = init*6364136223846793005ULL
+                               + 1442695040888963407ULL;
+                        a[lda*j+i] = ((int)(init >> 48) - 32768.0)/16384.0;
+                        *norma = (a[lda*j+i] > *norma) ? a[lda*j+i] : *norma;
+                }
+        }
+        for (i = 0; i < n; i++) {
+          b[i] = 0.0;
+        }
+        for (j = 0; j < n; j++) {
+                for (i = 0; i < n; i++) {
+                        b[i] = b[i] + a[lda*j+i];
+                }
+        }
+        return;
+}
+
+/*----------------------*/ 
+/*
+     Blocked LU factorization.
+
+     dgefa_blk computes the factorization of dgefa in the layout of
+     dgefa, so that dgesl can solve with it: the multipliers are stored
+     negated, and those of column k are left in the row order they had
+     at step k (later interchanges are not applied to them).
+
+     It is right-looking with panels of lu_nb columns. For each panel,
+       1. lu_panel factors it, splitting it in two halves recursively:
+          factor the left half, update the right half by a unit lower
+          triangular solve and a matrix product, factor the right half;
+       2. the interchanges of the panel are applied to the trailing
+          columns, whose top rows are updated by the triangular solve
+          (U12) and whose other rows by A22 += L21*U12, in blocks of
+          LU_NC columns handed out to lu_nthreads threads;
+       3. the multipliers of the panel are put back in dgefa row order.
+     Inside the panel the interchanges are applied to every column of
+     the panel, as the products need L21 in the final row order.
+
+     Products go through lu_gemm: L21 is packed once per panel in
+     strips of LU_MR rows, each block of U12 in strips of LU_NR
+     columns, and lu_kernel keeps an LU_MR x LU_NR block of the result
+     in vector registers.
+*/
+
+typedef REAL lu_vec __attribute__((vector_size(32)));
+
+#define LU_VL (int)(sizeof(lu_vec)/sizeof(REAL))
+#define LU_MR (2*LU_VL)
+#define LU_NR 6
+#define LU_NC 192               /* columns per trailing update task */
+#define LU_MC 384               /* rows of packed L21 per pass */
+#define LU_BASE 16              /* panel width factored unblocked */
+#define LU_MAX_THREADS 64
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define LU_FMA 1
+#endif
+
+static int lu_nb = 128;
+static int lu_nthreads = 1;
+
+/*----------------------*/ 
+static REAL *lu_alloc(size_t count)
+{
+        size_t size = (sizeof(REAL)*count + 31) & ~(size_t)31;
+        REAL *p = aligned_alloc(32, size);
+
+        if (!p) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+        }
+        return p;
+}
+
+/*----------------------*/ 
+static inline __attribute__((always_inline))
+void lu_kernel_body(int kc, const REAL *ap, const REAL *bp,
+                    REAL c[], int ldc, int m, int nn)
+
+/*
+     c[0..nn)[0..m) += ap*bp, ap being an LU_MR x kc strip and bp a
+     kc x LU_NR strip, both packed.
+*/
+
+{
+        lu_vec c0[LU_NR], c1[LU_NR], a0, a1, t;
+        REAL edge[LU_NR][LU_MR];
+        int p, i, j;
+
+#pragma GCC unroll 6
+        for (j = 0; j < LU_NR; j++) {
+                c0[j] = (lu_vec){0};
+                c1[j] = (lu_vec){0};
+        }
+        for (p = 0; p < kc; p++) {
+                a0 = *(const lu_vec *)(ap + p*LU_MR);
+                a1 = *(const lu_vec *)(ap + p*LU_MR + LU_VL);
+#pragma GCC unroll 6
+                for (j = 0; j < LU_NR; j++) {
+                        c0[j] += a0*bp[p*LU_NR+j];
+                        c1[j] += a1*bp[p*LU_NR+j];
+                }
+        }
+
+        if (m == LU_MR && nn == LU_NR) {
+#pragma GCC unroll 6
+                for (j = 0; j < LU_NR; j++) {
+                        memcpy(&t, c + ldc*j, sizeof(t));
+                        t += c0[j];
+                        memcpy(c + ldc*j, &t, sizeof(t));
+                        memcpy(&t, c + ldc*j + LU_VL, sizeof(t));
+                        t += c1[j];
+                        memcpy(c + ldc*j + LU_VL, &t, sizeof(t));
+                }
+                return;
+        }
+        for (j = 0; j < LU_NR; j++) {
+                memcpy(&edge[j][0], &c0[j], sizeof(lu_vec));
+                memcpy(&edge[j][LU_VL], &c1[j], sizeof(lu_vec));
+        }
+        for (j = 0; j < nn; j++)
+                for (i = 0; i < m; i++)
+                        c[ldc*j+i] += edge[j][i];
+}
+
+static void lu_kernel_gen(int kc, const REAL *ap, const REAL *bp,
+                          REAL c[], int ldc, int m, int nn)
+{
+        lu_kernel_body(kc, ap, bp, c, ldc, m, nn);
+}
+
+#ifdef LU_FMA
+__attribute__((target("avx2,fma")))
+static void lu_kernel_fma(int kc, const REAL *ap, const REAL *bp,
+                          REAL c[], int ldc, int m, int nn)
+{
+        lu_kernel_body(kc, ap, bp, c, ldc, m, nn);
+}
+#endif
+
+static void (*lu_kernel)(int kc, const REAL *ap, const REAL *bp,
+                         REAL c[], int ldc, int m, int nn) = lu_kernel_gen;
+
+/*----------------------*/ 
+static void lu_pack_a(int m, int kc, REAL a[], int lda, REAL *ap)
+
+/*
+     Pack the m x kc matrix a into strips of LU_MR rows, zero padded.
+*/
+
+{
+        int i, i0, p;
+
+        for (i0 = 0; i0 < m; i0 += LU_MR)
+                for (p = 0; p < kc; p++)
+                        for (i = 0; i < LU_MR; i++)
+                                *ap++ = i0 + i < m ? a[lda*p+i0+i] : ZERO;
+}
+
+/*----------------------*/ 
+static void lu_gemm(int m, int nn, int kc, const REAL *ap, REAL b[], int ldb,
+                    REAL c[], int ldc, REAL *bp)
+
+/*
+     c += a*b for an m x kc matrix a packed by lu_pack_a and a kc x nn
+     matrix b, packed into bp (kc x nn rounded up to LU_NR columns).
+*/
+
+{
+        int i, i0, i1, j, j0, p;
+        REAL *q = bp;
+
+        for (j0 = 0; j0 < nn; j0 += LU_NR)
+                for (p = 0; p < kc; p++)
+                        for (j = 0; j < LU_NR; j++)
+                                *q++ = j0 + j < nn ? b[ldb*(j0+j)+p] : ZERO;
+
+        for (i0 = 0; i0 < m; i0 += LU_MC) {
+                i1 = i0 + LU_MC < m ? i0 + LU_MC : m;
+                for (j = 0; j < nn; j += LU_NR)
+                        for (i = i0; i < i1; i += LU_MR)
+                                lu_kernel(kc, ap + i*kc, bp + j*kc,
+                                          &c[ldc*j+i], ldc,
+                                          m - i < LU_MR ? m - i : LU_MR,
+                                          nn - j < LU_NR ? nn - j : LU_NR);
+        }
+}
+
+/*----------------------*/ 
+static void lu_swap(REAL a[], int lda, int ipvt[], int k1, int k2,
+                    int c1, int c2)
+
+/*
+     Apply the interchanges of steps k1..k2-1 to columns c1..c2-1.
+*/
+
+{
+        REAL t;
+        int j, k, l;
+
+        for (j = c1; j < c2; j++)
+                for (k = k1; k < k2; k++) {
+                        l = ipvt[k];
+                        if (l != k) {
+                                t = a[lda*j+l];
+                                a[lda*j+l] = a[lda*j+k];
+                                a[lda*j+k] = t;
+                        }
+                }
+}
+
+/*----------------------*/ 
+static void lu_trsm(REAL a[], int lda, int k, int kb, int c1, int c2,
+                    REAL *ap, REAL *bp)
+
+/*
+     Rows k..k+kb-1 of columns c1..c2-1: solve with the unit lower
+     triangle of columns k..k+kb-1 (negated multipliers). Halves are
+     split recursively, the lower one being updated by lu_gemm.
+*/
+
+{
+        int h, j, p;
+
+        if (kb <= LU_BASE) {
+                for (j = c1; j < c2; j++)
+                        for (p = k; p < k + kb - 1; p++)
+                                daxpy(k+kb-p-1, a[lda*j+p], &a[lda*p+p+1], 1,
+                                      &a[lda*j+p+1], 1);
+                return;
+        }
+
+        h = kb/2;
+        lu_trsm(a, lda, k, h, c1, c2, ap, bp);
+        lu_pack_a(kb-h, h, &a[lda*k+k+h], lda, ap);
+        lu_gemm(kb-h, c2-c1, h, ap, &a[lda*c1+k], lda, &a[lda*c1+k+h], lda, bp);
+        lu_trsm(a, lda, k+h, kb-h, c1, c2, ap, bp);
+}
+
+/*----------------------*/ 
+static void lu_panel(REAL a[], int lda, int n, int k, int w, int ipvt[],
+                     int *info, REAL *ap, REAL *bp)
+
+/*
+     Factor columns k..k+w-1, rows k..n-1, applying the interchanges to
+     all w columns.
+*/
+
+{
+        REAL t;
+        int h, j, kk, l;
+
+        if (w <= LU_BASE) {
+                for (kk = k; kk < k + w; kk++) {
+                        l = idamax(n-kk, &a[lda*kk+kk], 1) + kk;
+                        ipvt[kk] = l;
+                        if (a[lda*kk+l] == ZERO) {
+                                *info = kk;
+                                continue;
+                        }
+                        lu_swap(a, lda, ipvt, kk, kk+1, k, k+w);
+                        t = -ONE/a[lda*kk+kk];
+                        dscal(n-(kk+1), t, &a[lda*kk+kk+1], 1);
+                        for (j = kk+1; j < k+w; j++)
+                                daxpy(n-(kk+1), a[lda*j+kk], &a[lda*kk+kk+1], 1,
+                                      &a[lda*j+kk+1], 1);
+                }
+                return;
+        }
+
+        h = w/2;
+        lu_panel(a, lda, n, k, h, ipvt, info, ap, bp);
+        lu_swap(a, lda, ipvt, k, k+h, k+h, k+w);
+        lu_trsm(a, lda, k, h, k+h, k+w, ap, bp);
+        lu_pack_a(n-k-h, h, &a[lda*k+k+h], lda, ap);
+        lu_gemm(n-k-h, w-h, h, ap, &a[lda*(k+h)+k], lda,
+                &a[lda*(k+h)+k+h], lda, bp);
+        lu_panel(a, lda, n, k+h, w-h, ipvt, info, ap, bp);
+        lu_swap(a, lda, ipvt, k+h, k+w, k, k+h);
+}
+
+/*----------------------*/ 
+struct lu_job {
+        REAL *a;
+        int lda, n, k, w;       /* panel columns k..k+w-1 */
+        int *ipvt;
+        const REAL *ap;         /* packed L21 */
+        int ntasks, next;       /* column blocks of the trailing matrix */
+};
+
+static void *lu_worker(void *arg)
+{
+        struct lu_job *job = arg;
+        REAL *a = job->a, *ap, *bp;
+        int lda = job->lda, k = job->k, w = job->w, kw = job->k + job->w;
+        int t, c1, c2;
+
+        ap = lu_alloc((size_t)(w+LU_MR)*w);
+        bp = lu_alloc((size_t)w*(LU_NC+LU_NR));
+        while ((t = __sync_fetch_and_add(&job->next, 1)) < job->ntasks) {
+                c1 = kw + t*LU_NC;
+                c2 = c1 + LU_NC < job->n ? c1 + LU_NC : job->n;
+                lu_swap(a, lda, job->ipvt, k, kw, c1, c2);
+                lu_trsm(a, lda, k, w, c1, c2, ap, bp);
+                lu_gemm(job->n-kw, c2-c1, w, job->ap, &a[lda*c1+k], lda,
+                        &a[lda*c1+kw], lda, bp);
+        }
+        free(ap);
+        free(bp);
+        return NULL;
+}
+
+/*----------------------*/ 
+void dgefa_blk(REAL a[], int lda, int n, int ipvt[], int *info)
+
+/*
+     Same arguments and results as dgefa; see above.
+*/
+
+{
+        pthread_t tid[LU_MAX_THREADS];
+        struct lu_job job;
+        REAL *ap, *bp, t;
+        int nb, nthreads, k, w, i, kk, l;
+
+        nb = lu_nb < 2*LU_BASE ? 2*LU_BASE : lu_nb;
+        nthreads = lu_nthreads < 1 ? 1 :
+                   lu_nthreads > LU_MAX_THREADS ? LU_MAX_THREADS : lu_nthreads;
+        ap = lu_alloc((size_t)(n+LU_MR)*nb);
+        bp = lu_alloc((size_t)nb*(nb+LU_NR));
+
+#ifdef LU_FMA
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+                lu_kernel = lu_kernel_fma;
+#endif
+
+        *info = 0;
+        for (k = 0; k < n; k += nb) {
+                w = n - k < nb ? n - k : nb;
+                lu_panel(a, lda, n, k, w, ipvt, info, ap, bp);
+
+                if (k + w < n) {
+                        lu_pack_a(n-k-w, w, &a[lda*k+k+w], lda, ap);
+                        job.a = a;
+                        job.lda = lda;
+                        job.n = n;
+                        job.k = k;
+                        job.w = w;
+                        job.ipvt = ipvt;
+                        job.ap = ap;
+                        job.ntasks = (n-k-w + LU_NC-1)/LU_NC;
+                        job.next = 0;
+                        for (i = 1; i < nthreads && i < job.ntasks; i++)
+                                if (pthread_create(&tid[i], NULL, lu_worker, &job)) {
+                                        fprintf(stderr, "Cannot create thread\n");
+                                        exit(1);
+                                }
+                        lu_worker(&job);
+                        while (--i > 0)
+                                pthread_join(tid[i], NULL);
+                }
+
+                /* undo the later interchanges of the panel on each column */
+                for (kk = k + w - 1; kk > k; kk--) {
+                        l = ipvt[kk];
+                        if (l == kk) continue;
+                        for (i = k; i < kk; i++) {
+                                t = a[lda*i+l];
+                                a[lda*i+l] = a[lda*i+kk];
+                                a[lda*i+kk] = t;
+                        }
+                }
+        }
+
+        free(ap);
+        free(bp);
+}
+
+/*----------------------*/ 
+static double lu_now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+/*----------------------*/ 
+int lu_bench(int argc, char *argv[])
+
+/*
+     -bench [n [threads [nb]]]
+
+     Factor and solve a system of order n (default 2000) with dgefa and
+     with dgefa_blk on 1 and on threads threads (default 4), checking
+     the residual as main does. dgefa is skipped above order 3000. The
+     matrix comes from matgen up to order 1000 and from matgenl above.
+     Returns 1 if a normalized residual exceeds 1000 (single precision
+     residuals grow to several tens at order 10000).
+*/
+
+{
+        REAL *a, *b, *x, norma, normx, resid, residn, eps, ops;
+        double t, tfa, tsl;
+        int *ipvt, n, lda, info, i, r, threads[3], nthreads, ok = 1;
+        const char *name;
+
+        n = argc > 0 ? atoi(argv[0]) : 2000;
+        nthreads = argc > 1 ? atoi(argv[1]) : 4;
+        if (argc > 2) lu_nb = atoi(argv[2]);
+        if (n < 2) n = 2;
+        if (nthreads < 1) nthreads = 1;
+        lda = n + (n % 2 == 0);         /* as lda = 201 for n = 200 */
+
+        a = malloc(sizeof(REAL)*(size_t)lda*n);
+        b = malloc(sizeof(REAL)*n);
+        x = malloc(sizeof(REAL)*n);
+        ipvt = malloc(sizeof(int)*n);
+        if (!a || !b || !x || !ipvt) {
+                fprintf(stderr, "Out of memory\n");
+                return 2;
+        }
+
+        ops = (2.0e0*((double)n*n*n))/3.0 + 2.0*((double)n*n);
+        eps = epslon(ONE);
+        threads[0] = 1;
+        threads[1] = 1;
+        threads[2] = nthreads;
+
+        printf(ROLLING PREC "Precision Linpack, order %d, lda %d, nb %d, %s\n\n",
+               n, lda, lu_nb, n <= 1000 ? "matgen" : "matgenl");
+        printf("path      threads      dgefa      dgesl      total"
+               "    GFLOP/s  norm resid       x[0]-1     x[n-1]-1\n");
+
+        for (r = 0; r < 3; r++) {
+                if (r == 0 && n > 3000) continue;
+                if (r == 2 && nthreads == 1) break;
+
+                if (n <= 1000) matgen(a, lda, n, b, &norma);
+                else matgenl(a, lda, n, b, &norma);
+
+                t = lu_now();
+                if (r == 0) {
+                        name = "dgefa";
+                        dgefa(a, lda, n, ipvt, &info);
+                } else {
+                        name = "blocked";
+                        lu_nthreads = threads[r];
+                        dgefa_blk(a, lda, n, ipvt, &info);
+                }
+                tfa = lu_now() - t;
+                t = lu_now();
+                dgesl(a, lda, n, ipvt, b, 0);
+                tsl = lu_now() - t;
+
+                /* residual, as in main */
+                for (i = 0; i < n; i++)
+                        x[i] = b[i];
+                if (n <= 1000) matgen(a, lda, n, b, &norma);
+                else matgenl(a, lda, n, b, &norma);
+                for (i = 0; i < n; i++)
+                        b[i] = -b[i];
+                dmxpy(n, b, n, lda, x, a);
+                resid = 0.0;
+                normx = 0.0;
+                for (i = 0; i < n; i++) {
+                        resid = (resid > fabs((double)b[i]))
+                                ? resid : fabs((double)b[i]);
+                        normx = (normx > fabs((double)x[i]))
+                                ? normx : fabs((double)x[i]);
+                }
+                residn = resid/( n*norma*normx*eps );
+                if (!(residn < 1000.0) || info != 0) ok = 0;
+
+                printf("%-8s %8d %10.4f %10.4f %10.4f %10.3f %11.2f %12.4e %12.4e\n",
+                       name, threads[r], tfa, tsl, tfa + tsl,
+                       ops/(1.0e9*(tfa + tsl)), (double)residn,
+                       (double)(x[0] - 1), (double)(x[n-1] - 1));
+        }
+
+        free(a);
+        free(b);
+        free(x);
+        free(ipvt);
+        printf("\n%s\n", ok ? "residuals ok" : "RESIDUAL CHECK FAILED");
+        return !ok;
+}
@@ -78,6 +78,10 @@
  *
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE		/* sched_setaffinity */
+#endif
+
 /* #define the type of float we will use:	*/
 #ifndef extended
 #define extended double
@@ -184,10 +188,14 @@ int Proc6();
 int Proc7();
 int Proc8();
 
+static int DhryBench();
+
 int main( argc, argv)
 int argc;
 char **argv;
 {
+	if (argc > 1 && !strcmp(argv[1], "-bench"))
+		return DhryBench(argc - 2, argv + 2);
   printf("calculate floating dhrystones using doubles size %d\n",
          sizeof(extended));
 	//fflush( stdout);
@@ -558,3 +566,471 @@ char *s1, *s2;
 }
 
 #endif
+
+/*
+ * Benchmark harness:
+ *
+ *	fldry -bench [copies [passes]] [-simd] [-profile] [-mhz MHz]
+ *
+ * Runs copies of the Dhrystone loop at the same time, each in its own
+ * process (the benchmark state is global) pinned to its own cpu, and
+ * prints Dhrystones/second and DMIPS (Dhrystones/second / 1757) per
+ * copy and in total. DMIPS/MHz uses the clock given with -mhz, else the
+ * cycles counted by perf_event_open, else the time stamp counter rate.
+ *
+ * -simd replaces strcpy and the strcmp of Func2 by inlined SSE2
+ * versions; comparing with a plain run gives the share of the score
+ * that is libc. -profile runs one more copy with the time stamp counter
+ * read around every procedure call and string routine, and prints the
+ * cycles spent in each.
+ */
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define DHRY_TSC_UNIT	"cycles"
+#else
+#define DHRY_TSC_UNIT	"ns"
+#endif
+
+static unsigned long long DhryTsc(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	_mm_lfence();
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static double DhryNow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Inlined string routines. 16 bytes are loaded at a time, unaligned,
+ * unless that could cross into the next page.
+ */
+#define DHRY_PAGE_SAFE(p)	(((unsigned long) (p) & 4095) <= 4096 - 16)
+
+static inline char *DhryStrcpy(char *d, const char *s)
+{
+	char *r = d;
+#ifdef __SSE2__
+	__m128i v;
+	int m;
+
+	while (DHRY_PAGE_SAFE(s)) {
+		v = _mm_loadu_si128((const __m128i *) s);
+		m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()));
+		if (m) {
+			m = __builtin_ctz(m);
+			if (d - r >= 16) {
+				/* last 16 bytes, overlapping the ones stored */
+				v = _mm_loadu_si128((const __m128i *) (s + m - 15));
+				_mm_storeu_si128((__m128i *) (d + m - 15), v);
+			} else
+				while (m-- >= 0)
+					*d++ = *s++;
+			return r;
+		}
+		_mm_storeu_si128((__m128i *) d, v);
+		d += 16;
+		s += 16;
+	}
+#endif
+	while ((*d++ = *s++))
+		;
+	return r;
+}
+
+static inline int DhryStrcmp(const char *a, const char *b)
+{
+#ifdef __SSE2__
+	__m128i x, y;
+	int m;
+
+	while (DHRY_PAGE_SAFE(a) && DHRY_PAGE_SAFE(b)) {
+		x = _mm_loadu_si128((const __m128i *) a);
+		y = _mm_loadu_si128((const __m128i *) b);
+		m = ~_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) |
+		    _mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128()));
+		m &= 0xffff;
+		if (m) {
+			m = __builtin_ctz(m);
+			return (unsigned char) a[m] - (unsigned char) b[m];
+		}
+		a += 16;
+		b += 16;
+	}
+#endif
+	while (*a && *a == *b)
+		a++, b++;
+	return (unsigned char) *a - (unsigned char) *b;
+}
+
+/*
+ * Profiling: DHRY_TIMED(id, stmt) accumulates the time stamp counter
+ * ticks of stmt in DhryTicks[id]; DHRY_PLAIN(id, stmt) is just stmt.
+ */
+enum { DHRY_NONE, DHRY_P1, DHRY_P2, DHRY_P4, DHRY_P5, DHRY_P6, DHRY_P7,
+       DHRY_P8, DHRY_F1, DHRY_F2, DHRY_STRCPY, DHRY_STRCMP, DHRY_IDS };
+
+static const char *DhryNames[DHRY_IDS] = {
+	"-", "Proc1", "Proc2", "Proc4", "Proc5", "Proc6", "Proc7", "Proc8",
+	"Func1", "Func2", "strcpy", "strcmp"
+};
+
+static unsigned long long DhryTicks[DHRY_IDS];
+static unsigned long long DhryCalls[DHRY_IDS];
+
+#define DHRY_PLAIN(id, stmt)	{ stmt; }
+#define DHRY_TIMED(id, stmt)						\
+	{								\
+		unsigned long long t0_ = DhryTsc();			\
+		stmt;							\
+		DhryTicks[id] += DhryTsc() - t0_;			\
+		DhryCalls[id]++;					\
+	}
+
+/* Func2 with the given strcmp, itself wrapped in T */
+#define DHRY_FUNC2(name, STRCMP, T)					\
+static boolean name(String30 StrParI1, String30 StrParI2)		\
+{									\
+	REG OneToThirty		IntLoc;					\
+	REG CapitalLetter	CharLoc;				\
+	int			cmp;					\
+									\
+	IntLoc = 1;							\
+	while (IntLoc <= 1)						\
+		if (Func1(StrParI1[(int)IntLoc], StrParI2[(int)IntLoc+1])	\
+		    == Ident1)						\
+		{							\
+			CharLoc = 'A';					\
+			++IntLoc;					\
+		}							\
+	if (CharLoc >= 'W' && CharLoc <= 'Z')				\
+		IntLoc = 7;						\
+	if (CharLoc == 'X')						\
+		return(TRUE);						\
+	T(DHRY_STRCMP, cmp = STRCMP(StrParI1, StrParI2));		\
+	if (cmp > 0)							\
+	{								\
+		IntLoc += 7.0;						\
+		return (TRUE);						\
+	}								\
+	return (FALSE);							\
+}
+
+DHRY_FUNC2(Func2Simd, DhryStrcmp, DHRY_PLAIN)
+DHRY_FUNC2(Func2Prof, strcmp, DHRY_TIMED)
+DHRY_FUNC2(Func2ProfSimd, DhryStrcmp, DHRY_TIMED)
+
+/*
+ * The loop of Proc0 with the given string routines, the call of Func2
+ * wrapped in TF2 and every other call in T.
+ */
+#define DHRY_LOOP(name, STRCPY, FUNC2, T, TF2)				\
+static void name(unsigned long passes)					\
+{									\
+	OneToFifty		IntLoc1;				\
+	REG OneToFifty		IntLoc2;				\
+	OneToFifty		IntLoc3;				\
+	REG char		CharIndex;				\
+	Enumeration	 	EnumLoc;				\
+	String30		String1Loc;				\
+	String30		String2Loc;				\
+	unsigned long		i;					\
+	int			same;					\
+									\
+	strcpy(String1Loc, "DHRYSTONE PROGRAM, 1'ST STRING");		\
+	for (i = 0; i < passes; ++i)					\
+	{								\
+		T(DHRY_P5, Proc5());					\
+		T(DHRY_P4, Proc4());					\
+		IntLoc1 = 2.0;						\
+		IntLoc2 = 3.0;						\
+		T(DHRY_STRCPY, STRCPY(String2Loc,			\
+				"DHRYSTONE PROGRAM, 2'ND STRING"));	\
+		EnumLoc = Ident2;					\
+		TF2(DHRY_F2, BoolGlob = ! FUNC2(String1Loc, String2Loc)); \
+		while (IntLoc1 < IntLoc2)				\
+		{							\
+			IntLoc3 = 5.0 * IntLoc1 - IntLoc2;		\
+			T(DHRY_P7, Proc7(IntLoc1, IntLoc2, &IntLoc3));	\
+			++IntLoc1;					\
+		}							\
+		T(DHRY_P8, Proc8(Array1Glob, Array2Glob, IntLoc1, IntLoc3)); \
+		T(DHRY_P1, Proc1(PtrGlb));				\
+		for (CharIndex = 'A'; CharIndex <= Char2Glob; ++CharIndex) \
+		{							\
+			T(DHRY_F1, same = EnumLoc == Func1(CharIndex, 'C')); \
+			if (same)					\
+				T(DHRY_P6, Proc6(Ident1, &EnumLoc));	\
+		}							\
+		IntLoc3 = IntLoc2 * IntLoc1;				\
+		IntLoc2 = IntLoc3 / IntLoc1;				\
+		IntLoc2 = 7.0 * (IntLoc3 - IntLoc2) - IntLoc1;		\
+		T(DHRY_P2, Proc2(&IntLoc1));				\
+	}								\
+}
+
+DHRY_LOOP(DhryLoop, strcpy, Func2, DHRY_PLAIN, DHRY_PLAIN)
+DHRY_LOOP(DhryLoopSimd, DhryStrcpy, Func2Simd, DHRY_PLAIN, DHRY_PLAIN)
+/* strcmp is timed apart, not to time a region inside another */
+DHRY_LOOP(DhryLoopProf, strcpy, Func2, DHRY_TIMED, DHRY_TIMED)
+DHRY_LOOP(DhryLoopProfSimd, DhryStrcpy, Func2Simd, DHRY_TIMED, DHRY_TIMED)
+DHRY_LOOP(DhryLoopStrcmp, strcpy, Func2Prof, DHRY_PLAIN, DHRY_PLAIN)
+DHRY_LOOP(DhryLoopStrcmpSimd, DhryStrcpy, Func2ProfSimd, DHRY_PLAIN,
+	  DHRY_PLAIN)
+
+static void DhryInit(void)
+{
+	PtrGlbNext = (RecordPtr) malloc(sizeof(RecordType));
+	PtrGlb = (RecordPtr) malloc(sizeof(RecordType));
+	PtrGlb->PtrComp = PtrGlbNext;
+	PtrGlb->Discr = Ident1;
+	PtrGlb->EnumComp = Ident3;
+	PtrGlb->IntComp = 40.0;
+	strcpy(PtrGlb->StringComp, "DHRYSTONE PROGRAM, SOME STRING");
+	Array2Glob[8][7] = 10.0;
+}
+
+/* Cycle counter of the calling process, or -1 */
+static int DhryPerfOpen(void)
+{
+#ifdef __linux__
+	struct perf_event_attr pe;
+
+	memset(&pe, 0, sizeof(pe));
+	pe.type = PERF_TYPE_HARDWARE;
+	pe.size = sizeof(pe);
+	pe.config = PERF_COUNT_HW_CPU_CYCLES;
+	pe.disabled = 1;
+	pe.exclude_kernel = 1;
+	pe.exclude_hv = 1;
+	return syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+#else
+	return -1;
+#endif
+}
+
+struct DhryResult {
+	int		copy, cpu;
+	double		seconds;
+	double		tsc;		/* ticks */
+	double		cycles;		/* perf cycles, or -1 */
+};
+
+static void DhryCopy(int copy, int cpu, unsigned long passes, int simd,
+		     int go, int out)
+{
+	struct DhryResult r;
+	long long count;
+	int fd;
+	char c;
+
+#ifdef __linux__
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) != 0)
+		cpu = -1;
+#else
+	cpu = -1;
+#endif
+	DhryInit();
+	fd = DhryPerfOpen();
+	read(go, &c, 1);		/* returns once all copies are forked */
+
+#ifdef __linux__
+	if (fd >= 0) ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+	r.seconds = DhryNow();
+	r.tsc = DhryTsc();
+	if (simd) DhryLoopSimd(passes);
+	else DhryLoop(passes);
+	r.tsc = DhryTsc() - r.tsc;
+	r.seconds = DhryNow() - r.seconds;
+	r.cycles = -1;
+#ifdef __linux__
+	if (fd >= 0) {
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(fd, &count, sizeof(count)) == sizeof(count) && count > 0)
+			r.cycles = count;
+	}
+#endif
+	r.copy = copy;
+	r.cpu = cpu;
+	write(out, &r, sizeof(r));
+}
+
+static void DhryProfile(unsigned long passes, int simd)
+{
+	double pass, sum, ovh, ticks[DHRY_IDS];
+	int i, k;
+
+	DhryInit();
+
+	/* cost of an empty timed region */
+	ovh = 1e30;
+	for (k = 0; k < 5; k++) {
+		DhryTicks[DHRY_NONE] = DhryCalls[DHRY_NONE] = 0;
+		for (i = 0; i < 100000; i++)
+			DHRY_TIMED(DHRY_NONE, (void) 0);
+		if ((double) DhryTicks[DHRY_NONE] / DhryCalls[DHRY_NONE] < ovh)
+			ovh = (double) DhryTicks[DHRY_NONE] / DhryCalls[DHRY_NONE];
+	}
+
+	/* uninstrumented pass, for reference */
+	pass = DhryTsc();
+	if (simd) DhryLoopSimd(passes);
+	else DhryLoop(passes);
+	pass = (DhryTsc() - pass) / passes;
+
+	memset(DhryTicks, 0, sizeof(DhryTicks));
+	memset(DhryCalls, 0, sizeof(DhryCalls));
+	if (simd) DhryLoopProfSimd(passes);
+	else DhryLoopProf(passes);
+	if (simd) DhryLoopStrcmpSimd(passes);
+	else DhryLoopStrcmp(passes);
+
+	/*
+	 * Each region is timed between serializing reads, so the figures
+	 * are latencies of the routine alone; in the real loop they
+	 * overlap each other and the code of Proc0. Routines cheaper
+	 * than the timer noise show as 0.
+	 */
+	sum = 0;
+	for (i = 1; i < DHRY_IDS; i++)
+		ticks[i] = DhryTicks[i] - ovh * DhryCalls[i];
+	ticks[DHRY_F2] -= ticks[DHRY_STRCMP];
+	for (i = 1; i < DHRY_IDS; i++) {
+		if (ticks[i] < 0) ticks[i] = 0;
+		sum += ticks[i];
+	}
+
+	printf("\nProfile (%s strings), %lu passes, timer overhead %.1f %s "
+	       "subtracted\n", simd ? "inlined SIMD" : "libc", passes, ovh,
+	       DHRY_TSC_UNIT);
+	printf("%-20s %12s %12s %12s %8s\n", "routine", "calls/pass",
+	       DHRY_TSC_UNIT "/call", DHRY_TSC_UNIT "/pass", "share");
+	for (i = 1; i < DHRY_IDS; i++)
+		printf("%-20s %12.2f %12.2f %12.2f %7.1f%%\n",
+		       i == DHRY_F2 ? "Func2 (w/o strcmp)" : DhryNames[i],
+		       (double) DhryCalls[i] / passes,
+		       DhryCalls[i] ? ticks[i] / DhryCalls[i] : 0.0,
+		       ticks[i] / passes, 100 * ticks[i] / sum);
+	printf("%-20s %12s %12s %12.2f\n", "sum, serialized", "", "",
+	       sum / passes);
+	printf("%-20s %12s %12s %12.2f\n", "uninstrumented pass", "", "",
+	       pass);
+}
+
+static int DhryBench(int argc, char **argv)
+{
+	struct DhryResult r, *res;
+	unsigned long passes = LOOPS;
+	double mhz = 0, rate, sum = 0, clk;
+	int copies, simd = 0, profile = 0, ncpu, go[2], out[2], i, n = 0;
+	pid_t pid;
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpu < 1) ncpu = 1;
+	copies = ncpu;
+	for (i = 0; i < argc; i++) {
+		if (!strcmp(argv[i], "-simd")) simd = 1;
+		else if (!strcmp(argv[i], "-profile")) profile = 1;
+		else if (!strcmp(argv[i], "-mhz") && i + 1 < argc)
+			mhz = atof(argv[++i]);
+		else if (n == 0 && atoi(argv[i]) > 0) copies = atoi(argv[i]), n++;
+		else if (n == 1 && atol(argv[i]) > 0) passes = atol(argv[i]), n++;
+		else {
+			fprintf(stderr, "usage: -bench [copies [passes]] [-simd] "
+				"[-profile] [-mhz MHz]\n");
+			return 1;
+		}
+	}
+
+	res = (struct DhryResult *) calloc(copies, sizeof(*res));
+	if (!res || pipe(go) || pipe(out)) {
+		perror("dhrystone");
+		return 1;
+	}
+	fflush(stdout);
+	for (i = 0; i < copies; i++) {
+		pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			return 1;
+		}
+		if (pid == 0) {
+			close(go[1]);
+			close(out[0]);
+			DhryCopy(i, i % ncpu, passes, simd, go[0], out[1]);
+			_exit(0);
+		}
+	}
+	close(go[0]);
+	close(out[1]);
+	close(go[1]);			/* start */
+	for (n = 0; n < copies && read(out[0], &r, sizeof(r)) == sizeof(r); n++)
+		res[r.copy] = r;
+	while (wait(NULL) > 0)
+		;
+	if (n < copies) {
+		fprintf(stderr, "dhrystone: %d copies did not report\n", copies - n);
+		return 1;
+	}
+
+	printf("Floating Dhrystone(%s) %s strings, %lu passes, %d copies on %d cpus\n",
+	       Version, simd ? "inlined SIMD" : "libc", passes, copies, ncpu);
+	printf("%-6s %4s %10s %14s %10s %9s %10s\n", "copy", "cpu", "seconds",
+	       "dhrystones/s", "DMIPS", "MHz", "DMIPS/MHz");
+	for (i = 0; i < copies; i++) {
+		r = res[i];
+		rate = passes / r.seconds;
+		sum += rate;
+		if (mhz > 0) clk = mhz;
+		else if (r.cycles > 0) clk = r.cycles / r.seconds / 1e6;
+#if defined(__x86_64__) || defined(__i386__)
+		else clk = r.tsc / r.seconds / 1e6;
+#else
+		else clk = 0;
+#endif
+		printf("%-6d %4d %10.3f %14.0f %10.1f %9.0f %10.3f\n", i, r.cpu,
+		       r.seconds, rate, rate / 1757, clk,
+		       clk > 0 ? rate / 1757 / clk : 0.0);
+	}
+	printf("%-6s %4s %10s %14.0f %10.1f   (%s clock)\n", "total", "", "",
+	       sum, sum / 1757, mhz > 0 ? "-mhz" : res[0].cycles > 0 ? "perf" :
+#if defined(__x86_64__) || defined(__i386__)
+	       "tsc"
+#else
+	       "no"
+#endif
+	       );
+
+	if (profile) DhryProfile(passes, simd);
+	free(res);
+	return 0;
+}
@@ -34,6 +34,8 @@
 #include <stdbool.h>
 #include <memory.h>
 #include <math.h>
+#include <stdint.h>
+#include <pthread.h>
 
 // embedded random number generator; ala Park and Miller
 static       long seed = 1325;
@@ -429,6 +431,760 @@ void compdecomp(byte * data, size_t data_len)
     free(comp);
 }
 
+/*
+    CHUNKED CANONICAL CODEC
+
+    huff_encode() splits the input into chunks of chunk_size bytes and
+    codes each one on its own: every chunk carries its own code lengths,
+    so chunks are encoded and decoded independently, by several threads.
+
+    Codes are canonical and at most HUFF_MAX_BITS long, so a chunk is
+    described by its code lengths alone and the decoder resolves every
+    symbol with one lookup in a table of 2^HUFF_MAX_BITS entries.  Bits
+    are packed least significant first through a 64-bit bit buffer.
+
+    stream layout (integers little-endian):
+        u32 magic, u32 chunk_size, u64 raw length
+        u32 coded size of each chunk
+        chunks: 128 bytes of code lengths, two per byte, u32 sizes of
+                the first three bit streams, then the four streams
+
+    Byte i of a chunk is coded in stream i % 4.  The four streams share
+    the code, but each has its own bit buffer, so the decoder's table
+    lookups for different streams do not wait on one another.
+*/
+
+#define HUFF_MAX_BITS    12
+#define HUFF_TABLE_SIZE  (1 << HUFF_MAX_BITS)
+#define HUFF_MAGIC       0x31465548     // "HUF1"
+#define HUFF_HEADER      16
+#define HUFF_LENS        128
+#define HUFF_STREAMS     4              // interleaved bit streams per chunk
+#define HUFF_CHUNK_HEAD  (HUFF_LENS + 4 * (HUFF_STREAMS - 1))
+#define HUFF_BAD         0x8000         // decode table hole
+#define HUFF_MAX_THREADS 64
+#define HUFF_MAX_CHUNK   (1 << 28)      // keeps coded chunk sizes in a u32
+
+static inline void huff_put32(byte * p, uint32_t v)
+{
+    p[0] = (byte)v;
+    p[1] = (byte)(v >> 8);
+    p[2] = (byte)(v >> 16);
+    p[3] = (byte)(v >> 24);
+}
+
+static inline uint32_t huff_get32(const byte * p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t huff_le64(uint64_t v)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+// load 8 bytes at p, as zeros past end
+static inline uint64_t huff_load(const byte * p, const byte * end)
+{
+    uint64_t v = 0;
+
+    if (end - p >= 8)
+        memcpy(&v, p, 8);
+    else if (p < end)
+        memcpy(&v, p, (size_t)(end - p));
+
+    return huff_le64(v);
+}
+
+// code lengths from symbol counts, built with heap_adjust as compdecomp
+// does, then limited to HUFF_MAX_BITS
+static void huff_code_lengths(const size_t * count, byte * len)
+{
+    size_t freq[512];
+    size_t heap[256];
+    int    link[512];
+    size_t i, n, temp;
+    int    l, k, best, kraft;
+
+    memset(freq,0,sizeof(size_t) * 512);
+    memset(link,0,sizeof(int)    * 512);
+    memcpy(freq,count,sizeof(size_t) * 256);
+
+    n = 0;
+
+    for (i = 0; i < 256; ++i)
+    {
+        len[i] = 0;
+
+        if (freq[i])
+        {
+            heap[n] = i;
+            ++n;
+        }
+    }
+
+    // a lone symbol still needs a one bit code
+    if (n == 1)
+    {
+        len[heap[0]] = 1;
+        return;
+    }
+
+    for (i = n; i > 0; --i)
+        heap_adjust(freq,heap,n,i);
+
+    while (n > 1)
+    {
+        --n;
+        temp    = heap[0];
+        heap[0] = heap[n];
+        heap_adjust(freq,heap,n,1);
+        freq[256 + n] = freq[heap[0]] + freq[temp];
+        link[temp]    =  256 + n;
+        link[heap[0]] = -256 - n;
+        heap[0]       =  256 + n;
+        heap_adjust(freq,heap,n,1);
+    }
+
+    link[256 + n] = 0;
+
+    // depth of each leaf, clamped to the limit
+    kraft = 0;
+
+    for (i = 0; i < 256; ++i)
+    {
+        if (!count[i])
+            continue;
+
+        k = 0;
+
+        for (l = link[i]; l; l = link[l < 0 ? -l : l])
+            ++k;
+
+        len[i] = (byte)(k > HUFF_MAX_BITS ? HUFF_MAX_BITS : k);
+        kraft += HUFF_TABLE_SIZE >> len[i];
+    }
+
+    // clamping overfills the code space; lengthen the longest codes
+    // still below the limit, least frequent first, until it fits
+    while (kraft > HUFF_TABLE_SIZE)
+    {
+        best = -1;
+
+        for (i = 0; i < 256; ++i)
+        {
+            if (!len[i] || len[i] == HUFF_MAX_BITS)
+                continue;
+
+            if (best < 0 || len[i] > len[best] || (len[i] == len[best] && count[i] < count[best]))
+                best = (int)i;
+        }
+
+        kraft -= HUFF_TABLE_SIZE >> (len[best] + 1);
+        ++len[best];
+    }
+
+    // then spend what is left on the most frequent symbols
+    for (;;)
+    {
+        best = -1;
+
+        for (i = 0; i < 256; ++i)
+        {
+            if (len[i] > 1 && kraft + (HUFF_TABLE_SIZE >> len[i]) <= HUFF_TABLE_SIZE
+             && (best < 0 || count[i] > count[best]))
+                best = (int)i;
+        }
+
+        if (best < 0)
+            break;
+
+        kraft += HUFF_TABLE_SIZE >> len[best];
+        --len[best];
+    }
+}
+
+// canonical codes for the lengths, bit reversed for LSB-first packing;
+// returns false if the lengths overfill the code space
+static bool huff_canonical(const byte * len, uint16_t * code)
+{
+    int count[HUFF_MAX_BITS + 1];
+    int next[HUFF_MAX_BITS + 1];
+    int i, l, c, r, kraft = 0;
+
+    memset(count,0,sizeof(count));
+
+    for (i = 0; i < 256; ++i)
+        ++count[len[i]];
+
+    count[0] = 0;
+    next[1]  = 0;
+
+    for (l = 1; l <= HUFF_MAX_BITS; ++l)
+    {
+        kraft += count[l] << (HUFF_MAX_BITS - l);
+
+        if (l > 1)
+            next[l] = (next[l - 1] + count[l - 1]) << 1;
+    }
+
+    if (kraft > HUFF_TABLE_SIZE)
+        return false;
+
+    for (i = 0; i < 256; ++i)
+    {
+        l = len[i];
+
+        if (!l)
+            continue;
+
+        c = next[l]++;
+        r = 0;
+
+        while (l--)
+        {
+            r = (r << 1) | (c & 1);
+            c >>= 1;
+        }
+
+        code[i] = (uint16_t)r;
+    }
+
+    return true;
+}
+
+// room for one stream of a chunk of n bytes
+static size_t huff_stream_bound(size_t n)
+{
+    return ((n + HUFF_STREAMS - 1) / HUFF_STREAMS * HUFF_MAX_BITS + 7) / 8 + 8;
+}
+
+static size_t huff_chunk_bound(size_t n)
+{
+    return HUFF_CHUNK_HEAD + HUFF_STREAMS * huff_stream_bound(n);
+}
+
+// add the code for c to a stream and flush whole bytes; the flush
+// stores 8 bytes, so at least 7 must be spare beyond the stream
+#define HUFF_PUT(c, s)                                      \
+    do                                                      \
+    {                                                       \
+        bb[s] |= (uint64_t)code[c] << bc[s];                \
+        bc[s] += len[c];                                    \
+    }                                                       \
+    while (0)
+
+#define HUFF_FLUSH(s)                                       \
+    do                                                      \
+    {                                                       \
+        uint64_t w = huff_le64(bb[s]);                      \
+        memcpy(optr[s],&w,8);                               \
+        optr[s] += bc[s] >> 3;                              \
+        bb[s]  >>= bc[s] & ~7;                              \
+        bc[s]   &= 7;                                       \
+    }                                                       \
+    while (0)
+
+// encode one chunk into out, which has room for huff_chunk_bound(n);
+// returns the coded size
+static size_t huff_encode_chunk(const byte * data, size_t n, byte * out)
+{
+    size_t   count[256];
+    byte     len[256];
+    uint16_t code[256];
+    uint64_t bb[HUFF_STREAMS];
+    int      bc[HUFF_STREAMS];
+    byte *   optr[HUFF_STREAMS];
+    byte *   sptr[HUFF_STREAMS];
+    size_t   i, size, sbound = huff_stream_bound(n);
+    int      s, k;
+
+    memset(count,0,sizeof(count));
+
+    for (i = 0; i < n; ++i)
+        ++count[data[i]];
+
+    huff_code_lengths(count,len);
+    huff_canonical(len,code);
+
+    for (i = 0; i < HUFF_LENS; ++i)
+        out[i] = (byte)(len[2 * i] | (len[2 * i + 1] << 4));
+
+    for (s = 0; s < HUFF_STREAMS; ++s)
+    {
+        bb[s]   = 0;
+        bc[s]   = 0;
+        sptr[s] = optr[s] = out + HUFF_CHUNK_HEAD + s * sbound;
+    }
+
+    // byte i goes to stream i % HUFF_STREAMS; four codes of up to 12
+    // bits fit above the 7 bits left unflushed
+    for (i = 0; i + 4 * HUFF_STREAMS <= n; i += 4 * HUFF_STREAMS)
+    {
+#pragma GCC unroll 16
+        for (k = 0; k < 4; ++k)
+#pragma GCC unroll 4
+            for (s = 0; s < HUFF_STREAMS; ++s)
+                HUFF_PUT(data[i + k * HUFF_STREAMS + s],s);
+
+#pragma GCC unroll 16
+        for (s = 0; s < HUFF_STREAMS; ++s)
+            HUFF_FLUSH(s);
+    }
+
+    for (; i < n; ++i)
+    {
+        s = (int)(i % HUFF_STREAMS);
+        HUFF_PUT(data[i],s);
+        HUFF_FLUSH(s);
+    }
+
+    // close the streams and pack them behind the sizes of all but the last
+    size = HUFF_CHUNK_HEAD;
+
+    for (s = 0; s < HUFF_STREAMS; ++s)
+    {
+        if (bc[s])
+            ++optr[s];
+
+        if (s < HUFF_STREAMS - 1)
+            huff_put32(out + HUFF_LENS + 4 * s,(uint32_t)(optr[s] - sptr[s]));
+
+        memmove(out + size,sptr[s],(size_t)(optr[s] - sptr[s]));
+        size += (size_t)(optr[s] - sptr[s]);
+    }
+
+    return size;
+}
+
+// take one symbol from a stream
+#define HUFF_GET(o, s)                                      \
+    do                                                      \
+    {                                                       \
+        e      = table[bb[s] & (HUFF_TABLE_SIZE - 1)];      \
+        bad   |= e;                                         \
+        (o)    = (byte)(e >> 4);                            \
+        bb[s] >>= e & 15;                                   \
+        bc[s]  -= e & 15;                                   \
+    }                                                       \
+    while (0)
+
+// refill a stream to at least 56 bits
+#define HUFF_REFILL(s)                                      \
+    do                                                      \
+    {                                                       \
+        bb[s]   |= huff_load(iptr[s],end[s]) << bc[s];      \
+        iptr[s] += (63 - bc[s]) >> 3;                       \
+        bc[s]   |= 56;                                      \
+    }                                                       \
+    while (0)
+
+// decode n bytes from the chunk at in, size in_len; returns false if the
+// chunk is corrupt
+static bool huff_decode_chunk(const byte * in, size_t in_len, byte * out, size_t n)
+{
+    uint16_t table[HUFF_TABLE_SIZE];
+    uint16_t code[256];
+    byte     len[256];
+    const byte * iptr[HUFF_STREAMS], * sptr[HUFF_STREAMS], * end[HUFF_STREAMS];
+    uint64_t bb[HUFF_STREAMS];
+    int      bc[HUFF_STREAMS];
+    unsigned bad = 0, e;
+    size_t   i, pos, size;
+    int      s, k;
+
+    if (in_len < HUFF_CHUNK_HEAD)
+        return false;
+
+    for (i = 0; i < HUFF_LENS; ++i)
+    {
+        len[2 * i]     = in[i] & 15;
+        len[2 * i + 1] = in[i] >> 4;
+
+        if (len[2 * i] > HUFF_MAX_BITS || len[2 * i + 1] > HUFF_MAX_BITS)
+            return false;
+    }
+
+    if (!huff_canonical(len,code))
+        return false;
+
+    for (i = 0; i < HUFF_TABLE_SIZE; ++i)
+        table[i] = HUFF_BAD;
+
+    for (s = 0; s < 256; ++s)
+        if (len[s])
+            for (i = code[s]; i < HUFF_TABLE_SIZE; i += (size_t)1 << len[s])
+                table[i] = (uint16_t)((s << 4) | len[s]);
+
+    pos = HUFF_CHUNK_HEAD;
+
+    for (s = 0; s < HUFF_STREAMS; ++s)
+    {
+        size = (s < HUFF_STREAMS - 1) ? huff_get32(in + HUFF_LENS + 4 * s) : in_len - pos;
+
+        if (size > in_len - pos)
+            return false;
+
+        sptr[s] = iptr[s] = in + pos;
+        end[s]  = in + pos + size;
+        bb[s]   = 0;
+        bc[s]   = 0;
+        pos    += size;
+    }
+
+    // the streams are independent, so their lookups overlap
+    for (i = 0; i + 4 * HUFF_STREAMS <= n; i += 4 * HUFF_STREAMS)
+    {
+#pragma GCC unroll 16
+        for (s = 0; s < HUFF_STREAMS; ++s)
+            HUFF_REFILL(s);
+
+#pragma GCC unroll 16
+        for (k = 0; k < 4; ++k)
+#pragma GCC unroll 4
+            for (s = 0; s < HUFF_STREAMS; ++s)
+                HUFF_GET(out[i + k * HUFF_STREAMS + s],s);
+    }
+
+    for (; i < n; ++i)
+    {
+        s = (int)(i % HUFF_STREAMS);
+        HUFF_REFILL(s);
+        HUFF_GET(out[i],s);
+    }
+
+    // no holes hit, and no bits taken past the end of a stream
+    for (s = 0; s < HUFF_STREAMS; ++s)
+        if ((size_t)(iptr[s] - sptr[s]) * 8 - bc[s] > (size_t)(end[s] - sptr[s]) * 8)
+            return false;
+
+    return !(bad & HUFF_BAD);
+}
+
+static size_t huff_chunk_size(size_t chunk_size)
+{
+    return chunk_size < 1 ? 1 : chunk_size > HUFF_MAX_CHUNK ? HUFF_MAX_CHUNK : chunk_size;
+}
+
+// largest stream huff_encode can produce for len bytes
+size_t huff_bound(size_t len, size_t chunk_size)
+{
+    size_t nchunks;
+
+    chunk_size = huff_chunk_size(chunk_size);
+    nchunks = (len + chunk_size - 1) / chunk_size;
+
+    return HUFF_HEADER + 4 * nchunks + nchunks * huff_chunk_bound(chunk_size);
+}
+
+typedef struct
+{
+    const byte * in;
+    byte *       out;
+    size_t       len;
+    size_t       chunk_size;
+    size_t       nchunks;
+    size_t       next;
+    const byte * src;           // decode: chunk start
+    size_t *     size;          // coded size of each chunk
+    bool         ok;
+} huff_job;
+
+static void * huff_encode_worker(void * arg)
+{
+    huff_job * job = arg;
+    size_t c, n, bound = huff_chunk_bound(job->chunk_size);
+
+    while ((c = __sync_fetch_and_add(&job->next, 1)) < job->nchunks)
+    {
+        n = job->len - c * job->chunk_size;
+
+        if (n > job->chunk_size)
+            n = job->chunk_size;
+
+        job->size[c] = huff_encode_chunk(job->in + c * job->chunk_size, n, job->out + c * bound);
+    }
+
+    return NULL;
+}
+
+static void * huff_decode_worker(void * arg)
+{
+    huff_job * job = arg;
+    size_t c, n, off;
+
+    while ((c = __sync_fetch_and_add(&job->next, 1)) < job->nchunks)
+    {
+        n   = job->len - c * job->chunk_size;
+        off = job->size[c];
+
+        if (n > job->chunk_size)
+            n = job->chunk_size;
+
+        if (!huff_decode_chunk(job->src + off, job->size[job->nchunks + c], job->out + c * job->chunk_size, n))
+            job->ok = false;
+    }
+
+    return NULL;
+}
+
+static void huff_run(huff_job * job, void * (*worker)(void *), int threads)
+{
+    pthread_t tid[HUFF_MAX_THREADS];
+    int i;
+
+    if (threads > HUFF_MAX_THREADS)
+        threads = HUFF_MAX_THREADS;
+
+    job->next = 0;
+
+    for (i = 1; i < threads && (size_t)i < job->nchunks; ++i)
+    {
+        if (pthread_create(&tid[i], NULL, worker, job))
+        {
+            fprintf(stderr,"error: cannot create thread\n");
+            exit(1);
+        }
+    }
+
+    worker(job);
+
+    while (--i > 0)
+        pthread_join(tid[i], NULL);
+}
+
+// compress data_len bytes into out, which holds huff_bound() bytes;
+// returns the stream size
+size_t huff_encode(const byte * data, size_t data_len, size_t chunk_size, byte * out, int threads)
+{
+    huff_job job;
+    size_t   c, pos, bound;
+    byte *   scratch;
+
+    chunk_size = huff_chunk_size(chunk_size);
+    bound      = huff_chunk_bound(chunk_size);
+
+    job.in         = data;
+    job.len        = data_len;
+    job.chunk_size = chunk_size;
+    job.nchunks    = (data_len + chunk_size - 1) / chunk_size;
+    job.size       = (size_t *)malloc(sizeof(size_t) * (job.nchunks + 1));
+    job.out        = scratch = (byte *)malloc(job.nchunks * bound + 1);
+
+    if (!job.size || !scratch)
+    {
+        fprintf(stderr,"error: out of memory\n");
+        exit(1);
+    }
+
+    // chunks are coded into fixed slots, then packed behind the header
+    huff_run(&job,huff_encode_worker,threads);
+
+    huff_put32(out,HUFF_MAGIC);
+    huff_put32(out + 4,(uint32_t)chunk_size);
+    huff_put32(out + 8,(uint32_t)data_len);
+    huff_put32(out + 12,(uint32_t)((uint64_t)data_len >> 32));
+    pos = HUFF_HEADER + 4 * job.nchunks;
+
+    for (c = 0; c < job.nchunks; ++c)
+    {
+        huff_put32(out + HUFF_HEADER + 4 * c,(uint32_t)job.size[c]);
+        memcpy(out + pos,scratch + c * bound,job.size[c]);
+        pos += job.size[c];
+    }
+
+    free(scratch);
+    free(job.size);
+    return pos;
+}
+
+// decompress the stream in into out, which holds out_len bytes; returns
+// the decoded size, or (size_t)-1 if the stream is corrupt or too large
+size_t huff_decode(const byte * in, size_t in_len, byte * out, size_t out_len, int threads)
+{
+    huff_job job;
+    size_t   c, pos;
+
+    if (in_len < HUFF_HEADER || huff_get32(in) != HUFF_MAGIC)
+        return (size_t)-1;
+
+    job.chunk_size = huff_get32(in + 4);
+    job.len        = (size_t)(huff_get32(in + 8) | ((uint64_t)huff_get32(in + 12) << 32));
+
+    if (!job.chunk_size || job.len > out_len)
+        return (size_t)-1;
+
+    job.nchunks = (job.len + job.chunk_size - 1) / job.chunk_size;
+
+    if ((in_len - HUFF_HEADER) / 4 < job.nchunks)
+        return (size_t)-1;
+
+    // size[c] is the offset of chunk c, size[nchunks + c] its length
+    job.size = (size_t *)malloc(sizeof(size_t) * (2 * job.nchunks + 1));
+
+    if (!job.size)
+    {
+        fprintf(stderr,"error: out of memory\n");
+        exit(1);
+    }
+
+    pos = HUFF_HEADER + 4 * job.nchunks;
+
+    for (c = 0; c < job.nchunks; ++c)
+    {
+        job.size[c] = pos;
+        job.size[job.nchunks + c] = huff_get32(in + HUFF_HEADER + 4 * c);
+        pos += job.size[job.nchunks + c];
+    }
+
+    job.src = in;
+    job.out = out;
+    job.ok  = pos <= in_len;
+
+    if (job.ok)
+        huff_run(&job,huff_decode_worker,threads);
+
+    free(job.size);
+    return job.ok ? job.len : (size_t)-1;
+}
+
+static double huff_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// bytes with halving frequencies, which need codes longer than the limit
+static void skewed_test_data(byte * data, size_t n)
+{
+    uint64_t x = 88172645463325252ULL;
+    size_t i;
+
+    for (i = 0; i < n; ++i)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        data[i] = (byte)('A' + (x ? __builtin_ctzll(x) : 63) % 40);
+    }
+}
+
+/*
+    -bench [size [threads [chunk]]]
+
+    Codes size bytes (default TEST_SIZE) of the test data and of a skewed
+    source through compdecomp and through huff_encode/huff_decode on one
+    and on threads threads (default 4), in chunks of chunk bytes (default
+    256 KiB).  Reports MB/s, best of three, and the ratio, and checks
+    every round trip.
+    Returns 1 if a round trip fails.
+*/
+int huff_bench(int argc, char ** argv)
+{
+    size_t size = argc > 0 ? (size_t)atol(argv[0]) : (size_t)TEST_SIZE;
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    size_t chunk = argc > 2 ? (size_t)atol(argv[2]) : 256 * 1024;
+    byte * data, * copy, * comp, * back;
+    size_t comp_len = 0, back_len = 0;
+    double start, t, tenc, tdec, mb;
+    int runs[2], r, s, k;
+    bool ok = true, same;
+
+    if (size < 2)
+        size = 2;
+
+    if (threads < 1)
+        threads = 1;
+
+    if (chunk < 1)
+        chunk = 1;
+
+    data = generate_test_data(size);
+    copy = (byte *)malloc(size);
+    back = (byte *)malloc(size);
+    comp = (byte *)malloc(huff_bound(size,chunk));
+
+    if (!data || !copy || !back || !comp)
+    {
+        fprintf(stderr,"error: out of memory\n");
+        return 2;
+    }
+
+    mb      = size / 1e6;
+    runs[0] = 1;
+    runs[1] = threads;
+
+    printf("huffbench codec: %lu bytes, chunks of %lu bytes\n\n",(unsigned long)size,(unsigned long)chunk);
+    printf("data      path       threads   encode MB/s   decode MB/s   ratio  round trip\n");
+
+    for (s = 0; s < 2; ++s)
+    {
+        const char * name = s ? "skewed" : "test";
+
+        if (s)
+            skewed_test_data(data,size);
+
+        // compdecomp times both directions together and decodes in place
+        if (!s)
+        {
+            memcpy(copy,data,size);
+            start = huff_now();
+            compdecomp(copy,size);
+            tenc  = huff_now() - start;
+            same  = !memcmp(copy,data,size);
+            ok   &= same;
+            printf("%-9s %-10s %7d %13.1f %13s %7s  %s\n",name,"compdecomp",1,
+                   mb / tenc,"(both)","",same ? "ok" : "FAILED");
+        }
+
+        for (r = 0; r < 2; ++r)
+        {
+            if (r == 1 && threads == 1)
+                break;
+
+            // best of three
+            tenc = tdec = 1e30;
+
+            for (k = 0; k < 3; ++k)
+            {
+                memset(back,0,size);
+                start    = huff_now();
+                comp_len = huff_encode(data,size,chunk,comp,runs[r]);
+                t        = huff_now() - start;
+                tenc     = t < tenc ? t : tenc;
+
+                start    = huff_now();
+                back_len = huff_decode(comp,comp_len,back,size,runs[r]);
+                t        = huff_now() - start;
+                tdec     = t < tdec ? t : tdec;
+            }
+
+            same = back_len == size && !memcmp(back,data,size);
+            ok  &= same;
+            printf("%-9s %-10s %7d %13.1f %13.1f %7.3f  %s\n",name,"canonical",runs[r],
+                   mb / tenc,mb / tdec,(double)comp_len / size,same ? "ok" : "FAILED");
+        }
+    }
+
+    // a damaged stream must be refused or decode without overrunning
+    comp[HUFF_HEADER + 4 * ((size + chunk - 1) / chunk)] = 0xff;
+    back_len = huff_decode(comp,comp_len,back,size,1);
+    printf("\ncorrupted stream: %s\n",back_len == (size_t)-1 ? "rejected" : "decoded");
+
+    free(data);
+    free(copy);
+    free(back);
+    free(comp);
+
+    printf("\n%s\n",ok ? "round trips ok" : "ROUND TRIP FAILED");
+    return !ok;
+}
+
 int main(int argc, char ** argv)
 {
     int i;
@@ -436,6 +1192,9 @@ int main(int argc, char ** argv)
     // do we have verbose output?
     bool ga_testing = false;
     
+    if (argc > 1 && !strcmp(argv[1],"-bench"))
+        return huff_bench(argc - 2,argv + 2);
+
     if (argc > 1)
     {
         for (i = 1; i < argc; ++i)
@@ -3,40 +3,168 @@
 //  contributed by Greg Buchholz
 //
 //  compile with:  -O3 -msse2 -lm
+//
+//  -DVEC_WIDTH=4 or 8 sums the vector series in that many lanes (give
+//  -mavx or wider to match); "-bench [n [reps]]" times the series at
+//  every width against scalar code.
 
 #include<math.h>
 #include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<time.h>
+
+//  Vector lanes for the series, over GCC vector extensions: vdW holds W
+//  doubles, and series() is the VEC_WIDTH one.  The helpers are macros
+//  so one spelling serves every width:
+//
+//      vec_lanes(v)        number of lanes of v
+//      vec_splat(T, x)     x in every lane
+//      vec_iota(T, a, d)   lanes a, a + d, a + 2d, ...
+//      vec_sum(v)          sum of the lanes, halving pairwise
+#ifndef VEC_WIDTH
+#define VEC_WIDTH 2
+#endif
+
+typedef double vd2 __attribute__ ((vector_size (2 * sizeof(double))));
+typedef double vd4 __attribute__ ((vector_size (4 * sizeof(double))));
+typedef double vd8 __attribute__ ((vector_size (8 * sizeof(double))));
+
+#define VEC_CAT_(a,b)   a##b
+#define VEC_CAT(a,b)    VEC_CAT_(a,b)
+
+#define vec_lanes(v)    ((int)(sizeof(v) / sizeof((v)[0])))
+#define vec_splat(T,x)  ((T){0} + (__typeof__(((T){0})[0]))(x))
+#define vec_iota(T,a,d) \
+    ({ T v_; int i_; for (i_ = 0; i_ < vec_lanes(v_); i_++) v_[i_] = (a) + i_*(d); v_; })
+#define vec_sum(v) \
+    ({ __typeof__(v) v_ = (v); int h_, i_; \
+       for (h_ = vec_lanes(v_)/2; h_ > 0; h_ /= 2) \
+           for (i_ = 0; i_ < h_; i_++) v_[i_] += v_[i_+h_]; \
+       v_[0]; })
+
+//  The five vector series over k = 1..n, k running through the lanes.
+//  Lanes beyond n in the last vector are weighted out.
+#define SERIES_DEFINE(T)                                                \
+static void series_##T(int n, double sum[5])                            \
+{                                                                       \
+    T   poly = {0}, Harmonic = {0}, zeta = {0}, alt = {0}, Gregory = {0};\
+    T   one = vec_splat(T, 1.0), two = vec_splat(T, 2.0);               \
+    T   kv = vec_iota(T, 1.0, 1.0), av = vec_splat(T, 1.0), w;          \
+    int i;                                                              \
+                                                                        \
+    for (i = 1; i < vec_lanes(av); i += 2)                              \
+        av[i] = -1.0;                                                   \
+                                                                        \
+    for (; kv[vec_lanes(kv)-1] <= n; kv += vec_splat(T, vec_lanes(kv))) \
+    {                                                                   \
+        poly    += one /(kv*(kv+one));                                  \
+        Harmonic+= one / kv;                                            \
+        zeta    += one /(kv*kv);                                        \
+        alt     +=  av / kv;                                            \
+        Gregory +=  av /(two*kv - one);                                 \
+    }                                                                   \
+                                                                        \
+    if (kv[0] <= n)                                                     \
+    {                                                                   \
+        for (i = 0; i < vec_lanes(w); i++)                              \
+            w[i] = kv[i] <= n;                                          \
+        poly    += w /(kv*(kv+one));                                    \
+        Harmonic+= w / kv;                                              \
+        zeta    += w /(kv*kv);                                          \
+        alt     += w*av / kv;                                           \
+        Gregory += w*av /(two*kv - one);                                \
+    }                                                                   \
+                                                                        \
+    sum[0] = vec_sum(poly);  sum[1] = vec_sum(Harmonic);                \
+    sum[2] = vec_sum(zeta);  sum[3] = vec_sum(alt);                     \
+    sum[4] = vec_sum(Gregory);                                          \
+}
+
+SERIES_DEFINE(vd2)
+SERIES_DEFINE(vd4)
+SERIES_DEFINE(vd8)
+
+#define series VEC_CAT(series_vd, VEC_WIDTH)
+
+//  The same sums one k at a time.
+static void series_scalar(int n, double sum[5])
+{
+    double  poly = 0, Harmonic = 0, zeta = 0, alt = 0, Gregory = 0;
+    double  k, a = 1.0;
+
+    for (k=1; k<=n; k++, a = -a)
+    {
+        poly    += 1.0/(k*(k+1.0));
+        Harmonic+= 1.0/k;
+        zeta    += 1.0/(k*k);
+        alt     +=   a/k;
+        Gregory +=   a/(2.0*k - 1.0);
+    }
 
-typedef double v2df __attribute__ ((vector_size (16)));
+    sum[0] = poly;  sum[1] = Harmonic;  sum[2] = zeta;
+    sum[3] = alt;   sum[4] = Gregory;
+}
 
-v2df make_vec(double a, double b)
+static double now(void)
 {
-    v2df v;
-    double *tmp;
-    tmp = (double *)&v; *(tmp) = a; *(tmp+1) = b;
-    return v;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
 }
 
-double sum_vec(v2df x)
+//  -bench [n [reps]]: best of reps runs of each series kernel, with the
+//  largest relative difference of its sums from the scalar ones.
+static int bench(int argc, char* argv[])
 {
-    double *tmp = (double *)&x;
-    return *(tmp) + *(tmp+1);
+    static const struct { const char *name; int lanes; void (*fn)(int, double *); }
+    path[] = { { "scalar", 1, series_scalar }, { "vd2", 2, series_vd2 },
+               { "vd4", 4, series_vd4 },       { "vd8", 8, series_vd8 } };
+    double  ref[5], sum[5], t, best, base = 0, diff;
+    int     n = argc > 0 ? atoi(argv[0]) : 2500000;
+    int     reps = argc > 1 ? atoi(argv[1]) : 10;
+    int     p, r, i;
+
+    if (n < 1) n = 1;
+    if (reps < 1) reps = 1;
+
+    printf("series over k = 1..%d, best of %d\n\n", n, reps);
+    printf("path    lanes     seconds  speedup  max rel diff\n");
+
+    series_scalar(n, ref);
+    for (p = 0; p < 4; p++)
+    {
+        best = 1e30;
+        for (r = 0; r < reps; r++)
+        {
+            t = now();
+            path[p].fn(n, sum);
+            t = now() - t;
+            if (t < best) best = t;
+        }
+        if (p == 0) base = best;
+
+        diff = 0;
+        for (i = 0; i < 5; i++)
+            if (fabs(sum[i] - ref[i]) > diff * fabs(ref[i]))
+                diff = fabs(sum[i] - ref[i]) / fabs(ref[i]);
+
+        printf("%-6s %6d %11.6f %8.2f %13.3e\n",
+               path[p].name, path[p].lanes, best, base/best, diff);
+    }
+    return 0;
 }
 
 int main(int argc, char* argv[])
 {
     double  twoThrd = 0, sqrts = 0, Flint = 0, Cookson = 0;
-    v2df    Harmonic, zeta, poly, alt, Gregory;
-    v2df    zero, one, two, init, m_one, kv, av;
+    double  sum[5];
 
     double  k, k3, s, c;
     int n;  n = 2500000;
 
-    zero  = make_vec( 0.0,  0.0);  one   = make_vec( 1.0,  1.0);
-    two   = make_vec( 2.0,  2.0);  m_one = make_vec(-1.0, -1.0);
-    init  = make_vec( 1.0,  2.0);  av    = make_vec( 1.0, -1.0);
-
-    Harmonic = zeta = poly = alt = Gregory = zero;
+    if (argc > 1 && !strcmp(argv[1], "-bench"))
+        return bench(argc-2, argv+2);
 
     for (k=1; k<=n; k++)
     {
@@ -48,21 +176,14 @@ int main(int argc, char* argv[])
         Cookson += 1.0/(k3 * c*c);
     }
 
-    for (kv=init; *(double *)(&kv)<=n; kv+=two)
-    {
-        poly    += one /(kv*(kv+one));
-        Harmonic+= one / kv;
-        zeta    += one /(kv*kv);
-        alt     +=  av / kv;
-        Gregory +=  av /(two*kv - one);
-    }
+    series(n, sum);
 
 #define psum(name,num) printf("%.9f\t%s\n",num,name)
     psum("(2/3)^k",           twoThrd); psum("k^-0.5",      sqrts);
-    psum("1/k(k+1)",    sum_vec(poly)); psum("Flint Hills", Flint);
-    psum("Cookson Hills",     Cookson); psum("Harmonic", sum_vec(Harmonic));
-    psum("Riemann Zeta",sum_vec(zeta)); psum("Alternating Harmonic",sum_vec(alt));
-    psum("Gregory",  sum_vec(Gregory));
+    psum("1/k(k+1)",           sum[0]); psum("Flint Hills", Flint);
+    psum("Cookson Hills",     Cookson); psum("Harmonic",   sum[1]);
+    psum("Riemann Zeta",       sum[2]); psum("Alternating Harmonic",sum[3]);
+    psum("Gregory",            sum[4]);
 
     return 0;
-}
\ No newline at end of file
+}
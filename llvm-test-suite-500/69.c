@@ -1,5 +1,13 @@
 #include "stdlib.h"
 #include "stdio.h"
+#include "string.h"
+#include "stdint.h"
+#include "time.h"
+#include "pthread.h"
+#include "fcntl.h"
+#include "unistd.h"
+#include "sys/mman.h"
+#include "sys/stat.h"
 
 #define ARRAY_SIZE 500000
 #define NLOOPS1 5
@@ -66,10 +74,433 @@ int findDuplicate(int *data, int len) {
     return result;
 }
 
-int main() {
+/*
+ * findDuplicate family, on IDs as 32-bit unsigned values.
+ *
+ * The XOR engines keep findDuplicate's contract: data holds 1..len-1 once
+ * each plus one extra copy of one of them.  XOR over 1..len-1 has a closed
+ * form, so only the data is read, DUP_SIMD_WORDS lanes at a time, and the
+ * parallel engine XORs one range per thread.
+ *
+ * The bitmap engine finds every value that occurs more than once, in any
+ * data.  Each thread marks its share of the data in private seen/dup
+ * bitmaps covering a window of values; the bitmaps are merged and the
+ * window moves on.  The window is sized so that all bitmaps fit in the
+ * memory bound, at the cost of one pass over the data per window.
+ *
+ * mapIdFile() maps a file of little-endian 32-bit IDs for streaming use by
+ * any engine; the kernel pages it in sequentially ahead of the scan.  A
+ * trailing partial ID is mapped but not counted, so unmapIdFile() takes
+ * the mapped byte length mapIdFile() returned, not the ID count.
+ */
+
+#define DUP_MAX_THREADS 64
+#define DUP_SIMD_WORDS  8
+
+typedef uint32_t dupvec __attribute__((vector_size(DUP_SIMD_WORDS * sizeof(uint32_t))));
+
+// XOR of 1..n
+static uint32_t xorUpTo(uint64_t n) {
+    switch (n & 3) {
+    case 0:  return (uint32_t)n;
+    case 1:  return 1;
+    case 2:  return (uint32_t)(n + 1);
+    default: return 0;
+    }
+}
+
+static inline __attribute__((always_inline))
+uint32_t xorBody(const uint32_t *data, size_t len) {
+    dupvec a0 = {0}, a1 = {0}, a2 = {0}, a3 = {0}, v;
+    uint32_t result = 0;
+    size_t i;
+    int k;
+
+    for (i = 0; i + 4 * DUP_SIMD_WORDS <= len; i += 4 * DUP_SIMD_WORDS) {
+        memcpy(&v, data + i, sizeof(v));
+        a0 ^= v;
+        memcpy(&v, data + i + DUP_SIMD_WORDS, sizeof(v));
+        a1 ^= v;
+        memcpy(&v, data + i + 2 * DUP_SIMD_WORDS, sizeof(v));
+        a2 ^= v;
+        memcpy(&v, data + i + 3 * DUP_SIMD_WORDS, sizeof(v));
+        a3 ^= v;
+    }
+    a0 ^= a1 ^ a2 ^ a3;
+    for (k = 0; k < DUP_SIMD_WORDS; k++)
+        result ^= a0[k];
+    for (; i < len; i++)
+        result ^= data[i];
+    return result;
+}
+
+static uint32_t xorGeneric(const uint32_t *data, size_t len) {
+    return xorBody(data, len);
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define DUP_AVX2 1
+__attribute__((target("avx2")))
+static uint32_t xorAvx2(const uint32_t *data, size_t len) {
+    return xorBody(data, len);
+}
+#endif
+
+typedef uint32_t xorFn(const uint32_t *data, size_t len);
+
+// the widest XOR kernel the CPU runs; callers resolve it before starting
+// threads, which then only read it
+static xorFn *xorKernel(void) {
+#ifdef DUP_AVX2
+    if (__builtin_cpu_supports("avx2"))
+        return xorAvx2;
+#endif
+    return xorGeneric;
+}
+
+uint32_t findDuplicateSimd(const uint32_t *data, size_t len) {
+    return xorKernel()(data, len) ^ xorUpTo(len - 1);
+}
+
+struct xorJob {
+    xorFn *kernel;
+    const uint32_t *data;
+    size_t len;
+    int nthreads;
+    uint32_t part[DUP_MAX_THREADS];
+};
+
+struct xorArg {
+    struct xorJob *job;
+    int t;
+};
+
+static void *xorWorker(void *arg) {
+    struct xorArg *a = arg;
+    struct xorJob *job = a->job;
+    size_t lo = job->len * a->t / job->nthreads;
+    size_t hi = job->len * (a->t + 1) / job->nthreads;
+
+    job->part[a->t] = job->kernel(job->data + lo, hi - lo);
+    return NULL;
+}
+
+// run fn(&arg[t]) on nthreads threads, the calling one included
+static void runThreads(void *(*fn)(void *), void *arg, size_t size, int nthreads) {
+    pthread_t tid[DUP_MAX_THREADS];
+    int t;
+
+    for (t = 1; t < nthreads; t++)
+        if (pthread_create(&tid[t], NULL, fn, (char *)arg + t * size)) {
+            fprintf(stderr, "cannot create thread\n");
+            exit(1);
+        }
+    fn(arg);
+    for (t = 1; t < nthreads; t++)
+        pthread_join(tid[t], NULL);
+}
+
+static int clampThreads(int nthreads) {
+    return nthreads < 1 ? 1 : nthreads > DUP_MAX_THREADS ? DUP_MAX_THREADS : nthreads;
+}
+
+uint32_t findDuplicateParallel(const uint32_t *data, size_t len, int nthreads) {
+    struct xorJob job;
+    struct xorArg arg[DUP_MAX_THREADS];
+    uint32_t result;
+    int t;
+
+    job.kernel = xorKernel();
+    job.data = data;
+    job.len = len;
+    job.nthreads = clampThreads(nthreads);
+    for (t = 0; t < job.nthreads; t++) {
+        arg[t].job = &job;
+        arg[t].t = t;
+    }
+    runThreads(xorWorker, arg, sizeof(arg[0]), job.nthreads);
+
+    result = xorUpTo(len - 1);
+    for (t = 0; t < job.nthreads; t++)
+        result ^= job.part[t];
+    return result;
+}
+
+struct bitmapJob {
+    const uint32_t *data;
+    size_t len;
+    int nthreads;
+    uint64_t lo;            // first value of the window
+    size_t words;           // window size in 64-bit words
+    uint64_t *seen[DUP_MAX_THREADS];
+    uint64_t *dup[DUP_MAX_THREADS];
+};
+
+struct bitmapArg {
+    struct bitmapJob *job;
+    int t;
+};
+
+static void *bitmapWorker(void *arg) {
+    struct bitmapArg *a = arg;
+    struct bitmapJob *job = a->job;
+    uint64_t *seen = job->seen[a->t], *dup = job->dup[a->t];
+    uint64_t span = (uint64_t)job->words * 64, off, bit;
+    size_t i = job->len * a->t / job->nthreads;
+    size_t hi = job->len * (a->t + 1) / job->nthreads;
+
+    // the window is a power of two; values outside it touch a word but
+    // set no bit.  Repeats are rare, so the test for one predicts well.
+    memset(seen, 0, job->words * sizeof(uint64_t));
+    memset(dup, 0, job->words * sizeof(uint64_t));
+    for (; i < hi; i++) {
+        off = job->data[i] - job->lo;
+        bit = (uint64_t)(off < span) << (off & 63);
+        off = (off & (span - 1)) >> 6;
+        if (seen[off] & bit)
+            dup[off] |= bit;
+        seen[off] |= bit;
+    }
+    return NULL;
+}
+
+/*
+ * Values occurring more than once in data[0..len), in increasing order.
+ * Up to max_out of them go to out; returns how many there are.  The
+ * bitmaps take at most mem_bytes (but at least 16 bytes per thread).
+ */
+size_t findDuplicatesBitmap(const uint32_t *data, size_t len, uint32_t *out,
+                            size_t max_out, size_t mem_bytes, int nthreads) {
+    struct bitmapJob job;
+    struct bitmapArg arg[DUP_MAX_THREADS];
+    uint64_t *store, maxv = 0, w, s, d;
+    size_t i, found = 0;
+    int t, b;
+
+    for (i = 0; i < len; i++)
+        if (data[i] > maxv)
+            maxv = data[i];
+
+    job.data = data;
+    job.len = len;
+    job.nthreads = clampThreads(nthreads);
+    w = mem_bytes / (2 * sizeof(uint64_t) * job.nthreads);
+    for (job.words = 1; job.words * 2 <= w && job.words * 64 <= maxv; job.words *= 2)
+        ;
+
+    store = malloc(2 * job.nthreads * job.words * sizeof(uint64_t));
+    if (!store) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for (t = 0; t < job.nthreads; t++) {
+        job.seen[t] = store + 2 * t * job.words;
+        job.dup[t] = job.seen[t] + job.words;
+        arg[t].job = &job;
+        arg[t].t = t;
+    }
+
+    for (job.lo = 0; job.lo <= maxv; job.lo += (uint64_t)job.words * 64) {
+        runThreads(bitmapWorker, arg, sizeof(arg[0]), job.nthreads);
+
+        // a value is repeated if some thread saw it twice or two saw it
+        for (i = 0; i < job.words; i++) {
+            s = job.seen[0][i];
+            d = job.dup[0][i];
+            for (t = 1; t < job.nthreads; t++) {
+                d |= job.dup[t][i] | (s & job.seen[t][i]);
+                s |= job.seen[t][i];
+            }
+            for (w = d; w; w &= w - 1) {
+                b = __builtin_ctzll(w);
+                if (found < max_out)
+                    out[found] = (uint32_t)(job.lo + i * 64 + b);
+                found++;
+            }
+        }
+    }
+
+    free(store);
+    return found;
+}
+
+// map a file of little-endian 32-bit IDs, *len of them in *bytes bytes;
+// returns NULL if it cannot
+const uint32_t *mapIdFile(const char *path, size_t *len, size_t *bytes) {
+    struct stat st;
+    void *p;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof(uint32_t)) {
+        close(fd);
+        return NULL;
+    }
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return NULL;
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+    *len = st.st_size / sizeof(uint32_t);
+    *bytes = st.st_size;
+    return p;
+}
+
+void unmapIdFile(const uint32_t *data, size_t bytes) {
+    munmap((void *)data, bytes);
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char *engine, int nthreads, double secs, size_t len,
+                   const char *result) {
+    printf("%-22s %7d %10.4f %8.2f   %s\n", engine, nthreads, secs,
+           len * sizeof(uint32_t) / secs / 1e9, result);
+}
+
+/*
+ * -bench [size [threads [file]]]
+ *
+ * Runs every engine over createRandomArray(size) (default 2^24), then
+ * the XOR and bitmap engines over the same IDs streamed from a mapped
+ * file: file if given (its contents are used as they are), else a
+ * temporary copy of the array.  The bitmap engine also runs under a 1 MB
+ * bound, which takes several passes, and over the array with extra
+ * duplicates planted, checked against a count of every value.
+ */
+static int bench(int argc, char *argv[]) {
+    int size = argc > 0 ? atoi(argv[0]) : 1 << 24;
+    int nthreads = clampThreads(argc > 1 ? atoi(argv[1]) : 4);
+    const char *path = argc > 2 ? argv[2] : NULL;
+    char tmp[] = "/tmp/dupidsXXXXXX", text[96];
+    const uint32_t *ids;
+    uint32_t *data, out[8], expect;
+    unsigned char *count;
+    size_t len, n, i, k, mapped;
+    double t;
+    int fd, ok = 1, r;
+
+    if (size < 2)
+        size = 2;
+    srand(1);
+    data = (uint32_t *)createRandomArray(size);
+    len = (size_t)size + 1;
+
+    printf("findDuplicate engines, %lu ids (%.1f MB), %d threads\n\n",
+           (unsigned long)len, len * 4 / 1e6, nthreads);
+    printf("engine                 threads    seconds     GB/s   result\n");
+
+    t = now();
+    expect = findDuplicate((int *)data, (int)len);
+    report("findDuplicate", 1, now() - t, len, "");
+
+#define XOR_ROW(name, th, call)                                          \
+    do {                                                                 \
+        uint32_t d_;                                                     \
+        t = now();                                                       \
+        d_ = call;                                                       \
+        t = now() - t;                                                   \
+        ok &= d_ == expect;                                              \
+        snprintf(text, sizeof(text), "%u %s", d_, d_ == expect ? "ok" : "WRONG"); \
+        report(name, th, t, len, text);                                  \
+    } while (0)
+
+    XOR_ROW("xor simd", 1, findDuplicateSimd(data, len));
+    XOR_ROW("xor parallel", nthreads, findDuplicateParallel(data, len, nthreads));
+
+#define BITMAP_ROW(name, th, mem, ids, len)                              \
+    do {                                                                 \
+        t = now();                                                       \
+        n = findDuplicatesBitmap(ids, len, out, 8, mem, th);             \
+        t = now() - t;                                                   \
+        r = n == 1 && out[0] == expect;                                  \
+        ok &= r;                                                         \
+        snprintf(text, sizeof(text), "%lu found, %u %s", (unsigned long)n, \
+                 n ? out[0] : 0, r ? "ok" : "WRONG");                    \
+        report(name, th, t, len, text);                                  \
+    } while (0)
+
+    BITMAP_ROW("bitmap", 1, 64 << 20, data, len);
+    BITMAP_ROW("bitmap", nthreads, 64 << 20, data, len);
+    BITMAP_ROW("bitmap, 1 MB bound", nthreads, 1 << 20, data, len);
+
+    // streaming from a mapped file
+    if (!path) {
+        fd = mkstemp(tmp);
+        if (fd < 0 || write(fd, data, len * 4) != (ssize_t)(len * 4)) {
+            fprintf(stderr, "cannot write %s\n", tmp);
+            return 2;
+        }
+        close(fd);
+    }
+    ids = mapIdFile(path ? path : tmp, &n, &mapped);
+    if (!ids) {
+        fprintf(stderr, "cannot map %s\n", path ? path : tmp);
+        return 2;
+    }
+    k = n;
+    if (path) {
+        // a file of our own choosing: report what the engines say
+        t = now();
+        expect = findDuplicateParallel(ids, k, nthreads);
+        report("mmap xor parallel", nthreads, now() - t, k, "");
+        t = now();
+        n = findDuplicatesBitmap(ids, k, out, 8, 64 << 20, nthreads);
+        snprintf(text, sizeof(text), "%lu found", (unsigned long)n);
+        report("mmap bitmap", nthreads, now() - t, k, text);
+    } else {
+        XOR_ROW("mmap xor parallel", nthreads, findDuplicateParallel(ids, len, nthreads));
+        BITMAP_ROW("mmap bitmap", nthreads, 64 << 20, ids, len);
+    }
+    unmapIdFile(ids, mapped);
+    if (!path)
+        unlink(tmp);
+
+    // several duplicates: overwrite some entries with copies of others
+    for (i = 1; i <= 5; i++)
+        data[len * i / 7] = data[len * i / 11];
+    count = calloc((size_t)size + 1, 1);
+    if (!count) {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+    for (i = 0; i < len; i++)
+        if (count[data[i]] < 2)
+            count[data[i]]++;
+    for (i = 0, k = 0; i <= (size_t)size; i++)
+        k += count[i] == 2;
+
+    t = now();
+    n = findDuplicatesBitmap(data, len, out, 8, 1 << 20, nthreads);
+    t = now() - t;
+    r = n == k;
+    for (i = 0; i < n && i < 8; i++)
+        r &= count[out[i]] == 2 && (i == 0 || out[i] > out[i - 1]);
+    ok &= r;
+    snprintf(text, sizeof(text), "%lu found of %lu %s", (unsigned long)n,
+             (unsigned long)k, r ? "ok" : "WRONG");
+    report("bitmap, planted", nthreads, t, len, text);
+
+    free(count);
+    free(data);
+    printf("\n%s\n", ok ? "all engines agree" : "ENGINE MISMATCH");
+    return !ok;
+}
+
+int main(int argc, char *argv[]) {
     int i, j, duplicate;
     int *rndArr;
 
+    if (argc > 1 && !strcmp(argv[1], "-bench"))
+        return bench(argc - 2, argv + 2);
+
     srand(1);
 
 	for (i = 0; i < NLOOPS1; i++) {